@@ -0,0 +1,483 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+cache of fixed size blocks of files keyed by fid + block index for random access reads (fuse).
+a read only fetches the blocks it touches using http range requests. missing blocks next to each other are fetched
+in one request (up to MFS_BLOCK_CACHE_MAX_RUN blocks).
+when reads of a file follow on from each other the next readahead blocks are fetched in the same request.
+fids are never reused so blocks never go stale. blocks evicted from memory are written to the disk cache (if enabled),
+and a miss looks there (as a whole file or a spilled block) before going to a file server.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+#include <stdlib.h>
+
+#define MFS_BLOCK_HEADER_SIZE APR_ALIGN_DEFAULT(sizeof(mfs_block))
+
+apr_status_t mfs_enable_block_cache(mfs_file_system *file_system, apr_size_t block_size, apr_size_t max_bytes, int readahead) {
+	if(file_system->block_cache != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_block_cache called when the block cache is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_block_cache *cache = apr_pcalloc(p, sizeof(mfs_block_cache));
+	cache->pool = p;
+	cache->block_size = (block_size > 0) ? block_size : DEFAULT_BLOCK_CACHE_BLOCK_SIZE;
+	cache->shard_max_bytes = ((max_bytes > 0) ? max_bytes : DEFAULT_BLOCK_CACHE_MAX_BYTES) / MFS_BLOCK_CACHE_SHARDS;
+	cache->readahead = (readahead > 0) ? readahead : DEFAULT_BLOCK_CACHE_READAHEAD;
+	int i;
+	for(i=0; i < MFS_BLOCK_CACHE_SHARDS; i++) {
+		mfs_block_cache_shard *shard = &cache->shards[i];
+		if((rv = apr_thread_mutex_create(&shard->lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_CRIT, rv, p, "Unable to create block cache mutex:");
+			apr_pool_destroy(p);
+			return rv;
+		}
+		shard->blocks = apr_hash_make(p);
+		shard->lru = apr_palloc(p, sizeof(mfs_block_cache_lru));
+		APR_RING_INIT(shard->lru, _mfs_block, link);
+	}
+	if((rv = apr_thread_mutex_create(&cache->stream_lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create block cache mutex:");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	for(i=0; i < MFS_BLOCK_CACHE_STREAMS; i++) {
+		cache->streams[i].fid = -1;
+	}
+	file_system->block_cache = cache;
+	mfs_log(LOG_INFO, "Block cache enabled. block_size=%ld, max_bytes=%ld, readahead=%d", (long)cache->block_size, (long)(cache->shard_max_bytes * MFS_BLOCK_CACHE_SHARDS), cache->readahead);
+	return APR_SUCCESS;
+}
+
+void mfs_block_cache_destroy(mfs_block_cache *cache) {
+	int i;
+	for(i=0; i < MFS_BLOCK_CACHE_SHARDS; i++) {
+		mfs_block_cache_shard *shard = &cache->shards[i];
+		while(!APR_RING_EMPTY(shard->lru, _mfs_block, link)) {
+			mfs_block *block = APR_RING_FIRST(shard->lru);
+			APR_RING_REMOVE(block, link);
+			mfs_block_release(block); //blocks still referenced by readers are freed when they are released
+		}
+		apr_thread_mutex_destroy(shard->lock);
+	}
+	apr_thread_mutex_destroy(cache->stream_lock);
+	apr_pool_destroy(cache->pool);
+}
+
+mfs_block * mfs_block_create(apr_int64_t fid, apr_int64_t index, apr_size_t size) {
+	char *mem = malloc(MFS_BLOCK_HEADER_SIZE + size);
+	if(mem == NULL) {
+		mfs_log(LOG_CRIT, "Unable to malloc block cache block (%ld bytes)", (long)size);
+		return NULL;
+	}
+	mfs_block *block = (mfs_block *)mem;
+	memset(block, 0, sizeof(mfs_block));
+	block->key.fid = fid;
+	block->key.index = index;
+	block->references = 1;
+	block->size = size;
+	block->data = mem + MFS_BLOCK_HEADER_SIZE;
+	return block;
+}
+
+void mfs_block_acquire(mfs_block *block) {
+	apr_atomic_inc32(&block->references);
+}
+
+void mfs_block_release(mfs_block *block) {
+	if(apr_atomic_dec32(&block->references) == 0) {
+		free(block);
+	}
+}
+
+mfs_block_cache_shard * mfs_block_cache_shard_for(mfs_block_cache *cache, mfs_block_key *key) {
+	apr_ssize_t l = sizeof(mfs_block_key);
+	//the low bits pick the bucket inside the shard's hash so use the high bits here
+	return &cache->shards[(apr_hashfunc_default((const char *)key, &l) >> 16) % MFS_BLOCK_CACHE_SHARDS];
+}
+
+mfs_block * mfs_block_cache_get(mfs_block_cache *cache, apr_int64_t fid, apr_int64_t index) {
+	mfs_block_key key;
+	memset(&key, 0, sizeof(key));
+	key.fid = fid;
+	key.index = index;
+	mfs_block_cache_shard *shard = mfs_block_cache_shard_for(cache, &key);
+	if(apr_thread_mutex_lock(shard->lock) != APR_SUCCESS) {
+		return NULL;
+	}
+	mfs_block *block = apr_hash_get(shard->blocks, &key, sizeof(mfs_block_key));
+	if(block != NULL) {
+		APR_RING_REMOVE(block, link);
+		APR_RING_INSERT_HEAD(shard->lru, block, _mfs_block, link);
+		mfs_block_acquire(block);
+	}
+	apr_thread_mutex_unlock(shard->lock);
+	return block;
+}
+
+//write an evicted block to the disk cache
+void mfs_block_cache_spill(mfs_disk_cache *disk_cache, mfs_block *block, apr_pool_t *pool) {
+	apr_file_t *file;
+	apr_status_t rv;
+	if((rv = apr_file_mktemp(&file, mfs_disk_cache_temp_template(disk_cache, pool), APR_CREATE | APR_READ | APR_WRITE, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to create disk cache temp file for block:");
+		return;
+	}
+	if((rv = apr_file_write_full(file, block->data, block->size, NULL)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to write block to disk cache:");
+		mfs_disk_cache_discard(disk_cache, file, pool);
+		return;
+	}
+	mfs_disk_cache_publish_block(disk_cache, block->key.fid, block->key.index, file, pool);
+	apr_file_close(file);
+}
+
+//the cache takes the caller's reference. blocks are spilled to disk_cache (if not NULL) as they are evicted
+void mfs_block_cache_insert(mfs_block_cache *cache, mfs_block *block, mfs_disk_cache *disk_cache) {
+	mfs_block_cache_shard *shard = mfs_block_cache_shard_for(cache, &block->key);
+	APR_RING_HEAD(_mfs_block_cache_evicted, _mfs_block) evicted;
+	APR_RING_INIT(&evicted, _mfs_block, link);
+	if(apr_thread_mutex_lock(shard->lock) != APR_SUCCESS) {
+		mfs_block_release(block);
+		return;
+	}
+	mfs_block *old = apr_hash_get(shard->blocks, &block->key, sizeof(mfs_block_key));
+	if(old != NULL) { //someone else fetched it at the same time
+		apr_hash_set(shard->blocks, &old->key, sizeof(mfs_block_key), NULL);
+		APR_RING_REMOVE(old, link);
+		shard->bytes -= old->size;
+		mfs_block_release(old);
+	}
+	while((shard->bytes + block->size > cache->shard_max_bytes) && !APR_RING_EMPTY(shard->lru, _mfs_block, link)) {
+		mfs_block *victim = APR_RING_LAST(shard->lru);
+		apr_hash_set(shard->blocks, &victim->key, sizeof(mfs_block_key), NULL);
+		APR_RING_REMOVE(victim, link);
+		shard->bytes -= victim->size;
+		APR_RING_INSERT_TAIL(&evicted, victim, _mfs_block, link);
+		apr_atomic_inc32(&cache->eviction_count);
+	}
+	apr_hash_set(shard->blocks, &block->key, sizeof(mfs_block_key), block);
+	APR_RING_INSERT_HEAD(shard->lru, block, _mfs_block, link);
+	shard->bytes += block->size;
+	apr_thread_mutex_unlock(shard->lock);
+	//spill and free outside the lock
+	if(APR_RING_EMPTY(&evicted, _mfs_block, link)) {
+		return;
+	}
+	apr_pool_t *pool = NULL;
+	if((disk_cache != NULL) && (apr_pool_create(&pool, NULL) != APR_SUCCESS)) {
+		pool = NULL;
+	}
+	while(!APR_RING_EMPTY(&evicted, _mfs_block, link)) {
+		mfs_block *b = APR_RING_FIRST(&evicted);
+		APR_RING_REMOVE(b, link);
+		if(pool != NULL) {
+			mfs_block_cache_spill(disk_cache, b, pool);
+			apr_pool_clear(pool);
+		}
+		mfs_block_release(b);
+	}
+	if(pool != NULL) {
+		apr_pool_destroy(pool);
+	}
+}
+
+void mfs_block_cache_put(mfs_block_cache *cache, mfs_block *block) {
+	mfs_block_cache_insert(cache, block, NULL);
+}
+
+//look for a block in the disk cache: as part of a whole cached file or as a spilled block
+mfs_block * mfs_block_cache_read_disk(mfs_disk_cache *disk_cache, apr_size_t block_size, apr_int64_t fid, apr_int64_t index, apr_pool_t *pool) {
+	apr_file_t *file;
+	apr_off_t size;
+	apr_off_t start = 0;
+	if(mfs_disk_cache_open(disk_cache, fid, &file, &size, pool) == APR_SUCCESS) {
+		start = index * (apr_off_t)block_size;
+		if(start >= size) { //past the end of the file
+			apr_file_close(file);
+			return NULL;
+		}
+		size -= start;
+	} else if(mfs_disk_cache_open_block(disk_cache, fid, index, &file, &size, pool) != APR_SUCCESS) {
+		return NULL;
+	}
+	if(size > (apr_off_t)block_size) {
+		size = block_size;
+	}
+	mfs_block *block = mfs_block_create(fid, index, (apr_size_t)size);
+	if(block != NULL) {
+		apr_status_t rv;
+		if(((rv = apr_file_seek(file, APR_SET, &start)) != APR_SUCCESS) || ((rv = apr_file_read_full(file, block->data, block->size, NULL)) != APR_SUCCESS)) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to read block from disk cache:");
+			mfs_block_release(block);
+			block = NULL;
+		}
+	}
+	apr_file_close(file);
+	return block;
+}
+
+//how many blocks to read ahead of a read of blocks first to last of fid
+int mfs_block_cache_readahead(mfs_block_cache *cache, apr_int64_t fid, apr_int64_t first, apr_int64_t last) {
+	int readahead = 0;
+	if(apr_thread_mutex_lock(cache->stream_lock) != APR_SUCCESS) {
+		return 0;
+	}
+	mfs_block_stream *stream = &cache->streams[(apr_uint64_t)fid % MFS_BLOCK_CACHE_STREAMS];
+	//small sequential reads start in the block the last one finished in
+	if((stream->fid == fid) && ((first == stream->next_index) || (first + 1 == stream->next_index))) {
+		stream->run++;
+		readahead = cache->readahead;
+	} else {
+		stream->fid = fid;
+		stream->run = 0;
+	}
+	stream->next_index = last + 1;
+	apr_thread_mutex_unlock(cache->stream_lock);
+	return readahead;
+}
+
+//read count blocks starting at block first from a replica on this machine
+apr_status_t mfs_block_cache_read_local(const char *local_path, apr_size_t block_size, apr_int64_t fid, apr_int64_t first, int count, mfs_block **blocks, apr_pool_t *pool) {
+	apr_file_t *file;
+	apr_off_t size;
+	apr_status_t rv;
+	if((rv = mfs_local_file_open(local_path, &file, &size, pool)) != APR_SUCCESS) {
+		return rv;
+	}
+	int k;
+	for(k = 0; k < count; k++) {
+		apr_off_t start = (first + k) * (apr_off_t)block_size;
+		if(start >= size) {
+			break;
+		}
+		apr_size_t length = (size - start > (apr_off_t)block_size) ? block_size : (apr_size_t)(size - start);
+		mfs_block *block = mfs_block_create(fid, first + k, length);
+		if(block == NULL) {
+			rv = APR_ENOMEM;
+			break;
+		}
+		if(((rv = apr_file_seek(file, APR_SET, &start)) != APR_SUCCESS) || ((rv = apr_file_read_full(file, block->data, length, NULL)) != APR_SUCCESS)) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to read local replica %s:", local_path);
+			mfs_block_release(block);
+			break;
+		}
+		blocks[k] = block;
+	}
+	apr_file_close(file);
+	return rv;
+}
+
+//fetch count blocks starting at block first in one range request. fetched blocks are put in blocks (with a reference)
+//and in the cache if cache_blocks. a range that starts past the end of the file leaves blocks NULL
+apr_status_t mfs_block_cache_fetch(mfs_file_system *file_system, mfs_block_cache *cache, char **paths, int path_count, apr_int64_t fid, bool cache_blocks, apr_int64_t first, int count, mfs_block **blocks, apr_pool_t *pool) {
+	apr_status_t rv = APR_EGENERAL;
+	apr_size_t block_size = cache->block_size;
+	int i;
+	apr_atomic_inc32(&cache->fetch_count);
+	for(i = 0; i < path_count; i++) {
+		char *local_path = mfs_local_path(file_system, paths[i], pool);
+		if(local_path != NULL) {
+			//the page cache already holds local replicas so they are not cached again
+			if((rv = mfs_block_cache_read_local(local_path, block_size, fid, first, count, blocks, pool)) == APR_SUCCESS) {
+				return APR_SUCCESS;
+			}
+			continue;
+		}
+		apr_uri_t uri;
+		if((rv = apr_uri_parse(pool, paths[i], &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to parse get_url %s:", paths[i]);
+			continue;
+		}
+		mfs_fetch_options options;
+		memset(&options, 0, sizeof(options));
+		options.range_offset = first * (apr_off_t)block_size;
+		options.range_length = block_size * count;
+		void *bytes = NULL;
+		apr_size_t total_bytes = 0;
+		apr_file_t *file = NULL;
+		if((rv = mfs_file_server_fetch(file_system, &uri, paths[i], &bytes, &total_bytes, &file, NULL, pool, NULL, &options)) != APR_SUCCESS) {
+			mfs_log(LOG_ERR, "Failed to get blocks %" APR_INT64_T_FMT "-%" APR_INT64_T_FMT " from %s. Attempt count = %d/%d", first, first + count - 1, paths[i], i+1, path_count);
+			continue;
+		}
+		if(options.response_code == 416) { //the range starts past the end of the file
+			return APR_SUCCESS;
+		}
+		//a 200 is the whole file: only right if we asked from the start (it fitted in the range or the download would have failed)
+		if((options.response_code != 206) && !((options.response_code == 200) && (options.range_offset == 0))) {
+			mfs_log(LOG_ERR, "Unexpected response %ld to range request to %s. Attempt count = %d/%d", options.response_code, paths[i], i+1, path_count);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		int k;
+		for(k = 0; k < count; k++) {
+			apr_size_t start = k * block_size;
+			if(start >= total_bytes) {
+				break;
+			}
+			apr_size_t size = total_bytes - start;
+			if(size > block_size) {
+				size = block_size;
+			}
+			mfs_block *block = mfs_block_create(fid, first + k, size);
+			if(block == NULL) {
+				return APR_ENOMEM;
+			}
+			memcpy(block->data, (char *)bytes + start, size);
+			blocks[k] = block;
+			if(cache_blocks) {
+				mfs_block_acquire(block);
+				mfs_block_cache_insert(cache, block, file_system->disk_cache);
+			}
+		}
+		return APR_SUCCESS;
+	}
+	return rv;
+}
+
+apr_status_t mfs_block_cache_read(mfs_file_system *file_system, const char *domain, const char *key, apr_off_t offset, void *buffer, apr_size_t length, apr_size_t *bytes_read, apr_pool_t *pool) {
+	mfs_block_cache *cache = file_system->block_cache;
+	*bytes_read = 0;
+	if(cache == NULL) {
+		mfs_log(LOG_ERR, "mfs_block_cache_read called without the block cache enabled");
+		return APR_EGENERAL;
+	}
+	if(length == 0) {
+		return APR_SUCCESS;
+	}
+	char **paths;
+	int path_count;
+	apr_status_t rv;
+	//a mirrored copy is already on local disk so it is read directly and not cached
+	apr_file_t *mirror_file;
+	apr_off_t mirror_size;
+	if((file_system->mirrors != NULL) && (mfs_mirror_open(file_system, domain, key, &mirror_file, &mirror_size, pool) == APR_SUCCESS)) {
+		rv = APR_SUCCESS;
+		if(offset < mirror_size) {
+			if((rv = apr_file_seek(mirror_file, APR_SET, &offset)) == APR_SUCCESS) {
+				rv = apr_file_read_full(mirror_file, buffer, (mirror_size - offset > (apr_off_t)length) ? length : (apr_size_t)(mirror_size - offset), bytes_read);
+			}
+		}
+		apr_file_close(mirror_file);
+		return rv;
+	}
+	if((rv = mfs_get_paths(file_system, domain, key, true, &paths, &path_count, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_DEBUG, rv, pool, "Unable to get paths for %s.%s:", domain, key);
+		return rv;
+	}
+	if(path_count == 0) {
+		return APR_EGENERAL;
+	}
+	mfs_prefer_local_paths(file_system, paths, path_count);
+	//without a fid (not a mogstored path) blocks can not be cached but ranges still save the download
+	apr_int64_t fid = mfs_fid_from_path(paths[0]);
+	bool cacheable = (fid >= 0);
+	apr_size_t block_size = cache->block_size;
+	apr_int64_t first = offset / block_size;
+	apr_int64_t last = (offset + length - 1) / block_size;
+	int wanted = (int)(last - first + 1);
+	int count = wanted + (cacheable ? mfs_block_cache_readahead(cache, fid, first, last) : 0);
+	mfs_block **blocks = apr_pcalloc(pool, count * sizeof(mfs_block *));
+	int i;
+	if(cacheable) {
+		for(i = 0; i < count; i++) {
+			if((blocks[i] = mfs_block_cache_get(cache, fid, first + i)) != NULL) {
+				apr_atomic_inc32(&cache->hit_count);
+			} else if((file_system->disk_cache != NULL) && ((blocks[i] = mfs_block_cache_read_disk(file_system->disk_cache, block_size, fid, first + i, pool)) != NULL)) {
+				apr_atomic_inc32(&cache->disk_hit_count);
+				mfs_block_acquire(blocks[i]);
+				mfs_block_cache_insert(cache, blocks[i], NULL); //it is already on disk
+			} else if(i < wanted) {
+				apr_atomic_inc32(&cache->miss_count);
+			}
+			if((blocks[i] != NULL) && (blocks[i]->size < block_size)) { //the last block of the file
+				count = i + 1;
+			}
+		}
+	}
+	//fetch the missing blocks: each run of missing blocks is one range request
+	rv = APR_SUCCESS;
+	i = 0;
+	while(i < count) {
+		if(blocks[i] != NULL) {
+			i++;
+			continue;
+		}
+		int run = 1;
+		while((i + run < count) && (blocks[i + run] == NULL) && (run < MFS_BLOCK_CACHE_MAX_RUN)) {
+			run++;
+		}
+		if(i + run > wanted) {
+			apr_atomic_add32(&cache->readahead_count, (apr_uint32_t)((i + run) - (i > wanted ? i : wanted)));
+		}
+		if((rv = mfs_block_cache_fetch(file_system, cache, paths, path_count, fid, cacheable, first + i, run, blocks + i, pool)) != APR_SUCCESS) {
+			if(i >= wanted) { //a failed read ahead is not an error
+				rv = APR_SUCCESS;
+			}
+			break;
+		}
+		int k;
+		bool end_of_file = false;
+		for(k = 0; (k < run) && !end_of_file; k++) {
+			end_of_file = (blocks[i + k] == NULL) || (blocks[i + k]->size < block_size);
+		}
+		if(end_of_file) {
+			break;
+		}
+		i += run;
+	}
+	//copy out what we have
+	if(rv == APR_SUCCESS) {
+		apr_size_t done = 0;
+		for(i = 0; (i < wanted) && (done < length); i++) {
+			mfs_block *block = blocks[i];
+			if(block == NULL) {
+				break;
+			}
+			apr_size_t block_offset = (apr_size_t)((offset + done) - (first + i) * (apr_off_t)block_size);
+			if(block_offset >= block->size) {
+				break;
+			}
+			apr_size_t n = block->size - block_offset;
+			if(n > length - done) {
+				n = length - done;
+			}
+			memcpy((char *)buffer + done, block->data + block_offset, n);
+			done += n;
+			if(block->size < block_size) {
+				break;
+			}
+		}
+		*bytes_read = done;
+	}
+	for(i = 0; i < count; i++) {
+		if(blocks[i] != NULL) {
+			mfs_block_release(blocks[i]);
+		}
+	}
+	return rv;
+}
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+per domain bloom filters so lookups for keys that don't exist can be answered without the tracker.
+a background thread lists the domain into a second bit array and swaps it in, so deleted keys only stop matching at the next rebuild.
+bits are set with compare and swap so adds only need the read lock; the write lock is held just long enough to swap the arrays.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+#include <apr_strings.h>
+#include <stdlib.h>
+#include <math.h>
+
+apr_status_t mfs_enable_bloom_filter(mfs_file_system *file_system, const char *domain, apr_size_t expected_keys, double false_positive_rate, apr_size_t max_bytes, apr_interval_time_t rebuild_interval) {
+	if(apr_hash_get(file_system->bloom_filters, domain, APR_HASH_KEY_STRING) != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_bloom_filter called when domain %s already has a filter", domain);
+		return APR_EGENERAL;
+	}
+	if(file_system->invalidation_dispatcher == NULL) {
+		//keys stored by other clients would be answered as absent until the next rebuild
+		mfs_log(LOG_ERR, "mfs_enable_bloom_filter called for %s before mfs_start_invalidation_dispatcher", domain);
+		return APR_EGENERAL;
+	}
+	if((false_positive_rate <= 0) || (false_positive_rate >= 1)) {
+		false_positive_rate = DEFAULT_BLOOM_FALSE_POSITIVE_RATE;
+	}
+	if(expected_keys == 0) {
+		expected_keys = 1;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_bloom_filter *filter = apr_pcalloc(p, sizeof(mfs_bloom_filter));
+	filter->file_system = file_system;
+	filter->pool = p;
+	filter->domain = apr_pstrdup(p, domain);
+	filter->rebuild_interval = rebuild_interval;
+	//m = -n ln(p) / ln(2)^2 bits and k = m/n ln(2) hashes
+	double bits = ceil(-(double)expected_keys * log(false_positive_rate) / (M_LN2 * M_LN2));
+	if((max_bytes > 0) && (bits > (double)max_bytes * 8)) {
+		bits = (double)max_bytes * 8;
+		mfs_log(LOG_WARNING, "Bloom filter for %s is limited to %ld bytes: the false positive rate will be about %.4f", domain, (long)max_bytes, pow(0.6185, bits / expected_keys));
+	}
+	apr_size_t words = (apr_size_t)((bits + 31) / 32);
+	if(words == 0) {
+		words = 1;
+	}
+	filter->bit_count = (apr_uint64_t)words * 32;
+	filter->hash_count = (int)floor(((double)filter->bit_count / expected_keys) * M_LN2 + 0.5);
+	if(filter->hash_count < 1) {
+		filter->hash_count = 1;
+	} else if(filter->hash_count > MFS_BLOOM_MAX_HASHES) {
+		filter->hash_count = MFS_BLOOM_MAX_HASHES;
+	}
+	filter->bits = apr_pcalloc(p, words * sizeof(apr_uint32_t));
+	filter->spare_bits = apr_pcalloc(p, words * sizeof(apr_uint32_t));
+	if((rv = apr_thread_rwlock_create(&filter->lock, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create apr_thread_rwlock_t:");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	apr_thread_mutex_create(&filter->rebuild_mutex, APR_THREAD_MUTEX_UNNESTED, p);
+	apr_thread_cond_create(&filter->rebuild_cond, p);
+	//listen before the first listing so nothing stored while it runs is missed
+	if((rv = mfs_add_invalidation_callback(file_system, mfs_bloom_invalidation_callback, filter)) != APR_SUCCESS) {
+		apr_thread_cond_destroy(filter->rebuild_cond);
+		apr_thread_mutex_destroy(filter->rebuild_mutex);
+		apr_thread_rwlock_destroy(filter->lock);
+		apr_pool_destroy(p);
+		return rv;
+	}
+	filter->running = true;
+	apr_threadattr_t *thd_attr;
+	apr_threadattr_create(&thd_attr, p);
+	if((rv = apr_thread_create(&filter->thread, thd_attr, mfs_bloom_filter_thread, (void*)filter, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to start mfs_bloom_filter_thread thread.:");
+		filter->thread = NULL;
+	}
+	apr_hash_set(file_system->bloom_filters, filter->domain, APR_HASH_KEY_STRING, filter);
+	mfs_log(LOG_INFO, "Bloom filter enabled for %s. bytes=%ld, hashes=%d, expected_keys=%ld", domain, (long)(words * sizeof(apr_uint32_t)), filter->hash_count, (long)expected_keys);
+	return APR_SUCCESS;
+}
+
+void mfs_bloom_filter_destroy(mfs_bloom_filter *filter) {
+	mfs_remove_invalidation_callback(filter->file_system, mfs_bloom_invalidation_callback, filter);
+	if(filter->thread != NULL) {
+		filter->running = false;
+		apr_thread_mutex_lock(filter->rebuild_mutex);
+		apr_thread_cond_signal(filter->rebuild_cond);
+		apr_thread_mutex_unlock(filter->rebuild_mutex);
+		apr_status_t rv2;
+		apr_thread_join(&rv2, filter->thread);
+		filter->thread = NULL;
+	}
+	int i;
+	for(i=0; i < filter->prefix_count; i++) {
+		free(filter->prefixes[i].prefix);
+	}
+	apr_hash_set(filter->file_system->bloom_filters, filter->domain, APR_HASH_KEY_STRING, NULL);
+	apr_thread_rwlock_destroy(filter->lock);
+	apr_thread_mutex_destroy(filter->rebuild_mutex);
+	apr_thread_cond_destroy(filter->rebuild_cond);
+	apr_pool_destroy(filter->pool);
+}
+
+//64 bit fnv-1a split into the two hashes for double hashing (h1 + i * h2)
+void mfs_bloom_hash(const char *key, apr_uint64_t *h1, apr_uint64_t *h2) {
+	apr_uint64_t h = 0xcbf29ce484222325ULL;
+	const unsigned char *c;
+	for(c = (const unsigned char *)key; *c != '\0'; c++) {
+		h ^= *c;
+		h *= 0x100000001b3ULL;
+	}
+	*h1 = h & 0xffffffffU;
+	*h2 = (h >> 32) | 1;
+}
+
+void mfs_bloom_set(mfs_bloom_filter *filter, volatile apr_uint32_t *bits, const char *key) {
+	apr_uint64_t h1, h2;
+	mfs_bloom_hash(key, &h1, &h2);
+	int i;
+	for(i=0; i < filter->hash_count; i++) {
+		apr_uint64_t bit = (h1 + i * h2) % filter->bit_count;
+		volatile apr_uint32_t *word = &bits[bit >> 5];
+		apr_uint32_t mask = 1U << (bit & 31);
+		apr_uint32_t old;
+		do {
+			old = apr_atomic_read32(word);
+			if(old & mask) {
+				break;
+			}
+		} while(apr_atomic_cas32(word, old | mask, old) != old);
+	}
+}
+
+bool mfs_bloom_test(mfs_bloom_filter *filter, volatile apr_uint32_t *bits, const char *key) {
+	apr_uint64_t h1, h2;
+	mfs_bloom_hash(key, &h1, &h2);
+	int i;
+	for(i=0; i < filter->hash_count; i++) {
+		apr_uint64_t bit = (h1 + i * h2) % filter->bit_count;
+		if((apr_atomic_read32(&bits[bit >> 5]) & (1U << (bit & 31))) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//add key to the filter and to the one being rebuilt
+void mfs_bloom_filter_put(mfs_bloom_filter *filter, const char *key) {
+	if(apr_thread_rwlock_rdlock(filter->lock) != APR_SUCCESS) {
+		mfs_bloom_filter_invalidate(filter); //we can't record it so we can't trust the filter
+		return;
+	}
+	mfs_bloom_set(filter, filter->bits, key);
+	if(filter->next_bits != NULL) {
+		mfs_bloom_set(filter, filter->next_bits, key);
+	}
+	apr_thread_rwlock_unlock(filter->lock);
+}
+
+bool mfs_bloom_filter_absent(mfs_file_system *file_system, const char *domain, const char *key) {
+	mfs_bloom_filter *filter = apr_hash_get(file_system->bloom_filters, domain, APR_HASH_KEY_STRING);
+	if((filter == NULL) || !filter->ready) {
+		return false;
+	}
+	if(apr_thread_rwlock_rdlock(filter->lock) != APR_SUCCESS) {
+		return false;
+	}
+	bool absent = filter->ready && !mfs_bloom_test(filter, filter->bits, key);
+	int i;
+	for(i=0; absent && (i < filter->prefix_count); i++) {
+		if(strncmp(filter->prefixes[i].prefix, key, strlen(filter->prefixes[i].prefix)) == 0) {
+			absent = false;
+		}
+	}
+	apr_thread_rwlock_unlock(filter->lock);
+	if(absent) {
+		apr_atomic_inc32(&filter->absent_count);
+	} else {
+		apr_atomic_inc32(&filter->maybe_count);
+	}
+	return absent;
+}
+
+void mfs_bloom_filter_add(mfs_file_system *file_system, const char *domain, const char *key) {
+	mfs_bloom_filter *filter = apr_hash_get(file_system->bloom_filters, domain, APR_HASH_KEY_STRING);
+	if(filter != NULL) {
+		mfs_bloom_filter_put(filter, key);
+	}
+}
+
+void mfs_bloom_filter_put_prefix(mfs_bloom_filter *filter, const char *key) {
+	if(apr_thread_rwlock_wrlock(filter->lock) != APR_SUCCESS) {
+		mfs_bloom_filter_invalidate(filter);
+		return;
+	}
+	if(filter->prefix_count == MFS_BLOOM_MAX_PREFIXES) {
+		apr_thread_rwlock_unlock(filter->lock);
+		mfs_bloom_filter_invalidate(filter);
+		return;
+	}
+	apr_size_t length = strlen(key);
+	char *prefix = malloc(length + 2);
+	if(prefix == NULL) {
+		apr_thread_rwlock_unlock(filter->lock);
+		mfs_bloom_filter_invalidate(filter);
+		return;
+	}
+	memcpy(prefix, key, length);
+	prefix[length] = '/';
+	prefix[length + 1] = '\0';
+	filter->prefixes[filter->prefix_count].prefix = prefix;
+	filter->prefixes[filter->prefix_count].added_at = apr_time_now();
+	filter->prefix_count++;
+	apr_thread_rwlock_unlock(filter->lock);
+}
+
+void mfs_bloom_filter_add_prefix(mfs_file_system *file_system, const char *domain, const char *key) {
+	mfs_bloom_filter *filter = apr_hash_get(file_system->bloom_filters, domain, APR_HASH_KEY_STRING);
+	if(filter != NULL) {
+		mfs_bloom_filter_put_prefix(filter, key);
+	}
+}
+
+void mfs_bloom_filter_invalidate(mfs_bloom_filter *filter) {
+	apr_atomic_inc32(&filter->generation);
+	filter->ready = false;
+	apr_thread_mutex_lock(filter->rebuild_mutex);
+	filter->rebuild_requested = true;
+	apr_thread_cond_signal(filter->rebuild_cond);
+	apr_thread_mutex_unlock(filter->rebuild_mutex);
+}
+
+void mfs_bloom_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool) {
+	mfs_bloom_filter *filter = (mfs_bloom_filter *)data;
+	if(event->operation == MFS_INVALIDATE_ALL) {
+		mfs_bloom_filter_invalidate(filter);
+		return;
+	}
+	if((event->operation == MFS_INVALIDATE_PATH) || (strcmp(filter->domain, event->domain) != 0)) {
+		return;
+	}
+	if(event->operation == MFS_INVALIDATE_RENAME) {
+		//a filepaths directory takes its children with it
+		mfs_bloom_filter_put(filter, event->to_key);
+		mfs_bloom_filter_put_prefix(filter, event->to_key);
+	} else if(event->operation != MFS_INVALIDATE_DELETE) { //deleted keys stay in the filter until the next rebuild
+		mfs_bloom_filter_put(filter, event->key);
+	}
+}
+
+apr_status_t mfs_bloom_filter_rebuild(mfs_bloom_filter *filter, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_time_t started = apr_time_now();
+	apr_uint32_t generation = apr_atomic_read32(&filter->generation);
+	apr_size_t words = (apr_size_t)(filter->bit_count / 32);
+	if(filter->spare_bits == NULL) { //a rebuild that could not be finished still holds it
+		return APR_EGENERAL;
+	}
+	//nothing else uses the spare bits so they can be cleared without the lock
+	memset((void *)filter->spare_bits, 0, words * sizeof(apr_uint32_t));
+	if((rv = apr_thread_rwlock_wrlock(filter->lock)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock bloom filter:");
+		return rv;
+	}
+	filter->next_bits = filter->spare_bits;
+	filter->spare_bits = NULL;
+	apr_thread_rwlock_unlock(filter->lock);
+
+	apr_pool_t *page_pool = NULL;
+	if((rv = apr_pool_create(&page_pool, pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+	}
+	apr_size_t key_count = 0;
+	char *after = NULL;
+	char *previous;
+	char **keys;
+	int page_count;
+	char *next_after;
+	while((rv == APR_SUCCESS) && filter->running) {
+		if((rv = mfs_list_keys(filter->file_system, filter->domain, NULL, after, MFS_LIST_KEYS_LIMIT, &keys, &page_count, &next_after, page_pool)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to list keys to build the bloom filter for %s:", filter->domain);
+			break;
+		}
+		int i;
+		for(i = 0; i < page_count; i++) {
+			mfs_bloom_set(filter, filter->next_bits, keys[i]);
+		}
+		key_count += page_count;
+		previous = after;
+		after = (next_after == NULL) ? NULL : apr_pstrdup(pool, next_after);
+		apr_pool_clear(page_pool);
+		if((page_count == 0) || (after == NULL) || ((previous != NULL) && (strcmp(previous, after) == 0))) {
+			break;
+		}
+	}
+	if(page_pool != NULL) {
+		apr_pool_destroy(page_pool);
+	}
+	bool complete = (rv == APR_SUCCESS) && filter->running;
+	apr_status_t rv2;
+	if((rv2 = apr_thread_rwlock_wrlock(filter->lock)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv2, pool, "Unable to lock bloom filter:");
+		return rv2; //next_bits is left in use so adds still reach it; the filter keeps its current state
+	}
+	if(complete) {
+		filter->spare_bits = filter->bits;
+		filter->bits = filter->next_bits;
+		//the listing has caught up with anything renamed before it started
+		int i, kept = 0;
+		for(i=0; i < filter->prefix_count; i++) {
+			if(filter->prefixes[i].added_at < started) {
+				free(filter->prefixes[i].prefix);
+			} else {
+				filter->prefixes[kept++] = filter->prefixes[i];
+			}
+		}
+		filter->prefix_count = kept;
+		//if events may have been missed while listing it needs another go
+		filter->ready = (generation == apr_atomic_read32(&filter->generation));
+	} else {
+		filter->spare_bits = filter->next_bits;
+	}
+	filter->next_bits = NULL;
+	apr_thread_rwlock_unlock(filter->lock);
+	if(complete) {
+		filter->key_count = key_count;
+		apr_atomic_inc32(&filter->rebuild_count);
+		mfs_log(LOG_INFO, "Rebuilt bloom filter for %s with %ld keys in %d ms", filter->domain, (long)key_count, (apr_int32_t)apr_time_as_msec(apr_time_now() - started));
+	}
+	return rv;
+}
+
+void* APR_THREAD_FUNC mfs_bloom_filter_thread(apr_thread_t *thd, void *data) {
+	mfs_bloom_filter *filter = (mfs_bloom_filter *)data;
+	apr_pool_t *pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&pool, NULL)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to create apr_pool");
+		apr_thread_exit(thd, rv);
+		return NULL;
+	}
+	apr_interval_time_t wait = 0; //the first build starts straight away
+	while(filter->running) {
+		apr_thread_mutex_lock(filter->rebuild_mutex);
+		if(filter->running && !filter->rebuild_requested && (wait > 0)) {
+			apr_thread_cond_timedwait(filter->rebuild_cond, filter->rebuild_mutex, wait);
+		}
+		filter->rebuild_requested = false;
+		apr_thread_mutex_unlock(filter->rebuild_mutex);
+		if(!filter->running) {
+			break;
+		}
+		rv = mfs_bloom_filter_rebuild(filter, pool);
+		apr_pool_clear(pool);
+		wait = (rv == APR_SUCCESS) ? filter->rebuild_interval : MFS_BLOOM_RETRY_INTERVAL;
+	}
+	apr_pool_destroy(pool);
+	apr_thread_exit(thd, APR_SUCCESS);
+	return NULL;
+}
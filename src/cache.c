@@ -0,0 +1,624 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+metadata cache for get_paths and path_info results.
+entries are malloc'd in a single block so they can be replaced/evicted without leaking pool memory.
+the lru is a ring (most recently used at the head) so eviction takes from the tail.
+expired entries are kept for stale_time so they can be served if all trackers are unreachable.
+hot entries (hot_hits hits) are queued for a background refresh refresh_ahead before they expire.
+misses fall back to the snapshot (if one was loaded) before going to the trackers.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <stdlib.h>
+
+apr_status_t mfs_enable_metadata_cache(mfs_file_system *file_system, int max_entries, apr_interval_time_t ttl, apr_interval_time_t stale_time, apr_interval_time_t refresh_ahead) {
+	if(file_system->metadata_cache != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_metadata_cache called when the metadata cache is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_metadata_cache *cache = apr_pcalloc(p, sizeof(mfs_metadata_cache));
+	if((rv = apr_thread_mutex_create(&cache->lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create metadata cache mutex:");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	apr_thread_mutex_create(&cache->refresh_mutex, APR_THREAD_MUTEX_UNNESTED, p);
+	apr_thread_cond_create(&cache->refresh_cond, p);
+	cache->file_system = file_system;
+	cache->pool = p;
+	cache->entries = apr_hash_make(p);
+	cache->lru = apr_palloc(p, sizeof(mfs_metadata_cache_lru));
+	APR_RING_INIT(cache->lru, _mfs_metadata_cache_entry, link);
+	cache->max_entries = max_entries;
+	cache->ttl = ttl;
+	cache->stale_time = stale_time;
+	cache->refresh_ahead = refresh_ahead;
+	cache->hot_hits = DEFAULT_METADATA_CACHE_HOT_HITS;
+	file_system->metadata_cache = cache;
+	if(refresh_ahead > 0) {
+		mfs_metadata_cache_start_refresh_thread(cache);
+	}
+	mfs_log(LOG_INFO, "Metadata cache enabled. max_entries=%d, ttl=%d ms, stale_time=%d ms, refresh_ahead=%d ms", max_entries, (apr_int32_t)apr_time_as_msec(ttl), (apr_int32_t)apr_time_as_msec(stale_time), (apr_int32_t)apr_time_as_msec(refresh_ahead));
+	return APR_SUCCESS;
+}
+
+void mfs_metadata_cache_destroy(mfs_metadata_cache *cache) {
+	mfs_metadata_cache_stop_refresh_thread(cache);
+	if(cache->snapshot_file != NULL) {
+		mfs_metadata_cache_save_snapshot(cache);
+	}
+	mfs_metadata_cache_snapshot_discard(cache);
+	while(!APR_RING_EMPTY(cache->lru, _mfs_metadata_cache_entry, link)) {
+		mfs_metadata_cache_entry *entry = APR_RING_FIRST(cache->lru);
+		APR_RING_REMOVE(entry, link);
+		free(entry);
+	}
+	while(cache->refresh_head != NULL) {
+		mfs_metadata_cache_refresh *refresh = cache->refresh_head;
+		cache->refresh_head = refresh->next;
+		free(refresh);
+	}
+	apr_thread_mutex_destroy(cache->lock);
+	apr_thread_mutex_destroy(cache->refresh_mutex);
+	apr_thread_cond_destroy(cache->refresh_cond);
+	apr_pool_destroy(cache->pool);
+}
+
+//the hash key: type + domain + \0 + key
+char * mfs_metadata_cache_key(unsigned char type, const char *domain, const char *key, apr_size_t *length, apr_pool_t *pool) {
+	apr_size_t domain_length = strlen(domain);
+	apr_size_t key_length = strlen(key);
+	char *cache_key = apr_palloc(pool, domain_length + key_length + 3);
+	cache_key[0] = (char)('0' + type);
+	memcpy(cache_key + 1, domain, domain_length + 1);
+	memcpy(cache_key + domain_length + 2, key, key_length + 1);
+	*length = domain_length + key_length + 2;
+	return cache_key;
+}
+
+//allocate an entry and everything it points to in a single block
+mfs_metadata_cache_entry * mfs_metadata_cache_entry_create(unsigned char type, const char *domain, const char *key, char **paths, int path_count, mfs_filepath_entry *info) {
+	apr_size_t domain_length = strlen(domain);
+	apr_size_t key_length = strlen(key);
+	apr_size_t size = APR_ALIGN_DEFAULT(sizeof(mfs_metadata_cache_entry));
+	apr_size_t cache_key_size = domain_length + key_length + 3;
+	size += APR_ALIGN_DEFAULT(cache_key_size);
+	size += sizeof(char *) * path_count;
+	int i;
+	for(i=0; i < path_count; i++) {
+		size += strlen(paths[i]) + 1;
+	}
+	if((info != NULL) && (info->type == TYPE_SYMLINK) && (info->link != NULL)) {
+		size += strlen(info->link) + 1;
+	}
+	char *block = malloc(size);
+	if(block == NULL) {
+		mfs_log(LOG_CRIT, "Unable to malloc metadata cache entry (%d bytes)", (int)size);
+		return NULL;
+	}
+	mfs_metadata_cache_entry *entry = (mfs_metadata_cache_entry *)block;
+	memset(entry, 0, sizeof(mfs_metadata_cache_entry));
+	block += APR_ALIGN_DEFAULT(sizeof(mfs_metadata_cache_entry));
+	entry->type = type;
+	entry->cache_key = block;
+	entry->cache_key[0] = (char)('0' + type);
+	memcpy(entry->cache_key + 1, domain, domain_length + 1);
+	memcpy(entry->cache_key + domain_length + 2, key, key_length + 1);
+	entry->cache_key_length = domain_length + key_length + 2;
+	entry->domain = entry->cache_key + 1;
+	entry->key = entry->cache_key + domain_length + 2;
+	block += APR_ALIGN_DEFAULT(cache_key_size);
+	entry->path_count = path_count;
+	if(path_count > 0) {
+		entry->paths = (char **)block;
+		block += sizeof(char *) * path_count;
+		for(i=0; i < path_count; i++) {
+			apr_size_t l = strlen(paths[i]) + 1;
+			memcpy(block, paths[i], l);
+			entry->paths[i] = block;
+			block += l;
+		}
+	}
+	if(info != NULL) {
+		entry->info = *info;
+		entry->info.name = NULL;
+		if((info->type == TYPE_SYMLINK) && (info->link != NULL)) {
+			strcpy(block, info->link);
+			entry->info.link = block;
+		} else {
+			entry->info.link = NULL;
+		}
+	}
+	return entry;
+}
+
+//must be called with cache->lock held
+void mfs_metadata_cache_unlink_entry(mfs_metadata_cache *cache, mfs_metadata_cache_entry *entry) {
+	apr_hash_set(cache->entries, entry->cache_key, entry->cache_key_length, NULL);
+	APR_RING_REMOVE(entry, link);
+	cache->entry_count--;
+}
+
+//must be called with cache->lock held
+void mfs_metadata_cache_queue_refresh(mfs_metadata_cache *cache, mfs_metadata_cache_entry *entry) {
+	apr_size_t domain_length = strlen(entry->domain);
+	apr_size_t key_length = strlen(entry->key);
+	mfs_metadata_cache_refresh *refresh = malloc(sizeof(mfs_metadata_cache_refresh) + domain_length + key_length + 2);
+	if(refresh == NULL) {
+		return;
+	}
+	refresh->type = entry->type;
+	refresh->domain = (char *)(refresh + 1);
+	memcpy(refresh->domain, entry->domain, domain_length + 1);
+	refresh->key = refresh->domain + domain_length + 1;
+	memcpy(refresh->key, entry->key, key_length + 1);
+	refresh->next = NULL;
+	if(cache->refresh_tail == NULL) {
+		cache->refresh_head = refresh;
+	} else {
+		cache->refresh_tail->next = refresh;
+	}
+	cache->refresh_tail = refresh;
+	entry->refreshing = true;
+}
+
+//find an entry, check if it is still usable and bump it in the lru. must be called with cache->lock held
+//returns NULL if not found or too stale to use
+mfs_metadata_cache_entry * mfs_metadata_cache_lookup(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *key, int *state, bool *wake_refresher, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_metadata_cache_key(type, domain, key, &cache_key_length, pool);
+	mfs_metadata_cache_entry *entry = apr_hash_get(cache->entries, cache_key, cache_key_length);
+	*state = MFS_CACHE_MISS;
+	*wake_refresher = false;
+	if((entry == NULL) && (cache->snapshot_index != NULL)) {
+		if((entry = mfs_metadata_cache_snapshot_take(cache, cache_key, cache_key_length, pool)) != NULL) {
+			mfs_metadata_cache_insert(cache, entry);
+		}
+	}
+	if(entry == NULL) {
+		return NULL;
+	}
+	apr_time_t now = apr_time_now();
+	if(entry->negative) {
+		if(now >= entry->expires_at) { //never serve a stale negative
+			mfs_metadata_cache_unlink_entry(cache, entry);
+			free(entry);
+			return NULL;
+		}
+		*state = MFS_CACHE_NEGATIVE;
+	} else if(now >= entry->expires_at) {
+		if(now >= entry->expires_at + cache->stale_time) { //too old to use even when the trackers are down
+			mfs_metadata_cache_unlink_entry(cache, entry);
+			free(entry);
+			return NULL;
+		}
+		*state = MFS_CACHE_STALE;
+	} else {
+		*state = MFS_CACHE_HIT;
+		entry->hits++;
+		if((cache->refresh_ahead > 0) && (!entry->refreshing) && (entry->hits >= cache->hot_hits) && (now >= entry->expires_at - cache->refresh_ahead)) {
+			mfs_metadata_cache_queue_refresh(cache, entry);
+			*wake_refresher = true;
+		}
+	}
+	//move to the head of the lru
+	APR_RING_REMOVE(entry, link);
+	APR_RING_INSERT_HEAD(cache->lru, entry, _mfs_metadata_cache_entry, link);
+	return entry;
+}
+
+void mfs_metadata_cache_wake_refresher(mfs_metadata_cache *cache) {
+	apr_thread_mutex_lock(cache->refresh_mutex);
+	apr_thread_cond_signal(cache->refresh_cond);
+	apr_thread_mutex_unlock(cache->refresh_mutex);
+}
+
+int mfs_metadata_cache_get_paths(mfs_metadata_cache *cache, const char *domain, const char *key, char ***paths, int *path_count, apr_pool_t *pool) {
+	int state;
+	bool wake_refresher;
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		return MFS_CACHE_MISS;
+	}
+	mfs_metadata_cache_entry *entry = mfs_metadata_cache_lookup(cache, MFS_CACHE_PATHS, domain, key, &state, &wake_refresher, pool);
+	if(entry != NULL) {
+		//copy out while locked: the entry may be replaced as soon as we unlock
+		char **s_paths = apr_palloc(pool, sizeof(char *) * entry->path_count);
+		int i;
+		for(i=0; i < entry->path_count; i++) {
+			s_paths[i] = apr_pstrdup(pool, entry->paths[i]);
+		}
+		*paths = s_paths;
+		*path_count = entry->path_count;
+	}
+	apr_thread_mutex_unlock(cache->lock);
+	if(wake_refresher) {
+		mfs_metadata_cache_wake_refresher(cache);
+	}
+	if((state == MFS_CACHE_HIT) || (state == MFS_CACHE_NEGATIVE)) {
+		apr_atomic_inc32(&cache->hit_count);
+	} else {
+		apr_atomic_inc32(&cache->miss_count);
+	}
+	return state;
+}
+
+int mfs_metadata_cache_get_path_info(mfs_metadata_cache *cache, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, apr_pool_t *pool) {
+	int state;
+	bool wake_refresher;
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		return MFS_CACHE_MISS;
+	}
+	mfs_metadata_cache_entry *entry = mfs_metadata_cache_lookup(cache, MFS_CACHE_PATH_INFO, domain, path, &state, &wake_refresher, pool);
+	if(entry != NULL) {
+		*filepath_entry = entry->info;
+		if(entry->info.link != NULL) {
+			filepath_entry->link = apr_pstrdup(pool, entry->info.link);
+		}
+	}
+	apr_thread_mutex_unlock(cache->lock);
+	if(wake_refresher) {
+		mfs_metadata_cache_wake_refresher(cache);
+	}
+	if((state == MFS_CACHE_HIT) || (state == MFS_CACHE_NEGATIVE)) {
+		apr_atomic_inc32(&cache->hit_count);
+	} else {
+		apr_atomic_inc32(&cache->miss_count);
+	}
+	return state;
+}
+
+//add an entry (replacing any existing one) and evict from the tail of the lru. must be called with cache->lock held
+void mfs_metadata_cache_insert(mfs_metadata_cache *cache, mfs_metadata_cache_entry *entry) {
+	mfs_metadata_cache_entry *old = apr_hash_get(cache->entries, entry->cache_key, entry->cache_key_length);
+	if(old != NULL) {
+		mfs_metadata_cache_unlink_entry(cache, old);
+		free(old);
+	}
+	apr_hash_set(cache->entries, entry->cache_key, entry->cache_key_length, entry);
+	APR_RING_INSERT_HEAD(cache->lru, entry, _mfs_metadata_cache_entry, link);
+	cache->entry_count++;
+	while(cache->entry_count > cache->max_entries) {
+		mfs_metadata_cache_entry *last = APR_RING_LAST(cache->lru);
+		mfs_metadata_cache_unlink_entry(cache, last);
+		free(last);
+	}
+}
+
+void mfs_metadata_cache_put(mfs_metadata_cache *cache, mfs_metadata_cache_entry *entry, apr_pool_t *pool) {
+	entry->expires_at = apr_time_now() + cache->ttl;
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		free(entry);
+		return;
+	}
+	mfs_metadata_cache_insert(cache, entry);
+	if(cache->snapshot_index != NULL) { //this is newer
+		mfs_metadata_cache_snapshot_forget(cache, entry->cache_key, entry->cache_key_length);
+	}
+	apr_thread_mutex_unlock(cache->lock);
+}
+
+void mfs_metadata_cache_put_paths(mfs_metadata_cache *cache, const char *domain, const char *key, char **paths, int path_count, apr_pool_t *pool) {
+	mfs_metadata_cache_entry *entry = mfs_metadata_cache_entry_create(MFS_CACHE_PATHS, domain, key, paths, path_count, NULL);
+	if(entry != NULL) {
+		mfs_metadata_cache_put(cache, entry, pool);
+	}
+}
+
+void mfs_metadata_cache_put_path_info(mfs_metadata_cache *cache, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, apr_pool_t *pool) {
+	mfs_metadata_cache_entry *entry = mfs_metadata_cache_entry_create(MFS_CACHE_PATH_INFO, domain, path, NULL, 0, filepath_entry);
+	if(entry != NULL) {
+		mfs_metadata_cache_put(cache, entry, pool);
+	}
+}
+
+void mfs_metadata_cache_remove(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *key, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_metadata_cache_key(type, domain, key, &cache_key_length, pool);
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		return;
+	}
+	mfs_metadata_cache_entry *entry = apr_hash_get(cache->entries, cache_key, cache_key_length);
+	if(entry != NULL) {
+		mfs_metadata_cache_unlink_entry(cache, entry);
+		free(entry);
+	}
+	if(cache->snapshot_index != NULL) {
+		mfs_metadata_cache_snapshot_forget(cache, cache_key, cache_key_length);
+	}
+	apr_thread_mutex_unlock(cache->lock);
+}
+
+void mfs_metadata_cache_put_negative(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *key, apr_pool_t *pool) {
+	mfs_metadata_cache_entry *entry = mfs_metadata_cache_entry_create(type, domain, key, NULL, 0, NULL);
+	if(entry != NULL) {
+		entry->negative = true;
+		mfs_metadata_cache_put(cache, entry, pool);
+	}
+}
+
+void mfs_metadata_cache_rename(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *from_key, const char *to_key, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_metadata_cache_key(type, domain, from_key, &cache_key_length, pool);
+	mfs_metadata_cache_entry *moved = NULL;
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		return;
+	}
+	mfs_metadata_cache_entry *entry = apr_hash_get(cache->entries, cache_key, cache_key_length);
+	if((entry != NULL) && (!entry->negative) && (apr_time_now() < entry->expires_at)) {
+		moved = mfs_metadata_cache_entry_create(type, domain, to_key, entry->paths, entry->path_count, (type == MFS_CACHE_PATH_INFO) ? &entry->info : NULL);
+	}
+	apr_thread_mutex_unlock(cache->lock);
+	if(moved != NULL) {
+		mfs_metadata_cache_put(cache, moved, pool);
+	} else {
+		mfs_metadata_cache_remove(cache, type, domain, to_key, pool);
+	}
+	mfs_metadata_cache_put_negative(cache, type, domain, from_key, pool);
+}
+
+void mfs_metadata_cache_remove_prefix(mfs_metadata_cache *cache, const char *domain, const char *prefix) {
+	apr_size_t prefix_length = strlen(prefix);
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock metadata cache mutex:");
+		return;
+	}
+	mfs_metadata_cache_entry *entry = APR_RING_FIRST(cache->lru);
+	while(entry != APR_RING_SENTINEL(cache->lru, _mfs_metadata_cache_entry, link)) {
+		mfs_metadata_cache_entry *next = APR_RING_NEXT(entry, link);
+		if((strncmp(entry->key, prefix, prefix_length) == 0) && (strcmp(entry->domain, domain) == 0)) {
+			mfs_metadata_cache_unlink_entry(cache, entry);
+			free(entry);
+		}
+		entry = next;
+	}
+	if(cache->snapshot_index != NULL) {
+		mfs_metadata_cache_snapshot_forget_prefix(cache, domain, prefix);
+	}
+	apr_thread_mutex_unlock(cache->lock);
+}
+
+void mfs_metadata_cache_remove_path(mfs_metadata_cache *cache, const char *path) {
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock metadata cache mutex:");
+		return;
+	}
+	mfs_metadata_cache_entry *entry = APR_RING_FIRST(cache->lru);
+	while(entry != APR_RING_SENTINEL(cache->lru, _mfs_metadata_cache_entry, link)) {
+		mfs_metadata_cache_entry *next = APR_RING_NEXT(entry, link);
+		if(entry->type == MFS_CACHE_PATHS) {
+			int i;
+			for(i=0; i < entry->path_count; i++) {
+				if(strcmp(entry->paths[i], path) == 0) {
+					mfs_metadata_cache_unlink_entry(cache, entry);
+					free(entry);
+					break;
+				}
+			}
+		}
+		entry = next;
+	}
+	if(cache->snapshot_index != NULL) {
+		mfs_metadata_cache_snapshot_forget_path(cache, path);
+	}
+	apr_thread_mutex_unlock(cache->lock);
+}
+
+void mfs_metadata_cache_clear(mfs_metadata_cache *cache) {
+	apr_status_t rv = apr_thread_mutex_lock(cache->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock metadata cache mutex:");
+		return;
+	}
+	while(!APR_RING_EMPTY(cache->lru, _mfs_metadata_cache_entry, link)) {
+		mfs_metadata_cache_entry *entry = APR_RING_FIRST(cache->lru);
+		mfs_metadata_cache_unlink_entry(cache, entry);
+		free(entry);
+	}
+	mfs_metadata_cache_snapshot_discard(cache);
+	apr_thread_mutex_unlock(cache->lock);
+}
+
+void mfs_metadata_cache_start_refresh_thread(mfs_metadata_cache *cache) {
+	cache->running = true;
+	apr_threadattr_t *thd_attr;
+	apr_threadattr_create(&thd_attr, cache->pool);
+	apr_status_t rv = apr_thread_create(&cache->refresh_thread, thd_attr, mfs_metadata_cache_refresher, (void*)cache, cache->pool);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, cache->pool, "Unable to start mfs_metadata_cache_refresher thread.:");
+		cache->refresh_thread = NULL;
+	}
+}
+
+void mfs_metadata_cache_stop_refresh_thread(mfs_metadata_cache *cache) {
+	if(cache->refresh_thread != NULL) {
+		cache->running = false;
+		mfs_metadata_cache_wake_refresher(cache);
+		apr_status_t rv2;
+		apr_thread_join(&rv2, cache->refresh_thread);
+		cache->refresh_thread = NULL;
+	}
+}
+
+//pop the next queued refresh. the caller must free it
+mfs_metadata_cache_refresh * mfs_metadata_cache_next_refresh(mfs_metadata_cache *cache) {
+	mfs_metadata_cache_refresh *refresh = NULL;
+	if(apr_thread_mutex_lock(cache->lock) == APR_SUCCESS) {
+		refresh = cache->refresh_head;
+		if(refresh != NULL) {
+			cache->refresh_head = refresh->next;
+			if(cache->refresh_head == NULL) {
+				cache->refresh_tail = NULL;
+			}
+		}
+		apr_thread_mutex_unlock(cache->lock);
+	}
+	return refresh;
+}
+
+//clear the refreshing flag if the refresh failed so the entry can be tried again
+void mfs_metadata_cache_refresh_failed(mfs_metadata_cache *cache, mfs_metadata_cache_refresh *refresh, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_metadata_cache_key(refresh->type, refresh->domain, refresh->key, &cache_key_length, pool);
+	if(apr_thread_mutex_lock(cache->lock) == APR_SUCCESS) {
+		mfs_metadata_cache_entry *entry = apr_hash_get(cache->entries, cache_key, cache_key_length);
+		if(entry != NULL) {
+			entry->refreshing = false;
+		}
+		apr_thread_mutex_unlock(cache->lock);
+	}
+}
+
+void* APR_THREAD_FUNC mfs_metadata_cache_refresher(apr_thread_t *thd, void *data) {
+	mfs_metadata_cache *cache = (mfs_metadata_cache *)data;
+	while(cache->running) {
+		mfs_metadata_cache_refresh *refresh;
+		while((cache->running) && ((refresh = mfs_metadata_cache_next_refresh(cache)) != NULL)) {
+			apr_pool_t *pool;
+			apr_status_t rv = apr_pool_create(&pool,NULL);
+			if(rv != APR_SUCCESS) {
+				mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to create apr_pool for mfs_metadata_cache_refresher:");
+				free(refresh);
+				continue;
+			}
+			bool unavailable;
+			if(refresh->type == MFS_CACHE_PATHS) {
+				char **paths;
+				int path_count;
+				rv = mfs_get_paths_from_tracker(cache->file_system, refresh->domain, refresh->key, true, &paths, &path_count, &unavailable, pool);
+				if(rv == APR_SUCCESS) {
+					mfs_metadata_cache_put_paths(cache, refresh->domain, refresh->key, paths, path_count, pool);
+				}
+			} else {
+				mfs_filepath_entry info;
+				rv = mfs_path_info_from_tracker(cache->file_system, refresh->domain, refresh->key, &info, &unavailable, pool);
+				if(rv == APR_SUCCESS) {
+					mfs_metadata_cache_put_path_info(cache, refresh->domain, refresh->key, &info, pool);
+				}
+			}
+			if(rv == APR_SUCCESS) {
+				apr_atomic_inc32(&cache->refresh_count);
+			} else if(rv == APR_EBADPATH) { //its gone... dont keep serving it
+				mfs_metadata_cache_remove(cache, refresh->type, refresh->domain, refresh->key, pool);
+			} else {
+				mfs_log_apr(LOG_DEBUG, rv, pool, "Refresh-ahead failed for %s.%s:", refresh->domain, refresh->key);
+				mfs_metadata_cache_refresh_failed(cache, refresh, pool);
+			}
+			apr_pool_destroy(pool);
+			free(refresh);
+		}
+		if((cache->snapshot_file != NULL) && (cache->snapshot_interval > 0) && (apr_time_now() >= cache->next_snapshot)) {
+			mfs_metadata_cache_save_snapshot(cache);
+		}
+		//use a condition variable to sleep allowing us to wake it from mfs_metadata_cache_stop_refresh_thread
+		apr_thread_mutex_lock(cache->refresh_mutex);
+		if(cache->running && (cache->refresh_head == NULL)) {
+			apr_thread_cond_timedwait(cache->refresh_cond, cache->refresh_mutex, apr_time_from_sec(1));
+		}
+		apr_thread_mutex_unlock(cache->refresh_mutex);
+	}
+	apr_thread_exit(thd, APR_SUCCESS);
+	return NULL;
+}
+
+void mfs_cache_after_store(mfs_file_system *file_system, const char *domain, const char *key, char *put_url, apr_pool_t *pool) {
+	mfs_bloom_filter_add(file_system, domain, key);
+	//the path we just wrote to is good until replication adds more
+	if(file_system->metadata_cache != NULL) {
+		mfs_metadata_cache_put_paths(file_system->metadata_cache, domain, key, &put_url, 1, pool);
+		mfs_metadata_cache_remove(file_system->metadata_cache, MFS_CACHE_PATH_INFO, domain, key, pool); //size and mtime have changed
+	}
+	if(file_system->shm_cache != NULL) {
+		mfs_shm_cache_put_paths(file_system->shm_cache, domain, key, &put_url, 1, pool);
+	}
+	if(file_system->content_cache != NULL) {
+		mfs_content_cache_remove(file_system->content_cache, domain, key, pool);
+	}
+}
+
+void mfs_cache_after_delete(mfs_file_system *file_system, const char *domain, const char *key, apr_pool_t *pool) {
+	if(file_system->metadata_cache != NULL) {
+		mfs_metadata_cache_put_negative(file_system->metadata_cache, MFS_CACHE_PATHS, domain, key, pool);
+		mfs_metadata_cache_put_negative(file_system->metadata_cache, MFS_CACHE_PATH_INFO, domain, key, pool);
+	}
+	if(file_system->shm_cache != NULL) {
+		mfs_shm_cache_remove(file_system->shm_cache, domain, key, pool);
+	}
+	if(file_system->content_cache != NULL) {
+		mfs_content_cache_remove(file_system->content_cache, domain, key, pool);
+	}
+}
+
+void mfs_cache_after_rename(mfs_file_system *file_system, const char *domain, const char *from_key, const char *to_key, bool filepath, apr_pool_t *pool) {
+	mfs_bloom_filter_add(file_system, domain, to_key);
+	if(filepath) {
+		mfs_bloom_filter_add_prefix(file_system, domain, to_key);
+	}
+	if(file_system->metadata_cache != NULL) {
+		mfs_metadata_cache_rename(file_system->metadata_cache, MFS_CACHE_PATHS, domain, from_key, to_key, pool);
+		mfs_metadata_cache_rename(file_system->metadata_cache, MFS_CACHE_PATH_INFO, domain, from_key, to_key, pool);
+		if(filepath) { //a directory takes its children with it
+			mfs_metadata_cache_remove_prefix(file_system->metadata_cache, domain, apr_pstrcat(pool, from_key, "/", NULL));
+			mfs_metadata_cache_remove_prefix(file_system->metadata_cache, domain, apr_pstrcat(pool, to_key, "/", NULL));
+		}
+	}
+	if(file_system->shm_cache != NULL) {
+		char **paths;
+		int path_count;
+		if(mfs_shm_cache_get_paths(file_system->shm_cache, domain, from_key, &paths, &path_count, pool)) {
+			mfs_shm_cache_put_paths(file_system->shm_cache, domain, to_key, paths, path_count, pool);
+		} else {
+			mfs_shm_cache_remove(file_system->shm_cache, domain, to_key, pool);
+		}
+		mfs_shm_cache_remove(file_system->shm_cache, domain, from_key, pool);
+		if(filepath) {
+			mfs_shm_cache_remove_prefix(file_system->shm_cache, domain, apr_pstrcat(pool, from_key, "/", NULL), pool);
+			mfs_shm_cache_remove_prefix(file_system->shm_cache, domain, apr_pstrcat(pool, to_key, "/", NULL), pool);
+		}
+	}
+	if(file_system->content_cache != NULL) {
+		mfs_content_cache_remove(file_system->content_cache, domain, from_key, pool);
+		mfs_content_cache_remove(file_system->content_cache, domain, to_key, pool);
+		if(filepath) {
+			mfs_content_cache_remove_prefix(file_system->content_cache, domain, apr_pstrcat(pool, from_key, "/", NULL));
+			mfs_content_cache_remove_prefix(file_system->content_cache, domain, apr_pstrcat(pool, to_key, "/", NULL));
+		}
+	}
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+in memory cache of small file contents keyed by domain/key.
+the cache is split into MFS_CONTENT_CACHE_SHARDS shards (each with its own lock, hash and lru) and each shard gets
+an equal share of the byte budget.
+entries are reference counted so they can be handed out without copying: as a buffer released by a pool cleanup
+or as a heap bucket released by its free function. evicting an entry only drops the cache's reference.
+when a shard is full a new entry is only admitted if the sketch says it is used more often than the lru victim (TinyLFU).
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+#include <stdlib.h>
+
+#define MFS_CONTENT_ENTRY_HEADER_SIZE APR_ALIGN_DEFAULT(sizeof(mfs_content_entry))
+
+apr_status_t mfs_enable_content_cache(mfs_file_system *file_system, apr_size_t max_bytes, apr_size_t max_object_size, apr_interval_time_t ttl) {
+	if(file_system->content_cache != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_content_cache called when the content cache is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_content_cache *cache = apr_pcalloc(p, sizeof(mfs_content_cache));
+	cache->pool = p;
+	cache->shard_max_bytes = max_bytes / MFS_CONTENT_CACHE_SHARDS;
+	cache->max_object_size = max_object_size;
+	if(cache->max_object_size > cache->shard_max_bytes) {
+		cache->max_object_size = cache->shard_max_bytes;
+	}
+	cache->ttl = ttl;
+	int i;
+	for(i=0; i < MFS_CONTENT_CACHE_SHARDS; i++) {
+		mfs_content_cache_shard *shard = &cache->shards[i];
+		if((rv = apr_thread_mutex_create(&shard->lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_CRIT, rv, p, "Unable to create content cache mutex:");
+			apr_pool_destroy(p);
+			return rv;
+		}
+		shard->entries = apr_hash_make(p);
+		shard->lru = apr_palloc(p, sizeof(mfs_content_cache_lru));
+		APR_RING_INIT(shard->lru, _mfs_content_entry, link);
+	}
+	//size the sketch for roughly the number of objects that fit
+	apr_size_t expected_entries = max_bytes / 4096;
+	if((rv = mfs_sketch_create(&cache->sketch, (apr_uint32_t)(expected_entries > 0x1000000 ? 0x1000000 : expected_entries), MFS_SKETCH_MAX_COUNT, p)) != APR_SUCCESS) {
+		apr_pool_destroy(p);
+		return rv;
+	}
+	file_system->content_cache = cache;
+	mfs_log(LOG_INFO, "Content cache enabled. max_bytes=%ld, max_object_size=%ld, ttl=%d ms", (long)max_bytes, (long)cache->max_object_size, (apr_int32_t)apr_time_as_msec(ttl));
+	return APR_SUCCESS;
+}
+
+void mfs_content_cache_destroy(mfs_content_cache *cache) {
+	mfs_content_cache_clear(cache); //entries still referenced by callers are freed when they are released
+	int i;
+	for(i=0; i < MFS_CONTENT_CACHE_SHARDS; i++) {
+		apr_thread_mutex_destroy(cache->shards[i].lock);
+	}
+	apr_pool_destroy(cache->pool);
+}
+
+//the data goes straight after the entry so it can be found from the data pointer in a bucket free function
+mfs_content_entry * mfs_content_entry_create(const char *domain, const char *key, apr_size_t size) {
+	apr_size_t domain_length = strlen(domain);
+	apr_size_t key_length = strlen(key);
+	char *block = malloc(MFS_CONTENT_ENTRY_HEADER_SIZE + size + domain_length + key_length + 2);
+	if(block == NULL) {
+		mfs_log(LOG_CRIT, "Unable to malloc content cache entry (%ld bytes)", (long)size);
+		return NULL;
+	}
+	mfs_content_entry *entry = (mfs_content_entry *)block;
+	memset(entry, 0, sizeof(mfs_content_entry));
+	entry->data = block + MFS_CONTENT_ENTRY_HEADER_SIZE;
+	entry->size = size;
+	entry->cache_key = entry->data + size;
+	memcpy(entry->cache_key, domain, domain_length + 1);
+	memcpy(entry->cache_key + domain_length + 1, key, key_length + 1);
+	entry->cache_key_length = domain_length + key_length + 1;
+	apr_ssize_t l = entry->cache_key_length;
+	entry->hash = apr_hashfunc_default(entry->cache_key, &l);
+	entry->references = 1;
+	return entry;
+}
+
+void mfs_content_entry_acquire(mfs_content_entry *entry) {
+	apr_atomic_inc32(&entry->references);
+}
+
+void mfs_content_entry_release(mfs_content_entry *entry) {
+	if(apr_atomic_dec32(&entry->references) == 0) {
+		free(entry);
+	}
+}
+
+apr_status_t mfs_content_entry_pool_release(void *data) {
+	mfs_content_entry_release((mfs_content_entry *)data);
+	return APR_SUCCESS;
+}
+
+void mfs_content_entry_release_with_pool(mfs_content_entry *entry, apr_pool_t *pool) {
+	apr_pool_cleanup_register(pool, entry, mfs_content_entry_pool_release, apr_pool_cleanup_null);
+}
+
+void mfs_content_entry_bucket_free(void *data) {
+	mfs_content_entry_release((mfs_content_entry *)((char *)data - MFS_CONTENT_ENTRY_HEADER_SIZE));
+}
+
+apr_bucket * mfs_content_entry_bucket_create(mfs_content_entry *entry, apr_bucket_alloc_t *list) {
+	mfs_content_entry_acquire(entry);
+	return apr_bucket_heap_create(entry->data, entry->size, mfs_content_entry_bucket_free, list);
+}
+
+mfs_content_cache_shard * mfs_content_cache_shard_for(mfs_content_cache *cache, apr_uint32_t hash) {
+	//the low bits pick the bucket inside the shard's hash so use the high bits here
+	return &cache->shards[(hash >> 16) % MFS_CONTENT_CACHE_SHARDS];
+}
+
+//must be called with shard->lock held. the caller must release the cache's reference
+void mfs_content_cache_unlink_entry(mfs_content_cache_shard *shard, mfs_content_entry *entry) {
+	apr_hash_set(shard->entries, entry->cache_key, entry->cache_key_length, NULL);
+	APR_RING_REMOVE(entry, link);
+	shard->bytes -= entry->size;
+}
+
+mfs_content_entry * mfs_content_cache_get(mfs_content_cache *cache, const char *domain, const char *key, apr_pool_t *pool) {
+	return mfs_content_cache_get_stale(cache, domain, key, pool, NULL);
+}
+
+mfs_content_entry * mfs_content_cache_get_stale(mfs_content_cache *cache, const char *domain, const char *key, apr_pool_t *pool, bool *stale) {
+	apr_ssize_t cache_key_length = strlen(domain) + strlen(key) + 1;
+	char *cache_key = apr_palloc(pool, cache_key_length + 1);
+	strcpy(cache_key, domain);
+	strcpy(cache_key + strlen(domain) + 1, key);
+	apr_ssize_t l = cache_key_length;
+	apr_uint32_t hash = apr_hashfunc_default(cache_key, &l);
+	mfs_sketch_increment(cache->sketch, hash); //misses count too: that is how a new key earns its place
+	mfs_content_cache_shard *shard = mfs_content_cache_shard_for(cache, hash);
+	mfs_content_entry *expired = NULL;
+	apr_status_t rv = apr_thread_mutex_lock(shard->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock content cache mutex:");
+		return NULL;
+	}
+	if(stale != NULL) {
+		*stale = false;
+	}
+	mfs_content_entry *entry = apr_hash_get(shard->entries, cache_key, cache_key_length);
+	if(entry != NULL) {
+		if(apr_time_now() >= entry->expires_at) {
+			if((stale != NULL) && ((entry->etag[0] != '\0') || (entry->last_modified[0] != '\0'))) {
+				//leave it linked: a 304 gives it a new ttl
+				mfs_content_entry_acquire(entry);
+				apr_thread_mutex_unlock(shard->lock);
+				*stale = true;
+				apr_atomic_inc32(&cache->miss_count);
+				return entry;
+			}
+			mfs_content_cache_unlink_entry(shard, entry);
+			expired = entry;
+			entry = NULL;
+		} else {
+			APR_RING_REMOVE(entry, link);
+			APR_RING_INSERT_HEAD(shard->lru, entry, _mfs_content_entry, link);
+			mfs_content_entry_acquire(entry);
+		}
+	}
+	apr_thread_mutex_unlock(shard->lock);
+	if(expired != NULL) {
+		mfs_content_entry_release(expired);
+	}
+	if(entry != NULL) {
+		apr_atomic_inc32(&cache->hit_count);
+	} else {
+		apr_atomic_inc32(&cache->miss_count);
+	}
+	return entry;
+}
+
+void mfs_content_cache_refresh(mfs_content_cache *cache, mfs_content_entry *entry) {
+	mfs_content_cache_shard *shard = mfs_content_cache_shard_for(cache, entry->hash);
+	if(apr_thread_mutex_lock(shard->lock) != APR_SUCCESS) {
+		return;
+	}
+	entry->expires_at = apr_time_now() + cache->ttl;
+	apr_thread_mutex_unlock(shard->lock);
+	apr_atomic_inc32(&cache->revalidated_count);
+}
+
+void mfs_content_cache_insert(mfs_content_cache *cache, mfs_content_entry *entry, bool check_admission) {
+	if(entry->size > cache->max_object_size) {
+		mfs_content_entry_release(entry);
+		return;
+	}
+	entry->expires_at = apr_time_now() + cache->ttl;
+	mfs_content_cache_shard *shard = mfs_content_cache_shard_for(cache, entry->hash);
+	int frequency = mfs_sketch_estimate(cache->sketch, entry->hash);
+	APR_RING_HEAD(_mfs_content_cache_evicted, _mfs_content_entry) evicted;
+	APR_RING_INIT(&evicted, _mfs_content_entry, link);
+	apr_status_t rv = apr_thread_mutex_lock(shard->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock content cache mutex:");
+		mfs_content_entry_release(entry);
+		return;
+	}
+	mfs_content_entry *old = apr_hash_get(shard->entries, entry->cache_key, entry->cache_key_length);
+	if(old != NULL) {
+		mfs_content_cache_unlink_entry(shard, old);
+		APR_RING_INSERT_TAIL(&evicted, old, _mfs_content_entry, link);
+	}
+	bool admit = true;
+	while(admit && (shard->bytes + entry->size > cache->shard_max_bytes)) {
+		mfs_content_entry *victim = APR_RING_LAST(shard->lru);
+		if(check_admission && (frequency <= mfs_sketch_estimate(cache->sketch, victim->hash))) {
+			admit = false;
+		} else {
+			mfs_content_cache_unlink_entry(shard, victim);
+			APR_RING_INSERT_TAIL(&evicted, victim, _mfs_content_entry, link);
+			apr_atomic_inc32(&cache->eviction_count);
+		}
+	}
+	if(admit) {
+		apr_hash_set(shard->entries, entry->cache_key, entry->cache_key_length, entry);
+		APR_RING_INSERT_HEAD(shard->lru, entry, _mfs_content_entry, link);
+		shard->bytes += entry->size;
+	}
+	apr_thread_mutex_unlock(shard->lock);
+	//free outside the lock
+	while(!APR_RING_EMPTY(&evicted, _mfs_content_entry, link)) {
+		mfs_content_entry *e = APR_RING_FIRST(&evicted);
+		APR_RING_REMOVE(e, link);
+		mfs_content_entry_release(e);
+	}
+	if(!admit) {
+		apr_atomic_inc32(&cache->rejected_count);
+		mfs_content_entry_release(entry);
+	}
+}
+
+void mfs_content_cache_put(mfs_content_cache *cache, mfs_content_entry *entry) {
+	mfs_content_cache_insert(cache, entry, true);
+}
+
+void mfs_content_cache_promote(mfs_content_cache *cache, mfs_content_entry *entry) {
+	mfs_content_cache_insert(cache, entry, false);
+}
+
+void mfs_content_cache_remove(mfs_content_cache *cache, const char *domain, const char *key, apr_pool_t *pool) {
+	apr_ssize_t cache_key_length = strlen(domain) + strlen(key) + 1;
+	char *cache_key = apr_palloc(pool, cache_key_length + 1);
+	strcpy(cache_key, domain);
+	strcpy(cache_key + strlen(domain) + 1, key);
+	apr_ssize_t l = cache_key_length;
+	mfs_content_cache_shard *shard = mfs_content_cache_shard_for(cache, apr_hashfunc_default(cache_key, &l));
+	apr_status_t rv = apr_thread_mutex_lock(shard->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock content cache mutex:");
+		return;
+	}
+	mfs_content_entry *entry = apr_hash_get(shard->entries, cache_key, cache_key_length);
+	if(entry != NULL) {
+		mfs_content_cache_unlink_entry(shard, entry);
+	}
+	apr_thread_mutex_unlock(shard->lock);
+	if(entry != NULL) {
+		mfs_content_entry_release(entry);
+	}
+}
+
+//drop every key in the domain that starts with prefix (the children of a renamed directory). every shard has to be looked at
+void mfs_content_cache_remove_prefix(mfs_content_cache *cache, const char *domain, const char *prefix) {
+	apr_size_t domain_length = strlen(domain);
+	apr_size_t prefix_length = strlen(prefix);
+	APR_RING_HEAD(_mfs_content_cache_removed, _mfs_content_entry) removed;
+	APR_RING_INIT(&removed, _mfs_content_entry, link);
+	int i;
+	for(i=0; i < MFS_CONTENT_CACHE_SHARDS; i++) {
+		mfs_content_cache_shard *shard = &cache->shards[i];
+		apr_status_t rv = apr_thread_mutex_lock(shard->lock);
+		if(rv != APR_SUCCESS) {
+			mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock content cache mutex:");
+			continue;
+		}
+		mfs_content_entry *entry = APR_RING_FIRST(shard->lru);
+		while(entry != APR_RING_SENTINEL(shard->lru, _mfs_content_entry, link)) {
+			mfs_content_entry *next = APR_RING_NEXT(entry, link);
+			if((entry->cache_key_length >= domain_length + 1 + prefix_length) && (strcmp(entry->cache_key, domain) == 0) && (strncmp(entry->cache_key + domain_length + 1, prefix, prefix_length) == 0)) {
+				mfs_content_cache_unlink_entry(shard, entry);
+				APR_RING_INSERT_TAIL(&removed, entry, _mfs_content_entry, link);
+			}
+			entry = next;
+		}
+		apr_thread_mutex_unlock(shard->lock);
+	}
+	//free outside the locks
+	while(!APR_RING_EMPTY(&removed, _mfs_content_entry, link)) {
+		mfs_content_entry *e = APR_RING_FIRST(&removed);
+		APR_RING_REMOVE(e, link);
+		mfs_content_entry_release(e);
+	}
+}
+
+void mfs_content_cache_clear(mfs_content_cache *cache) {
+	int i;
+	for(i=0; i < MFS_CONTENT_CACHE_SHARDS; i++) {
+		mfs_content_cache_shard *shard = &cache->shards[i];
+		if(apr_thread_mutex_lock(shard->lock) != APR_SUCCESS) {
+			continue;
+		}
+		while(!APR_RING_EMPTY(shard->lru, _mfs_content_entry, link)) {
+			mfs_content_entry *entry = APR_RING_FIRST(shard->lru);
+			mfs_content_cache_unlink_entry(shard, entry);
+			mfs_content_entry_release(entry);
+		}
+		apr_thread_mutex_unlock(shard->lock);
+	}
+}
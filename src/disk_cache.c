@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+on disk cache of downloaded files keyed by fid. a fid is never reused so a cached file never goes stale.
+layout: directory/xx/fid.fid where xx is the low byte of the fid in hex. temp files are directory/tmp.XXXXXX.
+blocks spilled from the block cache are directory/xx/fid.index.blk and share the same budget.
+downloads are written to a temp file and renamed into place so other processes never see a partial file.
+the mtime of a file is its lru time: hits touch it (at most once every MFS_DISK_CACHE_TOUCH_AGE).
+every process runs a sweep thread but an exclusive lock on directory/.lock means only one sweeps at a time.
+deleting a file that another process has open is fine: it keeps its copy until it closes it.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_tables.h>
+#include <stdlib.h>
+
+typedef struct {
+	char *path;
+	apr_time_t mtime;
+	apr_off_t size;
+} mfs_disk_cache_file;
+
+apr_status_t mfs_enable_disk_cache(mfs_file_system *file_system, const char *directory, apr_off_t max_bytes, apr_interval_time_t sweep_interval) {
+	if(file_system->disk_cache != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_disk_cache called when the disk cache is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_disk_cache *cache = apr_pcalloc(p, sizeof(mfs_disk_cache));
+	cache->pool = p;
+	cache->directory = apr_pstrdup(p, directory);
+	cache->max_bytes = (max_bytes > 0) ? max_bytes : DEFAULT_DISK_CACHE_MAX_BYTES;
+	cache->sweep_interval = (sweep_interval > 0) ? sweep_interval : DEFAULT_DISK_CACHE_SWEEP_INTERVAL;
+	if((rv = apr_dir_make_recursive(cache->directory, APR_FPROT_OS_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, p, "Unable to create disk cache directory %s:", cache->directory);
+		apr_pool_destroy(p);
+		return rv;
+	}
+	char *lock_path = apr_pstrcat(p, cache->directory, "/.lock", NULL);
+	if((rv = apr_file_open(&cache->lock_file, lock_path, APR_FOPEN_CREATE | APR_FOPEN_WRITE, APR_FPROT_OS_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, p, "Unable to open disk cache lock file %s:", lock_path);
+		apr_pool_destroy(p);
+		return rv;
+	}
+	apr_thread_mutex_create(&cache->sweep_mutex, APR_THREAD_MUTEX_UNNESTED, p);
+	apr_thread_cond_create(&cache->sweep_cond, p);
+	cache->running = true;
+	apr_threadattr_t *thd_attr;
+	apr_threadattr_create(&thd_attr, p);
+	if((rv = apr_thread_create(&cache->sweep_thread, thd_attr, mfs_disk_cache_sweeper, (void*)cache, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to start mfs_disk_cache_sweeper thread.:");
+		cache->sweep_thread = NULL;
+	}
+	file_system->disk_cache = cache;
+	mfs_log(LOG_INFO, "Disk cache enabled. directory=%s, max_bytes=%" APR_OFF_T_FMT ", sweep_interval=%d ms", cache->directory, cache->max_bytes, (apr_int32_t)apr_time_as_msec(cache->sweep_interval));
+	return APR_SUCCESS;
+}
+
+void mfs_disk_cache_destroy(mfs_disk_cache *cache) {
+	if(cache->sweep_thread != NULL) {
+		cache->running = false;
+		apr_thread_mutex_lock(cache->sweep_mutex);
+		apr_thread_cond_signal(cache->sweep_cond);
+		apr_thread_mutex_unlock(cache->sweep_mutex);
+		apr_status_t rv2;
+		apr_thread_join(&rv2, cache->sweep_thread);
+		cache->sweep_thread = NULL;
+	}
+	apr_thread_mutex_destroy(cache->sweep_mutex);
+	apr_thread_cond_destroy(cache->sweep_cond);
+	apr_pool_destroy(cache->pool); //closes the lock file
+}
+
+apr_int64_t mfs_fid_from_path(const char *path) {
+	const char *name = strrchr(path, '/');
+	if(name == NULL) {
+		return -1;
+	}
+	name++;
+	apr_size_t digits = strspn(name, "0123456789");
+	if((digits == 0) || (strcmp(name + digits, ".fid") != 0)) {
+		return -1;
+	}
+	return apr_atoi64(name);
+}
+
+char * mfs_disk_cache_path(mfs_disk_cache *cache, apr_int64_t fid, apr_pool_t *pool) {
+	return apr_psprintf(pool, "%s/%02x/%" APR_INT64_T_FMT ".fid", cache->directory, (unsigned int)(fid & 0xff), fid);
+}
+
+char * mfs_disk_cache_block_path(mfs_disk_cache *cache, apr_int64_t fid, apr_int64_t index, apr_pool_t *pool) {
+	return apr_psprintf(pool, "%s/%02x/%" APR_INT64_T_FMT ".%" APR_INT64_T_FMT ".blk", cache->directory, (unsigned int)(fid & 0xff), fid, index);
+}
+
+apr_status_t mfs_disk_cache_open_path(mfs_disk_cache *cache, char *path, apr_file_t **file, apr_off_t *size, apr_pool_t *pool) {
+	apr_status_t rv;
+	if((rv = apr_file_open(file, path, APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_XTHREAD, APR_FPROT_OS_DEFAULT, pool)) != APR_SUCCESS) {
+		apr_atomic_inc32(&cache->miss_count);
+		return APR_STATUS_IS_ENOENT(rv) ? APR_ENOENT : rv;
+	}
+	apr_finfo_t finfo;
+	if((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, *file)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to stat disk cache file %s:", path);
+		apr_file_close(*file);
+		apr_atomic_inc32(&cache->miss_count);
+		return rv;
+	}
+	apr_time_t now = apr_time_now();
+	if(now - finfo.mtime > MFS_DISK_CACHE_TOUCH_AGE) {
+		apr_file_mtime_set(path, now, pool);
+	}
+	*size = finfo.size;
+	apr_atomic_inc32(&cache->hit_count);
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_disk_cache_open(mfs_disk_cache *cache, apr_int64_t fid, apr_file_t **file, apr_off_t *size, apr_pool_t *pool) {
+	return mfs_disk_cache_open_path(cache, mfs_disk_cache_path(cache, fid, pool), file, size, pool);
+}
+
+apr_status_t mfs_disk_cache_open_block(mfs_disk_cache *cache, apr_int64_t fid, apr_int64_t index, apr_file_t **file, apr_off_t *size, apr_pool_t *pool) {
+	return mfs_disk_cache_open_path(cache, mfs_disk_cache_block_path(cache, fid, index, pool), file, size, pool);
+}
+
+char * mfs_disk_cache_temp_template(mfs_disk_cache *cache, apr_pool_t *pool) {
+	return apr_pstrcat(pool, cache->directory, "/tmp.XXXXXX", NULL);
+}
+
+apr_status_t mfs_disk_cache_publish_path(mfs_disk_cache *cache, apr_int64_t fid, char *path, apr_file_t *file, apr_pool_t *pool) {
+	const char *temp_path;
+	apr_status_t rv;
+	if((rv = apr_file_name_get(&temp_path, file)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get disk cache temp file name:");
+		return rv;
+	}
+	if((rv = apr_file_rename(temp_path, path, pool)) != APR_SUCCESS) {
+		//the first publish into this bucket directory
+		char *directory = apr_psprintf(pool, "%s/%02x", cache->directory, (unsigned int)(fid & 0xff));
+		if((apr_dir_make(directory, APR_FPROT_OS_DEFAULT, pool) != APR_SUCCESS) || ((rv = apr_file_rename(temp_path, path, pool)) != APR_SUCCESS)) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to publish %s to disk cache as %s:", temp_path, path);
+			apr_file_remove(temp_path, pool);
+			return rv;
+		}
+	}
+	apr_atomic_inc32(&cache->publish_count);
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_disk_cache_publish(mfs_disk_cache *cache, apr_int64_t fid, apr_file_t *file, apr_pool_t *pool) {
+	return mfs_disk_cache_publish_path(cache, fid, mfs_disk_cache_path(cache, fid, pool), file, pool);
+}
+
+apr_status_t mfs_disk_cache_publish_block(mfs_disk_cache *cache, apr_int64_t fid, apr_int64_t index, apr_file_t *file, apr_pool_t *pool) {
+	return mfs_disk_cache_publish_path(cache, fid, mfs_disk_cache_block_path(cache, fid, index, pool), file, pool);
+}
+
+void mfs_disk_cache_discard(mfs_disk_cache *cache, apr_file_t *file, apr_pool_t *pool) {
+	const char *temp_path;
+	if(apr_file_name_get(&temp_path, file) == APR_SUCCESS) {
+		temp_path = apr_pstrdup(pool, temp_path);
+		apr_file_close(file);
+		apr_file_remove(temp_path, pool);
+	} else {
+		apr_file_close(file);
+	}
+}
+
+int mfs_disk_cache_file_compare(const void *a, const void *b) {
+	const mfs_disk_cache_file *fa = (const mfs_disk_cache_file *)a;
+	const mfs_disk_cache_file *fb = (const mfs_disk_cache_file *)b;
+	return (fa->mtime < fb->mtime) ? -1 : ((fa->mtime > fb->mtime) ? 1 : 0);
+}
+
+//add the files in directory to files. temp files that have been abandoned are deleted
+void mfs_disk_cache_scan(mfs_disk_cache *cache, const char *directory, bool top, apr_array_header_t *files, apr_off_t *total, apr_pool_t *pool) {
+	apr_dir_t *dir;
+	apr_finfo_t finfo;
+	apr_status_t rv;
+	if((rv = apr_dir_open(&dir, directory, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to open disk cache directory %s:", directory);
+		return;
+	}
+	apr_time_t now = apr_time_now();
+	while(apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_SIZE | APR_FINFO_MTIME, dir) == APR_SUCCESS) {
+		if(finfo.name[0] == '.') { //., .. and .lock
+			continue;
+		}
+		char *path = apr_pstrcat(pool, directory, "/", finfo.name, NULL);
+		if(top) {
+			if(finfo.filetype == APR_DIR) {
+				mfs_disk_cache_scan(cache, path, false, files, total, pool);
+			} else if((strncmp(finfo.name, "tmp.", 4) == 0) && (now - finfo.mtime > MFS_DISK_CACHE_TEMP_AGE)) {
+				apr_file_remove(path, pool);
+			}
+		} else if(finfo.filetype == APR_REG) {
+			mfs_disk_cache_file *file = apr_array_push(files);
+			file->path = path;
+			file->mtime = finfo.mtime;
+			file->size = finfo.size;
+			*total += finfo.size;
+		}
+	}
+	apr_dir_close(dir);
+}
+
+apr_status_t mfs_disk_cache_sweep(mfs_disk_cache *cache) {
+	apr_status_t rv;
+	if((rv = apr_file_lock(cache->lock_file, APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK)) != APR_SUCCESS) {
+		return APR_EBUSY; //another process is sweeping
+	}
+	apr_pool_t *pool;
+	if((rv = apr_pool_create(&pool, NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		apr_file_unlock(cache->lock_file);
+		return rv;
+	}
+	apr_array_header_t *files = apr_array_make(pool, 1024, sizeof(mfs_disk_cache_file));
+	apr_off_t total = 0;
+	mfs_disk_cache_scan(cache, cache->directory, true, files, &total, pool);
+	if(total > cache->max_bytes) {
+		apr_off_t target = cache->max_bytes - (cache->max_bytes / 10);
+		qsort(files->elts, files->nelts, sizeof(mfs_disk_cache_file), mfs_disk_cache_file_compare);
+		int i;
+		for(i=0; (i < files->nelts) && (total > target); i++) {
+			mfs_disk_cache_file *file = &APR_ARRAY_IDX(files, i, mfs_disk_cache_file);
+			if(apr_file_remove(file->path, pool) == APR_SUCCESS) {
+				total -= file->size;
+				apr_atomic_inc32(&cache->eviction_count);
+			}
+		}
+	}
+	cache->size = total;
+	apr_pool_destroy(pool);
+	apr_file_unlock(cache->lock_file);
+	return APR_SUCCESS;
+}
+
+void* APR_THREAD_FUNC mfs_disk_cache_sweeper(apr_thread_t *thd, void *data) {
+	mfs_disk_cache *cache = (mfs_disk_cache *)data;
+	while(cache->running) {
+		mfs_disk_cache_sweep(cache);
+		//use a condition variable to sleep allowing us to wake it from mfs_disk_cache_destroy
+		apr_thread_mutex_lock(cache->sweep_mutex);
+		if(cache->running) {
+			apr_thread_cond_timedwait(cache->sweep_cond, cache->sweep_mutex, cache->sweep_interval);
+		}
+		apr_thread_mutex_unlock(cache->sweep_mutex);
+	}
+	apr_thread_exit(thd, APR_SUCCESS);
+	return NULL;
+}
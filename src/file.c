@@ -19,6 +19,7 @@
 #include "mogile_fs.h"
 #include "logger.h"
 #include <apr_strings.h>
+#include <apr_atomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <curl/curl.h>
@@ -27,6 +28,7 @@
 
 apr_status_t mfs_file_server_conn_constructor(void **resource, void *params, apr_pool_t *pool);
 apr_status_t mfs_file_server_conn_destructor(void *resource, void *params, apr_pool_t *pool);
+apr_status_t mfs_get_paths_lookup(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, bool promote, char ***paths, int *path_count, apr_pool_t *pool);
 
 
 apr_status_t mfs_init_file_system(mfs_file_system ** file_system, tracker_pool *trackers) {
@@ -55,6 +57,30 @@ apr_status_t mfs_init_file_system(mfs_file_system ** file_system, tracker_pool *
 	fs->lock = lock;
 	fs->file_servers = apr_hash_make(p);
 	fs->client_id = NULL;
+	fs->metadata_cache = NULL;
+	fs->shm_cache = NULL;
+	fs->invalidation_dispatcher = NULL;
+	fs->content_cache = NULL;
+	fs->disk_cache = NULL;
+	fs->block_cache = NULL;
+	fs->local_docroots = apr_hash_make(p);
+	fs->mirrors = NULL;
+	fs->hot_keys = NULL;
+	fs->bloom_filters = apr_hash_make(p);
+	fs->parallel_download = NULL;
+	fs->hedge = NULL;
+	fs->replica_ranking = NULL;
+	fs->load_balancer = NULL;
+	fs->slab_arena = NULL;
+	if((rv = apr_thread_mutex_create(&fs->made_directories_lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create made directories mutex:");
+		return rv;
+	}
+	if((rv = apr_pool_create(&fs->made_directories_pool, p)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	fs->made_directories = apr_hash_make(fs->made_directories_pool);
 	*file_system = fs;
 	mfs_pool_start_maintenance_thread(trackers);
 	
@@ -78,6 +104,43 @@ apr_status_t mfs_init_file_system(mfs_file_system ** file_system, tracker_pool *
 }
 
 void mfs_close_file_system(mfs_file_system *file_system) {
+	mfs_stop_invalidation_dispatcher(file_system); //it applies events to the caches
+	while(file_system->mirrors != NULL) { //they use the caches and trackers
+		mfs_stop_mirror(file_system->mirrors);
+	}
+	apr_hash_index_t *bi;
+	while((bi = apr_hash_first(NULL, file_system->bloom_filters)) != NULL) { //stop the rebuild threads
+		mfs_bloom_filter *filter;
+		apr_hash_this(bi, NULL, NULL, (void**)&filter);
+		mfs_bloom_filter_destroy(filter);
+	}
+	if(file_system->metadata_cache != NULL) { //stop the refresh thread before the trackers go away
+		mfs_metadata_cache_destroy(file_system->metadata_cache);
+		file_system->metadata_cache = NULL;
+	}
+	if(file_system->shm_cache != NULL) {
+		mfs_shm_cache_destroy(file_system->shm_cache);
+		file_system->shm_cache = NULL;
+	}
+	if(file_system->content_cache != NULL) {
+		mfs_content_cache_destroy(file_system->content_cache);
+		file_system->content_cache = NULL;
+	}
+	if(file_system->block_cache != NULL) {
+		mfs_block_cache_destroy(file_system->block_cache);
+		file_system->block_cache = NULL;
+	}
+	if(file_system->disk_cache != NULL) {
+		mfs_disk_cache_destroy(file_system->disk_cache);
+		file_system->disk_cache = NULL;
+	}
+	if(file_system->hot_keys != NULL) {
+		mfs_hot_keys_destroy(file_system->hot_keys);
+		file_system->hot_keys = NULL;
+	}
+	if(file_system->slab_arena != NULL) {
+		mfs_slab_arena_destroy(file_system->slab_arena);
+	}
 	if(file_system->trackers != NULL) {
 		mfs_pool_stop_maintenance_thread(file_system->trackers);
 	}
@@ -138,7 +201,12 @@ apr_status_t mfs_get_file_server(mfs_file_system *file_system, apr_uri_t *uri, m
 	//first check the file server was not added in the last few ops...
 	fs = (mfs_file_server *)apr_hash_get(file_system->file_servers, uri->hostinfo,  klen);
 	if(fs == NULL) {
-		fs = apr_palloc(file_system->pool, sizeof(mfs_file_server));
+		fs = apr_pcalloc(file_system->pool, sizeof(mfs_file_server));
+		if((rv = apr_thread_mutex_create(&fs->stats_lock, APR_THREAD_MUTEX_DEFAULT, file_system->pool)) != APR_SUCCESS) {
+			apr_thread_rwlock_unlock(file_system->lock);
+			mfs_log_apr(LOG_CRIT, rv, file_system->pool, "Unable to create file server stats mutex:");
+			return rv;
+		}
 		rv = apr_reslist_create(&fs->connections, 0, 3, 50, apr_time_from_sec(60), mfs_file_server_conn_constructor, mfs_file_server_conn_destructor, fs, file_system->pool);
 		if(rv != APR_SUCCESS) {
 			apr_thread_rwlock_unlock(file_system->lock);
@@ -183,6 +251,84 @@ apr_status_t mfs_file_server_conn_destructor(void *resource, void *params, apr_p
 }
 
 apr_status_t mfs_get_paths(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, char ***paths, int *path_count, apr_pool_t *pool) {
+	bool promote = (file_system->hot_keys == NULL) || mfs_hot_keys_record(file_system->hot_keys, domain, key);
+	return mfs_get_paths_cached(file_system, domain, key, noverify, promote, paths, path_count, pool);
+}
+
+apr_status_t mfs_get_paths_cached(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, bool promote, char ***paths, int *path_count, apr_pool_t *pool) {
+	apr_status_t rv = mfs_get_paths_lookup(file_system, domain, key, noverify, promote, paths, path_count, pool);
+	//the paths are always our own copy so they can be reordered
+	if((rv == APR_SUCCESS) && (file_system->replica_ranking != NULL)) {
+		mfs_rank_paths(file_system, *paths, *path_count, pool);
+	}
+	if((rv == APR_SUCCESS) && (file_system->load_balancer != NULL) && promote) {
+		mfs_balance_paths(file_system, *paths, *path_count, pool);
+	}
+	return rv;
+}
+
+apr_status_t mfs_get_paths_lookup(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, bool promote, char ***paths, int *path_count, apr_pool_t *pool) {
+	mfs_metadata_cache *cache = file_system->metadata_cache;
+	mfs_shm_cache *shm_cache = file_system->shm_cache;
+	bool unavailable;
+	if((apr_hash_count(file_system->bloom_filters) > 0) && mfs_bloom_filter_absent(file_system, domain, key)) {
+		return APR_EBADPATH;
+	}
+	if((cache == NULL) && (shm_cache == NULL)) {
+		return mfs_get_paths_from_tracker(file_system, domain, key, noverify, paths, path_count, &unavailable, pool);
+	}
+	char **cached_paths;
+	int cached_path_count;
+	int state = MFS_CACHE_MISS;
+	if(cache != NULL) {
+		state = mfs_metadata_cache_get_paths(cache, domain, key, &cached_paths, &cached_path_count, pool);
+		if(state == MFS_CACHE_HIT) {
+			*paths = cached_paths;
+			*path_count = cached_path_count;
+			return APR_SUCCESS;
+		} else if(state == MFS_CACHE_NEGATIVE) {
+			return APR_EBADPATH;
+		}
+	}
+	char **s_paths;
+	int pc;
+	//another process on this host may have just looked it up
+	if((shm_cache != NULL) && mfs_shm_cache_get_paths(shm_cache, domain, key, &s_paths, &pc, pool)) {
+		if((cache != NULL) && promote) {
+			mfs_metadata_cache_put_paths(cache, domain, key, s_paths, pc, pool);
+		}
+		*paths = s_paths;
+		*path_count = pc;
+		return APR_SUCCESS;
+	}
+	apr_status_t rv = mfs_get_paths_from_tracker(file_system, domain, key, noverify, &s_paths, &pc, &unavailable, pool);
+	if(rv == APR_SUCCESS) {
+		if((cache != NULL) && promote) {
+			mfs_metadata_cache_put_paths(cache, domain, key, s_paths, pc, pool);
+		}
+		if((shm_cache != NULL) && promote) {
+			mfs_shm_cache_put_paths(shm_cache, domain, key, s_paths, pc, pool);
+		}
+		*paths = s_paths;
+		*path_count = pc;
+	} else if((state == MFS_CACHE_STALE) && unavailable) { //the trackers are down: serve what we had
+		mfs_log_apr(LOG_WARNING, rv, pool, "Serving stale paths for %s.%s because the trackers are unavailable:", domain, key);
+		apr_atomic_inc32(&cache->stale_count);
+		*paths = cached_paths;
+		*path_count = cached_path_count;
+		rv = APR_SUCCESS;
+	} else if(rv == APR_EBADPATH) {
+		if(cache != NULL) {
+			mfs_metadata_cache_remove(cache, MFS_CACHE_PATHS, domain, key, pool);
+		}
+		if(shm_cache != NULL) {
+			mfs_shm_cache_remove(shm_cache, domain, key, pool);
+		}
+	}
+	return rv;
+}
+
+apr_status_t mfs_get_paths_from_tracker(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, char ***paths, int *path_count, bool *unavailable, apr_pool_t *pool) {
 	apr_status_t rv = APR_SUCCESS;
 	bool ok;
 
@@ -194,6 +340,7 @@ apr_status_t mfs_get_paths(mfs_file_system *file_system, const char *domain, con
 	apr_hash_t *result = apr_hash_make(pool);
 
 	rv = mfs_request_do(file_system->trackers, "get_paths", params, &ok, result, pool, file_system->tracker_timeout);
+	*unavailable = (rv != APR_SUCCESS);
 	if(rv == APR_SUCCESS) {
 		if(ok) {
 			char *path_count_str = apr_hash_get(result, "paths", APR_HASH_KEY_STRING);
@@ -261,6 +408,9 @@ apr_status_t mfs_delete(mfs_file_system *file_system, const char *domain, const
 		mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling delete for key %s", apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING), apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), key);
 		rv = APR_EGENERAL;
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_cache_after_delete(file_system, domain, key, pool);
+	}
 	return rv;
 }
 
@@ -292,6 +442,9 @@ apr_status_t mfs_delete_filepath_node(mfs_file_system *file_system, const char *
 		  rv = APR_EGENERAL;
 		}
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_cache_after_delete(file_system, domain, key, pool);
+	}
 	return rv;
 }
 
@@ -319,6 +472,9 @@ apr_status_t mfs_create_directory(mfs_file_system *file_system, const char *doma
 		mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling filepaths_create_node (directory) for key %s", apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING), apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), key );
 		rv = APR_EGENERAL;
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_invalidate_key(file_system, domain, key, pool); //there may be a negative entry from a delete
+	}
 	if(server_id != NULL) {
 		char *s_server_id = apr_hash_get(result, "nid", APR_HASH_KEY_STRING);
 		if(s_server_id != NULL) {
@@ -356,6 +512,9 @@ apr_status_t mfs_create_link(mfs_file_system *file_system, const char *domain, c
 		mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling filepaths_create_node (link) for key %s", apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING), apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), key );
 		rv = APR_EGENERAL;
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_invalidate_key(file_system, domain, key, pool); //there may be a negative entry from a delete
+	}
 	if(server_id != NULL) {
 		char *s_server_id = apr_hash_get(result, "nid", APR_HASH_KEY_STRING);
 		if(s_server_id != NULL) {
@@ -409,6 +568,9 @@ apr_status_t mfs_rename(mfs_file_system *file_system, const char *domain, const
 		mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling rename from key %s to %s", apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING), apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), from_key,to_key );
 		rv = APR_EGENERAL;
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_cache_after_rename(file_system, domain, from_key, to_key, false, pool);
+	}
 	return rv;
 }
 
@@ -436,6 +598,9 @@ apr_status_t mfs_rename_filepath(mfs_file_system *file_system, const char *domai
 		mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling mfs_rename_filepath from key %s to %s", apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING), apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), from_key,to_key );
 		rv = APR_EGENERAL;
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_cache_after_rename(file_system, domain, from_key, to_key, true, pool);
+	}
 	return rv;
 }
 
@@ -464,6 +629,9 @@ apr_status_t mfs_set_mtime(mfs_file_system *file_system, const char *domain, con
 		mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling mfs_set_mtime for key %s", apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING), apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), key );
 		rv = APR_EGENERAL;
 	}
+	if((rv == APR_SUCCESS) && (file_system->metadata_cache != NULL)) {
+		mfs_metadata_cache_remove(file_system->metadata_cache, MFS_CACHE_PATH_INFO, domain, key, pool);
+	}
 	return rv;
 
 }
@@ -574,8 +742,98 @@ apr_status_t mfs_list_directory(mfs_file_system *file_system, const char *domain
 	return rv;
 }
 
+apr_status_t mfs_list_keys(mfs_file_system *file_system, const char *domain, const char *prefix, const char *after, int limit, char ***keys, int *key_count, char **next_after, apr_pool_t *pool) {
+	apr_status_t rv;
+	bool ok;
+	char limit_str[20];
+
+	*key_count = 0;
+	*next_after = NULL;
+	tracker_request_parameters * params = mfs_tracker_init_parameters(pool);
+	mfs_tracker_add_parameter(params, "domain",  domain, pool);
+	if(prefix != NULL) {
+		mfs_tracker_add_parameter(params, "prefix",  prefix, pool);
+	}
+	if(after != NULL) {
+		mfs_tracker_add_parameter(params, "after",  after, pool);
+	}
+	sprintf(limit_str, "%d", limit);
+	mfs_tracker_add_parameter(params, "limit",  limit_str, pool);
+
+	apr_hash_t *result = apr_hash_make(pool);
+
+	rv = mfs_request_do(file_system->trackers, "list_keys", params, &ok, result, pool, file_system->tracker_timeout);
+	if(rv == APR_SUCCESS) {
+		if(ok) {
+			char *key_count_str = apr_hash_get(result, "key_count", APR_HASH_KEY_STRING);
+			if(key_count_str == NULL) {
+				mfs_log(LOG_ERR, "Successful list_keys did not return a key_count");
+				return APR_EGENERAL;
+			}
+			int kc = atoi(key_count_str);
+			if((kc < 0) || (kc > limit)) {
+				mfs_log(LOG_ERR, "Successful list_keys returned invalid key_count (%s)", key_count_str);
+				return APR_EGENERAL;
+			}
+			char **result_keys = apr_palloc(pool, sizeof(char *) * (kc + 1));
+			int pos;
+			char key[100];
+			for(pos = 0; pos < kc; pos++) {
+				sprintf(key, "key_%d", pos + 1);
+				result_keys[pos] = apr_hash_get(result, key, APR_HASH_KEY_STRING);
+				if(result_keys[pos] == NULL) {
+					mfs_log(LOG_ERR, "Successful list_keys did not return key %d", pos + 1);
+					return APR_EGENERAL;
+				}
+			}
+			*keys = result_keys;
+			*key_count = kc;
+			*next_after = apr_hash_get(result, "next_after", APR_HASH_KEY_STRING);
+			if((*next_after == NULL) && (kc > 0)) {
+				*next_after = result_keys[kc - 1];
+			}
+		} else { //an error occured....
+			char *error_code = apr_hash_get(result, MFS_TRACKER_ERROR_CODE, APR_HASH_KEY_STRING);
+			if((error_code != NULL) && (strcmp("none_match", error_code) == 0)) { //no (more) keys
+				return APR_SUCCESS;
+			}
+			mfs_log(LOG_ERR, "Tracker returned error %s (%s) when calling list_keys for domain %s", error_code, apr_hash_get(result, MFS_TRACKER_ERROR_DESC, APR_HASH_KEY_STRING), domain);
+			rv = APR_EGENERAL;
+		}
+	}
+	return rv;
+}
+
 //FilePaths plugin function
 apr_status_t mfs_path_info(mfs_file_system *file_system, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, apr_pool_t *pool) {
+	mfs_metadata_cache *cache = file_system->metadata_cache;
+	bool unavailable;
+	if(cache == NULL) {
+		return mfs_path_info_from_tracker(file_system, domain, path, filepath_entry, &unavailable, pool);
+	}
+	mfs_filepath_entry cached_entry;
+	int state = mfs_metadata_cache_get_path_info(cache, domain, path, &cached_entry, pool);
+	if(state == MFS_CACHE_HIT) {
+		*filepath_entry = cached_entry;
+		return APR_SUCCESS;
+	} else if(state == MFS_CACHE_NEGATIVE) {
+		return APR_EBADPATH;
+	}
+	apr_status_t rv = mfs_path_info_from_tracker(file_system, domain, path, filepath_entry, &unavailable, pool);
+	if(rv == APR_SUCCESS) {
+		mfs_metadata_cache_put_path_info(cache, domain, path, filepath_entry, pool);
+	} else if((state == MFS_CACHE_STALE) && unavailable) { //the trackers are down: serve what we had
+		mfs_log_apr(LOG_WARNING, rv, pool, "Serving stale path info for %s.%s because the trackers are unavailable:", domain, path);
+		apr_atomic_inc32(&cache->stale_count);
+		*filepath_entry = cached_entry;
+		rv = APR_SUCCESS;
+	} else if(rv == APR_EBADPATH) {
+		mfs_metadata_cache_remove(cache, MFS_CACHE_PATH_INFO, domain, path, pool);
+	}
+	return rv;
+}
+
+apr_status_t mfs_path_info_from_tracker(mfs_file_system *file_system, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, bool *unavailable, apr_pool_t *pool) {
 	apr_status_t rv = APR_SUCCESS;
 	bool ok;
 
@@ -587,6 +845,7 @@ apr_status_t mfs_path_info(mfs_file_system *file_system, const char *domain, con
 	apr_hash_t *result = apr_hash_make(pool);
 
 	rv = mfs_request_do(file_system->trackers, "plugin_filepaths_path_info", params, &ok, result, pool, file_system->tracker_timeout);
+	*unavailable = (rv != APR_SUCCESS);
 	if(rv == APR_SUCCESS) {
 		if(ok) {
 			filepath_entry->name = NULL; //we dont set this ATM..
@@ -18,11 +18,14 @@
 #include "mogile_fs.h"
 #include "logger.h"
 #include <apr_strings.h>
+#include <apr_atomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <strings.h>
 #include <curl/curl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 
 
 typedef struct {
@@ -34,8 +37,32 @@ typedef struct {
 	mfs_file_system *file_system;
 	apr_pool_t *pool;
 	char *destination_file_path; //if not NULL, store the file here if above memory threshold
+	char *spill_template; //if not NULL, the apr_file_mktemp template for the file used above the memory threshold (the disk cache)
+	bool spilled; //the file was made from spill_template
+	mfs_fetch_options *options; //if not NULL, response validators are recorded here
+	apr_size_t max_size; //if > 0, the download fails if it is larger than this
+	bool memory_only; //the data is never put in a file
+	CURL *curl; //to read the Content-Length
+	bool direct_allowed; //the result is wanted as bytes: if the size is known it is written straight into one buffer
+	char *direct; //if not NULL, the data so far (current_size bytes) is here and not in the brigade
+	apr_size_t direct_size;
+	mfs_content_entry *direct_content; //direct is the data of this new content cache entry
+	bool direct_fixed; //direct is the caller's buffer: a longer body fails
+	mfs_slab *slab; //with the slab arena, the slab being filled. it is added to the brigade when it is full or the download ends
+	apr_size_t slab_used;
+	bool headers_checked; //the headers are checked when the first block of the body arrives
+	apr_off_t content_length; //from the headers (-1 if there was none)
+	long response_code; //from the headers
 } mfs_write_buffer;
 
+bool mfs_write_buffer_check_headers(mfs_write_buffer *buf);
+void mfs_file_preallocate(apr_file_t *file, apr_off_t length);
+apr_status_t mfs_make_parent_directory(mfs_file_system *file_system, char *path, bool again, apr_pool_t *pool);
+void mfs_write_buffer_direct(mfs_write_buffer *buf);
+void mfs_write_buffer_undirect(mfs_write_buffer *buf);
+bool mfs_write_buffer_slab_append(mfs_write_buffer *buf, const char *data, apr_size_t length);
+void mfs_write_buffer_close_slab(mfs_write_buffer *buf);
+
 
 //cURL does not do 'last successfully transfered' type timeouts... its timed based on total transfer time (even if everything is going ok)... odd
 //this will track the last time a successful transfer occured and timeout if that time is too long ago...
@@ -85,41 +112,69 @@ size_t mfs_buffer_get_write_callback( void *ptr, size_t size, size_t nmemb, void
 	apr_status_t rv;
 	apr_size_t bytes_written;
 	apr_size_t total_size = (size * nmemb);
+	if((buf->max_size > 0) && (total_size + buf->current_size > buf->max_size)) {
+		mfs_log(LOG_ERR, "Download is larger than the %ld bytes requested", (long)buf->max_size);
+		return 0;
+	}
+	if(!buf->headers_checked) {
+		buf->headers_checked = true;
+		if(!mfs_write_buffer_check_headers(buf)) {
+			return 0;
+		}
+	}
+	if(buf->direct_allowed) { //decided on the first block: the headers are in by now
+		buf->direct_allowed = false;
+		mfs_write_buffer_direct(buf);
+	}
+	if(buf->direct != NULL) {
+		if(buf->current_size + total_size <= buf->direct_size) {
+			memcpy(buf->direct + buf->current_size, ptr, total_size);
+			buf->current_size += total_size;
+			return total_size;
+		}
+		if(buf->direct_fixed) {
+			mfs_log(LOG_ERR, "Download is larger than the %ld byte buffer", (long)buf->direct_size);
+			buf->options->buffer_full = true;
+			return 0;
+		}
+		mfs_write_buffer_undirect(buf); //longer than we were told: carry on as if we had not known
+	}
 	if(buf->file != NULL) { //we are using a file to store the data
 		if((rv = apr_file_write_full(buf->file, ptr, total_size, &bytes_written))!= APR_SUCCESS) {
 			mfs_log_apr(LOG_ERR, rv, buf->pool, "Error writing to wbuf->file when streaming download:");
 		}
 		buf->file_size += total_size;
 		buf->current_size += total_size;
-	} else if(total_size + buf->current_size > buf->file_system->max_buffer_size) { //if we get here then file is NULL so this is the first time...
-		if(buf->destination_file_path == NULL) {
+	} else if(!buf->memory_only && (total_size + buf->current_size > buf->file_system->max_buffer_size)) { //if we get here then file is NULL so this is the first time...
+		mfs_write_buffer_close_slab(buf); //what is already in memory must be in the brigade
+		if(buf->spill_template != NULL) {
+			if((rv = apr_file_mktemp(&buf->file, buf->spill_template, APR_CREATE | APR_READ | APR_WRITE | APR_XTHREAD, buf->pool)) != APR_SUCCESS) {
+				mfs_log_apr(LOG_ERR, rv, buf->pool, "Error opening disk cache tmp file when streaming download:");
+				return 0;
+			}
+			buf->spilled = true;
+		} else if(buf->destination_file_path == NULL) {
 			char filename[] = "mogile_fs_XXXXXX";
 			if((rv = apr_file_mktemp(&buf->file, filename, APR_CREATE | APR_READ | APR_WRITE, buf->pool)) != APR_SUCCESS) {
 				mfs_log_apr(LOG_ERR, rv, buf->pool, "Error opening tmp file when streaming download:");
 				return 0;
 			}
 		} else {
-			//we have to create the parent directory....
-			char *last_slash = NULL;
-			int i;
-			for(i = strlen(buf->destination_file_path); ((i > 0) && (last_slash == NULL)); i--) {
-				if(buf->destination_file_path[i] == '/') {
-				    last_slash = buf->destination_file_path + i;
-				    last_slash[0] = '\0';
-				}
-			}
-			//we now have the parent directory...
-			if((rv = apr_dir_make_recursive(buf->destination_file_path, 0x0777, buf->pool)) != APR_SUCCESS) {
-				mfs_log_apr(LOG_ERR, rv, NULL, "Unable to create tmp file parent directory %s:",buf->destination_file_path);
-			}
-			//still try even if above fails..... it may not be fatal....
-			last_slash[0] = '/';
+			//we have to create the parent directory.... still try even if it fails..... it may not be fatal....
+			mfs_make_parent_directory(buf->file_system, buf->destination_file_path, false, buf->pool);
 			//create the file....
-			if((rv = apr_file_open(&buf->file, buf->destination_file_path, APR_READ | APR_WRITE | APR_CREATE | APR_XTHREAD , 0x777, buf->pool)) != APR_SUCCESS) {
+			rv = apr_file_open(&buf->file, buf->destination_file_path, APR_READ | APR_WRITE | APR_CREATE | APR_XTHREAD , 0x777, buf->pool);
+			if(APR_STATUS_IS_ENOENT(rv) && (mfs_make_parent_directory(buf->file_system, buf->destination_file_path, true, buf->pool) == APR_SUCCESS)) {
+				//the directory was removed since we made it
+				rv = apr_file_open(&buf->file, buf->destination_file_path, APR_READ | APR_WRITE | APR_CREATE | APR_XTHREAD , 0x777, buf->pool);
+			}
+			if(rv != APR_SUCCESS) {
 				mfs_log_apr(LOG_ERR, rv, buf->pool, "Error opening tmp file %s when streaming download:", buf->destination_file_path);
 				return 0;
 			}
 		}
+		//the file will hold the whole body (dont_want_brigade) or the rest of it
+		mfs_file_preallocate(buf->file, buf->dont_want_brigade ? buf->content_length : buf->content_length - (apr_off_t)buf->current_size);
 		//do we put the existing data into the file first?
 		if(buf->dont_want_brigade) { //yes, otherwise the start of the file would only be in the brigade...
 			apr_bucket *b;
@@ -146,6 +201,12 @@ size_t mfs_buffer_get_write_callback( void *ptr, size_t size, size_t nmemb, void
 		}
 		buf->file_size += total_size;
 		buf->current_size += total_size;
+	} else if(buf->file_system->slab_arena != NULL) { //we are still in memory... fill the slabs
+		if(!mfs_write_buffer_slab_append(buf, ptr, total_size)) {
+			return 0;
+		}
+		bytes_written = total_size;
+		buf->current_size += total_size;
 	} else { //we are still in memory... add a memory bucket to the brigade...
 		apr_bucket *b = apr_bucket_pool_create (apr_pmemdup(buf->pool, ptr, total_size), total_size, buf->pool, buf->brigade->bucket_alloc);
 		APR_BUCKET_INSERT_AFTER(APR_BRIGADE_LAST(buf->brigade), b); //append the new bucket....
@@ -155,6 +216,225 @@ size_t mfs_buffer_get_write_callback( void *ptr, size_t size, size_t nmemb, void
 	return bytes_written; //if this does not == (size*nmemb) then something when wrong and cURL will abort the download...
 }
 
+//read the Content-Length when the body starts. false if it is not the length the caller requires: there is no point downloading it
+bool mfs_write_buffer_check_headers(mfs_write_buffer *buf) {
+	mfs_fetch_options *options = buf->options;
+	curl_off_t content_length = -1; //-1 if the server did not send one
+	long code = 0;
+	curl_easy_getinfo(buf->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+	curl_easy_getinfo(buf->curl, CURLINFO_RESPONSE_CODE, &code);
+	buf->content_length = (content_length >= 0) ? (apr_off_t)content_length : -1;
+	buf->response_code = code;
+	if((options != NULL) && options->check_length && (code == 200) && (buf->content_length >= 0) && (buf->content_length != options->required_length)) {
+		mfs_log(LOG_ERR, "Content-Length (%" APR_OFF_T_FMT ") does not match the required length (%" APR_OFF_T_FMT ")", buf->content_length, options->required_length);
+		options->length_mismatch = true;
+		return false;
+	}
+	if(buf->file != NULL) { //the caller's file
+		mfs_file_preallocate(buf->file, buf->content_length);
+	}
+	return true;
+}
+
+//reserve length bytes on disk from the current position so a large download is not written one extent at a time.
+//the size of the file is not changed so a failed download is not padded with zeros. only linux has fallocate: elsewhere this does nothing
+void mfs_file_preallocate(apr_file_t *file, apr_off_t length) {
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+	apr_os_file_t fd;
+	apr_off_t offset = 0;
+	if((length <= 0) || (apr_file_seek(file, APR_CUR, &offset) != APR_SUCCESS) || (apr_os_file_get(&fd, file) != APR_SUCCESS)) {
+		return;
+	}
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) != 0) { //not every file system can
+		mfs_log(LOG_DEBUG, "Unable to preallocate %" APR_OFF_T_FMT " bytes for download: %s", length, strerror(errno));
+	}
+#endif
+}
+
+//make the directory path is in unless it has been made before (again forgets that it was). path is changed while this runs.
+//the made directories pool is shared by every thread so it is only used with the lock held
+apr_status_t mfs_make_parent_directory(mfs_file_system *file_system, char *path, bool again, apr_pool_t *pool) {
+	apr_status_t rv;
+	char *last_slash = strrchr(path, '/');
+	if((last_slash == NULL) || (last_slash == path)) {
+		return APR_SUCCESS; //the current or root directory
+	}
+	apr_size_t length = last_slash - path;
+	if((rv = apr_thread_mutex_lock(file_system->made_directories_lock)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock made directories mutex:");
+		return rv;
+	}
+	bool made = (apr_hash_get(file_system->made_directories, path, length) != NULL);
+	if(made && again) {
+		apr_hash_set(file_system->made_directories, path, length, NULL);
+	}
+	apr_thread_mutex_unlock(file_system->made_directories_lock);
+	if(made && !again) {
+		return APR_SUCCESS;
+	}
+	last_slash[0] = '\0';
+	rv = apr_dir_make_recursive(path, 0x0777, pool);
+	last_slash[0] = '/';
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, NULL, "Unable to create tmp file parent directory %.*s:", (int)length, path);
+		return rv;
+	}
+	if(apr_thread_mutex_lock(file_system->made_directories_lock) == APR_SUCCESS) {
+		if(apr_hash_count(file_system->made_directories) >= MFS_MADE_DIRECTORIES_MAX) { //start again rather than grow forever
+			apr_pool_clear(file_system->made_directories_pool);
+			file_system->made_directories = apr_hash_make(file_system->made_directories_pool);
+		}
+		apr_hash_set(file_system->made_directories, apr_pstrndup(file_system->made_directories_pool, path, length), length, (void*)1);
+		apr_thread_mutex_unlock(file_system->made_directories_lock);
+	}
+	return APR_SUCCESS;
+}
+
+//pick the one buffer the body goes in: the caller's, a content cache entry or the pool. nothing is done if the size is not known
+void mfs_write_buffer_direct(mfs_write_buffer *buf) {
+	mfs_fetch_options *options = buf->options;
+	mfs_content_cache *content_cache = buf->file_system->content_cache;
+	//an error page is not the caller's data: it goes to the pool like any other body
+	if((options != NULL) && (options->buffer != NULL) && (buf->response_code >= 200) && (buf->response_code < 300)) {
+		buf->direct = options->buffer;
+		buf->direct_size = options->buffer_size;
+		buf->direct_fixed = true;
+		return;
+	}
+	apr_size_t size;
+	if(buf->content_length >= 0) {
+		size = (apr_size_t)buf->content_length;
+	} else if((options != NULL) && (options->expected_length > 0)) {
+		size = options->expected_length;
+	} else {
+		return;
+	}
+	if(((size > buf->file_system->max_buffer_size) && !buf->memory_only) || ((buf->max_size > 0) && (size > buf->max_size))) {
+		return; //it will go to a file (or fail)
+	}
+	if((options != NULL) && options->want_content && (content_cache != NULL) && (size <= content_cache->max_object_size)
+			&& ((buf->direct_content = mfs_content_entry_create(options->domain, options->key, size)) != NULL)) {
+		buf->direct = buf->direct_content->data;
+	} else {
+		buf->direct = apr_palloc(buf->pool, size + 1); //room to terminate it
+	}
+	buf->direct_size = size;
+}
+
+//move what is in the direct buffer to the brigade
+void mfs_write_buffer_undirect(mfs_write_buffer *buf) {
+	if(buf->current_size > 0) {
+		char *data = (buf->direct_content != NULL) ? apr_pmemdup(buf->pool, buf->direct, buf->current_size) : buf->direct;
+		APR_BRIGADE_INSERT_TAIL(buf->brigade, apr_bucket_pool_create(data, buf->current_size, buf->pool, buf->brigade->bucket_alloc));
+	}
+	if(buf->direct_content != NULL) {
+		mfs_content_entry_release(buf->direct_content);
+		buf->direct_content = NULL;
+	}
+	buf->direct = NULL;
+}
+
+//copy into the current slab, starting new ones as they fill
+bool mfs_write_buffer_slab_append(mfs_write_buffer *buf, const char *data, apr_size_t length) {
+	mfs_slab_arena *arena = buf->file_system->slab_arena;
+	while(length > 0) {
+		if(buf->slab == NULL) {
+			if((buf->slab = mfs_slab_get(arena)) == NULL) {
+				return false;
+			}
+			buf->slab_used = 0;
+		}
+		apr_size_t n = arena->slab_size - buf->slab_used;
+		if(n > length) {
+			n = length;
+		}
+		memcpy(buf->slab->data + buf->slab_used, data, n);
+		buf->slab_used += n;
+		data += n;
+		length -= n;
+		if(buf->slab_used == arena->slab_size) {
+			mfs_write_buffer_close_slab(buf);
+		}
+	}
+	return true;
+}
+
+//put the slab being filled at the end of the brigade
+void mfs_write_buffer_close_slab(mfs_write_buffer *buf) {
+	if(buf->slab == NULL) {
+		return;
+	}
+	if(buf->slab_used > 0) {
+		APR_BRIGADE_INSERT_TAIL(buf->brigade, mfs_slab_bucket_create(buf->slab, buf->slab_used, buf->brigade->bucket_alloc));
+	} else {
+		mfs_slab_put(buf->slab);
+	}
+	buf->slab = NULL;
+}
+
+//copy the value of header into value if line is that header
+void mfs_copy_header_value(const char *line, apr_size_t length, const char *header, char *value) {
+	apr_size_t header_length = strlen(header);
+	if((length <= header_length) || (strncasecmp(line, header, header_length) != 0) || (line[header_length] != ':')) {
+		return;
+	}
+	const char *start = line + header_length + 1;
+	const char *end = line + length;
+	while((start < end) && ((*start == ' ') || (*start == '\t'))) {
+		start++;
+	}
+	while((end > start) && ((end[-1] == '\r') || (end[-1] == '\n') || (end[-1] == ' '))) {
+		end--;
+	}
+	if(end - start < MFS_VALIDATOR_SIZE) {
+		memcpy(value, start, end - start);
+		value[end - start] = '\0';
+	}
+}
+
+//"bytes first-last/total" ("bytes */total" on a 416)
+void mfs_parse_content_range(const char *value, mfs_fetch_options *options) {
+	char *end;
+	if(strncasecmp(value, "bytes ", 6) != 0) {
+		return;
+	}
+	value += 6;
+	if(*value == '*') {
+		value++;
+	} else {
+		apr_off_t start = apr_strtoi64(value, &end, 10);
+		if(*end != '-') {
+			return;
+		}
+		apr_off_t last = apr_strtoi64(end + 1, &end, 10);
+		if(*end != '/') {
+			return;
+		}
+		options->range_start = start;
+		options->range_end = last;
+		value = end;
+	}
+	if((value[0] == '/') && (value[1] != '*')) {
+		options->range_total = apr_strtoi64(value + 1, NULL, 10);
+	}
+}
+
+//called by cURL for each response header line
+size_t mfs_buffer_get_header_callback(char *ptr, size_t size, size_t nmemb, void *stream) {
+	mfs_write_buffer *buf = (mfs_write_buffer*)stream;
+	apr_size_t length = size * nmemb;
+	mfs_copy_header_value(ptr, length, "ETag", buf->options->etag);
+	mfs_copy_header_value(ptr, length, "Last-Modified", buf->options->last_modified);
+	if((buf->options->range_length > 0) || (buf->options->range_offset > 0)) {
+		char content_range[MFS_VALIDATOR_SIZE] = "";
+		mfs_copy_header_value(ptr, length, "Content-Range", content_range);
+		if(content_range[0] != '\0') {
+			mfs_parse_content_range(content_range, buf->options);
+		}
+	}
+	return length;
+}
+
 int mfs_buffer_get_write_seek(void *instream, curl_off_t offset, int origin) {
 	mfs_log(LOG_ERR, "Seek called on curl callback (download)");
 	return CURL_SEEKFUNC_CANTSEEK;
@@ -163,6 +443,13 @@ int mfs_buffer_get_write_seek(void *instream, curl_off_t offset, int origin) {
 //if the *file pointer is not NULL, it is assumed we want to store the data in the passed in file
 //if the brigade is not NULL, it is assumed that is how the data will be returned
 apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, char *original_uri, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool, char *destination_file_path) {
+	return mfs_file_server_fetch(file_system, uri, original_uri, bytes, total_bytes, file, brigade, pool, destination_file_path, NULL);
+}
+
+//as mfs_file_server_get. if options->want_content and the result is returned as bytes that are small enough for the content cache,
+//the bytes are put in a new (unlinked) content entry for domain/key instead of the pool.
+//if options->spill_to_disk_cache and the result is returned as a file, the file is a disk cache temp file (options->spill_file)
+apr_status_t mfs_file_server_fetch(mfs_file_system *file_system, apr_uri_t *uri, char *original_uri, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool, char *destination_file_path, mfs_fetch_options *options) {
 	apr_status_t rv;
 	mfs_file_server *file_server;
 	if((rv = mfs_get_file_server(file_system, uri, &file_server) != APR_SUCCESS)) {
@@ -174,11 +461,15 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get file server connection for %s:", uri->hostinfo);
 		return rv;
 	}
+	apr_atomic_inc32(&file_server->downloads);
 
 	mfs_write_buffer *wbuf = apr_pcalloc(pool, sizeof(mfs_write_buffer));
 	wbuf->file_system = file_system;
 	wbuf->pool = pool;
 	wbuf->destination_file_path = destination_file_path;
+	wbuf->options = options;
+	wbuf->curl = conn->curl;
+	wbuf->content_length = -1;
 	apr_bucket *start_bucket; //used for cleanup of passed in brigade
 	if(*file != NULL) { //caller wants the result in the file
 		wbuf->brigade = NULL;
@@ -192,6 +483,10 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 		//we will use a temp brigade...
 		wbuf->dont_want_brigade = true;
 		wbuf->brigade = apr_brigade_create(pool, apr_bucket_alloc_create(pool));
+		wbuf->direct_allowed = true;
+		if((options != NULL) && options->spill_to_disk_cache && (destination_file_path == NULL) && (file_system->disk_cache != NULL)) {
+			wbuf->spill_template = mfs_disk_cache_temp_template(file_system->disk_cache, pool);
+		}
 	}
 	
 	
@@ -203,6 +498,32 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 
 	curl_easy_setopt(conn->curl, CURLOPT_SEEKFUNCTION, mfs_buffer_get_write_seek);
 	curl_easy_setopt(conn->curl, CURLOPT_SEEKDATA, wbuf);
+
+	struct curl_slist *headerlist = NULL;
+	if(options != NULL) {
+		options->response_code = 0;
+		options->etag[0] = '\0';
+		options->last_modified[0] = '\0';
+		options->range_start = -1;
+		options->range_end = -1;
+		options->range_total = -1;
+		curl_easy_setopt(conn->curl, CURLOPT_HEADERFUNCTION, mfs_buffer_get_header_callback);
+		curl_easy_setopt(conn->curl, CURLOPT_HEADERDATA, wbuf);
+		if(options->if_none_match != NULL) {
+			headerlist = curl_slist_append(headerlist, apr_pstrcat(pool, "If-None-Match: ", options->if_none_match, NULL));
+		}
+		if(options->if_modified_since != NULL) {
+			headerlist = curl_slist_append(headerlist, apr_pstrcat(pool, "If-Modified-Since: ", options->if_modified_since, NULL));
+		}
+		curl_easy_setopt(conn->curl, CURLOPT_HTTPHEADER, headerlist);
+		if(options->range_length > 0) {
+			curl_easy_setopt(conn->curl, CURLOPT_RANGE, apr_psprintf(pool, "%" APR_OFF_T_FMT "-%" APR_OFF_T_FMT, options->range_offset, options->range_offset + (apr_off_t)options->range_length - 1));
+			wbuf->max_size = options->range_length;
+			wbuf->memory_only = !options->range_spill;
+		} else if(options->range_offset > 0) { //the rest of the file
+			curl_easy_setopt(conn->curl, CURLOPT_RANGE, apr_psprintf(pool, "%" APR_OFF_T_FMT "-", options->range_offset));
+		}
+	}
 	
 	curl_easy_setopt(conn->curl, CURLOPT_CONNECTTIMEOUT_MS, apr_time_as_msec(file_system->file_server_timeout));
 	curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1L);
@@ -232,6 +553,30 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 #endif
 	
 	CURLcode res = curl_easy_perform(conn->curl);
+	apr_atomic_dec32(&file_server->downloads);
+	mfs_write_buffer_close_slab(wbuf);
+	//a write error is our own doing (too large, disk full) so it says nothing about the host
+	if((file_system->replica_ranking != NULL) && (res != CURLE_WRITE_ERROR)) {
+		long code = 0;
+		double ttfb = 0, elapsed = 0;
+		curl_off_t downloaded = 0;
+		curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &code);
+		curl_easy_getinfo(conn->curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+		curl_easy_getinfo(conn->curl, CURLINFO_TOTAL_TIME, &elapsed);
+		curl_easy_getinfo(conn->curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+		mfs_host_stats_record(file_system, file_server, (res == CURLE_OK) && (code > 0) && (code < 500), ttfb, (double)downloaded, elapsed);
+	}
+	bool not_modified = false;
+	if(options != NULL) {
+		curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &options->response_code);
+		not_modified = (options->response_code == 304);
+		//we reuse connections... clean this up!
+		curl_slist_free_all(headerlist);
+		curl_easy_setopt(conn->curl, CURLOPT_HTTPHEADER, NULL);
+		curl_easy_setopt(conn->curl, CURLOPT_HEADERFUNCTION, NULL);
+		curl_easy_setopt(conn->curl, CURLOPT_HEADERDATA, NULL);
+		curl_easy_setopt(conn->curl, CURLOPT_RANGE, NULL);
+	}
 	if(res != CURLE_OK) {
 		mfs_log(LOG_ERR, "Error downloading from %s:%s (%d)", original_uri, curl_easy_strerror(res), res);
 		if((rv = apr_reslist_invalidate(file_server->connections, conn)) != APR_SUCCESS) {
@@ -279,9 +624,26 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 			}
 		}
 	} else { //we will use a temp brigade... 
-		if(rv == APR_SUCCESS) {
+		if((rv == APR_SUCCESS) && not_modified) {
+			//no body: the caller already has the content
+		} else if(rv == APR_SUCCESS) {
 			//did the response fit in memory?
-			if(wbuf->file != NULL) { //a file was used to buffer data... 
+			if(wbuf->direct != NULL) { //already in one buffer
+				if(wbuf->direct_content == NULL) {
+					if(!wbuf->direct_fixed) {
+						wbuf->direct[wbuf->current_size] = '\0';
+					}
+					*bytes = wbuf->direct;
+				} else if(wbuf->current_size == wbuf->direct_content->size) {
+					options->content = wbuf->direct_content;
+					*bytes = options->content->data;
+					strcpy(options->content->etag, options->etag);
+					strcpy(options->content->last_modified, options->last_modified);
+				} else { //shorter than expected_length: not worth a new entry
+					*bytes = apr_pmemdup(pool, wbuf->direct, wbuf->current_size);
+					mfs_content_entry_release(wbuf->direct_content);
+				}
+			} else if(wbuf->file != NULL) { //a file was used to buffer data... 
 				if(wbuf->current_size > 0) { //we wrote to the file... lets rewind it to be nice
 					apr_off_t start_pos = 0;
 					apr_status_t rv2 = apr_file_seek(wbuf->file,APR_SET, &start_pos);
@@ -290,6 +652,24 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 					}
 				}
 				*file = wbuf->file; //return the file pointer...
+				if(wbuf->spilled) {
+					options->spill_file = wbuf->file;
+				}
+			} else if((options != NULL) && options->want_content && (file_system->content_cache != NULL) && (wbuf->current_size <= file_system->content_cache->max_object_size)
+					&& ((options->content = mfs_content_entry_create(options->domain, options->key, wbuf->current_size)) != NULL)) {
+				//flatten straight into the cache entry so caching costs no extra copy
+				apr_size_t len = wbuf->current_size;
+				rv = apr_brigade_flatten(wbuf->brigade, options->content->data, &len);
+				if(rv != APR_SUCCESS) {
+					mfs_log_apr(LOG_ERR, rv, pool, "Unable to get response from bucket brigade for get %s:", original_uri);
+					mfs_content_entry_release(options->content);
+					options->content = NULL;
+				} else {
+					*bytes = options->content->data;
+					*total_bytes = len;
+					strcpy(options->content->etag, options->etag);
+					strcpy(options->content->last_modified, options->last_modified);
+				}
 			} else {
 				//we need to get the data out of the bucket brigade...
 				rv = apr_brigade_pflatten(wbuf->brigade, (char**)bytes, total_bytes, pool);
@@ -297,6 +677,11 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 					mfs_log_apr(LOG_ERR, rv, pool, "Unable to get response from bucket brigade for get %s:", original_uri);
 				}
 			}
+		} else if(wbuf->spilled) { //dont leave a partial download in the disk cache
+			mfs_disk_cache_discard(file_system->disk_cache, wbuf->file, pool);
+		}
+		if((rv != APR_SUCCESS) && (wbuf->direct_content != NULL)) {
+			mfs_content_entry_release(wbuf->direct_content);
 		}
 		apr_status_t rv2 = apr_brigade_destroy(wbuf->brigade);
 		if(rv2 != APR_SUCCESS) {
@@ -306,50 +691,355 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 	return rv;
 }
 
+//hand a content cache entry to the caller in the form they asked for. takes the caller's reference to entry
+apr_status_t mfs_content_entry_serve(mfs_content_entry *entry, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool) {
+	apr_status_t rv = APR_SUCCESS;
+	*total_bytes = entry->size;
+	if((file != NULL) && (*file != NULL)) { //caller wants the result in the file
+		if((rv = apr_file_write_full(*file, entry->data, entry->size, NULL)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Error writing cached content to file:");
+		} else {
+			apr_off_t start_pos = 0;
+			apr_file_seek(*file, APR_SET, &start_pos);
+		}
+		mfs_content_entry_release(entry);
+	} else if(brigade != NULL) {
+		apr_bucket *b = mfs_content_entry_bucket_create(entry, brigade->bucket_alloc);
+		APR_BRIGADE_INSERT_TAIL(brigade, b);
+		mfs_content_entry_release(entry);
+	} else {
+		*bytes = entry->data; //shared with the cache: valid until pool goes
+		mfs_content_entry_release_with_pool(entry, pool);
+	}
+	return rv;
+}
+
+//hand an open local file to the caller in the form they asked for
+apr_status_t mfs_local_file_serve(apr_file_t *local_file, apr_off_t size, mfs_file_system *file_system, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool) {
+	apr_status_t rv = APR_SUCCESS;
+	*total_bytes = (apr_size_t)size;
+	if((file != NULL) && (*file != NULL)) { //caller wants the result in the file
+		char buffer[32768];
+		apr_size_t len;
+		while(rv == APR_SUCCESS) {
+			len = sizeof(buffer);
+			if((rv = apr_file_read(local_file, buffer, &len)) == APR_SUCCESS) {
+				rv = apr_file_write_full(*file, buffer, len, NULL);
+			}
+		}
+		if(APR_STATUS_IS_EOF(rv)) {
+			apr_off_t start_pos = 0;
+			rv = apr_file_seek(*file, APR_SET, &start_pos);
+		} else {
+			mfs_log_apr(LOG_ERR, rv, pool, "Error copying local file:");
+		}
+		apr_file_close(local_file);
+	} else if(brigade != NULL) {
+		apr_bucket *b = apr_bucket_file_create(local_file, 0, (apr_size_t)size, pool, brigade->bucket_alloc);
+		APR_BRIGADE_INSERT_TAIL(brigade, b);
+	} else if((bytes != NULL) && ((size <= file_system->max_buffer_size) || (file == NULL))) {
+		*bytes = apr_palloc(pool, (apr_size_t)size + 1);
+		if((rv = apr_file_read_full(local_file, *bytes, (apr_size_t)size, NULL)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Error reading local file:");
+		}
+		apr_file_close(local_file);
+	} else {
+		*file = local_file;
+	}
+	return rv;
+}
+
+//hand the length bytes at offset of an open local file to the caller in the form they asked for
+apr_status_t mfs_local_range_serve(apr_file_t *local_file, apr_off_t size, apr_off_t offset, apr_size_t length, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool) {
+	apr_status_t rv = APR_SUCCESS;
+	apr_size_t count = 0;
+	if(offset < size) {
+		count = ((apr_off_t)length < size - offset) ? length : (apr_size_t)(size - offset);
+	}
+	*total_bytes = count;
+	if(brigade != NULL) {
+		if(count > 0) {
+			apr_bucket *b = apr_bucket_file_create(local_file, offset, count, pool, brigade->bucket_alloc);
+			APR_BRIGADE_INSERT_TAIL(brigade, b);
+		} else {
+			apr_file_close(local_file);
+		}
+		return APR_SUCCESS;
+	}
+	apr_off_t position = offset;
+	if((count > 0) && ((rv = apr_file_seek(local_file, APR_SET, &position)) != APR_SUCCESS)) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Error seeking in local file:");
+	} else if(bytes != NULL) {
+		*bytes = apr_palloc(pool, count + 1);
+		if((count > 0) && ((rv = apr_file_read_full(local_file, *bytes, count, NULL)) != APR_SUCCESS)) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Error reading local file:");
+		}
+	} else { //caller wants the result in the file
+		char buffer[32768];
+		apr_size_t remaining = count;
+		while((rv == APR_SUCCESS) && (remaining > 0)) {
+			apr_size_t len = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+			if((rv = apr_file_read_full(local_file, buffer, len, NULL)) == APR_SUCCESS) {
+				rv = apr_file_write_full(*file, buffer, len, NULL);
+				remaining -= len;
+			}
+		}
+		if(rv != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Error copying local file:");
+		}
+	}
+	apr_file_close(local_file);
+	return rv;
+}
+
 //internal method.. that the api calls that looks after tracker calling...
 apr_status_t mfs_file_system_get(mfs_file_system *file_system, char *domain, char *key, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool, char *destination_file_path, long requiredLength) {
 
 	char **paths;
 	int path_count;
 	apr_status_t rv;
-	if((rv = mfs_get_paths(file_system, domain, key, true, &paths, &path_count, pool)) != APR_SUCCESS) {
+	mfs_content_cache *content_cache = file_system->content_cache;
+	mfs_disk_cache *disk_cache = file_system->disk_cache;
+	mfs_fetch_options options;
+	bool caller_file = (file != NULL) && (*file != NULL);
+	//hits can be written to a file the caller supplied but only downloads to memory (or a brigade) fill the caches
+	bool use_content_cache = (content_cache != NULL) && ((brigade != NULL) || ((bytes != NULL) && !caller_file));
+	bool use_disk_cache = (disk_cache != NULL) && (destination_file_path == NULL) && ((brigade != NULL) || ((bytes != NULL) && !caller_file));
+	mfs_content_entry *stale_content = NULL; //expired but it can be revalidated with a conditional get
+	mfs_hot_keys *hot_keys = file_system->hot_keys;
+	//with hot key detection only hot keys are added to the caches
+	bool promote = (hot_keys == NULL) || mfs_hot_keys_record(hot_keys, domain, key);
+	//a mirror is kept current by the watch so its copy is read without asking the tracker
+	if((file_system->mirrors != NULL) && (destination_file_path == NULL)) {
+		apr_file_t *mirror_file;
+		apr_off_t mirror_size;
+		if(mfs_mirror_open(file_system, domain, key, &mirror_file, &mirror_size, pool) == APR_SUCCESS) {
+			if((requiredLength < 0) || (mirror_size == requiredLength)) {
+				return mfs_local_file_serve(mirror_file, mirror_size, file_system, bytes, total_bytes, file, brigade, pool);
+			}
+			apr_file_close(mirror_file);
+		}
+	}
+	if((content_cache != NULL) && (use_content_cache || caller_file)) {
+		bool stale = false;
+		mfs_content_entry *content = mfs_content_cache_get_stale(content_cache, domain, key, pool, use_content_cache ? &stale : NULL);
+		if(content != NULL) {
+			if((requiredLength >= 0) && (content->size != requiredLength)) {
+				//it has changed since we cached it
+				mfs_content_entry_release(content);
+				mfs_content_cache_remove(content_cache, domain, key, pool);
+			} else if(stale) {
+				stale_content = content;
+			} else {
+				return mfs_content_entry_serve(content, bytes, total_bytes, file, brigade, pool);
+			}
+		}
+	}
+	if((rv = mfs_get_paths_cached(file_system, domain, key, true, promote, &paths, &path_count, pool)) != APR_SUCCESS) {
 		mfs_log_apr(LOG_DEBUG, rv, pool, "Unable to get paths for %s.%s:", domain, key);
+		if(stale_content != NULL) {
+			mfs_content_entry_release(stale_content);
+		}
 		return rv;
 	}
+	//replicas on this machine are read without http
+	if((destination_file_path == NULL) && (apr_hash_count(file_system->local_docroots) > 0)) {
+		int l;
+		for(l = 0; l < path_count; l++) {
+			char *local_path = mfs_local_path(file_system, paths[l], pool);
+			apr_file_t *local_file;
+			apr_off_t local_size;
+			if((local_path != NULL) && (mfs_local_file_open(local_path, &local_file, &local_size, pool) == APR_SUCCESS)) {
+				if((requiredLength < 0) || (local_size == requiredLength)) {
+					if(stale_content != NULL) {
+						mfs_content_entry_release(stale_content);
+					}
+					return mfs_local_file_serve(local_file, local_size, file_system, bytes, total_bytes, file, brigade, pool);
+				}
+				apr_file_close(local_file);
+			}
+		}
+	}
+	//fids are never reused so a disk cache hit is never stale
+	apr_int64_t fid = -1;
+	if((disk_cache != NULL) && (destination_file_path == NULL) && (path_count > 0) && ((fid = mfs_fid_from_path(paths[0])) >= 0)) {
+		apr_file_t *cache_file;
+		apr_off_t cache_size;
+		if(mfs_disk_cache_open(disk_cache, fid, &cache_file, &cache_size, pool) == APR_SUCCESS) {
+			if((requiredLength < 0) || (cache_size == requiredLength)) {
+				return mfs_local_file_serve(cache_file, cache_size, file_system, bytes, total_bytes, file, brigade, pool);
+			}
+			apr_file_close(cache_file);
+		}
+	}
+	//large downloads to a file are fetched as concurrent ranges. if that fails the file is cut back and downloaded the usual way
+	if((file_system->parallel_download != NULL) && (file != NULL) && (bytes == NULL) && (brigade == NULL) && (destination_file_path == NULL) && (path_count > 0)) {
+		apr_off_t file_start = 0;
+		if(*file == NULL) {
+			char filename[] = "mogile_fs_XXXXXX";
+			rv = apr_file_mktemp(file, filename, APR_CREATE | APR_READ | APR_WRITE, pool);
+		} else {
+			rv = apr_file_seek(*file, APR_CUR, &file_start);
+		}
+		if(rv != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to prepare file for parallel download:", key);
+		} else if((rv = mfs_parallel_download_file(file_system, key, paths, path_count, *file, total_bytes, pool)) == APR_SUCCESS) {
+			if((requiredLength < 0) || (*total_bytes == requiredLength)) {
+				apr_off_t start_pos = 0;
+				apr_file_seek(*file, APR_SET, &start_pos); //rewind like a single download
+				return APR_SUCCESS;
+			}
+			mfs_log(LOG_ERR, "Failed to get file %s because returned length (%d) does not match the required length (%d)", key, (*total_bytes), requiredLength);
+		}
+		if(*file != NULL) {
+			apr_off_t position = file_start;
+			apr_file_trunc(*file, file_start);
+			apr_file_seek(*file, APR_SET, &position);
+		}
+	}
+	//small downloads to memory race a second replica if the first is slow. files too large to hold in memory go the usual way
+	if((file_system->hedge != NULL) && (path_count > 1) && ((bytes != NULL) || (brigade != NULL)) && !caller_file && (destination_file_path == NULL) && (stale_content == NULL)) {
+		void *h_bytes;
+		if((rv = mfs_hedged_get(file_system, key, paths, path_count, &h_bytes, total_bytes, pool)) == APR_SUCCESS) {
+			if((requiredLength < 0) || (*total_bytes == requiredLength)) {
+				mfs_content_entry *content;
+				if(use_content_cache && promote && (*total_bytes <= content_cache->max_object_size)
+						&& ((content = mfs_content_entry_create(domain, key, *total_bytes)) != NULL)) {
+					memcpy(content->data, h_bytes, *total_bytes);
+					mfs_content_entry_acquire(content); //the cache takes one reference, the caller gets the other
+					if(hot_keys != NULL) {
+						mfs_content_cache_promote(content_cache, content);
+					} else {
+						mfs_content_cache_put(content_cache, content);
+					}
+					return mfs_content_entry_serve(content, bytes, total_bytes, file, brigade, pool);
+				}
+				if(brigade != NULL) {
+					APR_BRIGADE_INSERT_TAIL(brigade, apr_bucket_pool_create(h_bytes, *total_bytes, pool, brigade->bucket_alloc));
+				} else {
+					*bytes = h_bytes;
+					if(file != NULL) {
+						*file = NULL;
+					}
+				}
+				return APR_SUCCESS;
+			}
+			mfs_log(LOG_ERR, "Failed to get file %s because returned length (%d) does not match the required length (%d)", key, (*total_bytes), requiredLength);
+			return APR_EGENERAL;
+		}
+		if(rv != APR_ENOSPC) { //every replica has already been tried
+			return rv;
+		}
+	}
+	//with the caches a brigade is filled after the download so the result can be cached first
+	void *c_bytes = NULL;
+	apr_file_t *c_file = NULL;
 	int i=0;
 	for(i = 0; i < path_count; i++) {
 		char *path = paths[i];
 		apr_uri_t uri;
-		*bytes = NULL; //make sure its NULL in case this time we allocated memory, but next time it uses a file
+		if(bytes != NULL) {
+			*bytes = NULL; //make sure its NULL in case this time we allocated memory, but next time it uses a file
+		}
 		if((rv = apr_uri_parse(pool, path, &uri)) != APR_SUCCESS) {
 			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to parse get_url %s:", key, path);
 		} else if((uri.hostinfo == NULL)||(uri.scheme == NULL)||(uri.path==NULL)) {
 			mfs_log(LOG_ERR, "%s: Unable to parse get_url %s:", key, path);
 			rv = APR_EGENERAL;
 		} else {
-			if((rv = mfs_file_server_get(file_system, &uri, path, bytes, total_bytes, file, brigade, pool, destination_file_path)) != APR_SUCCESS) {
+			memset(&options, 0, sizeof(options));
+			if(use_content_cache || use_disk_cache) {
+				c_bytes = NULL;
+				c_file = NULL;
+				options.domain = domain;
+				options.key = key;
+				options.want_content = use_content_cache && promote;
+				options.spill_to_disk_cache = use_disk_cache && (fid >= 0);
+				if(stale_content != NULL) {
+					options.if_none_match = (stale_content->etag[0] != '\0') ? stale_content->etag : NULL;
+					options.if_modified_since = (stale_content->last_modified[0] != '\0') ? stale_content->last_modified : NULL;
+				}
+				options.expected_length = (requiredLength > 0) ? requiredLength : 0;
+				options.required_length = requiredLength;
+				options.check_length = (requiredLength >= 0);
+				rv = mfs_file_server_fetch(file_system, &uri, path, &c_bytes, total_bytes, &c_file, NULL, pool, destination_file_path, &options);
+			} else if(requiredLength >= 0) { //a wrong Content-Length stops the download at the headers
+				options.required_length = requiredLength;
+				options.check_length = true;
+				if((bytes != NULL) && !caller_file) { //size the buffer from the length the caller expects
+					options.expected_length = requiredLength;
+				}
+				rv = mfs_file_server_fetch(file_system, &uri, path, bytes, total_bytes, file, brigade, pool, destination_file_path, &options);
+			} else {
+				rv = mfs_file_server_get(file_system, &uri, path, bytes, total_bytes, file, brigade, pool, destination_file_path);
+			}
+			if(rv != APR_SUCCESS) {
 				mfs_log(LOG_ERR, "%s: Failed to get file from %s. Attempt count = %d/%d", key, path, i+1, path_count);
+			} else if((stale_content != NULL) && (options.response_code == 304)) {
+				//not modified: no body was sent so keep what we have for another ttl
+				mfs_content_cache_refresh(content_cache, stale_content);
+				return mfs_content_entry_serve(stale_content, bytes, total_bytes, file, brigade, pool);
 			} else {
 				//we succeeded!.. lets make sure its the correct length (the file server can return a 0 length file..)
-				if(requiredLength >= 0) {
-					if((*total_bytes) != requiredLength) {
-						mfs_log(LOG_ERR, "Failed to get file %s from %s because returned length (%d) does not match the required length (%d). Attempt count = %d/%d", key, path, (*total_bytes), requiredLength, i+1, path_count);
-						rv = APR_EGENERAL;
-					} else {
-						if(i != 0) {
-							mfs_log(LOG_ERR, "Fetched %s from %s Attempt count = %d", key, path, i+1);
-						}
-						return APR_SUCCESS;
+				if((requiredLength >= 0)&&((*total_bytes) != requiredLength)) {
+					mfs_log(LOG_ERR, "Failed to get file %s from %s because returned length (%d) does not match the required length (%d). Attempt count = %d/%d", key, path, (*total_bytes), requiredLength, i+1, path_count);
+					rv = APR_EGENERAL;
+					if(options.content != NULL) {
+						mfs_content_entry_release(options.content);
+					}
+					if(options.spill_file != NULL) {
+						mfs_disk_cache_discard(disk_cache, options.spill_file, pool);
 					}
 				} else {
 					if(i != 0) {
 						mfs_log(LOG_ERR, "Fetched %s from %s Attempt count = %d", key, path, i+1);
 					}
+					if(!use_content_cache && !use_disk_cache) {
+						return APR_SUCCESS;
+					}
+					if(stale_content != NULL) { //replaced by what we just fetched
+						if(options.content == NULL) {
+							mfs_content_cache_remove(content_cache, domain, key, pool);
+						}
+						mfs_content_entry_release(stale_content);
+					}
+					if(options.content != NULL) {
+						mfs_content_entry_acquire(options.content); //the cache takes one reference, the caller gets the other
+						if(hot_keys != NULL) {
+							mfs_content_cache_promote(content_cache, options.content);
+						} else {
+							mfs_content_cache_put(content_cache, options.content);
+						}
+						return mfs_content_entry_serve(options.content, bytes, total_bytes, file, brigade, pool);
+					}
+					if(options.spill_file != NULL) {
+						mfs_disk_cache_publish(disk_cache, fid, options.spill_file, pool); //if this fails the temp file is unlinked but still readable
+					}
+					//not in the content cache: return it as the caller asked
+					if(brigade != NULL) {
+						apr_bucket *b;
+						if(c_file != NULL) {
+							b = apr_bucket_file_create(c_file, 0, *total_bytes, pool, brigade->bucket_alloc);
+						} else {
+							b = apr_bucket_pool_create(c_bytes, *total_bytes, pool, brigade->bucket_alloc);
+						}
+						APR_BRIGADE_INSERT_TAIL(brigade, b);
+					} else {
+						if(bytes != NULL) {
+							*bytes = c_bytes;
+						}
+						if(file != NULL) {
+							*file = c_file;
+						}
+					}
 					return APR_SUCCESS;
 				}
 			}
 		}
 	}
+	if(stale_content != NULL) {
+		mfs_content_entry_release(stale_content);
+	}
 	return rv; //this will contain the last error code...
 
 }
@@ -369,4 +1059,445 @@ apr_status_t mfs_get_brigade(mfs_file_system *file_system, char *domain, char *k
 	return mfs_file_system_get(file_system, domain, key, NULL, total_bytes, &file, brigade, pool, NULL, requiredLength);
 }
 
+//read a whole local file into the caller's buffer and close it
+apr_status_t mfs_local_file_read_into(apr_file_t *local_file, apr_off_t size, void *buffer, apr_size_t buffer_size, apr_size_t *total_bytes, apr_pool_t *pool) {
+	apr_status_t rv = APR_ENOSPC;
+	if(size <= (apr_off_t)buffer_size) {
+		if((rv = apr_file_read_full(local_file, buffer, (apr_size_t)size, total_bytes)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to read local file:");
+		}
+	}
+	apr_file_close(local_file);
+	return rv;
+}
+
+apr_status_t mfs_get_into(mfs_file_system *file_system, char *domain, char *key, void *buffer, apr_size_t buffer_size, apr_size_t *total_bytes, apr_pool_t *pool) {
+	char **paths;
+	int path_count;
+	apr_status_t rv;
+	int i;
+	*total_bytes = 0;
+	if(file_system->content_cache != NULL) {
+		mfs_content_entry *content = mfs_content_cache_get(file_system->content_cache, domain, key, pool);
+		if(content != NULL) {
+			rv = APR_ENOSPC;
+			if(content->size <= buffer_size) {
+				memcpy(buffer, content->data, content->size);
+				*total_bytes = content->size;
+				rv = APR_SUCCESS;
+			}
+			mfs_content_entry_release(content);
+			return rv;
+		}
+	}
+	apr_file_t *local_file;
+	apr_off_t local_size;
+	if((file_system->mirrors != NULL) && (mfs_mirror_open(file_system, domain, key, &local_file, &local_size, pool) == APR_SUCCESS)) {
+		return mfs_local_file_read_into(local_file, local_size, buffer, buffer_size, total_bytes, pool);
+	}
+	if((rv = mfs_get_paths(file_system, domain, key, true, &paths, &path_count, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_DEBUG, rv, pool, "Unable to get paths for %s.%s:", domain, key);
+		return rv;
+	}
+	if(apr_hash_count(file_system->local_docroots) > 0) {
+		for(i = 0; i < path_count; i++) {
+			char *local_path = mfs_local_path(file_system, paths[i], pool);
+			if((local_path != NULL) && (mfs_local_file_open(local_path, &local_file, &local_size, pool) == APR_SUCCESS)) {
+				return mfs_local_file_read_into(local_file, local_size, buffer, buffer_size, total_bytes, pool);
+			}
+		}
+	}
+	rv = APR_EGENERAL;
+	for(i = 0; i < path_count; i++) {
+		char *path = paths[i];
+		apr_uri_t uri;
+		if((rv = apr_uri_parse(pool, path, &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to parse get_url %s:", key, path);
+			continue;
+		}
+		if((uri.hostinfo == NULL)||(uri.scheme == NULL)||(uri.path==NULL)) {
+			mfs_log(LOG_ERR, "%s: Unable to parse get_url %s:", key, path);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		mfs_fetch_options options;
+		memset(&options, 0, sizeof(options));
+		options.buffer = buffer;
+		options.buffer_size = buffer_size;
+		void *bytes = NULL;
+		apr_file_t *file = NULL;
+		if((rv = mfs_file_server_fetch(file_system, &uri, path, &bytes, total_bytes, &file, NULL, pool, NULL, &options)) == APR_SUCCESS) {
+			if((options.response_code >= 200) && (options.response_code < 300)) {
+				if(i != 0) {
+					mfs_log(LOG_ERR, "Fetched %s from %s Attempt count = %d", key, path, i+1);
+				}
+				if((*total_bytes > 0) && (bytes != buffer)) { //the body went to the pool after all
+					memcpy(buffer, bytes, *total_bytes);
+				}
+				return APR_SUCCESS;
+			}
+			mfs_log(LOG_ERR, "%s: Unexpected response %ld from %s. Attempt count = %d/%d", key, options.response_code, path, i+1, path_count);
+			rv = APR_EGENERAL;
+		} else if(options.buffer_full && (options.response_code >= 200) && (options.response_code < 300)) {
+			return APR_ENOSPC;
+		} else {
+			mfs_log(LOG_ERR, "%s: Failed to get file from %s. Attempt count = %d/%d", key, path, i+1, path_count);
+		}
+	}
+	*total_bytes = 0;
+	return rv;
+}
+
+//is the reply to a range request the bytes that were asked for? a 200 is the whole file: only right if we asked from the start
+//(it was no longer than the range or the download would have failed)
+bool mfs_range_response_ok(mfs_fetch_options *options, apr_size_t received) {
+	if(options->response_code == 200) {
+		return options->range_offset == 0;
+	}
+	return (options->response_code == 206) && (received > 0) && (options->range_start == options->range_offset)
+		&& (options->range_end == options->range_offset + (apr_off_t)received - 1);
+}
+
+//internal method for the range calls: the result goes to bytes, the caller's file or the brigade (one of them is not NULL)
+apr_status_t mfs_file_system_get_range(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool) {
+	char **paths;
+	int path_count;
+	apr_status_t rv;
+	int i;
+	*total_bytes = 0;
+	if(offset < 0) {
+		mfs_log(LOG_ERR, "%s: Invalid range offset %" APR_OFF_T_FMT, key, offset);
+		return APR_EINVAL;
+	}
+	if(length == 0) {
+		if(bytes != NULL) {
+			*bytes = apr_pcalloc(pool, 1);
+		}
+		return APR_SUCCESS;
+	}
+	if(file_system->mirrors != NULL) {
+		apr_file_t *mirror_file;
+		apr_off_t mirror_size;
+		if(mfs_mirror_open(file_system, domain, key, &mirror_file, &mirror_size, pool) == APR_SUCCESS) {
+			return mfs_local_range_serve(mirror_file, mirror_size, offset, length, bytes, total_bytes, file, brigade, pool);
+		}
+	}
+	if((rv = mfs_get_paths(file_system, domain, key, true, &paths, &path_count, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_DEBUG, rv, pool, "Unable to get paths for %s.%s:", domain, key);
+		return rv;
+	}
+	if(apr_hash_count(file_system->local_docroots) > 0) {
+		for(i = 0; i < path_count; i++) {
+			char *local_path = mfs_local_path(file_system, paths[i], pool);
+			apr_file_t *local_file;
+			apr_off_t local_size;
+			if((local_path != NULL) && (mfs_local_file_open(local_path, &local_file, &local_size, pool) == APR_SUCCESS)) {
+				return mfs_local_range_serve(local_file, local_size, offset, length, bytes, total_bytes, file, brigade, pool);
+			}
+		}
+	}
+	//a rejected reply is removed from the caller's file
+	apr_off_t file_start = 0;
+	if((file != NULL) && ((rv = apr_file_seek(*file, APR_CUR, &file_start)) != APR_SUCCESS)) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get the position of the file for the range of %s:", key);
+		return rv;
+	}
+	rv = APR_EGENERAL;
+	for(i = 0; i < path_count; i++) {
+		char *path = paths[i];
+		apr_uri_t uri;
+		if((rv = apr_uri_parse(pool, path, &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to parse get_url %s:", key, path);
+			continue;
+		}
+		if((uri.hostinfo == NULL)||(uri.scheme == NULL)||(uri.path==NULL)) {
+			mfs_log(LOG_ERR, "%s: Unable to parse get_url %s:", key, path);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		mfs_fetch_options options;
+		memset(&options, 0, sizeof(options));
+		options.range_offset = offset;
+		options.range_length = length;
+		options.range_spill = (bytes == NULL);
+		void *r_bytes = NULL;
+		apr_file_t *r_file = (file != NULL) ? *file : NULL;
+		apr_bucket_brigade *r_brigade = (brigade != NULL) ? apr_brigade_create(pool, brigade->bucket_alloc) : NULL;
+		if((rv = mfs_file_server_fetch(file_system, &uri, path, &r_bytes, total_bytes, &r_file, r_brigade, pool, NULL, &options)) != APR_SUCCESS) {
+			mfs_log(LOG_ERR, "%s: Failed to get range %" APR_OFF_T_FMT "+%" APR_SIZE_T_FMT " from %s. Attempt count = %d/%d", key, offset, length, path, i+1, path_count);
+		} else if(options.response_code == 416) { //the range starts past the end of the file
+			*total_bytes = 0;
+		} else if(!mfs_range_response_ok(&options, *total_bytes)) {
+			mfs_log(LOG_ERR, "%s: Unexpected response %ld (bytes %" APR_OFF_T_FMT "-%" APR_OFF_T_FMT ") to range %" APR_OFF_T_FMT "+%" APR_SIZE_T_FMT " from %s. Attempt count = %d/%d",
+				key, options.response_code, options.range_start, options.range_end, offset, length, path, i+1, path_count);
+			rv = APR_EGENERAL;
+		} else {
+			if(i != 0) {
+				mfs_log(LOG_ERR, "Fetched range of %s from %s Attempt count = %d", key, path, i+1);
+			}
+			if(brigade != NULL) {
+				APR_BRIGADE_CONCAT(brigade, r_brigade);
+			} else if(bytes != NULL) {
+				*bytes = r_bytes;
+			}
+			return APR_SUCCESS;
+		}
+		//throw away what was received
+		if(r_brigade != NULL) {
+			apr_brigade_cleanup(r_brigade);
+		}
+		if(file != NULL) {
+			apr_off_t position = file_start;
+			apr_file_trunc(*file, file_start);
+			apr_file_seek(*file, APR_SET, &position);
+		}
+		if(rv == APR_SUCCESS) { //a 416
+			if(bytes != NULL) {
+				*bytes = apr_pcalloc(pool, 1);
+			}
+			return APR_SUCCESS;
+		}
+	}
+	return rv; //this will contain the last error code...
+}
 
+apr_status_t mfs_get_range_bytes(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, void **bytes, apr_size_t *total_bytes, apr_pool_t *pool) {
+	return mfs_file_system_get_range(file_system, domain, key, offset, length, bytes, total_bytes, NULL, NULL, pool);
+}
+
+apr_status_t mfs_get_range_file(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, apr_size_t *total_bytes, apr_file_t **file, apr_pool_t *pool) {
+	apr_status_t rv;
+	bool temp_file = (*file == NULL);
+	if(temp_file) {
+		char filename[] = "mogile_fs_XXXXXX";
+		if((rv = apr_file_mktemp(file, filename, APR_CREATE | APR_READ | APR_WRITE, pool)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Error opening tmp file for range of %s:", key);
+			return rv;
+		}
+	}
+	if((rv = mfs_file_system_get_range(file_system, domain, key, offset, length, NULL, total_bytes, file, NULL, pool)) == APR_SUCCESS) {
+		apr_off_t start_pos = 0;
+		apr_file_seek(*file, APR_SET, &start_pos); //rewind like mfs_get_file
+	} else if(temp_file) {
+		apr_file_close(*file);
+		*file = NULL;
+	}
+	return rv;
+}
+
+apr_status_t mfs_get_range_brigade(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, apr_size_t *total_bytes, apr_bucket_brigade *brigade, apr_pool_t *pool) {
+	return mfs_file_system_get_range(file_system, domain, key, offset, length, NULL, total_bytes, NULL, brigade, pool);
+}
+
+
+
+//a streaming download. the data goes straight from curl to the caller's callback
+typedef struct {
+	mfs_stream_callback callback;
+	void *ctx;
+	CURL *curl;
+	apr_size_t delivered; //bytes given to the callback so far (a retry resumes from here)
+	apr_size_t skip; //a retry answered with the whole file: bytes already delivered to drop
+	bool started; //the response code of this attempt has been checked
+	apr_status_t callback_rv; //what the callback returned if it stopped the download
+	mfs_fetch_options options; //the Content-Range of a resumed download
+} mfs_stream_state;
+
+//called by cURL when data is ready to read
+size_t mfs_stream_write_callback(void *ptr, size_t size, size_t nmemb, void *stream) {
+	mfs_stream_state *state = (mfs_stream_state *)stream;
+	apr_size_t length = size * nmemb;
+	const char *data = ptr;
+	if(!state->started) { //an error page is not the file
+		long response_code = 0;
+		curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &response_code);
+		if(response_code == 200) {
+			state->skip = state->delivered;
+		} else if((response_code == 206) && (state->delivered > 0) && (state->options.range_start == (apr_off_t)state->delivered)) {
+			state->skip = 0;
+		} else {
+			mfs_log(LOG_ERR, "Unexpected response %ld to a streaming download", response_code);
+			return 0;
+		}
+		state->started = true;
+	}
+	if(state->skip > 0) {
+		apr_size_t skipped = (state->skip < length) ? state->skip : length;
+		state->skip -= skipped;
+		data += skipped;
+		length -= skipped;
+		if(length == 0) {
+			return size * nmemb;
+		}
+	}
+	apr_status_t rv = state->callback(state->ctx, data, length);
+	if(rv != APR_SUCCESS) {
+		state->callback_rv = rv;
+		return 0;
+	}
+	state->delivered += length;
+	return size * nmemb;
+}
+
+//called by cURL for each response header line
+size_t mfs_stream_header_callback(char *ptr, size_t size, size_t nmemb, void *stream) {
+	mfs_stream_state *state = (mfs_stream_state *)stream;
+	apr_size_t length = size * nmemb;
+	char content_range[MFS_VALIDATOR_SIZE] = "";
+	mfs_copy_header_value(ptr, length, "Content-Range", content_range);
+	if(content_range[0] != '\0') {
+		mfs_parse_content_range(content_range, &state->options);
+	}
+	return length;
+}
+
+//one attempt at streaming from a file server. if some of the file was delivered by an earlier attempt only the rest is asked for
+apr_status_t mfs_file_server_stream(mfs_file_system *file_system, apr_uri_t *uri, char *original_uri, mfs_stream_state *state, apr_pool_t *pool) {
+	apr_status_t rv;
+	mfs_file_server *file_server;
+	if((rv = mfs_get_file_server(file_system, uri, &file_server)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get file server for %s:", uri->hostinfo);
+		return rv;
+	}
+	mfs_http_connection *conn;
+	if((rv = apr_reslist_acquire(file_server->connections, (void**)&conn)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get file server connection for %s:", uri->hostinfo);
+		return rv;
+	}
+	apr_atomic_inc32(&file_server->downloads);
+	state->curl = conn->curl;
+	state->started = false;
+	state->skip = 0;
+	state->options.range_start = -1;
+	state->options.range_end = -1;
+	state->options.range_total = -1;
+	curl_easy_setopt(conn->curl, CURLOPT_URL, original_uri);
+	curl_easy_setopt(conn->curl, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, mfs_stream_write_callback);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, state);
+	curl_easy_setopt(conn->curl, CURLOPT_HEADERFUNCTION, mfs_stream_header_callback);
+	curl_easy_setopt(conn->curl, CURLOPT_HEADERDATA, state);
+	if(state->delivered > 0) {
+		curl_easy_setopt(conn->curl, CURLOPT_RANGE, apr_psprintf(pool, "%" APR_SIZE_T_FMT "-", state->delivered));
+	}
+	curl_easy_setopt(conn->curl, CURLOPT_CONNECTTIMEOUT_MS, apr_time_as_msec(file_system->file_server_timeout));
+	curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(conn->curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(conn->curl, CURLOPT_LOW_SPEED_LIMIT, 30L);
+	curl_easy_setopt(conn->curl, CURLOPT_READFUNCTION, NULL);
+	curl_easy_setopt(conn->curl, CURLOPT_READDATA, NULL);
+
+	CURLcode res = curl_easy_perform(conn->curl);
+	apr_atomic_dec32(&file_server->downloads);
+	long response_code = 0;
+	curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &response_code);
+	if((file_system->replica_ranking != NULL) && (state->callback_rv == APR_SUCCESS)) {
+		double ttfb = 0, elapsed = 0;
+		curl_off_t downloaded = 0;
+		curl_easy_getinfo(conn->curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+		curl_easy_getinfo(conn->curl, CURLINFO_TOTAL_TIME, &elapsed);
+		curl_easy_getinfo(conn->curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+		mfs_host_stats_record(file_system, file_server, (res == CURLE_OK) && (response_code > 0) && (response_code < 500), ttfb, (double)downloaded, elapsed);
+	}
+	//we reuse connections... clean this up!
+	curl_easy_setopt(conn->curl, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(conn->curl, CURLOPT_HEADERDATA, NULL);
+	curl_easy_setopt(conn->curl, CURLOPT_RANGE, NULL);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, NULL);
+	if(res != CURLE_OK) {
+		if(state->callback_rv == APR_SUCCESS) {
+			mfs_log(LOG_ERR, "Error streaming from %s:%s (%d)", original_uri, curl_easy_strerror(res), res);
+		}
+		if((rv = apr_reslist_invalidate(file_server->connections, conn)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to invalidate file server connection for %s:", uri->hostinfo);
+		}
+		return (state->callback_rv != APR_SUCCESS) ? state->callback_rv : APR_EGENERAL;
+	}
+	if((rv = apr_reslist_release(file_server->connections, conn)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to release file server connection for %s:", uri->hostinfo);
+	}
+	//an empty body never reaches the write callback
+	if(!state->started && ((response_code != 200) || (state->delivered > 0))) {
+		mfs_log(LOG_ERR, "Unexpected response %ld streaming from %s", response_code, original_uri);
+		return APR_EGENERAL;
+	}
+	return APR_SUCCESS;
+}
+
+//a local copy is read in blocks and handed to the callback
+apr_status_t mfs_local_file_stream(apr_file_t *local_file, mfs_stream_callback callback, void *ctx, apr_size_t *total_bytes, apr_pool_t *pool) {
+	apr_status_t rv = APR_SUCCESS;
+	char *buffer = apr_palloc(pool, MFS_STREAM_BLOCK_SIZE);
+	*total_bytes = 0;
+	while(rv == APR_SUCCESS) {
+		apr_size_t length = MFS_STREAM_BLOCK_SIZE;
+		if((rv = apr_file_read(local_file, buffer, &length)) == APR_EOF) {
+			rv = APR_SUCCESS;
+			break;
+		} else if(rv != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to read local file to stream:");
+		} else if((rv = callback(ctx, buffer, length)) == APR_SUCCESS) {
+			*total_bytes += length;
+		}
+	}
+	apr_file_close(local_file);
+	return rv;
+}
+
+apr_status_t mfs_get_stream(mfs_file_system *file_system, char *domain, char *key, mfs_stream_callback callback, void *ctx, apr_size_t *total_bytes, apr_pool_t *pool) {
+	char **paths;
+	int path_count;
+	apr_status_t rv;
+	int i;
+	*total_bytes = 0;
+	if(file_system->mirrors != NULL) {
+		apr_file_t *mirror_file;
+		apr_off_t mirror_size;
+		if(mfs_mirror_open(file_system, domain, key, &mirror_file, &mirror_size, pool) == APR_SUCCESS) {
+			return mfs_local_file_stream(mirror_file, callback, ctx, total_bytes, pool);
+		}
+	}
+	if((rv = mfs_get_paths(file_system, domain, key, true, &paths, &path_count, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_DEBUG, rv, pool, "Unable to get paths for %s.%s:", domain, key);
+		return rv;
+	}
+	if(apr_hash_count(file_system->local_docroots) > 0) {
+		for(i = 0; i < path_count; i++) {
+			char *local_path = mfs_local_path(file_system, paths[i], pool);
+			apr_file_t *local_file;
+			apr_off_t local_size;
+			if((local_path != NULL) && (mfs_local_file_open(local_path, &local_file, &local_size, pool) == APR_SUCCESS)) {
+				return mfs_local_file_stream(local_file, callback, ctx, total_bytes, pool);
+			}
+		}
+	}
+	mfs_stream_state *state = apr_pcalloc(pool, sizeof(mfs_stream_state));
+	state->callback = callback;
+	state->ctx = ctx;
+	rv = APR_EGENERAL;
+	for(i = 0; i < path_count; i++) {
+		char *path = paths[i];
+		apr_uri_t uri;
+		if((rv = apr_uri_parse(pool, path, &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to parse get_url %s:", key, path);
+			continue;
+		}
+		if((uri.hostinfo == NULL)||(uri.scheme == NULL)||(uri.path==NULL)) {
+			mfs_log(LOG_ERR, "%s: Unable to parse get_url %s:", key, path);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		if((rv = mfs_file_server_stream(file_system, &uri, path, state, pool)) == APR_SUCCESS) {
+			if(i != 0) {
+				mfs_log(LOG_ERR, "Streamed %s from %s Attempt count = %d (resumed at %" APR_SIZE_T_FMT ")", key, path, i+1, state->delivered);
+			}
+			break;
+		}
+		if(state->callback_rv != APR_SUCCESS) { //the caller stopped it
+			break;
+		}
+		mfs_log(LOG_ERR, "%s: Failed to stream file from %s after %" APR_SIZE_T_FMT " bytes. Attempt count = %d/%d", key, path, state->delivered, i+1, path_count);
+	}
+	*total_bytes = state->delivered;
+	return rv;
+}
@@ -308,8 +308,16 @@ apr_status_t mfs_store_file_or_bytes(mfs_file_system *file_system, const char *d
 						return rv;
 					}
 				}
-				if((rv = mfs_file_server_put(file_system, &uri, put_url, bytes, &total_bytes, file, pool)) != APR_SUCCESS) {
-					mfs_log(LOG_ERR, "Failed to put file to %s. Attempt count = %d", put_url, attempt_count);
+				//a device on this machine is written directly (falling back to http if that fails)
+				char *local_path = mfs_local_path(file_system, put_url, pool);
+				if((local_path == NULL) || ((rv = mfs_local_file_put(local_path, bytes, &total_bytes, file, pool)) != APR_SUCCESS)) {
+					if((local_path != NULL) && (file != NULL)) {
+						apr_off_t off = 0;
+						apr_file_seek(file, APR_SET, &off);
+					}
+					if((rv = mfs_file_server_put(file_system, &uri, put_url, bytes, &total_bytes, file, pool)) != APR_SUCCESS) {
+						mfs_log(LOG_ERR, "Failed to put file to %s. Attempt count = %d", put_url, attempt_count);
+					}
 				}
 				put_count++;
 			}
@@ -342,6 +350,9 @@ apr_status_t mfs_store_file_or_bytes(mfs_file_system *file_system, const char *d
 			apr_sleep(file_system->retry_timeout);
 		}
 	}
+	if(rv == APR_SUCCESS) {
+		mfs_cache_after_store(file_system, domain, key, put_url, pool);
+	}
 	
 	if(manage_pool) {
 		apr_pool_destroy(pool); 
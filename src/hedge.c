@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+hedged downloads of small files.
+the first replica is fetched with a curl multi handle. if the last replica started has not sent a byte within the delay the next one
+is started alongside it (a failure starts the next one straight away). the first to finish with a 2xx wins and the others are
+aborted: their connections are invalidated because they were dropped mid transfer.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <stdlib.h>
+#include <curl/curl.h>
+
+typedef struct {
+	char *path;
+	mfs_file_server *file_server;
+	mfs_http_connection *conn; //NULL once it is finished with
+	char *data; //malloc'd
+	apr_size_t size;
+	apr_size_t capacity;
+	apr_size_t max_size;
+	bool too_big; //the body was longer than max_size
+	bool first_byte;
+} mfs_hedge_transfer;
+
+apr_status_t mfs_enable_hedged_downloads(mfs_file_system *file_system, apr_interval_time_t delay) {
+	if(file_system->hedge != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_hedged_downloads called when hedged downloads are already enabled");
+		return APR_EGENERAL;
+	}
+	mfs_hedge *hedge = apr_pcalloc(file_system->pool, sizeof(mfs_hedge));
+	hedge->delay = (delay > 0) ? delay : DEFAULT_HEDGE_DELAY;
+	file_system->hedge = hedge;
+	return APR_SUCCESS;
+}
+
+//called by cURL when data is ready to read
+size_t mfs_hedge_write_callback(void *ptr, size_t size, size_t nmemb, void *stream) {
+	mfs_hedge_transfer *t = (mfs_hedge_transfer *)stream;
+	apr_size_t length = size * nmemb;
+	t->first_byte = true;
+	if(t->size + length > t->max_size) {
+		t->too_big = true;
+		return 0; //too big to hedge
+	}
+	if(t->size + length > t->capacity) {
+		apr_size_t capacity = (t->capacity == 0) ? 16384 : t->capacity * 2;
+		while(capacity < t->size + length) {
+			capacity *= 2;
+		}
+		char *data = realloc(t->data, capacity);
+		if(data == NULL) {
+			mfs_log(LOG_CRIT, "Unable to allocate hedged download buffer");
+			return 0;
+		}
+		t->data = data;
+		t->capacity = capacity;
+	}
+	memcpy(t->data + t->size, ptr, length);
+	t->size += length;
+	return length;
+}
+
+apr_status_t mfs_hedge_start(mfs_file_system *file_system, CURLM *multi, mfs_hedge_transfer *t, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_uri_t uri;
+	if((rv = apr_uri_parse(pool, t->path, &uri)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to parse get_url %s:", t->path);
+		return rv;
+	}
+	if((uri.hostinfo == NULL)||(uri.scheme == NULL)||(uri.path==NULL)) {
+		mfs_log(LOG_ERR, "Unable to parse get_url %s:", t->path);
+		return APR_EGENERAL;
+	}
+	if((rv = mfs_get_file_server(file_system, &uri, &t->file_server)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get file server for %s:", uri.hostinfo);
+		return rv;
+	}
+	if((rv = apr_reslist_acquire(t->file_server->connections, (void**)&t->conn)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get file server connection for %s:", uri.hostinfo);
+		t->conn = NULL;
+		return rv;
+	}
+	apr_atomic_inc32(&t->file_server->downloads);
+	t->max_size = file_system->max_buffer_size;
+	CURL *curl = t->conn->curl;
+	curl_easy_setopt(curl, CURLOPT_URL, t->path);
+	curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, mfs_hedge_write_callback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, NULL);
+	curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, apr_time_as_msec(file_system->file_server_timeout));
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 30L);
+	if(curl_multi_add_handle(multi, curl) != CURLM_OK) {
+		mfs_log(LOG_ERR, "Unable to add download of %s to curl multi handle", t->path);
+		apr_reslist_invalidate(t->file_server->connections, t->conn);
+		apr_atomic_dec32(&t->file_server->downloads);
+		t->conn = NULL;
+		return APR_EGENERAL;
+	}
+	return APR_SUCCESS;
+}
+
+//give the connection back: a finished transfer can be reused, an aborted one can't
+void mfs_hedge_finish(CURLM *multi, mfs_hedge_transfer *t, bool reuse, apr_pool_t *pool) {
+	apr_status_t rv;
+	curl_multi_remove_handle(multi, t->conn->curl);
+	apr_atomic_dec32(&t->file_server->downloads);
+	curl_easy_setopt(t->conn->curl, CURLOPT_WRITEDATA, NULL);
+	if(reuse) {
+		if((rv = apr_reslist_release(t->file_server->connections, t->conn)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to release file server connection for %s:", t->path);
+		}
+	} else if((rv = apr_reslist_invalidate(t->file_server->connections, t->conn)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to invalidate file server connection for %s:", t->path);
+	}
+	t->conn = NULL;
+	free(t->data);
+	t->data = NULL;
+}
+
+apr_status_t mfs_hedged_get(mfs_file_system *file_system, const char *key, char **paths, int path_count, void **bytes, apr_size_t *total_bytes, apr_pool_t *pool) {
+	mfs_hedge *hedge = file_system->hedge;
+	apr_status_t rv = APR_EGENERAL;
+	CURLM *multi = curl_multi_init();
+	if(multi == NULL) {
+		mfs_log(LOG_CRIT, "Unable to curl_multi_init");
+		return APR_EGENERAL;
+	}
+	mfs_hedge_transfer *transfers = apr_pcalloc(pool, sizeof(mfs_hedge_transfer) * path_count);
+	mfs_hedge_transfer *winner = NULL;
+	int started = 0; //paths tried so far
+	int active = 0;
+	apr_time_t hedge_at = 0;
+	int i;
+	while(winner == NULL) {
+		apr_time_t now = apr_time_now();
+		//start the next replica if none is running or the newest has been silent for the delay
+		bool start_next = (active == 0) || ((now >= hedge_at) && !transfers[started - 1].first_byte);
+		if(start_next && (started < path_count)) {
+			mfs_hedge_transfer *t = &transfers[started++];
+			t->path = paths[started - 1];
+			if(mfs_hedge_start(file_system, multi, t, pool) == APR_SUCCESS) {
+				if(active > 0) {
+					apr_atomic_inc32(&hedge->hedged_count);
+					mfs_log(LOG_DEBUG, "%s: nothing from %s after %d ms, also trying %s", key, transfers[started - 2].path, (apr_int32_t)apr_time_as_msec(hedge->delay), t->path);
+				}
+				active++;
+				hedge_at = now + hedge->delay;
+			}
+			continue;
+		}
+		if(active == 0) { //every replica failed
+			break;
+		}
+		int still_running;
+		curl_multi_perform(multi, &still_running);
+		CURLMsg *msg;
+		int msgs_left;
+		while((winner == NULL) && ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL)) {
+			if(msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			mfs_hedge_transfer *t = NULL;
+			for(i = 0; i < started; i++) {
+				if((transfers[i].conn != NULL) && (transfers[i].conn->curl == msg->easy_handle)) {
+					t = &transfers[i];
+				}
+			}
+			if(t == NULL) {
+				continue;
+			}
+			active--;
+			long response_code = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+			if((file_system->replica_ranking != NULL) && (msg->data.result != CURLE_WRITE_ERROR)) {
+				double ttfb = 0, elapsed = 0;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &elapsed);
+				mfs_host_stats_record(file_system, t->file_server, (msg->data.result == CURLE_OK) && (response_code > 0) && (response_code < 500), ttfb, t->size, elapsed);
+			}
+			if((msg->data.result == CURLE_OK) && (response_code >= 200) && (response_code < 300)) {
+				winner = t;
+			} else {
+				if(msg->data.result != CURLE_OK) {
+					mfs_log(LOG_ERR, "%s: Error downloading from %s:%s (%d)", key, t->path, curl_easy_strerror(msg->data.result), msg->data.result);
+				} else {
+					mfs_log(LOG_ERR, "%s: Unexpected response %ld from %s", key, response_code, t->path);
+				}
+				rv = t->too_big ? APR_ENOSPC : APR_EGENERAL;
+				mfs_hedge_finish(multi, t, msg->data.result == CURLE_OK, pool);
+				if(rv == APR_ENOSPC) { //too big to hold in memory: the others would be too
+					break;
+				}
+			}
+		}
+		if((winner != NULL) || (rv == APR_ENOSPC)) {
+			break;
+		}
+		//wake for data or when the next replica is due
+		int timeout_ms = 1000;
+		if(started < path_count) {
+			apr_interval_time_t wait = hedge_at - apr_time_now();
+			timeout_ms = (wait <= 0) ? 0 : ((wait < apr_time_from_sec(1)) ? (int)apr_time_as_msec(wait) + 1 : 1000);
+		}
+		curl_multi_wait(multi, NULL, 0, timeout_ms, NULL);
+	}
+	if(winner != NULL) {
+		*total_bytes = winner->size;
+		*bytes = apr_palloc(pool, winner->size + 1);
+		if(winner->size > 0) {
+			memcpy(*bytes, winner->data, winner->size);
+		}
+		if(winner != &transfers[0]) {
+			apr_atomic_inc32(&hedge->won_count);
+		}
+		mfs_hedge_finish(multi, winner, true, pool);
+		rv = APR_SUCCESS;
+	}
+	for(i = 0; i < started; i++) {
+		if(transfers[i].conn != NULL) { //the losers
+			apr_atomic_inc32(&hedge->abort_count);
+			mfs_hedge_finish(multi, &transfers[i], false, pool);
+		}
+	}
+	curl_multi_cleanup(multi);
+	return rv;
+}
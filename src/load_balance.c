@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+spreads reads of hot keys over their replicas.
+each mfs_file_server counts the downloads it has in flight. two of the paths are picked at random and the one whose file server is
+less busy goes first. always taking the least busy of all the paths would send every client to the same idle host at once: two random
+choices spread the load nearly as well without that herd.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+
+apr_uint32_t mfs_path_downloads(mfs_file_system *file_system, char *path, apr_pool_t *pool);
+
+apr_status_t mfs_enable_load_balancing(mfs_file_system *file_system) {
+	if(file_system->load_balancer != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_load_balancing called when load balancing is already enabled");
+		return APR_EGENERAL;
+	}
+	mfs_load_balancer *balancer = apr_pcalloc(file_system->pool, sizeof(mfs_load_balancer));
+	balancer->sequence = (apr_uint32_t)apr_time_now();
+	file_system->load_balancer = balancer;
+	return APR_SUCCESS;
+}
+
+//in flight downloads from the file server for path (0 if it can't be found)
+apr_uint32_t mfs_path_downloads(mfs_file_system *file_system, char *path, apr_pool_t *pool) {
+	apr_uri_t uri;
+	mfs_file_server *file_server;
+	if((apr_uri_parse(pool, path, &uri) == APR_SUCCESS) && (uri.hostinfo != NULL) && (mfs_get_file_server(file_system, &uri, &file_server) == APR_SUCCESS)) {
+		return apr_atomic_read32(&file_server->downloads);
+	}
+	return 0;
+}
+
+void mfs_balance_paths(mfs_file_system *file_system, char **paths, int path_count, apr_pool_t *pool) {
+	mfs_load_balancer *balancer = file_system->load_balancer;
+	int i;
+	if(path_count < 2) {
+		return;
+	}
+	//threads share the sequence so mix it up (murmur3 finaliser) rather than take the next number
+	apr_uint32_t r = apr_atomic_inc32(&balancer->sequence);
+	r ^= r >> 16;
+	r *= 0x85ebca6b;
+	r ^= r >> 13;
+	r *= 0xc2b2ae35;
+	r ^= r >> 16;
+	int first = r % path_count;
+	int second = (first + 1 + (int)((r >> 8) % (path_count - 1))) % path_count;
+	if(second < first) { //on a tie the earlier path wins so a ranking is kept
+		int swap = first;
+		first = second;
+		second = swap;
+	}
+	int chosen = (mfs_path_downloads(file_system, paths[second], pool) < mfs_path_downloads(file_system, paths[first], pool)) ? second : first;
+	apr_atomic_inc32(&balancer->balanced_count);
+	if(chosen != 0) {
+		char *path = paths[chosen];
+		for(i = chosen; i > 0; i--) {
+			paths[i] = paths[i - 1];
+		}
+		paths[0] = path;
+		apr_atomic_inc32(&balancer->moved_count);
+	}
+}
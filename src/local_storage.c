@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+reads of replicas on this machine without going through http.
+mogstored serves http://host:port/devN/... from docroot/devN/... so a path on a local mogstored maps straight to a file.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+
+apr_status_t mfs_add_local_docroot(mfs_file_system *file_system, const char *hostinfo, const char *docroot) {
+	apr_size_t length = strlen(docroot);
+	while((length > 1) && (docroot[length - 1] == '/')) {
+		length--;
+	}
+	apr_hash_set(file_system->local_docroots, apr_pstrdup(file_system->pool, hostinfo), APR_HASH_KEY_STRING, apr_pstrndup(file_system->pool, docroot, length));
+	mfs_log(LOG_INFO, "Reading paths on %s from %s", hostinfo, docroot);
+	return APR_SUCCESS;
+}
+
+char * mfs_local_path(mfs_file_system *file_system, const char *path, apr_pool_t *pool) {
+	if(apr_hash_count(file_system->local_docroots) == 0) {
+		return NULL;
+	}
+	apr_uri_t uri;
+	if((apr_uri_parse(pool, path, &uri) != APR_SUCCESS) || (uri.hostinfo == NULL) || (uri.path == NULL)) {
+		return NULL;
+	}
+	const char *docroot = apr_hash_get(file_system->local_docroots, uri.hostinfo, APR_HASH_KEY_STRING);
+	if((docroot == NULL) || (strstr(uri.path, "/../") != NULL)) {
+		return NULL;
+	}
+	return apr_pstrcat(pool, docroot, uri.path, NULL);
+}
+
+//is the host:port of path a local mogstored (no allocation so it can be used on every get)
+bool mfs_is_local_path(mfs_file_system *file_system, const char *path) {
+	const char *host = strstr(path, "://");
+	if(host == NULL) {
+		return false;
+	}
+	host += 3;
+	const char *end = strchr(host, '/');
+	return (end != NULL) && (apr_hash_get(file_system->local_docroots, host, end - host) != NULL);
+}
+
+void mfs_prefer_local_paths(mfs_file_system *file_system, char **paths, int path_count) {
+	if(apr_hash_count(file_system->local_docroots) == 0) {
+		return;
+	}
+	int i, j;
+	int next = 0; //where the next local path goes
+	for(i = 0; i < path_count; i++) {
+		if(mfs_is_local_path(file_system, paths[i])) {
+			char *local = paths[i];
+			for(j = i; j > next; j--) {
+				paths[j] = paths[j - 1];
+			}
+			paths[next++] = local;
+		}
+	}
+}
+
+apr_status_t mfs_local_file_open(const char *local_path, apr_file_t **file, apr_off_t *size, apr_pool_t *pool) {
+	apr_status_t rv;
+	if((rv = apr_file_open(file, local_path, APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_XTHREAD | APR_FOPEN_SENDFILE_ENABLED, APR_FPROT_OS_DEFAULT, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_DEBUG, rv, pool, "Unable to open local replica %s:", local_path);
+		return rv;
+	}
+	apr_finfo_t finfo;
+	if((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, *file)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to stat local replica %s:", local_path);
+		apr_file_close(*file);
+		return rv;
+	}
+	*size = finfo.size;
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_local_file_put(const char *local_path, void *bytes, long *total_bytes, apr_file_t *file, apr_pool_t *pool) {
+	apr_status_t rv;
+	//mogstored makes the directories for a put so we have to as well
+	char *directory = apr_pstrdup(pool, local_path);
+	char *last_slash = strrchr(directory, '/');
+	if(last_slash != NULL) {
+		*last_slash = '\0';
+		if((rv = apr_dir_make_recursive(directory, APR_FPROT_OS_DEFAULT, pool)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to create local device directory %s:", directory);
+			return rv;
+		}
+	}
+	//write to a temp name next to the final one so a reader never sees part of the file
+	apr_file_t *temp;
+	char *temp_path = apr_pstrcat(pool, local_path, ".XXXXXX", NULL);
+	if((rv = apr_file_mktemp(&temp, temp_path, APR_CREATE | APR_WRITE | APR_BINARY, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to create temp file for %s:", local_path);
+		return rv;
+	}
+	if(file == NULL) {
+		rv = apr_file_write_full(temp, bytes, *total_bytes, NULL);
+	} else {
+		char buffer[65536];
+		apr_size_t len;
+		long written = 0;
+		while(rv == APR_SUCCESS) {
+			len = sizeof(buffer);
+			if((rv = apr_file_read(file, buffer, &len)) == APR_SUCCESS) {
+				rv = apr_file_write_full(temp, buffer, len, NULL);
+				written += len;
+			}
+		}
+		if(APR_STATUS_IS_EOF(rv)) {
+			rv = APR_SUCCESS;
+			*total_bytes = written;
+		}
+	}
+	if(rv == APR_SUCCESS) {
+		rv = apr_file_sync(temp);
+	}
+	apr_file_close(temp);
+	if(rv == APR_SUCCESS) {
+		apr_file_perms_set(temp_path, APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_GREAD | APR_FPROT_WREAD); //mkstemp makes it 0600
+		rv = apr_file_rename(temp_path, local_path, pool);
+	}
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to write local replica %s:", local_path);
+		apr_file_remove(temp_path, pool);
+	}
+	return rv;
+}
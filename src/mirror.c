@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+a local copy of a domain (or the keys under a prefix).
+a resync lists the keys and queues a fetch for each one. worker threads run the queue: a fetch compares the fid from get_paths
+with the fid of the local copy and only downloads when they differ, so a resync of an unchanged mirror costs a get_paths per key.
+after the initial sync the invalidation dispatcher's events queue fetches and removes, and a reconnect of the watch (events may
+have been missed) queues another resync.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <stdlib.h>
+
+#define MFS_MIRROR_INDEX_INTERVAL apr_time_from_sec(60) //least time between index writes while the mirror is running
+
+void mfs_mirror_read_index(mfs_mirror *mirror);
+void mfs_mirror_write_index(mfs_mirror *mirror, apr_pool_t *pool);
+
+apr_status_t mfs_start_mirror(mfs_file_system *file_system, const char *domain, const char *prefix, const char *directory, int thread_count, apr_off_t max_bytes_per_sec, mfs_mirror **mirror) {
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_mirror *m = apr_pcalloc(p, sizeof(mfs_mirror));
+	m->file_system = file_system;
+	m->pool = p;
+	m->domain = apr_pstrdup(p, domain);
+	m->prefix = apr_pstrdup(p, (prefix == NULL) ? "" : prefix);
+	apr_size_t length = strlen(directory);
+	while((length > 1) && (directory[length - 1] == '/')) {
+		length--;
+	}
+	m->directory = apr_pstrndup(p, directory, length);
+	m->thread_count = (thread_count > 0) ? thread_count : DEFAULT_MIRROR_THREADS;
+	m->max_bytes_per_sec = max_bytes_per_sec;
+	if((rv = apr_dir_make_recursive(m->directory, APR_FPROT_OS_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, p, "Unable to create mirror directory %s:", m->directory);
+		apr_pool_destroy(p);
+		return rv;
+	}
+	if((rv = apr_pool_create(&m->fids_pool, p)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	m->fids = apr_hash_make(m->fids_pool);
+	m->unconfirmed = apr_hash_make(m->fids_pool);
+	mfs_mirror_read_index(m);
+	apr_thread_mutex_create(&m->lock, APR_THREAD_MUTEX_UNNESTED, p);
+	apr_thread_cond_create(&m->cond, p);
+	apr_thread_cond_create(&m->idle_cond, p);
+	m->running = true;
+	m->threads = apr_pcalloc(p, sizeof(apr_thread_t *) * m->thread_count);
+	apr_threadattr_t *thd_attr;
+	apr_threadattr_create(&thd_attr, p);
+	int i;
+	for(i = 0; i < m->thread_count; i++) {
+		if((rv = apr_thread_create(&m->threads[i], thd_attr, mfs_mirror_thread, (void*)m, p)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_CRIT, rv, p, "Unable to start mfs_mirror_thread thread.:");
+			m->threads[i] = NULL;
+		}
+	}
+	//listen before listing so nothing that changes during the initial sync is missed
+	if(file_system->invalidation_dispatcher != NULL) {
+		mfs_add_invalidation_callback(file_system, mfs_mirror_invalidation_callback, m);
+	} else {
+		mfs_log(LOG_WARNING, "Mirror of %s started without the invalidation dispatcher: changes after the initial sync will not be followed", m->domain);
+	}
+	mfs_mirror_queue(m, MFS_MIRROR_RESYNC, "");
+	m->next = file_system->mirrors;
+	file_system->mirrors = m;
+	*mirror = m;
+	mfs_log(LOG_INFO, "Mirroring %s%s%s to %s. threads=%d, max_bytes_per_sec=%" APR_OFF_T_FMT, m->domain, (m->prefix[0] != '\0') ? " prefix " : "", m->prefix, m->directory, m->thread_count, max_bytes_per_sec);
+	return APR_SUCCESS;
+}
+
+void mfs_stop_mirror(mfs_mirror *mirror) {
+	mfs_file_system *file_system = mirror->file_system;
+	mfs_remove_invalidation_callback(file_system, mfs_mirror_invalidation_callback, mirror);
+	mfs_mirror **m;
+	for(m = &file_system->mirrors; *m != NULL; m = &(*m)->next) {
+		if(*m == mirror) {
+			*m = mirror->next;
+			break;
+		}
+	}
+	apr_thread_mutex_lock(mirror->lock);
+	mirror->running = false;
+	apr_thread_cond_broadcast(mirror->cond);
+	apr_thread_mutex_unlock(mirror->lock);
+	int i;
+	apr_status_t rv2;
+	for(i = 0; i < mirror->thread_count; i++) {
+		if(mirror->threads[i] != NULL) {
+			apr_thread_join(&rv2, mirror->threads[i]);
+		}
+	}
+	while(mirror->queue_head != NULL) {
+		mfs_mirror_task *task = mirror->queue_head;
+		mirror->queue_head = task->next;
+		free(task);
+	}
+	if(mirror->index_dirty) {
+		mfs_mirror_write_index(mirror, mirror->pool);
+	}
+	mfs_log(LOG_INFO, "Stopped mirroring %s to %s. fetched=%u (%" APR_OFF_T_FMT " bytes), current=%u, removed=%u, errors=%u", mirror->domain, mirror->directory, mirror->fetch_count, mirror->fetched_bytes, mirror->skip_count, mirror->remove_count, mirror->error_count);
+	apr_thread_mutex_destroy(mirror->lock);
+	apr_thread_cond_destroy(mirror->cond);
+	apr_thread_cond_destroy(mirror->idle_cond);
+	apr_pool_destroy(mirror->pool);
+}
+
+apr_status_t mfs_mirror_wait(mfs_mirror *mirror, apr_interval_time_t timeout) {
+	apr_time_t until = apr_time_now() + timeout;
+	apr_status_t rv = APR_SUCCESS;
+	apr_thread_mutex_lock(mirror->lock);
+	while((rv == APR_SUCCESS) && ((mirror->queue_head != NULL) || (mirror->busy > 0))) {
+		apr_time_t now = apr_time_now();
+		if(now >= until) {
+			rv = APR_TIMEUP;
+		} else {
+			apr_thread_cond_timedwait(mirror->idle_cond, mirror->lock, until - now);
+		}
+	}
+	apr_thread_mutex_unlock(mirror->lock);
+	return rv;
+}
+
+//keys are stored under their own names with just enough escaping to keep them inside the directory:
+//% is %25, a component that is empty or starts with . has that first character escaped (so names starting with . are free for the index and temp files)
+char * mfs_mirror_path(mfs_mirror *mirror, const char *key, apr_pool_t *pool) {
+	apr_size_t directory_length = strlen(mirror->directory);
+	char *path = apr_palloc(pool, directory_length + (strlen(key) * 4) + 8);
+	memcpy(path, mirror->directory, directory_length);
+	char *p = path + directory_length;
+	*p++ = '/';
+	if(key[0] == '/') {
+		key++;
+	}
+	bool component_start = true;
+	for(; *key != '\0'; key++) {
+		if(*key == '/') {
+			if(component_start) {
+				memcpy(p, "%2F", 3);
+				p += 3;
+			}
+			*p++ = '/';
+			component_start = true;
+			continue;
+		}
+		if(*key == '%') {
+			memcpy(p, "%25", 3);
+			p += 3;
+		} else if(component_start && (*key == '.')) {
+			memcpy(p, "%2E", 3);
+			p += 3;
+		} else {
+			*p++ = *key;
+		}
+		component_start = false;
+	}
+	if(component_start) {
+		memcpy(p, "%2F", 3);
+		p += 3;
+	}
+	*p = '\0';
+	return path;
+}
+
+bool mfs_mirror_matches(mfs_mirror *mirror, const char *domain, const char *key) {
+	return (strcmp(mirror->domain, domain) == 0) && (strncmp(mirror->prefix, key, strlen(mirror->prefix)) == 0);
+}
+
+apr_status_t mfs_mirror_open(mfs_file_system *file_system, const char *domain, const char *key, apr_file_t **file, apr_off_t *size, apr_pool_t *pool) {
+	mfs_mirror *mirror;
+	for(mirror = file_system->mirrors; mirror != NULL; mirror = mirror->next) {
+		if(!mfs_mirror_matches(mirror, domain, key)) {
+			continue;
+		}
+		apr_thread_mutex_lock(mirror->lock);
+		bool current = (apr_hash_get(mirror->fids, key, APR_HASH_KEY_STRING) != NULL);
+		apr_thread_mutex_unlock(mirror->lock);
+		if(current && (mfs_local_file_open(mfs_mirror_path(mirror, key, pool), file, size, pool) == APR_SUCCESS)) {
+			return APR_SUCCESS;
+		}
+	}
+	return APR_ENOENT;
+}
+
+//the caller holds the lock
+void mfs_mirror_queue_locked(mfs_mirror *mirror, int operation, const char *key) {
+	apr_size_t key_length = strlen(key);
+	mfs_mirror_task *task = malloc(sizeof(mfs_mirror_task) + key_length + 1);
+	if(task == NULL) {
+		mfs_log(LOG_CRIT, "Unable to allocate mirror task for %s", key);
+		apr_atomic_inc32(&mirror->error_count);
+		return;
+	}
+	task->operation = operation;
+	task->key = (char *)(task + 1);
+	memcpy(task->key, key, key_length + 1);
+	task->next = NULL;
+	if(mirror->queue_tail == NULL) {
+		mirror->queue_head = task;
+	} else {
+		mirror->queue_tail->next = task;
+	}
+	mirror->queue_tail = task;
+	//throttled workers wait on the same condition so they all have to be woken
+	apr_thread_cond_broadcast(mirror->cond);
+}
+
+apr_status_t mfs_mirror_queue(mfs_mirror *mirror, int operation, const char *key) {
+	apr_status_t rv = apr_thread_mutex_lock(mirror->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock mirror mutex:");
+		return rv;
+	}
+	mfs_mirror_queue_locked(mirror, operation, key);
+	apr_thread_mutex_unlock(mirror->lock);
+	return APR_SUCCESS;
+}
+
+//the caller holds the lock
+void mfs_mirror_set_fid(mfs_mirror *mirror, apr_hash_t *fids, const char *key, apr_int64_t fid) {
+	apr_int64_t *value = apr_hash_get(fids, key, APR_HASH_KEY_STRING);
+	if(value == NULL) {
+		value = apr_palloc(mirror->fids_pool, sizeof(apr_int64_t));
+		apr_hash_set(fids, apr_pstrdup(mirror->fids_pool, key), APR_HASH_KEY_STRING, value);
+	}
+	*value = fid;
+	mirror->index_dirty = true;
+}
+
+//stop serving key until a fetch has checked it (the copy is kept in case the fid has not changed)
+void mfs_mirror_forget(mfs_mirror *mirror, const char *key) {
+	apr_thread_mutex_lock(mirror->lock);
+	apr_int64_t *fid = apr_hash_get(mirror->fids, key, APR_HASH_KEY_STRING);
+	if(fid != NULL) {
+		mfs_mirror_set_fid(mirror, mirror->unconfirmed, key, *fid);
+		apr_hash_set(mirror->fids, key, APR_HASH_KEY_STRING, NULL);
+	}
+	apr_thread_mutex_unlock(mirror->lock);
+}
+
+void mfs_mirror_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool) {
+	mfs_mirror *mirror = (mfs_mirror *)data;
+	if(event->operation == MFS_INVALIDATE_ALL) {
+		mfs_mirror_queue(mirror, MFS_MIRROR_RESYNC, "");
+		return;
+	}
+	if((event->operation == MFS_INVALIDATE_PATH) || (strcmp(mirror->domain, event->domain) != 0)) {
+		return;
+	}
+	if((event->operation == MFS_INVALIDATE_RENAME) && mfs_mirror_matches(mirror, event->domain, event->to_key)) {
+		mfs_mirror_forget(mirror, event->to_key);
+		mfs_mirror_queue(mirror, MFS_MIRROR_FETCH, event->to_key);
+	}
+	if(!mfs_mirror_matches(mirror, event->domain, event->key)) {
+		return;
+	}
+	mfs_mirror_forget(mirror, event->key);
+	if((event->operation == MFS_INVALIDATE_DELETE) || (event->operation == MFS_INVALIDATE_RENAME)) {
+		mfs_mirror_queue(mirror, MFS_MIRROR_REMOVE, event->key);
+	} else {
+		mfs_mirror_queue(mirror, MFS_MIRROR_FETCH, event->key);
+	}
+}
+
+//sleep until the bytes fetched so far are within max_bytes_per_sec
+void mfs_mirror_throttle(mfs_mirror *mirror, apr_off_t bytes) {
+	apr_off_t rate = mirror->max_bytes_per_sec;
+	if(rate <= 0) {
+		return;
+	}
+	apr_thread_mutex_lock(mirror->lock);
+	apr_time_t now = apr_time_now();
+	apr_time_t due = mirror->throttle_start + (apr_time_t)(mirror->throttle_bytes * APR_USEC_PER_SEC / rate);
+	if(due < now - apr_time_from_sec(1)) {
+		//we have been under the rate (or idle): don't let the unused allowance build up
+		mirror->throttle_start = now;
+		mirror->throttle_bytes = 0;
+	}
+	mirror->throttle_bytes += bytes;
+	due = mirror->throttle_start + (apr_time_t)(mirror->throttle_bytes * APR_USEC_PER_SEC / rate);
+	while(mirror->running && ((now = apr_time_now()) < due)) {
+		apr_thread_cond_timedwait(mirror->cond, mirror->lock, due - now);
+	}
+	apr_thread_mutex_unlock(mirror->lock);
+}
+
+apr_status_t mfs_mirror_remove(mfs_mirror *mirror, const char *key, apr_pool_t *pool) {
+	apr_thread_mutex_lock(mirror->lock);
+	apr_hash_set(mirror->fids, key, APR_HASH_KEY_STRING, NULL);
+	apr_hash_set(mirror->unconfirmed, key, APR_HASH_KEY_STRING, NULL);
+	mirror->index_dirty = true;
+	apr_thread_mutex_unlock(mirror->lock);
+	char *local_path = mfs_mirror_path(mirror, key, pool);
+	apr_status_t rv = apr_file_remove(local_path, pool);
+	if(rv == APR_SUCCESS) {
+		apr_atomic_inc32(&mirror->remove_count);
+	} else if(!APR_STATUS_IS_ENOENT(rv)) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to remove mirrored %s:", local_path);
+		return rv;
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_mirror_fetch(mfs_mirror *mirror, const char *key, apr_pool_t *pool) {
+	mfs_file_system *file_system = mirror->file_system;
+	char **paths;
+	int path_count;
+	//the mirror's own lookups are not accesses so they don't make keys hot
+	bool promote = (file_system->hot_keys == NULL) || mfs_hot_keys_is_hot(file_system->hot_keys, mirror->domain, key);
+	apr_status_t rv = mfs_get_paths_cached(file_system, mirror->domain, key, true, promote, &paths, &path_count, pool);
+	if(rv == APR_EBADPATH) { //deleted since it was queued
+		return mfs_mirror_remove(mirror, key, pool);
+	} else if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get paths for mirrored %s.%s:", mirror->domain, key);
+		return rv;
+	}
+	apr_int64_t fid = (path_count > 0) ? mfs_fid_from_path(paths[0]) : -1;
+	char *local_path = mfs_mirror_path(mirror, key, pool);
+	apr_thread_mutex_lock(mirror->lock);
+	apr_int64_t *current = apr_hash_get(mirror->fids, key, APR_HASH_KEY_STRING);
+	if(current == NULL) {
+		current = apr_hash_get(mirror->unconfirmed, key, APR_HASH_KEY_STRING);
+	}
+	bool same = (current != NULL) && (fid >= 0) && (*current == fid);
+	if(!same) {
+		apr_hash_set(mirror->fids, key, APR_HASH_KEY_STRING, NULL);
+	}
+	apr_thread_mutex_unlock(mirror->lock);
+	apr_finfo_t finfo;
+	if(same && (apr_stat(&finfo, local_path, APR_FINFO_TYPE, pool) == APR_SUCCESS) && (finfo.filetype == APR_REG)) {
+		apr_thread_mutex_lock(mirror->lock);
+		apr_hash_set(mirror->unconfirmed, key, APR_HASH_KEY_STRING, NULL);
+		mfs_mirror_set_fid(mirror, mirror->fids, key, fid);
+		apr_atomic_inc32(&mirror->skip_count);
+		apr_thread_mutex_unlock(mirror->lock);
+		return APR_SUCCESS;
+	}
+	char *directory = apr_pstrdup(pool, local_path);
+	char *name = strrchr(directory, '/');
+	*name++ = '\0';
+	if((rv = apr_dir_make_recursive(directory, APR_FPROT_OS_DEFAULT, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to create mirror directory %s:", directory);
+		return rv;
+	}
+	//download next to the final name so readers of the directory never see part of a file
+	apr_file_t *temp;
+	char *temp_path = apr_pstrcat(pool, directory, "/.", name, ".XXXXXX", NULL);
+	if((rv = apr_file_mktemp(&temp, temp_path, APR_CREATE | APR_WRITE | APR_BINARY, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to create temp file for %s:", local_path);
+		return rv;
+	}
+	apr_size_t total_bytes = 0;
+	rv = mfs_get_file(file_system, mirror->domain, (char *)key, &total_bytes, &temp, pool, -1);
+	apr_file_close(temp);
+	if(rv == APR_SUCCESS) {
+		apr_file_perms_set(temp_path, APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_GREAD | APR_FPROT_WREAD); //mkstemp makes it 0600
+		rv = apr_file_rename(temp_path, local_path, pool);
+	}
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to mirror %s.%s to %s:", mirror->domain, key, local_path);
+		apr_file_remove(temp_path, pool);
+		return rv;
+	}
+	apr_thread_mutex_lock(mirror->lock);
+	apr_hash_set(mirror->unconfirmed, key, APR_HASH_KEY_STRING, NULL);
+	mfs_mirror_set_fid(mirror, mirror->fids, key, fid);
+	apr_atomic_inc32(&mirror->fetch_count);
+	mirror->fetched_bytes += total_bytes;
+	apr_thread_mutex_unlock(mirror->lock);
+	mfs_mirror_throttle(mirror, total_bytes);
+	return APR_SUCCESS;
+}
+
+//queue a fetch for every key and a remove for every mirrored key that was not listed
+apr_status_t mfs_mirror_resync(mfs_mirror *mirror, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_pool_t *page_pool;
+	if((rv = apr_pool_create(&page_pool, pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	apr_hash_t *listed = apr_hash_make(pool);
+	char *after = NULL;
+	char *previous;
+	char **keys;
+	int key_count;
+	char *next_after;
+	const char *prefix = (mirror->prefix[0] == '\0') ? NULL : mirror->prefix;
+	do {
+		if((rv = mfs_list_keys(mirror->file_system, mirror->domain, prefix, after, MFS_LIST_KEYS_LIMIT, &keys, &key_count, &next_after, page_pool)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to list keys to mirror %s:", mirror->domain);
+			break;
+		}
+		int i;
+		apr_thread_mutex_lock(mirror->lock);
+		for(i = 0; i < key_count; i++) {
+			char *key = apr_pstrdup(pool, keys[i]);
+			apr_hash_set(listed, key, APR_HASH_KEY_STRING, key);
+			mfs_mirror_queue_locked(mirror, MFS_MIRROR_FETCH, key);
+		}
+		apr_thread_mutex_unlock(mirror->lock);
+		previous = after;
+		after = (next_after == NULL) ? NULL : apr_pstrdup(pool, next_after);
+		apr_pool_clear(page_pool);
+	} while(mirror->running && (key_count > 0) && (after != NULL) && ((previous == NULL) || (strcmp(previous, after) != 0)));
+	apr_pool_destroy(page_pool);
+	if((rv != APR_SUCCESS) || !mirror->running) { //don't remove anything on a partial listing
+		return rv;
+	}
+	apr_thread_mutex_lock(mirror->lock);
+	apr_hash_t *mirrored[2] = {mirror->fids, mirror->unconfirmed};
+	int m;
+	for(m = 0; m < 2; m++) {
+		apr_hash_index_t *hi;
+		const void *key;
+		for(hi = apr_hash_first(pool, mirrored[m]); hi; hi = apr_hash_next(hi)) {
+			apr_hash_this(hi, &key, NULL, NULL);
+			if(apr_hash_get(listed, key, APR_HASH_KEY_STRING) == NULL) {
+				mfs_mirror_queue_locked(mirror, MFS_MIRROR_REMOVE, key);
+			}
+		}
+	}
+	apr_thread_mutex_unlock(mirror->lock);
+	mfs_log(LOG_INFO, "Resync of mirror %s listed %u keys", mirror->domain, apr_hash_count(listed));
+	return APR_SUCCESS;
+}
+
+void mfs_mirror_read_index(mfs_mirror *mirror) {
+	apr_file_t *file;
+	char *index_path = apr_pstrcat(mirror->pool, mirror->directory, "/" MFS_MIRROR_INDEX, NULL);
+	if(apr_file_open(&file, index_path, APR_FOPEN_READ | APR_FOPEN_BUFFERED, APR_FPROT_OS_DEFAULT, mirror->pool) != APR_SUCCESS) {
+		return; //a new mirror
+	}
+	char line[8192];
+	while(apr_file_gets(line, sizeof(line), file) == APR_SUCCESS) {
+		char *tab = strchr(line, '\t');
+		char *end = strchr(line, '\n');
+		if((tab == NULL) || (end == NULL) || (strspn(line, "0123456789") != (apr_size_t)(tab - line))) {
+			continue;
+		}
+		*end = '\0';
+		//nothing is served until a resync has checked it
+		mfs_mirror_set_fid(mirror, mirror->unconfirmed, tab + 1, apr_atoi64(line));
+	}
+	apr_file_close(file);
+	mirror->index_dirty = false;
+	mfs_log(LOG_INFO, "Read %u keys from the index of mirror %s", apr_hash_count(mirror->unconfirmed), mirror->directory);
+}
+
+//the caller holds the lock (or the threads are stopped). the fids are copied to a new pool so removed keys are freed
+void mfs_mirror_write_index(mfs_mirror *mirror, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_pool_t *fids_pool;
+	if((rv = apr_pool_create(&fids_pool, mirror->pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return;
+	}
+	apr_file_t *file;
+	char *index_path = apr_pstrcat(pool, mirror->directory, "/" MFS_MIRROR_INDEX, NULL);
+	char *temp_path = apr_pstrcat(pool, index_path, ".XXXXXX", NULL);
+	if((rv = apr_file_mktemp(&file, temp_path, APR_CREATE | APR_WRITE | APR_BINARY | APR_BUFFERED, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to create temp file for %s:", index_path);
+		apr_pool_destroy(fids_pool);
+		return;
+	}
+	apr_hash_t *mirrored[2] = {mirror->fids, mirror->unconfirmed};
+	apr_hash_t *copies[2] = {apr_hash_make(fids_pool), apr_hash_make(fids_pool)};
+	int m;
+	for(m = 0; m < 2; m++) {
+		apr_hash_index_t *hi;
+		const void *key;
+		void *value;
+		for(hi = apr_hash_first(pool, mirrored[m]); hi; hi = apr_hash_next(hi)) {
+			apr_hash_this(hi, &key, NULL, &value);
+			apr_int64_t *fid = apr_palloc(fids_pool, sizeof(apr_int64_t));
+			*fid = *(apr_int64_t *)value;
+			apr_hash_set(copies[m], apr_pstrdup(fids_pool, key), APR_HASH_KEY_STRING, fid);
+			if(rv == APR_SUCCESS) {
+				rv = apr_file_printf(file, "%" APR_INT64_T_FMT "\t%s\n", *fid, (const char *)key) < 0 ? APR_EGENERAL : APR_SUCCESS;
+			}
+		}
+	}
+	if(rv == APR_SUCCESS) {
+		rv = apr_file_flush(file);
+	}
+	apr_file_close(file);
+	if(rv == APR_SUCCESS) {
+		rv = apr_file_rename(temp_path, index_path, pool);
+	}
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to write mirror index %s:", index_path);
+		apr_file_remove(temp_path, pool);
+	}
+	apr_pool_destroy(mirror->fids_pool);
+	mirror->fids_pool = fids_pool;
+	mirror->fids = copies[0];
+	mirror->unconfirmed = copies[1];
+	mirror->index_dirty = false;
+	mirror->index_written = apr_time_now();
+}
+
+void* APR_THREAD_FUNC mfs_mirror_thread(apr_thread_t *thd, void *data) {
+	mfs_mirror *mirror = (mfs_mirror *)data;
+	apr_pool_t *task_pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&task_pool, NULL)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to create apr_pool");
+		apr_thread_exit(thd, rv);
+		return NULL;
+	}
+	apr_thread_mutex_lock(mirror->lock);
+	while(mirror->running) {
+		mfs_mirror_task *task = mirror->queue_head;
+		if(task == NULL) {
+			apr_thread_cond_wait(mirror->cond, mirror->lock);
+			continue;
+		}
+		mirror->queue_head = task->next;
+		if(mirror->queue_head == NULL) {
+			mirror->queue_tail = NULL;
+		}
+		mirror->busy++;
+		apr_thread_mutex_unlock(mirror->lock);
+		switch(task->operation) {
+			case MFS_MIRROR_FETCH:
+				rv = mfs_mirror_fetch(mirror, task->key, task_pool);
+				break;
+			case MFS_MIRROR_REMOVE:
+				rv = mfs_mirror_remove(mirror, task->key, task_pool);
+				break;
+			default:
+				rv = mfs_mirror_resync(mirror, task_pool);
+		}
+		free(task);
+		apr_pool_clear(task_pool);
+		apr_thread_mutex_lock(mirror->lock);
+		if(rv != APR_SUCCESS) {
+			apr_atomic_inc32(&mirror->error_count);
+		}
+		mirror->busy--;
+		if((mirror->queue_head == NULL) && (mirror->busy == 0)) {
+			if(mirror->index_dirty && (apr_time_now() - mirror->index_written >= MFS_MIRROR_INDEX_INTERVAL)) {
+				mfs_mirror_write_index(mirror, task_pool);
+				apr_pool_clear(task_pool);
+			}
+			apr_thread_cond_broadcast(mirror->idle_cond);
+		}
+	}
+	apr_thread_mutex_unlock(mirror->lock);
+	apr_pool_destroy(task_pool);
+	apr_thread_exit(thd, APR_SUCCESS);
+	return NULL;
+}
@@ -31,6 +31,7 @@
 #include <apr_uri.h>
 #include <apr_buckets.h>
 #include <apr_file_io.h>
+#include <apr_shm.h>
 /*
 ===================================================================
 TRACKER STUFF
@@ -239,10 +240,14 @@ typedef struct {
 	apr_size_t cnt;
 	char *client_id;
 	int client_id_length;
+	volatile bool stopped; //set by stop_watch to break out of a blocking read
+	bool return_on_timeout; //return APR_TIMEUP from get_next_watch_line when no data arrives (instead of waiting)
+	unsigned int connect_count; //number of times the watch has (re)connected
 } watch_data;
 
 void stop_watching();
 void enable_watching();
+void stop_watch(watch_data *watch);
 
 watch_data * init_watch(int tracket_index, tracker_pool *trackers, apr_pool_t *pool, char *client_id);
 apr_status_t get_next_watch_line(watch_data *watch, char *buf, int len);
@@ -271,6 +276,7 @@ FS Client
 #define DEFAULT_TRACKER_TIMEOUT apr_time_from_sec(2)
 #define DEFAULT_FILE_SERVER_TIMEOUT apr_time_from_sec(2)
 #define DEFAULT_MAX_BUFFER_SIZE (100 * 1024)
+#define MFS_MADE_DIRECTORIES_MAX 4096
 #define MAX_ALLOWED_PATHS 100
 #define MAX_ALLOWED_DIRECTORY_ENTRIES 32000
 
@@ -279,14 +285,25 @@ typedef struct _mfs_http_connection {
 	CURL *curl; //the Curl handle that manages the http stuff
 } mfs_http_connection;
 
+//what we have seen of a file server's transfers (only kept with replica ranking). moving averages, guarded by mfs_file_server.stats_lock
+typedef struct {
+	double ttfb; //seconds to the first byte
+	double throughput; //bytes per second after the first byte
+	double error_rate; //0 - 1
+	unsigned long samples;
+} mfs_host_stats;
+
 //used to pool http connections for keep-alive
 typedef struct {
 	apr_reslist_t *connections;
 	char *url; //i.e http://some.local.address:port
+	apr_thread_mutex_t *stats_lock;
+	mfs_host_stats stats;
+	volatile apr_uint32_t downloads; //in flight
 } mfs_file_server;
 
 //threadsafe handle to the file system
-typedef struct {
+typedef struct _mfs_file_system {
 	volatile int max_retries;
 	volatile apr_interval_time_t retry_timeout; //in microseconds - wait between upload retries
 	volatile apr_interval_time_t tracker_timeout; //microseconds
@@ -298,6 +315,24 @@ typedef struct {
 	apr_hash_t *file_servers; //hash of mfs_http_server to cache connections so we can use keep-alive
 	//client_id is sent with requests that cause cache invalidations so we can safely ignore cache invalidations caused by out own requests
 	char *client_id;
+	struct _mfs_metadata_cache *metadata_cache; //optional get_paths/path_info cache (NULL if disabled)
+	struct _mfs_shm_cache *shm_cache; //optional get_paths cache shared between processes (NULL if disabled)
+	struct _mfs_invalidation_dispatcher *invalidation_dispatcher; //optional watch thread that applies cache invalidations (NULL if not started)
+	struct _mfs_content_cache *content_cache; //optional cache of small file contents (NULL if disabled)
+	struct _mfs_disk_cache *disk_cache; //optional on disk cache of large file contents shared between processes (NULL if disabled)
+	struct _mfs_block_cache *block_cache; //optional cache of fixed size blocks for random access reads (NULL if disabled)
+	apr_hash_t *local_docroots; //hostinfo (host:port) of mogstored instances on this machine -> their docroot
+	struct _mfs_mirror *mirrors; //local copies of domains (NULL if none)
+	struct _mfs_hot_keys *hot_keys; //optional access counting that decides what is cached (NULL if disabled)
+	apr_hash_t *bloom_filters; //domain -> mfs_bloom_filter for domains with an existence filter
+	struct _mfs_parallel_download *parallel_download; //optional split of large downloads to files into concurrent ranges (NULL if disabled)
+	struct _mfs_hedge *hedge; //optional second request to another replica when the first is slow to respond (NULL if disabled)
+	struct _mfs_replica_ranking *replica_ranking; //optional reordering of paths by how their file servers have performed (NULL if disabled)
+	struct _mfs_load_balancer *load_balancer; //optional choice of the least busy of two replicas for hot keys (NULL if disabled)
+	struct _mfs_slab_arena *slab_arena; //optional recycled buffers for downloads kept in a brigade (NULL if disabled)
+	apr_thread_mutex_t *made_directories_lock;
+	apr_hash_t *made_directories; //parent directories of destination files that have been made: they are not made again
+	apr_pool_t *made_directories_pool; //cleared with the hash when it holds MFS_MADE_DIRECTORIES_MAX
 } mfs_file_system;
 
 //init the file system
@@ -309,6 +344,8 @@ apr_status_t mfs_get_file_server(mfs_file_system *file_system, apr_uri_t *uri, m
 
 //the paths are allocated from the pool passed in
 apr_status_t mfs_get_paths(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, char ***paths, int *path_count, apr_pool_t *pool);
+//mfs_get_paths without counting the access for hot key detection. the result is only cached if promote is true
+apr_status_t mfs_get_paths_cached(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, bool promote, char ***paths, int *path_count, apr_pool_t *pool);
 
 apr_status_t mfs_delete(mfs_file_system *file_system, const char *domain, const char *key, apr_pool_t *pool);
 apr_status_t mfs_sleep(mfs_file_system *file_system, int duration, apr_pool_t *pool);
@@ -323,6 +360,10 @@ apr_status_t mfs_create_directory(mfs_file_system *file_system, const char *doma
 apr_status_t mfs_create_link(mfs_file_system *file_system, const char *domain, const char *key, const char *link, apr_pool_t *pool, long long *server_id);
 //set the modification time (filepaths plugin)
 apr_status_t mfs_set_mtime(mfs_file_system *file_system, const char *domain, const char *key, apr_time_t mtime, apr_pool_t *pool);
+//list up to limit keys starting with prefix (NULL for all) in key order after the key after (NULL to start at the beginning).
+//next_after is the key to pass as after for the next page. key_count is 0 at the end of the listing
+#define MFS_LIST_KEYS_LIMIT 1000
+apr_status_t mfs_list_keys(mfs_file_system *file_system, const char *domain, const char *prefix, const char *after, int limit, char ***keys, int *key_count, char **next_after, apr_pool_t *pool);
 
 
 //FilePaths Plugin Calls
@@ -385,9 +426,1010 @@ apr_status_t mfs_file_server_get(mfs_file_system *file_system, apr_uri_t *uri, c
 apr_status_t mfs_get_file(mfs_file_system *file_system, char *domain, char *key, apr_size_t *total_bytes, apr_file_t **file, apr_pool_t *pool, long requiredLength);
 
 //return the file in a byte buffer if the file is small enough (file_system.max_buffer_size)
+//if the content cache is enabled the bytes may be shared with the cache: they are valid for the life of pool and must not be modified
 apr_status_t mfs_get_file_or_bytes(mfs_file_system *file_system, char *domain, char *key, apr_size_t *total_bytes, void **bytes, apr_file_t **file, apr_pool_t *pool, char *destination_file_path, long requiredLength);
 
+//download the file into the caller's buffer. APR_ENOSPC if it is larger than buffer_size
+apr_status_t mfs_get_into(mfs_file_system *file_system, char *domain, char *key, void *buffer, apr_size_t buffer_size, apr_size_t *total_bytes, apr_pool_t *pool);
+
 //store the file in a bucket brigade
 apr_status_t mfs_get_brigade(mfs_file_system *file_system, char *domain, char *key, apr_size_t *total_bytes, apr_bucket_brigade *brigade, apr_pool_t *pool, long requiredLength);
 
+//the length bytes at offset of a file (fewer if the file ends first, none if it starts past the end) with a Range request.
+//fails over across the replicas. a reply must be a 206 whose Content-Range matches the request (or a 200 if offset is 0)
+apr_status_t mfs_get_range_bytes(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, void **bytes, apr_size_t *total_bytes, apr_pool_t *pool);
+//the range in a file: the caller's if *file is not NULL (written from its current position), otherwise a new temp file
+apr_status_t mfs_get_range_file(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, apr_size_t *total_bytes, apr_file_t **file, apr_pool_t *pool);
+//the range appended to a bucket brigade
+apr_status_t mfs_get_range_brigade(mfs_file_system *file_system, char *domain, char *key, apr_off_t offset, apr_size_t length, apr_size_t *total_bytes, apr_bucket_brigade *brigade, apr_pool_t *pool);
+
+#define MFS_STREAM_BLOCK_SIZE (64 * 1024) //local copies are streamed in blocks of this size
+
+//given each block of a streamed download as it arrives. data is only valid during the call. anything but APR_SUCCESS stops the download
+typedef apr_status_t (*mfs_stream_callback)(void *ctx, const char *data, apr_size_t length);
+//pass the file to callback without buffering it. if a replica fails the next one carries on from the last byte delivered (with a Range
+//request, or by skipping what was delivered if the server ignores it) so callback never sees a byte twice. total_bytes is what was
+//delivered, even on failure
+apr_status_t mfs_get_stream(mfs_file_system *file_system, char *domain, char *key, mfs_stream_callback callback, void *ctx, apr_size_t *total_bytes, apr_pool_t *pool);
+
+
+/*
+===================================================================
+METADATA CACHE (in cache.c)
+===================================================================
+*/
+#define DEFAULT_METADATA_CACHE_MAX_ENTRIES 100000
+#define DEFAULT_METADATA_CACHE_TTL apr_time_from_sec(60)
+#define DEFAULT_METADATA_CACHE_STALE_TIME apr_time_from_sec(300)
+#define DEFAULT_METADATA_CACHE_REFRESH_AHEAD apr_time_from_sec(10)
+#define DEFAULT_METADATA_CACHE_HOT_HITS 3
+
+//cache entry types
+#define MFS_CACHE_PATHS 0
+#define MFS_CACHE_PATH_INFO 1
+
+//cache lookup results
+#define MFS_CACHE_MISS 0
+#define MFS_CACHE_HIT 1
+#define MFS_CACHE_STALE 2 //expired but still inside the stale window
+#define MFS_CACHE_NEGATIVE 3 //known not to exist (we deleted it)
+
+typedef struct _mfs_metadata_cache_entry {
+	APR_RING_ENTRY(_mfs_metadata_cache_entry) link; //lru list: most recently used at the head
+	char *cache_key; //type byte + domain + \0 + key
+	apr_size_t cache_key_length;
+	unsigned char type; //MFS_CACHE_PATHS or MFS_CACHE_PATH_INFO
+	char *domain; //points into cache_key
+	char *key; //points into cache_key
+	char **paths;
+	int path_count;
+	mfs_filepath_entry info;
+	apr_time_t expires_at;
+	unsigned int hits; //hits since the entry was (re)loaded: used to decide if it is hot
+	bool refreshing; //a refresh-ahead has been queued
+	bool negative; //the key was deleted: no paths/info
+} mfs_metadata_cache_entry;
+
+typedef struct _mfs_metadata_cache_lru mfs_metadata_cache_lru;
+APR_RING_HEAD(_mfs_metadata_cache_lru, _mfs_metadata_cache_entry);
+
+//a queued refresh-ahead request (malloc'd so it can outlive the entry)
+typedef struct _mfs_metadata_cache_refresh {
+	unsigned char type;
+	char *domain;
+	char *key;
+	struct _mfs_metadata_cache_refresh *next;
+} mfs_metadata_cache_refresh;
+
+typedef struct _mfs_metadata_cache {
+	mfs_file_system *file_system;
+	apr_pool_t *pool;
+	apr_thread_mutex_t *lock; //guards entries, lru and the refresh queue
+	apr_hash_t *entries;
+	mfs_metadata_cache_lru *lru;
+	int entry_count;
+	volatile int max_entries;
+	volatile apr_interval_time_t ttl; //how long an entry is fresh
+	volatile apr_interval_time_t stale_time; //how long past expiry an entry may be served when the trackers are unreachable (0 to disable)
+	volatile apr_interval_time_t refresh_ahead; //hot entries are refreshed this long before they expire (0 to disable)
+	volatile unsigned int hot_hits; //hits before an entry is considered hot
+	mfs_metadata_cache_refresh *refresh_head;
+	mfs_metadata_cache_refresh *refresh_tail;
+	apr_thread_mutex_t *refresh_mutex; //used to stop/start refresh thread quickly
+	apr_thread_cond_t *refresh_cond;
+	apr_thread_t *refresh_thread;
+	volatile bool running;
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hit_count;
+	volatile apr_uint32_t miss_count;
+	volatile apr_uint32_t stale_count;
+	volatile apr_uint32_t refresh_count;
+	//snapshot (see snapshot.c). the index and map are guarded by lock
+	char *snapshot_file; //NULL if snapshots are disabled
+	volatile apr_interval_time_t snapshot_interval; //0 to only save on destroy
+	apr_time_t next_snapshot;
+	apr_pool_t *snapshot_pool; //holds the mapped snapshot and its index
+	apr_hash_t *snapshot_index; //cache key -> snapshot record that has not been looked up yet (NULL if nothing is loaded)
+	volatile apr_uint32_t snapshot_load_count; //entries taken from the snapshot
+} mfs_metadata_cache;
+
+//turn on the metadata cache for get_paths and path_info (must be called before the file system is shared between threads)
+apr_status_t mfs_enable_metadata_cache(mfs_file_system *file_system, int max_entries, apr_interval_time_t ttl, apr_interval_time_t stale_time, apr_interval_time_t refresh_ahead);
+void mfs_metadata_cache_destroy(mfs_metadata_cache *cache);
+
+//lookups copy the result into pool. Returns MFS_CACHE_MISS, MFS_CACHE_HIT or MFS_CACHE_STALE
+int mfs_metadata_cache_get_paths(mfs_metadata_cache *cache, const char *domain, const char *key, char ***paths, int *path_count, apr_pool_t *pool);
+int mfs_metadata_cache_get_path_info(mfs_metadata_cache *cache, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, apr_pool_t *pool);
+void mfs_metadata_cache_put_paths(mfs_metadata_cache *cache, const char *domain, const char *key, char **paths, int path_count, apr_pool_t *pool);
+void mfs_metadata_cache_put_path_info(mfs_metadata_cache *cache, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, apr_pool_t *pool);
+void mfs_metadata_cache_remove(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *key, apr_pool_t *pool);
+//cache that domain/key does not exist (until ttl or an invalidation)
+void mfs_metadata_cache_put_negative(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *key, apr_pool_t *pool);
+//move from_key's entry to to_key and make from_key negative
+void mfs_metadata_cache_rename(mfs_metadata_cache *cache, unsigned char type, const char *domain, const char *from_key, const char *to_key, apr_pool_t *pool);
+//remove every entry (of both types) whose key starts with prefix
+void mfs_metadata_cache_remove_prefix(mfs_metadata_cache *cache, const char *domain, const char *prefix);
+//remove every get_paths entry that contains path
+void mfs_metadata_cache_remove_path(mfs_metadata_cache *cache, const char *path);
+void mfs_metadata_cache_clear(mfs_metadata_cache *cache);
+
+//refresh-ahead thread
+void mfs_metadata_cache_start_refresh_thread(mfs_metadata_cache *cache);
+void mfs_metadata_cache_stop_refresh_thread(mfs_metadata_cache *cache);
+void* APR_THREAD_FUNC mfs_metadata_cache_refresher(apr_thread_t *thd, void *data);
+//must be called with cache->lock held
+void mfs_metadata_cache_insert(mfs_metadata_cache *cache, mfs_metadata_cache_entry *entry);
+mfs_metadata_cache_entry * mfs_metadata_cache_entry_create(unsigned char type, const char *domain, const char *key, char **paths, int path_count, mfs_filepath_entry *info);
+
+/*
+===================================================================
+METADATA CACHE SNAPSHOT (in snapshot.c)
+===================================================================
+*/
+#define DEFAULT_METADATA_CACHE_SNAPSHOT_INTERVAL apr_time_from_sec(60)
+
+//save the cache to filename on destroy and every interval (0 for destroy only), and load filename now if it exists.
+//call straight after mfs_enable_metadata_cache so a restarted process starts warm
+apr_status_t mfs_metadata_cache_set_snapshot(mfs_metadata_cache *cache, const char *filename, apr_interval_time_t interval);
+apr_status_t mfs_metadata_cache_save_snapshot(mfs_metadata_cache *cache);
+apr_status_t mfs_metadata_cache_load_snapshot(mfs_metadata_cache *cache);
+//the rest must be called with cache->lock held
+//turn the snapshot record for cache_key into an entry (NULL if there is none or it is corrupt). the entry is not inserted
+mfs_metadata_cache_entry * mfs_metadata_cache_snapshot_take(mfs_metadata_cache *cache, const char *cache_key, apr_size_t cache_key_length, apr_pool_t *pool);
+void mfs_metadata_cache_snapshot_forget(mfs_metadata_cache *cache, const char *cache_key, apr_size_t cache_key_length);
+void mfs_metadata_cache_snapshot_forget_path(mfs_metadata_cache *cache, const char *path);
+void mfs_metadata_cache_snapshot_forget_prefix(mfs_metadata_cache *cache, const char *domain, const char *prefix);
+//unmap the snapshot and forget everything in it
+void mfs_metadata_cache_snapshot_discard(mfs_metadata_cache *cache);
+
+//tracker calls that bypass the cache. unavailable is set to true if no tracker could be reached
+apr_status_t mfs_get_paths_from_tracker(mfs_file_system *file_system, const char *domain, const char *key, bool noverify, char ***paths, int *path_count, bool *unavailable, apr_pool_t *pool);
+apr_status_t mfs_path_info_from_tracker(mfs_file_system *file_system, const char *domain, const char *path, mfs_filepath_entry *filepath_entry, bool *unavailable, apr_pool_t *pool);
+//keep the caches in step with our own writes so a read straight after a write does not need the tracker
+void mfs_cache_after_store(mfs_file_system *file_system, const char *domain, const char *key, char *put_url, apr_pool_t *pool);
+void mfs_cache_after_delete(mfs_file_system *file_system, const char *domain, const char *key, apr_pool_t *pool);
+void mfs_cache_after_rename(mfs_file_system *file_system, const char *domain, const char *from_key, const char *to_key, bool filepath, apr_pool_t *pool);
+
+/*
+===================================================================
+SHARED MEMORY PATH CACHE (in shm_cache.c)
+===================================================================
+*/
+#define DEFAULT_SHM_CACHE_SLOTS 65536
+#define DEFAULT_SHM_CACHE_TTL apr_time_from_sec(60)
+#define MFS_SHM_CACHE_SLOT_SIZE 1024 //bytes for domain, key and paths. entries that dont fit are not cached
+
+typedef struct _mfs_shm_cache {
+	apr_pool_t *pool;
+	apr_shm_t *shm;
+	char *filename;
+	bool created; //this file system created the segment
+	struct _mfs_shm_cache_header *header;
+	char *slots; //first slot in the segment
+	apr_uint32_t slot_count; //fixed when the segment is created
+	apr_uint32_t slot_size;
+	volatile apr_interval_time_t ttl;
+	//per process counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hit_count;
+	volatile apr_uint32_t miss_count;
+} mfs_shm_cache;
+
+//create (or attach to) the named segment filename. every process on the host using the same filename shares the cache.
+//slot_count is only used by the process that creates the segment. slot_count and ttl <= 0 use the defaults. call before forking workers
+//where possible
+apr_status_t mfs_enable_shm_cache(mfs_file_system *file_system, const char *filename, int slot_count, apr_interval_time_t ttl);
+void mfs_shm_cache_destroy(mfs_shm_cache *cache);
+//returns true on a hit. paths are allocated from pool
+bool mfs_shm_cache_get_paths(mfs_shm_cache *cache, const char *domain, const char *key, char ***paths, int *path_count, apr_pool_t *pool);
+void mfs_shm_cache_put_paths(mfs_shm_cache *cache, const char *domain, const char *key, char **paths, int path_count, apr_pool_t *pool);
+void mfs_shm_cache_remove(mfs_shm_cache *cache, const char *domain, const char *key, apr_pool_t *pool);
+//expire every slot (for all processes)
+void mfs_shm_cache_remove_prefix(mfs_shm_cache *cache, const char *domain, const char *prefix, apr_pool_t *pool);
+void mfs_shm_cache_clear(mfs_shm_cache *cache);
+
+/*
+===================================================================
+INVALIDATION DISPATCHER (in watch.c)
+===================================================================
+*/
+#define DEFAULT_INVALIDATION_COALESCE_TIME (apr_time_from_sec(1) / 20)
+#define MFS_INVALIDATION_MAX_BATCH 1000
+
+//[cache][client_id] lines are in the form:
+//	<operation> <domain> <key> [<to_key>]  (url encoded, operation is delete, rename, store or anything else for a plain invalidation)
+//	<url> (a storage path that is no longer valid)
+#define MFS_INVALIDATE_KEY 0 //drop anything cached for domain/key
+#define MFS_INVALIDATE_DELETE 1
+#define MFS_INVALIDATE_RENAME 2 //key was renamed to to_key
+#define MFS_INVALIDATE_STORE 3 //key was (re)stored
+#define MFS_INVALIDATE_PATH 4 //path is no longer valid
+#define MFS_INVALIDATE_ALL 5 //events may have been missed (the watch reconnected): drop everything
+
+typedef struct {
+	int operation;
+	char *domain;
+	char *key;
+	char *to_key; //MFS_INVALIDATE_RENAME only
+	char *path; //MFS_INVALIDATE_PATH only
+} mfs_invalidation_event;
+
+//called from the dispatcher thread. pool only lives for the duration of the call
+typedef void (*mfs_invalidation_callback)(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool);
+
+typedef struct {
+	mfs_invalidation_callback callback;
+	void *data;
+} mfs_invalidation_listener;
+
+typedef struct _mfs_invalidation_dispatcher {
+	mfs_file_system *file_system;
+	apr_pool_t *pool;
+	watch_data *watch;
+	apr_thread_t *thread;
+	volatile bool running;
+	volatile apr_interval_time_t coalesce_time; //how long events are collected before they are applied
+	apr_thread_mutex_t *lock; //guards listeners
+	apr_array_header_t *listeners; //of mfs_invalidation_listener
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t event_count; //events parsed
+	volatile apr_uint32_t applied_count; //events applied after coalescing
+} mfs_invalidation_dispatcher;
+
+//start a thread that watches a tracker and applies [cache] events to the library caches and listeners
+apr_status_t mfs_start_invalidation_dispatcher(mfs_file_system *file_system, apr_interval_time_t coalesce_time);
+void mfs_stop_invalidation_dispatcher(mfs_file_system *file_system);
+//register a user callback. the dispatcher must be started
+apr_status_t mfs_add_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_callback callback, void *data);
+//once this returns the callback is not running and will not be called again
+void mfs_remove_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_callback callback, void *data);
+//parse the payload of a [cache] line (as returned by get_next_watch_cache_line). line is modified
+apr_status_t mfs_parse_invalidation(char *line, mfs_invalidation_event *event, apr_pool_t *pool);
+//drop domain/key from the library caches
+void mfs_invalidate_key(mfs_file_system *file_system, const char *domain, const char *key, apr_pool_t *pool);
+//apply an event to the library caches and any registered callbacks
+void mfs_apply_invalidation(mfs_file_system *file_system, mfs_invalidation_event *event, apr_pool_t *pool);
+void* APR_THREAD_FUNC mfs_invalidation_dispatcher_thread(apr_thread_t *thd, void *data);
+
+/*
+===================================================================
+FREQUENCY SKETCH (in sketch.c)
+===================================================================
+*/
+#define MFS_SKETCH_DEPTH 4
+#define MFS_SKETCH_MAX_COUNT 15
+
+//count-min sketch used to estimate how often a key has been seen recently.
+//counters are halved every sample_size increments so old popularity fades.
+//updates are lock-free: counters are packed into 32 bit words that are changed with compare and swap
+typedef struct {
+	volatile apr_uint32_t *counters; //MFS_SKETCH_DEPTH rows of width counters
+	apr_uint32_t width; //a power of 2
+	apr_uint32_t max_count; //counters saturate here
+	int counter_bits; //8 (4 to a word) if max_count fits in a byte, otherwise 32
+	volatile apr_uint32_t additions;
+	apr_uint32_t sample_size;
+	volatile apr_uint32_t ages; //times the counters have been halved
+} mfs_frequency_sketch;
+
+apr_status_t mfs_sketch_create(mfs_frequency_sketch **sketch, apr_uint32_t width, apr_uint32_t max_count, apr_pool_t *pool);
+void mfs_sketch_increment(mfs_frequency_sketch *sketch, apr_uint32_t hash);
+int mfs_sketch_estimate(mfs_frequency_sketch *sketch, apr_uint32_t hash);
+
+/*
+===================================================================
+HOT KEYS (in sketch.c)
+===================================================================
+*/
+#define DEFAULT_HOT_KEY_SKETCH_WIDTH 65536
+#define DEFAULT_HOT_KEY_THRESHOLD 8 //accesses in a sample period
+#define DEFAULT_HOT_KEY_TOP_K 32
+#define MFS_HOT_KEY_DOMAIN_SIZE 64 //longer domains and keys are truncated in the top-k list
+#define MFS_HOT_KEY_SIZE 256
+
+typedef struct {
+	apr_uint32_t hash;
+	apr_uint32_t count; //estimated accesses (when it was last seen for the list, now for mfs_hot_keys_top)
+	apr_uint32_t ages; //sketch ages when count was taken
+	char domain[MFS_HOT_KEY_DOMAIN_SIZE];
+	char key[MFS_HOT_KEY_SIZE];
+} mfs_hot_key;
+
+typedef struct _mfs_hot_keys {
+	apr_pool_t *pool;
+	mfs_frequency_sketch *sketch;
+	volatile apr_uint32_t threshold;
+	apr_thread_mutex_t *lock; //guards top. only try-locked when recording
+	mfs_hot_key *top;
+	int top_k;
+	int top_count;
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hot_count; //accesses to hot keys
+	volatile apr_uint32_t promotion_count; //keys added to the top-k list
+} mfs_hot_keys;
+
+//count accesses from mfs_file_system_get and mfs_get_paths. once enabled only keys that reach threshold are added to the
+//metadata, shm and content caches, and hot keys skip the content cache's admission check (must be called before the file system is shared between threads)
+apr_status_t mfs_enable_hot_keys(mfs_file_system *file_system, apr_uint32_t width, apr_uint32_t threshold, int top_k);
+void mfs_hot_keys_destroy(mfs_hot_keys *hot_keys);
+//count an access. returns true if the key is hot
+bool mfs_hot_keys_record(mfs_hot_keys *hot_keys, const char *domain, const char *key);
+bool mfs_hot_keys_is_hot(mfs_hot_keys *hot_keys, const char *domain, const char *key);
+//copy up to max of the hottest keys, hottest first. returns how many were copied
+int mfs_hot_keys_top(mfs_hot_keys *hot_keys, mfs_hot_key *keys, int max);
+
+/*
+===================================================================
+CONTENT CACHE (in content_cache.c)
+===================================================================
+*/
+#define DEFAULT_CONTENT_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define DEFAULT_CONTENT_CACHE_MAX_OBJECT_SIZE (64 * 1024)
+#define DEFAULT_CONTENT_CACHE_TTL apr_time_from_sec(300)
+#define MFS_CONTENT_CACHE_SHARDS 16
+#define MFS_VALIDATOR_SIZE 128 //longer ETag/Last-Modified values are not kept
+
+//a cached file. malloc'd in one block (entry, cache key, data) and freed when the last reference is released
+typedef struct _mfs_content_entry {
+	APR_RING_ENTRY(_mfs_content_entry) link; //shard lru: most recently used at the head
+	char *cache_key; //domain + \0 + key
+	apr_size_t cache_key_length;
+	apr_uint32_t hash;
+	volatile apr_uint32_t references; //the cache holds one while the entry is linked
+	apr_time_t expires_at;
+	apr_size_t size;
+	char *data;
+	char etag[MFS_VALIDATOR_SIZE]; //validators from the file server ("" if none). once expired they are used to revalidate
+	char last_modified[MFS_VALIDATOR_SIZE];
+} mfs_content_entry;
+
+typedef struct _mfs_content_cache_lru mfs_content_cache_lru;
+APR_RING_HEAD(_mfs_content_cache_lru, _mfs_content_entry);
+
+typedef struct {
+	apr_thread_mutex_t *lock;
+	apr_hash_t *entries;
+	mfs_content_cache_lru *lru;
+	apr_size_t bytes;
+} mfs_content_cache_shard;
+
+typedef struct _mfs_content_cache {
+	apr_pool_t *pool;
+	mfs_content_cache_shard shards[MFS_CONTENT_CACHE_SHARDS];
+	apr_size_t shard_max_bytes;
+	volatile apr_size_t max_object_size; //larger files are never cached
+	volatile apr_interval_time_t ttl;
+	mfs_frequency_sketch *sketch; //tinylfu admission: a new entry only displaces entries that are used less often
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hit_count;
+	volatile apr_uint32_t miss_count;
+	volatile apr_uint32_t rejected_count; //not admitted
+	volatile apr_uint32_t eviction_count;
+	volatile apr_uint32_t revalidated_count; //expired entries the file server said were not modified
+} mfs_content_cache;
+
+//turn on the content cache (must be called before the file system is shared between threads)
+apr_status_t mfs_enable_content_cache(mfs_file_system *file_system, apr_size_t max_bytes, apr_size_t max_object_size, apr_interval_time_t ttl);
+void mfs_content_cache_destroy(mfs_content_cache *cache);
+//create an unlinked entry with room for size bytes of data
+mfs_content_entry * mfs_content_entry_create(const char *domain, const char *key, apr_size_t size);
+//returns a referenced entry or NULL
+mfs_content_entry * mfs_content_cache_get(mfs_content_cache *cache, const char *domain, const char *key, apr_pool_t *pool);
+//as mfs_content_cache_get but an expired entry with validators is returned (with *stale set) instead of dropped so it can be revalidated
+mfs_content_entry * mfs_content_cache_get_stale(mfs_content_cache *cache, const char *domain, const char *key, apr_pool_t *pool, bool *stale);
+//the file server said entry has not changed: give it a new ttl
+void mfs_content_cache_refresh(mfs_content_cache *cache, mfs_content_entry *entry);
+//offer an entry to the cache. the cache takes the caller's reference (the entry may be released straight away if it is not admitted)
+void mfs_content_cache_put(mfs_content_cache *cache, mfs_content_entry *entry);
+//put without the admission check (the entry is known to be hot)
+void mfs_content_cache_promote(mfs_content_cache *cache, mfs_content_entry *entry);
+void mfs_content_cache_remove(mfs_content_cache *cache, const char *domain, const char *key, apr_pool_t *pool);
+void mfs_content_cache_remove_prefix(mfs_content_cache *cache, const char *domain, const char *prefix);
+void mfs_content_cache_clear(mfs_content_cache *cache);
+void mfs_content_entry_acquire(mfs_content_entry *entry);
+void mfs_content_entry_release(mfs_content_entry *entry);
+//hand a reference to pool: it is released when pool is cleared or destroyed
+void mfs_content_entry_release_with_pool(mfs_content_entry *entry, apr_pool_t *pool);
+//a heap bucket over the entry's data. the bucket takes a reference
+apr_bucket * mfs_content_entry_bucket_create(mfs_content_entry *entry, apr_bucket_alloc_t *list);
+
+//extra inputs/outputs for mfs_file_server_fetch
+typedef struct {
+	const char *domain; //domain/key name the content entry
+	const char *key;
+	bool want_content; //return small downloads in a new (unlinked) content entry instead of the pool
+	mfs_content_entry *content; //out: the content entry (if one was made)
+	bool spill_to_disk_cache; //downloads over max_buffer_size go to a temp file in the disk cache directory
+	apr_file_t *spill_file; //out: the disk cache temp file (if one was used). it is ready to be published
+	const char *if_none_match; //make the request conditional (NULL to leave out)
+	const char *if_modified_since;
+	long response_code; //out: the http status. a 304 has no body
+	char etag[MFS_VALIDATOR_SIZE]; //out: validators from the response headers ("" if none)
+	char last_modified[MFS_VALIDATOR_SIZE];
+	apr_off_t range_offset; //if range_length > 0 only these bytes are requested. the response is kept in memory. with a range_length of 0
+	//an offset > 0 asks for the rest of the file from there and the body goes where a whole download would
+	apr_size_t range_length; //and the download fails if it is longer than this (a server that ignores the range)
+	bool range_spill; //a range response over max_buffer_size may go to a file like a whole download
+	apr_off_t range_start; //out: from the Content-Range header of a range request (-1 if there was none)
+	apr_off_t range_end;
+	apr_off_t range_total; //-1 if the server sent * (unknown)
+	apr_size_t expected_length; //if > 0 and the server sends no Content-Length, the size of the buffer allocated for a download to memory
+	void *buffer; //if not NULL, the body is written here instead of to memory from the pool
+	apr_size_t buffer_size; //a longer body fails the download
+	bool buffer_full; //out: the body did not fit in buffer
+	bool check_length; //a 200 response with a Content-Length other than required_length is abandoned before the body is read
+	apr_off_t required_length;
+	bool length_mismatch; //out: the download was abandoned because of required_length
+} mfs_fetch_options;
+
+//(in file_download.c) mfs_file_server_get with options (options may be NULL)
+apr_status_t mfs_file_server_fetch(mfs_file_system *file_system, apr_uri_t *uri, char *original_uri, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool, char *destination_file_path, mfs_fetch_options *options);
+//(in file_download.c) copy the value of header from a response header line into value (MFS_VALIDATOR_SIZE) if the line is that header
+void mfs_copy_header_value(const char *line, apr_size_t length, const char *header, char *value);
+//(in file_download.c) set options->range_start, range_end and range_total from a Content-Range value
+void mfs_parse_content_range(const char *value, mfs_fetch_options *options);
+//(in file_download.c) return an entry as bytes, a bucket or written to the caller's file. takes the caller's reference
+apr_status_t mfs_content_entry_serve(mfs_content_entry *entry, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool);
+
+/*
+===================================================================
+DISK CACHE (in disk_cache.c)
+===================================================================
+*/
+#define DEFAULT_DISK_CACHE_MAX_BYTES ((apr_off_t)10 * 1024 * 1024 * 1024)
+#define DEFAULT_DISK_CACHE_SWEEP_INTERVAL apr_time_from_sec(60)
+#define MFS_DISK_CACHE_TEMP_AGE apr_time_from_sec(3600) //temp files older than this are left over from a failed download
+#define MFS_DISK_CACHE_TOUCH_AGE apr_time_from_sec(60) //hits only update the mtime (used for lru) if it is older than this
+
+typedef struct _mfs_disk_cache {
+	apr_pool_t *pool;
+	char *directory;
+	volatile apr_off_t max_bytes; //a sweep deletes the least recently used files until the cache is 90% of this
+	volatile apr_interval_time_t sweep_interval;
+	apr_file_t *lock_file; //only one process sweeps at a time
+	apr_thread_mutex_t *sweep_mutex; //used to stop/start sweep thread quickly
+	apr_thread_cond_t *sweep_cond;
+	apr_thread_t *sweep_thread;
+	volatile bool running;
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hit_count;
+	volatile apr_uint32_t miss_count;
+	volatile apr_uint32_t publish_count;
+	volatile apr_uint32_t eviction_count;
+	volatile apr_off_t size; //bytes in the cache at the last sweep
+} mfs_disk_cache;
+
+//turn on the disk cache (must be called before the file system is shared between threads). directory is created if needed.
+//max_bytes and sweep_interval <= 0 use the defaults
+apr_status_t mfs_enable_disk_cache(mfs_file_system *file_system, const char *directory, apr_off_t max_bytes, apr_interval_time_t sweep_interval);
+void mfs_disk_cache_destroy(mfs_disk_cache *cache);
+//the fid from a file server path (.../0000000123.fid) or -1
+apr_int64_t mfs_fid_from_path(const char *path);
+char * mfs_disk_cache_path(mfs_disk_cache *cache, apr_int64_t fid, apr_pool_t *pool);
+//open the cached copy of fid. returns APR_ENOENT on a miss
+apr_status_t mfs_disk_cache_open(mfs_disk_cache *cache, apr_int64_t fid, apr_file_t **file, apr_off_t *size, apr_pool_t *pool);
+//block cache blocks are kept next to whole files
+char * mfs_disk_cache_block_path(mfs_disk_cache *cache, apr_int64_t fid, apr_int64_t index, apr_pool_t *pool);
+apr_status_t mfs_disk_cache_open_block(mfs_disk_cache *cache, apr_int64_t fid, apr_int64_t index, apr_file_t **file, apr_off_t *size, apr_pool_t *pool);
+//the template for apr_file_mktemp so temp files are on the same file system as the cache
+char * mfs_disk_cache_temp_template(mfs_disk_cache *cache, apr_pool_t *pool);
+//rename a completed temp file into the cache. the file stays open
+apr_status_t mfs_disk_cache_publish(mfs_disk_cache *cache, apr_int64_t fid, apr_file_t *file, apr_pool_t *pool);
+apr_status_t mfs_disk_cache_publish_block(mfs_disk_cache *cache, apr_int64_t fid, apr_int64_t index, apr_file_t *file, apr_pool_t *pool);
+//close and delete a temp file from a failed download
+void mfs_disk_cache_discard(mfs_disk_cache *cache, apr_file_t *file, apr_pool_t *pool);
+//delete least recently used files until the cache is under max_bytes. returns APR_EBUSY if another process is sweeping
+apr_status_t mfs_disk_cache_sweep(mfs_disk_cache *cache);
+void* APR_THREAD_FUNC mfs_disk_cache_sweeper(apr_thread_t *thd, void *data);
+
+/*
+===================================================================
+BLOCK CACHE (in block_cache.c)
+===================================================================
+*/
+#define DEFAULT_BLOCK_CACHE_BLOCK_SIZE (256 * 1024)
+#define DEFAULT_BLOCK_CACHE_MAX_BYTES (256 * 1024 * 1024)
+#define DEFAULT_BLOCK_CACHE_READAHEAD 4 //blocks
+#define MFS_BLOCK_CACHE_SHARDS 16
+#define MFS_BLOCK_CACHE_MAX_RUN 16 //most blocks fetched in one range request
+#define MFS_BLOCK_CACHE_STREAMS 64 //files tracked for sequential access
+
+typedef struct {
+	apr_int64_t fid;
+	apr_int64_t index;
+} mfs_block_key;
+
+//a block of a file. malloc'd in one block (block, data) and freed when the last reference is released
+typedef struct _mfs_block {
+	APR_RING_ENTRY(_mfs_block) link; //shard lru: most recently used at the head
+	mfs_block_key key;
+	volatile apr_uint32_t references; //the cache holds one while the block is linked
+	apr_size_t size; //less than block_size for the last block of a file
+	char *data;
+} mfs_block;
+
+typedef struct _mfs_block_cache_lru mfs_block_cache_lru;
+APR_RING_HEAD(_mfs_block_cache_lru, _mfs_block);
+
+typedef struct {
+	apr_thread_mutex_t *lock;
+	apr_hash_t *blocks;
+	mfs_block_cache_lru *lru;
+	apr_size_t bytes;
+} mfs_block_cache_shard;
+
+//where the last read of a file finished
+typedef struct {
+	apr_int64_t fid;
+	apr_int64_t next_index;
+	int run; //reads in a row that started where the last one finished
+} mfs_block_stream;
+
+typedef struct _mfs_block_cache {
+	apr_pool_t *pool;
+	mfs_block_cache_shard shards[MFS_BLOCK_CACHE_SHARDS];
+	apr_size_t block_size;
+	apr_size_t shard_max_bytes;
+	volatile int readahead; //blocks read ahead once access looks sequential
+	apr_thread_mutex_t *stream_lock;
+	mfs_block_stream streams[MFS_BLOCK_CACHE_STREAMS];
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hit_count;
+	volatile apr_uint32_t disk_hit_count; //found in the disk cache (whole file or spilled block)
+	volatile apr_uint32_t miss_count;
+	volatile apr_uint32_t fetch_count; //range requests
+	volatile apr_uint32_t readahead_count; //blocks fetched that were not asked for (apr_atomic_add32)
+	volatile apr_uint32_t eviction_count;
+} mfs_block_cache;
+
+//turn on the block cache (must be called before the file system is shared between threads). block_size, max_bytes and readahead of 0
+//(or less) use the defaults. blocks evicted from memory are kept in the disk cache if it is enabled
+apr_status_t mfs_enable_block_cache(mfs_file_system *file_system, apr_size_t block_size, apr_size_t max_bytes, int readahead);
+void mfs_block_cache_destroy(mfs_block_cache *cache);
+//returns a referenced block or NULL
+mfs_block * mfs_block_cache_get(mfs_block_cache *cache, apr_int64_t fid, apr_int64_t index);
+//the cache takes the caller's reference
+void mfs_block_cache_put(mfs_block_cache *cache, mfs_block *block);
+void mfs_block_release(mfs_block *block);
+//read up to length bytes from offset into buffer. *bytes_read is less than length at the end of the file
+apr_status_t mfs_block_cache_read(mfs_file_system *file_system, const char *domain, const char *key, apr_off_t offset, void *buffer, apr_size_t length, apr_size_t *bytes_read, apr_pool_t *pool);
+
+/*
+===================================================================
+LOCAL STORAGE (in local_storage.c)
+===================================================================
+*/
+//paths on the mogstored at hostinfo (host:port) are read straight from docroot (must be called before the file system is shared between threads)
+apr_status_t mfs_add_local_docroot(mfs_file_system *file_system, const char *hostinfo, const char *docroot);
+//the file system path for a get_paths path or NULL if it is not on this machine
+char * mfs_local_path(mfs_file_system *file_system, const char *path, apr_pool_t *pool);
+bool mfs_is_local_path(mfs_file_system *file_system, const char *path);
+//move paths on this machine to the front (keeping the tracker's order otherwise)
+void mfs_prefer_local_paths(mfs_file_system *file_system, char **paths, int path_count);
+apr_status_t mfs_local_file_open(const char *local_path, apr_file_t **file, apr_off_t *size, apr_pool_t *pool);
+//write a new file on a local device instead of putting it over http: temp file, fsync and rename.
+//the file is written as this process's user so mogstored must be able to read files it does not own
+apr_status_t mfs_local_file_put(const char *local_path, void *bytes, long *total_bytes, apr_file_t *file, apr_pool_t *pool);
+//(in file_download.c) return an open local file (replica or disk cache) as bytes, a file bucket, the file itself or copied to the caller's file
+apr_status_t mfs_local_file_serve(apr_file_t *local_file, apr_off_t size, mfs_file_system *file_system, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool);
+//(in file_download.c) is the reply to a range request (options->response_code, range_start, range_end) the received bytes asked for
+bool mfs_range_response_ok(mfs_fetch_options *options, apr_size_t received);
+//(in file_download.c) as mfs_local_file_serve for the length bytes at offset (fewer if the file ends first)
+apr_status_t mfs_local_range_serve(apr_file_t *local_file, apr_off_t size, apr_off_t offset, apr_size_t length, void **bytes, apr_size_t *total_bytes, apr_file_t **file, apr_bucket_brigade *brigade, apr_pool_t *pool);
+
+
+/*
+===================================================================
+MIRROR (in mirror.c)
+===================================================================
+*/
+#define DEFAULT_MIRROR_THREADS 4
+#define MFS_MIRROR_INDEX ".mfs_mirror_index" //fid<tab>key lines so a restarted mirror only fetches what changed
+
+#define MFS_MIRROR_FETCH 0 //fetch key if its fid differs from the mirrored copy
+#define MFS_MIRROR_REMOVE 1
+#define MFS_MIRROR_RESYNC 2 //list the domain: fetch every key and remove mirrored keys that are gone
+
+//malloc'd in one block (task, key)
+typedef struct _mfs_mirror_task {
+	int operation;
+	char *key;
+	struct _mfs_mirror_task *next;
+} mfs_mirror_task;
+
+//a local copy of a domain (or the keys under a prefix) kept current from the invalidation dispatcher
+typedef struct _mfs_mirror {
+	mfs_file_system *file_system;
+	apr_pool_t *pool;
+	char *domain;
+	char *prefix; //"" for the whole domain
+	char *directory; //key /a/b is mirrored to directory/a/b
+	apr_thread_t **threads;
+	int thread_count;
+	volatile bool running;
+	volatile apr_off_t max_bytes_per_sec; //0 for no limit
+	apr_thread_mutex_t *lock; //guards the queue, fids and the throttle
+	apr_thread_cond_t *cond; //signalled when a task is queued or the mirror stops
+	apr_thread_cond_t *idle_cond; //signalled when the queue is empty and no task is running
+	mfs_mirror_task *queue_head;
+	mfs_mirror_task *queue_tail;
+	int busy; //tasks being run
+	bool index_dirty; //fids or unconfirmed have changed since the index was written
+	apr_pool_t *fids_pool; //rebuilt when the index is written so removed keys don't accumulate
+	apr_hash_t *fids; //key -> apr_int64_t fid of the local copy. only these keys are served from the mirror
+	apr_hash_t *unconfirmed; //key -> fid of a local copy that has to be checked before it is served (read from the index or invalidated)
+	apr_time_t index_written;
+	apr_time_t throttle_start;
+	apr_off_t throttle_bytes; //fetched since throttle_start
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t fetch_count;
+	volatile apr_uint32_t skip_count; //fetches that found the local copy current
+	volatile apr_uint32_t remove_count;
+	volatile apr_uint32_t error_count;
+	apr_off_t fetched_bytes; //under lock: too wide for the 32 bit atomics
+	struct _mfs_mirror *next; //the file system's list of mirrors
+} mfs_mirror;
+
+//mirror domain (keys starting with prefix, NULL for all) to directory with thread_count parallel fetches.
+//the initial sync runs in the background (see mfs_mirror_wait). the invalidation dispatcher must be started for the mirror to follow changes.
+//must be called before the file system is shared between threads
+apr_status_t mfs_start_mirror(mfs_file_system *file_system, const char *domain, const char *prefix, const char *directory, int thread_count, apr_off_t max_bytes_per_sec, mfs_mirror **mirror);
+//stop the threads and write the index (the mirror is removed from the file system so it must not be in use by other threads)
+void mfs_stop_mirror(mfs_mirror *mirror);
+//wait until there is nothing left to sync. returns APR_TIMEUP if there is still work after timeout
+apr_status_t mfs_mirror_wait(mfs_mirror *mirror, apr_interval_time_t timeout);
+//the local file for key (escaped so any key maps to a path inside directory)
+char * mfs_mirror_path(mfs_mirror *mirror, const char *key, apr_pool_t *pool);
+//open the mirrored copy of domain/key. returns APR_ENOENT if no mirror has a current copy
+apr_status_t mfs_mirror_open(mfs_file_system *file_system, const char *domain, const char *key, apr_file_t **file, apr_off_t *size, apr_pool_t *pool);
+apr_status_t mfs_mirror_queue(mfs_mirror *mirror, int operation, const char *key);
+void mfs_mirror_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool);
+void* APR_THREAD_FUNC mfs_mirror_thread(apr_thread_t *thd, void *data);
+
+
+/*
+===================================================================
+BLOOM FILTER (in bloom.c)
+===================================================================
+*/
+#define DEFAULT_BLOOM_FALSE_POSITIVE_RATE 0.01
+#define DEFAULT_BLOOM_REBUILD_INTERVAL apr_time_from_sec(6 * 3600)
+#define MFS_BLOOM_RETRY_INTERVAL apr_time_from_sec(60) //after a failed rebuild
+#define MFS_BLOOM_MAX_HASHES 16
+#define MFS_BLOOM_MAX_PREFIXES 16 //renamed keys that may have taken children with them. past this the filter is not used until a rebuild
+
+typedef struct {
+	char *prefix; //malloc'd. key + "/"
+	apr_time_t added_at;
+} mfs_bloom_prefix;
+
+//existence filter for the keys of a domain. no false negatives so long as every store is seen: our own stores are added directly,
+//other clients' come from the invalidation dispatcher and the filter is not used after events may have been missed until it is rebuilt
+typedef struct _mfs_bloom_filter {
+	mfs_file_system *file_system;
+	apr_pool_t *pool;
+	char *domain;
+	apr_uint64_t bit_count;
+	int hash_count;
+	volatile apr_uint32_t *bits; //answers lookups
+	volatile apr_uint32_t *next_bits; //being rebuilt (NULL between rebuilds). keys are added to both
+	volatile apr_uint32_t *spare_bits;
+	apr_thread_rwlock_t *lock; //read locked to use the bits and prefixes, write locked to swap the bits or change the prefixes
+	volatile bool ready; //bits hold a complete listing and no events have been missed since
+	volatile apr_uint32_t generation; //bumped when events may have been missed
+	mfs_bloom_prefix prefixes[MFS_BLOOM_MAX_PREFIXES];
+	int prefix_count;
+	volatile apr_interval_time_t rebuild_interval;
+	apr_thread_t *thread;
+	apr_thread_mutex_t *rebuild_mutex;
+	apr_thread_cond_t *rebuild_cond;
+	volatile bool rebuild_requested;
+	volatile bool running;
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t absent_count; //lookups answered without the tracker
+	volatile apr_uint32_t maybe_count;
+	volatile apr_uint32_t rebuild_count;
+	volatile apr_size_t key_count; //keys listed by the last rebuild
+} mfs_bloom_filter;
+
+//keep a filter of the keys in domain sized for expected_keys at false_positive_rate (but no bigger than max_bytes, 0 for no limit).
+//twice max_bytes is used while rebuilding. the first build runs in the background and the filter is not used until it is done.
+//the invalidation dispatcher must already be started (APR_EGENERAL otherwise) so keys stored by other clients are added.
+//must be called before the file system is shared between threads
+apr_status_t mfs_enable_bloom_filter(mfs_file_system *file_system, const char *domain, apr_size_t expected_keys, double false_positive_rate, apr_size_t max_bytes, apr_interval_time_t rebuild_interval);
+void mfs_bloom_filter_destroy(mfs_bloom_filter *filter);
+//true only if domain has a ready filter that says key definitely does not exist
+bool mfs_bloom_filter_absent(mfs_file_system *file_system, const char *domain, const char *key);
+void mfs_bloom_filter_add(mfs_file_system *file_system, const char *domain, const char *key);
+//keys under key/ may exist (a renamed directory). forgotten once a rebuild has listed them
+void mfs_bloom_filter_add_prefix(mfs_file_system *file_system, const char *domain, const char *key);
+//stop answering until a rebuild (events may have been missed)
+void mfs_bloom_filter_invalidate(mfs_bloom_filter *filter);
+apr_status_t mfs_bloom_filter_rebuild(mfs_bloom_filter *filter, apr_pool_t *pool);
+void mfs_bloom_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool);
+void* APR_THREAD_FUNC mfs_bloom_filter_thread(apr_thread_t *thd, void *data);
+
+
+/*
+===================================================================
+PACKING (in pack.c)
+===================================================================
+*/
+#define DEFAULT_PACK_CONTAINER_SIZE (16 * 1024 * 1024)
+#define DEFAULT_PACK_COMPACT_RATIO 0.5
+#define MFS_PACK_INDEX_SUFFIX ".idx" //the index of container key is stored as key + ".idx"
+
+struct _mfs_pack_container;
+
+//malloc'd in one block (object, name)
+typedef struct _mfs_pack_object {
+	struct _mfs_pack_container *container;
+	apr_size_t offset;
+	apr_size_t length;
+	struct _mfs_pack_object *prev; //the container's objects
+	struct _mfs_pack_object *next;
+	char name[1];
+} mfs_pack_object;
+
+//malloc'd in one block (container, key)
+typedef struct _mfs_pack_container {
+	char *key;
+	char *data; //malloc'd contents until the container is stored (NULL once it is)
+	apr_size_t size; //bytes appended, including deleted objects
+	apr_size_t live_bytes;
+	int live_count;
+	bool busy; //being compacted (it is not freed)
+	bool moved; //objects were compacted out of it: it is only deleted once a flush has stored everything
+	bool index_dirty; //objects were removed since the index was stored
+	bool index_deleted;
+	mfs_pack_object *objects;
+	struct _mfs_pack_container *next;
+} mfs_pack_container;
+
+//small objects appended into container keys of about container_size so a store or delete of an object is not a tracker call.
+//each container key has an index key of "offset<tab>length<tab>url encoded name" lines (after a line with the container size).
+//a prefix must only be written by one pack at a time
+typedef struct _mfs_pack {
+	mfs_file_system *file_system;
+	apr_pool_t *pool;
+	char *domain;
+	char *prefix; //container keys are prefix followed by a unique id that sorts by creation time
+	char *storage_class;
+	apr_size_t container_size;
+	apr_thread_mutex_t *lock; //guards the objects and containers
+	apr_thread_mutex_t *flush_lock; //one flush at a time
+	apr_hash_t *objects; //name -> mfs_pack_object
+	mfs_pack_container *containers;
+	mfs_pack_container *open; //being appended to (NULL if none)
+	apr_uint64_t last_id; //of the newest container
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t put_count;
+	volatile apr_uint32_t get_count;
+	volatile apr_uint32_t delete_count;
+	volatile apr_uint32_t container_count; //containers stored
+	volatile apr_uint32_t compact_count; //containers compacted
+	apr_off_t reclaimed_bytes; //under lock: too wide for the 32 bit atomics
+} mfs_pack;
+
+//open the pack stored under prefix in domain and load its indexes. containers are cut at container_size (0 for the default)
+apr_status_t mfs_pack_open(mfs_file_system *file_system, const char *domain, const char *prefix, const char *storage_class, apr_size_t container_size, mfs_pack **pack);
+//flush and free the pack (it must not be in use by other threads). close packs before the file system
+void mfs_pack_close(mfs_pack *pack);
+//add or replace name. objects are buffered in memory and only stored once their container fills or on mfs_pack_flush
+apr_status_t mfs_pack_put(mfs_pack *pack, const char *name, const void *bytes, apr_size_t length, apr_pool_t *pool);
+//the bytes of name with one range request on its container. APR_ENOENT if there is no such object
+apr_status_t mfs_pack_get(mfs_pack *pack, const char *name, void **bytes, apr_size_t *length, apr_pool_t *pool);
+//APR_ENOENT if there is no such object. the container's index is rewritten by the next flush
+apr_status_t mfs_pack_delete(mfs_pack *pack, const char *name);
+//store the open container and buffered containers, rewrite changed indexes and delete empty containers
+apr_status_t mfs_pack_flush(mfs_pack *pack, apr_pool_t *pool);
+//copy the live objects of containers with less than min_live_ratio of their bytes live into new containers and delete them
+apr_status_t mfs_pack_compact(mfs_pack *pack, double min_live_ratio, apr_pool_t *pool);
+apr_status_t mfs_pack_load(mfs_pack *pack, apr_pool_t *pool);
+apr_status_t mfs_pack_read_range(mfs_pack *pack, const char *key, apr_size_t offset, apr_size_t length, void **bytes, apr_pool_t *pool);
+
+
+/*
+===================================================================
+PARALLEL DOWNLOAD (in parallel_download.c)
+===================================================================
+*/
+#define DEFAULT_PARALLEL_DOWNLOAD_MIN_SIZE ((apr_off_t)64 * 1024 * 1024)
+#define DEFAULT_PARALLEL_DOWNLOAD_RANGE_SIZE (8 * 1024 * 1024)
+#define DEFAULT_PARALLEL_DOWNLOAD_THREADS 4
+
+typedef struct _mfs_parallel_download {
+	apr_off_t min_size; //smaller files are fetched one range after another
+	apr_size_t range_size; //each range is held in memory until it is written
+	int thread_count; //ranges fetched at once by one download
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t download_count; //downloads split across threads
+	volatile apr_uint32_t range_count;
+	volatile apr_uint32_t retry_count; //ranges fetched from another replica after a failure
+} mfs_parallel_download;
+
+//one download shared by its threads
+typedef struct {
+	mfs_file_system *file_system;
+	mfs_parallel_download *config;
+	const char *key;
+	char **paths;
+	int path_count;
+	apr_os_file_t fd; //ranges are written with positional writes
+	apr_off_t start; //where the download starts in the file
+	apr_off_t total; //size of the file (-1 until the first range is fetched)
+	apr_uint32_t range_count;
+	volatile apr_uint32_t next_range;
+	volatile apr_uint32_t failed; //a range could not be fetched from any replica: the other threads stop
+	volatile apr_status_t rv;
+} mfs_parallel_job;
+
+//downloads to a file (mfs_get_file) are fetched as ranges of range_size. files of min_size or more are fetched thread_count ranges at a
+//time with each range starting on a different replica. smaller files get the first range and then the rest in one request. must be called before the file system is shared between threads
+apr_status_t mfs_enable_parallel_download(mfs_file_system *file_system, apr_off_t min_size, apr_size_t range_size, int thread_count);
+//download paths into file from its current position. total_bytes is the size of the file. a server that ignores ranges gives APR_ENOTIMPL
+apr_status_t mfs_parallel_download_file(mfs_file_system *file_system, const char *key, char **paths, int path_count, apr_file_t *file, apr_size_t *total_bytes, apr_pool_t *pool);
+apr_status_t mfs_parallel_fetch_range(mfs_parallel_job *job, apr_uint32_t range, apr_pool_t *pool);
+apr_status_t mfs_parallel_fetch_rest(mfs_parallel_job *job, apr_file_t *file, apr_pool_t *pool);
+void mfs_parallel_download_ranges(mfs_parallel_job *job);
+void* APR_THREAD_FUNC mfs_parallel_download_thread(apr_thread_t *thd, void *data);
+
+
+/*
+===================================================================
+HEDGED DOWNLOADS (in hedge.c)
+===================================================================
+*/
+#define DEFAULT_HEDGE_DELAY apr_time_from_msec(50)
+
+typedef struct _mfs_hedge {
+	apr_interval_time_t delay; //time to wait for the first byte before starting the next replica
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t hedged_count; //extra replicas started
+	volatile apr_uint32_t won_count; //downloads finished by a replica other than the first
+	volatile apr_uint32_t abort_count; //slower replicas dropped mid transfer
+} mfs_hedge;
+
+//downloads to memory or a brigade start the next replica alongside the current one if it has not sent a byte within delay. the first
+//to finish wins. must be called before the file system is shared between threads
+apr_status_t mfs_enable_hedged_downloads(mfs_file_system *file_system, apr_interval_time_t delay);
+//download paths into bytes (allocated from pool). files larger than max_buffer_size give APR_ENOSPC
+apr_status_t mfs_hedged_get(mfs_file_system *file_system, const char *key, char **paths, int path_count, void **bytes, apr_size_t *total_bytes, apr_pool_t *pool);
+
+
+/*
+===================================================================
+REPLICA RANKING (in replica_ranking.c)
+===================================================================
+*/
+#define DEFAULT_REPLICA_RANKING_ALPHA 0.2
+#define DEFAULT_REPLICA_RANKING_EXPLORE_INTERVAL 20
+#define MFS_REPLICA_RANKING_SIZE (64 * 1024) //the transfer size paths are compared on
+#define MFS_REPLICA_RANKING_MIN_SUCCESS 0.05 //a host that always fails still has a finite cost
+
+typedef struct _mfs_replica_ranking {
+	double alpha; //weight of the latest transfer in the moving averages
+	int explore_interval; //every explore_interval rankings the worst path is tried first so a recovered host is noticed (0 never)
+	volatile apr_uint32_t rankings;
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t reordered_count; //rankings that changed the tracker's order
+	volatile apr_uint32_t explored_count;
+} mfs_replica_ranking;
+
+//paths are sorted by the expected time to fetch MFS_REPLICA_RANKING_SIZE bytes from their file server (ttfb and throughput, scaled up by
+//the error rate). hosts with no transfers yet go first. must be called before the file system is shared between threads
+apr_status_t mfs_enable_replica_ranking(mfs_file_system *file_system, double alpha, int explore_interval);
+//add a transfer to a file server's statistics. ttfb and elapsed are in seconds. does nothing without replica ranking
+void mfs_host_stats_record(mfs_file_system *file_system, mfs_file_server *file_server, bool ok, double ttfb, double bytes, double elapsed);
+//expected seconds to fetch size bytes (0 if nothing is known). the caller holds stats_lock
+double mfs_host_stats_cost(mfs_host_stats *stats, double size);
+//reorder paths in place, best first
+void mfs_rank_paths(mfs_file_system *file_system, char **paths, int path_count, apr_pool_t *pool);
+
+
+/*
+===================================================================
+LOAD BALANCING (in load_balance.c)
+===================================================================
+*/
+typedef struct _mfs_load_balancer {
+	volatile apr_uint32_t sequence; //mixed into the random choices
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t balanced_count; //paths lists that were considered
+	volatile apr_uint32_t moved_count; //the first path was not the one chosen
+} mfs_load_balancer;
+
+//the paths of hot keys (every key without hot key detection) start with the replica whose file server has fewer downloads in flight of
+//two picked at random. the rest keep their order. with replica ranking this runs after the ranking. must be called before the file
+//system is shared between threads
+apr_status_t mfs_enable_load_balancing(mfs_file_system *file_system);
+//move the chosen path to the front of paths
+void mfs_balance_paths(mfs_file_system *file_system, char **paths, int path_count, apr_pool_t *pool);
+
+
+/*
+===================================================================
+SLAB ARENA (in slab.c)
+===================================================================
+*/
+#define DEFAULT_SLAB_SIZE (64 * 1024)
+#define DEFAULT_SLAB_MAX_FREE 256
+
+typedef struct _mfs_slab {
+	struct _mfs_slab *next; //on the free list
+	struct _mfs_slab_arena *arena;
+	char *data; //slab_size bytes
+} mfs_slab;
+
+typedef struct _mfs_slab_arena {
+	apr_pool_t *pool; //unmanaged: the arena, and its lock, live until the last reference is dropped
+	volatile apr_uint32_t references; //the file system's and one for each slab that exists
+	apr_size_t slab_size;
+	int max_free; //idle slabs kept for reuse
+	apr_thread_mutex_t *lock; //free list
+	mfs_slab *free_list;
+	int free_count;
+	//counters: updated with apr_atomic_inc32
+	volatile apr_uint32_t allocated_count;
+	volatile apr_uint32_t reused_count;
+} mfs_slab_arena;
+
+//downloads to memory or a brigade are written into slabs of slab_size instead of a pool copy of each block cURL hands over. up to
+//max_free idle slabs are kept. must be called before the file system is shared between threads
+apr_status_t mfs_enable_slab_arena(mfs_file_system *file_system, apr_size_t slab_size, int max_free);
+//called when the file system is closed. the arena lasts until the last slab in a brigade is returned
+void mfs_slab_arena_destroy(mfs_slab_arena *arena);
+void mfs_slab_arena_release(mfs_slab_arena *arena, apr_uint32_t count);
+//an empty slab (NULL if none could be allocated)
+mfs_slab * mfs_slab_get(mfs_slab_arena *arena);
+void mfs_slab_put(mfs_slab *slab);
+//a heap bucket over the first length bytes of slab. the slab goes back to the arena when the bucket is destroyed
+apr_bucket * mfs_slab_bucket_create(mfs_slab *slab, apr_size_t length, apr_bucket_alloc_t *list);
+
+
+/*
+===================================================================
+READER (in reader.c)
+===================================================================
+*/
+#define DEFAULT_READER_BUFFER_SIZE (256 * 1024)
+#define MIN_READER_BUFFER_SIZE 1024 //the smallest receive buffer cURL allows
+
+//an open key read a piece at a time. not threadsafe: use one reader per thread
+typedef struct _mfs_reader {
+	mfs_file_system *file_system;
+	apr_pool_t *pool; //destroyed by mfs_close
+	char *domain;
+	char *key;
+	char **paths; //NULL until the first read or seek
+	int path_count;
+	int path_index; //the replica being read
+	apr_file_t *local_file; //a copy on this machine is read instead of the paths
+	apr_off_t position; //of the next byte mfs_read returns
+	apr_off_t size; //-1 until a server says
+	char *buffer; //bytes from position on
+	apr_size_t buffer_size;
+	apr_size_t buffer_start;
+	apr_size_t buffer_length;
+	//the transfer (conn is NULL when there is none)
+	CURLM *multi;
+	mfs_file_server *file_server;
+	mfs_http_connection *conn;
+	apr_off_t transfer_offset; //of the next byte the transfer writes to the buffer
+	apr_off_t skip; //bytes a server that ignored the range sends before transfer_offset
+	bool started; //the response code has been checked
+	bool paused; //the buffer was full
+	apr_status_t transfer_rv;
+	mfs_fetch_options options; //the Content-Range of the transfer
+} mfs_reader;
+
+//open key for reading. nothing is fetched until the first mfs_read or mfs_seek. at most buffer_size bytes (0 for the default, at least
+//MIN_READER_BUFFER_SIZE) are held ahead of the caller. the reader is allocated from a sub pool of pool
+apr_status_t mfs_open(mfs_file_system *file_system, char *domain, char *key, apr_size_t buffer_size, mfs_reader **reader, apr_pool_t *pool);
+//read up to *length bytes. *length is set to what was read: less than asked for if that is all there is buffered. APR_EOF at the end
+apr_status_t mfs_read(mfs_reader *reader, void *data, apr_size_t *length);
+//as apr_file_seek. a seek outside the buffer drops the transfer: the next read asks for a range from the new position.
+//APR_END waits for the size of the file (APR_ENOTIMPL if the server will not say)
+apr_status_t mfs_seek(mfs_reader *reader, apr_seek_where_t where, apr_off_t *offset);
+void mfs_close(mfs_reader *reader);
+
 #endif
@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+small objects packed into container keys.
+puts are appended to an in memory container that is stored with mfs_store_bytes once it fills (or on a flush), followed by its
+index key. the index of every container is loaded when the pack is opened, so a get is one range request on the container and a
+delete only marks the container's index to be rewritten. compaction copies the live objects out of mostly deleted containers and
+deletes them once the copies are stored. if the same name turns up in two indexes (a crash between storing a compacted copy and
+deleting the old container) the newer container wins: container ids sort by creation time.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <stdlib.h>
+
+mfs_pack_container * mfs_pack_create_container(mfs_pack *pack, const char *prefix, const char *id);
+void mfs_pack_remove_container(mfs_pack *pack, mfs_pack_container *container);
+void mfs_pack_link(mfs_pack_container *container, mfs_pack_object *object);
+void mfs_pack_unlink(mfs_pack_object *object);
+apr_status_t mfs_pack_append(mfs_pack *pack, mfs_pack_object *object, const void *bytes);
+apr_status_t mfs_pack_load_index(mfs_pack *pack, const char *container_key, const char *index_key, apr_pool_t *pool);
+apr_status_t mfs_pack_store_index(mfs_pack *pack, mfs_pack_container *container, apr_pool_t *pool);
+apr_status_t mfs_pack_flush_locked(mfs_pack *pack, bool include_open, apr_pool_t *pool);
+void mfs_pack_free(mfs_pack *pack);
+
+apr_status_t mfs_pack_open(mfs_file_system *file_system, const char *domain, const char *prefix, const char *storage_class, apr_size_t container_size, mfs_pack **pack) {
+	apr_pool_t *p, *load_pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_pack *pk = apr_pcalloc(p, sizeof(mfs_pack));
+	pk->file_system = file_system;
+	pk->pool = p;
+	pk->domain = apr_pstrdup(p, domain);
+	pk->prefix = apr_pstrdup(p, prefix);
+	pk->storage_class = apr_pstrdup(p, storage_class);
+	pk->container_size = (container_size > 0) ? container_size : DEFAULT_PACK_CONTAINER_SIZE;
+	apr_thread_mutex_create(&pk->lock, APR_THREAD_MUTEX_UNNESTED, p);
+	apr_thread_mutex_create(&pk->flush_lock, APR_THREAD_MUTEX_UNNESTED, p);
+	pk->objects = apr_hash_make(p);
+	if((rv = apr_pool_create(&load_pool, p)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	rv = mfs_pack_load(pk, load_pool);
+	apr_pool_destroy(load_pool);
+	if(rv != APR_SUCCESS) {
+		mfs_pack_free(pk);
+		return rv;
+	}
+	*pack = pk;
+	return APR_SUCCESS;
+}
+
+void mfs_pack_close(mfs_pack *pack) {
+	apr_pool_t *p;
+	if(apr_pool_create(&p, pack->pool) == APR_SUCCESS) {
+		if(mfs_pack_flush(pack, p) != APR_SUCCESS) {
+			mfs_log(LOG_ERR, "Unable to flush pack %s in %s on close", pack->prefix, pack->domain);
+		}
+	}
+	mfs_pack_free(pack);
+}
+
+void mfs_pack_free(mfs_pack *pack) {
+	apr_hash_index_t *hi;
+	void *object;
+	for(hi = apr_hash_first(NULL, pack->objects); hi; hi = apr_hash_next(hi)) {
+		apr_hash_this(hi, NULL, NULL, &object);
+		free(object);
+	}
+	while(pack->containers != NULL) {
+		mfs_pack_container *container = pack->containers;
+		pack->containers = container->next;
+		free(container->data);
+		free(container);
+	}
+	apr_pool_destroy(pack->pool);
+}
+
+//the key is prefix followed by id. the container is added to the head of the list
+mfs_pack_container * mfs_pack_create_container(mfs_pack *pack, const char *prefix, const char *id) {
+	apr_size_t prefix_length = strlen(prefix);
+	apr_size_t id_length = strlen(id);
+	mfs_pack_container *container = malloc(sizeof(mfs_pack_container) + prefix_length + id_length + 1);
+	if(container == NULL) {
+		return NULL;
+	}
+	memset(container, 0, sizeof(mfs_pack_container));
+	container->key = (char *)(container + 1);
+	memcpy(container->key, prefix, prefix_length);
+	memcpy(container->key + prefix_length, id, id_length + 1);
+	container->next = pack->containers;
+	pack->containers = container;
+	return container;
+}
+
+//free an empty container. only called with the flush lock held
+void mfs_pack_remove_container(mfs_pack *pack, mfs_pack_container *container) {
+	apr_thread_mutex_lock(pack->lock);
+	mfs_pack_container **previous = &pack->containers;
+	while((*previous != NULL) && (*previous != container)) {
+		previous = &(*previous)->next;
+	}
+	if(*previous != NULL) {
+		*previous = container->next;
+	}
+	apr_thread_mutex_unlock(pack->lock);
+	free(container->data);
+	free(container);
+}
+
+//the containers' objects are linked newest first. called with the lock held
+void mfs_pack_link(mfs_pack_container *container, mfs_pack_object *object) {
+	object->container = container;
+	object->prev = NULL;
+	object->next = container->objects;
+	if(object->next != NULL) {
+		object->next->prev = object;
+	}
+	container->objects = object;
+	container->live_count++;
+	container->live_bytes += object->length;
+}
+
+void mfs_pack_unlink(mfs_pack_object *object) {
+	mfs_pack_container *container = object->container;
+	if(object->prev != NULL) {
+		object->prev->next = object->next;
+	} else {
+		container->objects = object->next;
+	}
+	if(object->next != NULL) {
+		object->next->prev = object->prev;
+	}
+	container->live_count--;
+	container->live_bytes -= object->length;
+	container->index_dirty = true;
+	object->container = NULL;
+	object->prev = NULL;
+	object->next = NULL;
+}
+
+//copy bytes to the end of the open container, starting a new one if they don't fit. a full container is left for the next flush.
+//called with the lock held
+apr_status_t mfs_pack_append(mfs_pack *pack, mfs_pack_object *object, const void *bytes) {
+	if((pack->open != NULL) && (pack->open->size + object->length > pack->container_size)) {
+		pack->open = NULL;
+	}
+	if(pack->open == NULL) {
+		char *data = malloc(pack->container_size);
+		if(data == NULL) {
+			mfs_log(LOG_CRIT, "Unable to allocate pack container");
+			return APR_ENOMEM;
+		}
+		//ids only go forward so the newest container sorts last
+		apr_uint64_t id = (apr_uint64_t)apr_time_now();
+		if(id <= pack->last_id) {
+			id = pack->last_id + 1;
+		}
+		char id_str[32];
+		sprintf(id_str, "%016" APR_UINT64_T_HEX_FMT, id);
+		mfs_pack_container *container = mfs_pack_create_container(pack, pack->prefix, id_str);
+		if(container == NULL) {
+			mfs_log(LOG_CRIT, "Unable to allocate pack container");
+			free(data);
+			return APR_ENOMEM;
+		}
+		pack->last_id = id;
+		container->data = data;
+		pack->open = container;
+	}
+	mfs_pack_container *container = pack->open;
+	memcpy(container->data + container->size, bytes, object->length);
+	object->offset = container->size;
+	container->size += object->length;
+	mfs_pack_link(container, object);
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_pack_put(mfs_pack *pack, const char *name, const void *bytes, apr_size_t length, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_size_t name_length = strlen(name);
+	if((name_length == 0) || (length > pack->container_size)) {
+		mfs_log(LOG_ERR, "Unable to pack '%s' (%" APR_SIZE_T_FMT " bytes) in containers of %" APR_SIZE_T_FMT " bytes", name, length, pack->container_size);
+		return APR_EINVAL;
+	}
+	mfs_pack_object *object = malloc(sizeof(mfs_pack_object) + name_length);
+	if(object == NULL) {
+		mfs_log(LOG_CRIT, "Unable to allocate pack object");
+		return APR_ENOMEM;
+	}
+	memset(object, 0, sizeof(mfs_pack_object));
+	memcpy(object->name, name, name_length + 1);
+	object->length = length;
+	apr_thread_mutex_lock(pack->lock);
+	mfs_pack_container *open = pack->open;
+	if((rv = mfs_pack_append(pack, object, bytes)) != APR_SUCCESS) {
+		apr_thread_mutex_unlock(pack->lock);
+		free(object);
+		return rv;
+	}
+	mfs_pack_object *old = apr_hash_get(pack->objects, name, name_length);
+	if(old != NULL) {
+		mfs_pack_unlink(old);
+		apr_hash_set(pack->objects, old->name, name_length, NULL);
+		free(old);
+	}
+	apr_hash_set(pack->objects, object->name, name_length, object);
+	bool filled = (open != NULL) && (pack->open != open);
+	apr_thread_mutex_unlock(pack->lock);
+	apr_atomic_inc32(&pack->put_count);
+	if(filled) {
+		//the object is buffered even if storing the full container fails (the next flush tries again).
+		//the container it went in stays open: it would only be stored holding this one object
+		apr_thread_mutex_lock(pack->flush_lock);
+		rv = mfs_pack_flush_locked(pack, false, pool);
+		apr_thread_mutex_unlock(pack->flush_lock);
+		return rv;
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_pack_get(mfs_pack *pack, const char *name, void **bytes, apr_size_t *length, apr_pool_t *pool) {
+	apr_status_t rv = APR_ENOENT;
+	int attempt;
+	apr_atomic_inc32(&pack->get_count);
+	for(attempt = 0; attempt < 2; attempt++) {
+		apr_thread_mutex_lock(pack->lock);
+		mfs_pack_object *object = apr_hash_get(pack->objects, name, APR_HASH_KEY_STRING);
+		if(object == NULL) {
+			apr_thread_mutex_unlock(pack->lock);
+			return APR_ENOENT;
+		}
+		*length = object->length;
+		if((object->container->data != NULL) || (object->length == 0)) { //not stored yet
+			*bytes = apr_palloc(pool, object->length + 1);
+			if(object->length > 0) {
+				memcpy(*bytes, object->container->data + object->offset, object->length);
+			}
+			apr_thread_mutex_unlock(pack->lock);
+			return APR_SUCCESS;
+		}
+		char *key = apr_pstrdup(pool, object->container->key);
+		apr_size_t offset = object->offset;
+		apr_thread_mutex_unlock(pack->lock);
+		if((rv = mfs_pack_read_range(pack, key, offset, *length, bytes, pool)) == APR_SUCCESS) {
+			return APR_SUCCESS;
+		}
+		//try again in case the object was compacted into another container and the old one deleted
+	}
+	return rv;
+}
+
+apr_status_t mfs_pack_delete(mfs_pack *pack, const char *name) {
+	apr_thread_mutex_lock(pack->lock);
+	mfs_pack_object *object = apr_hash_get(pack->objects, name, APR_HASH_KEY_STRING);
+	if(object == NULL) {
+		apr_thread_mutex_unlock(pack->lock);
+		return APR_ENOENT;
+	}
+	mfs_pack_unlink(object);
+	apr_hash_set(pack->objects, object->name, APR_HASH_KEY_STRING, NULL);
+	apr_thread_mutex_unlock(pack->lock);
+	free(object);
+	apr_atomic_inc32(&pack->delete_count);
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_pack_read_range(mfs_pack *pack, const char *key, apr_size_t offset, apr_size_t length, void **bytes, apr_pool_t *pool) {
+	apr_status_t rv;
+	char **paths;
+	int path_count;
+	int i;
+	if((rv = mfs_get_paths(pack->file_system, pack->domain, key, false, &paths, &path_count, pool)) != APR_SUCCESS) {
+		return rv;
+	}
+	rv = APR_EGENERAL;
+	for(i = 0; i < path_count; i++) {
+		char *local_path = mfs_local_path(pack->file_system, paths[i], pool);
+		if(local_path != NULL) {
+			apr_file_t *file;
+			apr_off_t position = offset;
+			char *buffer = apr_palloc(pool, length + 1);
+			if((rv = apr_file_open(&file, local_path, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool)) == APR_SUCCESS) {
+				if(((rv = apr_file_seek(file, APR_SET, &position)) == APR_SUCCESS) && ((rv = apr_file_read_full(file, buffer, length, NULL)) == APR_SUCCESS)) {
+					apr_file_close(file);
+					*bytes = buffer;
+					return APR_SUCCESS;
+				}
+				apr_file_close(file);
+			}
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to read %" APR_SIZE_T_FMT " bytes at %" APR_SIZE_T_FMT " of %s from %s. Attempt count = %d/%d:", length, offset, key, local_path, i+1, path_count);
+			continue;
+		}
+		apr_uri_t uri;
+		if((rv = apr_uri_parse(pool, paths[i], &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to parse get_url %s:", paths[i]);
+			continue;
+		}
+		mfs_fetch_options options;
+		memset(&options, 0, sizeof(options));
+		options.range_offset = offset;
+		options.range_length = length;
+		void *fetched = NULL;
+		apr_size_t total_bytes = 0;
+		apr_file_t *file = NULL;
+		if((rv = mfs_file_server_fetch(pack->file_system, &uri, paths[i], &fetched, &total_bytes, &file, NULL, pool, NULL, &options)) != APR_SUCCESS) {
+			mfs_log(LOG_ERR, "Failed to get %" APR_SIZE_T_FMT " bytes at %" APR_SIZE_T_FMT " of %s from %s. Attempt count = %d/%d", length, offset, key, paths[i], i+1, path_count);
+			continue;
+		}
+		//a 200 is the whole file: only right if we asked from the start
+		if(((options.response_code != 206) && !((options.response_code == 200) && (offset == 0))) || (total_bytes != length)) {
+			mfs_log(LOG_ERR, "Unexpected response %ld (%" APR_SIZE_T_FMT " bytes) to range request to %s. Attempt count = %d/%d", options.response_code, total_bytes, paths[i], i+1, path_count);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		*bytes = fetched;
+		return APR_SUCCESS;
+	}
+	return rv;
+}
+
+apr_status_t mfs_pack_load(mfs_pack *pack, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_pool_t *page_pool, *index_pool;
+	char *after = NULL;
+	apr_size_t suffix_length = strlen(MFS_PACK_INDEX_SUFFIX);
+	if(((rv = apr_pool_create(&page_pool, pool)) != APR_SUCCESS) || ((rv = apr_pool_create(&index_pool, pool)) != APR_SUCCESS)) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	while(true) {
+		char **keys;
+		int key_count;
+		char *next_after;
+		int i;
+		if((rv = mfs_list_keys(pack->file_system, pack->domain, pack->prefix, after, MFS_LIST_KEYS_LIMIT, &keys, &key_count, &next_after, page_pool)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to list pack %s in %s:", pack->prefix, pack->domain);
+			return rv;
+		}
+		//keys are listed in order so a name in more than one index ends up in the newest container
+		for(i = 0; i < key_count; i++) {
+			apr_size_t key_length = strlen(keys[i]);
+			if((key_length <= strlen(pack->prefix) + suffix_length) || (strcmp(keys[i] + key_length - suffix_length, MFS_PACK_INDEX_SUFFIX) != 0)) {
+				continue; //a container
+			}
+			apr_pool_clear(index_pool);
+			if((rv = mfs_pack_load_index(pack, apr_pstrndup(index_pool, keys[i], key_length - suffix_length), keys[i], index_pool)) != APR_SUCCESS) {
+				return rv;
+			}
+		}
+		if((key_count == 0) || (next_after == NULL) || ((after != NULL) && (strcmp(next_after, after) == 0))) {
+			break;
+		}
+		after = apr_pstrdup(pool, next_after);
+		apr_pool_clear(page_pool);
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_pack_load_index(mfs_pack *pack, const char *container_key, const char *index_key, apr_pool_t *pool) {
+	apr_status_t rv;
+	void *bytes = NULL;
+	apr_file_t *file = NULL;
+	apr_size_t total_bytes = 0;
+	if((rv = mfs_get_file_or_bytes(pack->file_system, pack->domain, (char *)index_key, &total_bytes, &bytes, &file, pool, NULL, -1)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to get pack index %s:", index_key);
+		return rv;
+	}
+	char *text = apr_palloc(pool, total_bytes + 1);
+	if(file != NULL) {
+		apr_off_t position = 0;
+		if(((rv = apr_file_seek(file, APR_SET, &position)) != APR_SUCCESS) || ((rv = apr_file_read_full(file, text, total_bytes, NULL)) != APR_SUCCESS)) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to read pack index %s:", index_key);
+			apr_file_close(file);
+			return rv;
+		}
+		apr_file_close(file);
+	} else {
+		memcpy(text, bytes, total_bytes);
+	}
+	text[total_bytes] = '\0';
+	char *line_state;
+	char *line = apr_strtok(text, "\n", &line_state);
+	if(line == NULL) {
+		mfs_log(LOG_ERR, "Pack index %s is empty", index_key);
+		return APR_EGENERAL;
+	}
+	mfs_pack_container *container = mfs_pack_create_container(pack, container_key, "");
+	if(container == NULL) {
+		mfs_log(LOG_CRIT, "Unable to allocate pack container");
+		return APR_ENOMEM;
+	}
+	container->size = (apr_size_t)apr_atoi64(line);
+	apr_uint64_t id = (apr_uint64_t)apr_strtoi64(container_key + strlen(pack->prefix), NULL, 16);
+	if(id > pack->last_id) {
+		pack->last_id = id;
+	}
+	while((line = apr_strtok(NULL, "\n", &line_state)) != NULL) {
+		char *field_state;
+		char *offset = apr_strtok(line, "\t", &field_state);
+		char *length = apr_strtok(NULL, "\t", &field_state);
+		char *name = apr_strtok(NULL, "\t", &field_state);
+		if(name == NULL) {
+			mfs_log(LOG_ERR, "Invalid line in pack index %s", index_key);
+			return APR_EGENERAL;
+		}
+		name = mfs_tracker_url_decode(name, pool);
+		apr_size_t name_length = strlen(name);
+		mfs_pack_object *object = malloc(sizeof(mfs_pack_object) + name_length);
+		if(object == NULL) {
+			mfs_log(LOG_CRIT, "Unable to allocate pack object");
+			return APR_ENOMEM;
+		}
+		memset(object, 0, sizeof(mfs_pack_object));
+		memcpy(object->name, name, name_length + 1);
+		object->offset = (apr_size_t)apr_atoi64(offset);
+		object->length = (apr_size_t)apr_atoi64(length);
+		if(object->offset + object->length > container->size) {
+			mfs_log(LOG_ERR, "Object %s is past the end of pack container %s", name, container_key);
+			free(object);
+			return APR_EGENERAL;
+		}
+		mfs_pack_object *old = apr_hash_get(pack->objects, name, name_length);
+		if(old != NULL) {
+			mfs_pack_unlink(old);
+			apr_hash_set(pack->objects, old->name, name_length, NULL);
+			free(old);
+		}
+		mfs_pack_link(container, object);
+		apr_hash_set(pack->objects, object->name, name_length, object);
+	}
+	return APR_SUCCESS;
+}
+
+//store the index of a stored container. called with the flush lock held (so the container is not freed)
+apr_status_t mfs_pack_store_index(mfs_pack *pack, mfs_pack_container *container, apr_pool_t *pool) {
+	apr_status_t rv;
+	apr_thread_mutex_lock(pack->lock);
+	apr_array_header_t *lines = apr_array_make(pool, container->live_count + 1, sizeof(char *));
+	APR_ARRAY_PUSH(lines, char *) = apr_psprintf(pool, "%" APR_SIZE_T_FMT "\n", container->size);
+	mfs_pack_object *object = container->objects;
+	while((object != NULL) && (object->next != NULL)) {
+		object = object->next;
+	}
+	for(; object != NULL; object = object->prev) { //oldest (lowest offset) first
+		int name_length;
+		APR_ARRAY_PUSH(lines, char *) = apr_psprintf(pool, "%" APR_SIZE_T_FMT "\t%" APR_SIZE_T_FMT "\t%s\n", object->offset, object->length, mfs_tracker_url_encode(object->name, pool, &name_length));
+	}
+	container->index_dirty = false;
+	apr_thread_mutex_unlock(pack->lock);
+	char *text = apr_array_pstrcat(pool, lines, 0);
+	char *index_key = apr_pstrcat(pool, container->key, MFS_PACK_INDEX_SUFFIX, NULL);
+	if((rv = mfs_store_bytes(pack->file_system, pack->domain, index_key, pack->storage_class, pool, text, strlen(text))) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to store pack index %s:", index_key);
+		apr_thread_mutex_lock(pack->lock);
+		container->index_dirty = true;
+		apr_thread_mutex_unlock(pack->lock);
+	}
+	return rv;
+}
+
+apr_status_t mfs_pack_flush(mfs_pack *pack, apr_pool_t *pool) {
+	apr_thread_mutex_lock(pack->flush_lock);
+	apr_status_t rv = mfs_pack_flush_locked(pack, true, pool);
+	apr_thread_mutex_unlock(pack->flush_lock);
+	return rv;
+}
+
+//containers are only freed and their next pointers only change with the flush lock held, so the list can be walked without the lock.
+//without include_open the open container is left to be appended to
+apr_status_t mfs_pack_flush_locked(mfs_pack *pack, bool include_open, apr_pool_t *pool) {
+	apr_status_t rv = APR_SUCCESS, status;
+	apr_pool_t *p;
+	mfs_pack_container *container, *next;
+	bool stored_all = true; //every container that was in memory when the flush started is stored with its index
+	if((rv = apr_pool_create(&p, pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	apr_thread_mutex_lock(pack->lock);
+	if(include_open) {
+		pack->open = NULL; //stored with the full containers
+	}
+	container = pack->containers;
+	apr_thread_mutex_unlock(pack->lock);
+	for(; container != NULL; container = next) {
+		next = container->next;
+		apr_pool_clear(p);
+		apr_thread_mutex_lock(pack->lock);
+		char *data = container->data;
+		bool empty = (container->live_count == 0);
+		bool index_dirty = container->index_dirty;
+		bool open = (container == pack->open);
+		apr_thread_mutex_unlock(pack->lock);
+		if(open) {
+			if(!empty) { //it may hold objects compacted out of containers that must not be deleted yet
+				stored_all = false;
+			}
+		} else if(data == NULL) {
+			if(index_dirty && !empty && ((status = mfs_pack_store_index(pack, container, p)) != APR_SUCCESS)) {
+				rv = status;
+				stored_all = false;
+			}
+		} else if(empty) { //everything in it was deleted before it was stored
+			mfs_pack_remove_container(pack, container);
+		} else if((status = mfs_store_bytes(pack->file_system, pack->domain, container->key, pack->storage_class, p, data, container->size)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, status, p, "Unable to store pack container %s:", container->key);
+			rv = status;
+			stored_all = false;
+		} else {
+			apr_atomic_inc32(&pack->container_count);
+			apr_thread_mutex_lock(pack->lock);
+			container->data = NULL;
+			apr_thread_mutex_unlock(pack->lock);
+			free(data);
+			if((status = mfs_pack_store_index(pack, container, p)) != APR_SUCCESS) {
+				rv = status;
+				stored_all = false;
+			}
+		}
+	}
+	//delete empty containers (index first so a restart never finds objects in a deleted container)
+	apr_thread_mutex_lock(pack->lock);
+	container = pack->containers;
+	apr_thread_mutex_unlock(pack->lock);
+	for(; container != NULL; container = next) {
+		next = container->next;
+		apr_pool_clear(p);
+		apr_thread_mutex_lock(pack->lock);
+		bool remove = (container->data == NULL) && (container->live_count == 0) && !container->busy && (stored_all || !container->moved);
+		apr_thread_mutex_unlock(pack->lock);
+		if(!remove) {
+			continue;
+		}
+		if(!container->index_deleted) {
+			char *index_key = apr_pstrcat(p, container->key, MFS_PACK_INDEX_SUFFIX, NULL);
+			if((status = mfs_delete(pack->file_system, pack->domain, index_key, p)) != APR_SUCCESS) {
+				mfs_log_apr(LOG_ERR, status, p, "Unable to delete pack index %s:", index_key);
+				rv = status;
+				continue;
+			}
+			container->index_deleted = true;
+		}
+		if((status = mfs_delete(pack->file_system, pack->domain, container->key, p)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, status, p, "Unable to delete pack container %s:", container->key);
+			rv = status;
+			continue;
+		}
+		mfs_pack_remove_container(pack, container);
+	}
+	apr_pool_destroy(p);
+	return rv;
+}
+
+apr_status_t mfs_pack_compact(mfs_pack *pack, double min_live_ratio, apr_pool_t *pool) {
+	apr_status_t rv = APR_SUCCESS, status;
+	apr_pool_t *p;
+	mfs_pack_container *container;
+	int i;
+	if(min_live_ratio <= 0) {
+		min_live_ratio = DEFAULT_PACK_COMPACT_RATIO;
+	}
+	//busy containers are not freed so they can be used without the lock
+	apr_array_header_t *candidates = apr_array_make(pool, 16, sizeof(mfs_pack_container *));
+	apr_thread_mutex_lock(pack->lock);
+	for(container = pack->containers; container != NULL; container = container->next) {
+		if((container->data == NULL) && !container->busy && (container->live_count > 0) && (container->live_bytes < min_live_ratio * container->size)) {
+			container->busy = true;
+			APR_ARRAY_PUSH(candidates, mfs_pack_container *) = container;
+		}
+	}
+	apr_thread_mutex_unlock(pack->lock);
+	if(candidates->nelts == 0) {
+		return APR_SUCCESS;
+	}
+	if((rv = apr_pool_create(&p, pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	for(i = 0; i < candidates->nelts; i++) {
+		container = APR_ARRAY_IDX(candidates, i, mfs_pack_container *);
+		apr_pool_clear(p);
+		char *key = apr_pstrdup(p, container->key); //the container may be freed once it is no longer busy
+		void *bytes = NULL;
+		status = mfs_pack_read_range(pack, key, 0, container->size, &bytes, p);
+		//moved with the flush lock held so the next flush stores every copy before it deletes the container
+		apr_thread_mutex_lock(pack->flush_lock);
+		apr_thread_mutex_lock(pack->lock);
+		if(status == APR_SUCCESS) {
+			apr_size_t reclaimed = container->size - container->live_bytes;
+			while(container->objects != NULL) {
+				mfs_pack_object *object = container->objects;
+				mfs_pack_unlink(object);
+				if((status = mfs_pack_append(pack, object, (char *)bytes + object->offset)) != APR_SUCCESS) {
+					mfs_pack_link(container, object);
+					break;
+				}
+			}
+			container->moved = true;
+			if(status == APR_SUCCESS) {
+				apr_atomic_inc32(&pack->compact_count);
+				pack->reclaimed_bytes += reclaimed;
+			}
+		}
+		container->busy = false;
+		apr_thread_mutex_unlock(pack->lock);
+		apr_thread_mutex_unlock(pack->flush_lock);
+		if(status != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, status, p, "Unable to compact pack container %s:", key);
+			rv = status;
+		}
+	}
+	apr_pool_destroy(p);
+	if((status = mfs_pack_flush(pack, pool)) != APR_SUCCESS) {
+		rv = status;
+	}
+	return rv;
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+downloads to a file split into ranges.
+the first range is fetched on its own: its Content-Range gives the size of the file. the rest are handed out to threads from a shared
+counter and range n starts on replica n % path_count so a large file is read from every storage node at once. each range is written
+at its own offset with pwrite so the threads don't share a file position.
+a file smaller than min_size is not worth the threads: the rest of it after the first range is one request written straight to the file.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+#include <unistd.h>
+#include <errno.h>
+
+apr_status_t mfs_enable_parallel_download(mfs_file_system *file_system, apr_off_t min_size, apr_size_t range_size, int thread_count) {
+	if(file_system->parallel_download != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_parallel_download called when parallel downloads are already enabled");
+		return APR_EGENERAL;
+	}
+	mfs_parallel_download *config = apr_pcalloc(file_system->pool, sizeof(mfs_parallel_download));
+	config->min_size = (min_size > 0) ? min_size : DEFAULT_PARALLEL_DOWNLOAD_MIN_SIZE;
+	config->range_size = (range_size > 0) ? range_size : DEFAULT_PARALLEL_DOWNLOAD_RANGE_SIZE;
+	config->thread_count = (thread_count > 0) ? thread_count : DEFAULT_PARALLEL_DOWNLOAD_THREADS;
+	file_system->parallel_download = config;
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_parallel_write(apr_os_file_t fd, const char *data, apr_size_t length, apr_off_t offset) {
+	while(length > 0) {
+		ssize_t written = pwrite(fd, data, length, offset);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return APR_FROM_OS_ERROR(errno);
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+	return APR_SUCCESS;
+}
+
+//fetch range (trying each replica in turn) and write it to the file. the first range sets job->total
+apr_status_t mfs_parallel_fetch_range(mfs_parallel_job *job, apr_uint32_t range, apr_pool_t *pool) {
+	apr_status_t rv = APR_EGENERAL;
+	apr_size_t range_size = job->config->range_size;
+	apr_off_t offset = (apr_off_t)range * range_size;
+	apr_size_t length = range_size;
+	int i;
+	if((job->total >= 0) && (offset + (apr_off_t)length > job->total)) {
+		length = (apr_size_t)(job->total - offset);
+	}
+	for(i = 0; i < job->path_count; i++) {
+		char *path = job->paths[(range + i) % job->path_count];
+		apr_uri_t uri;
+		apr_pool_clear(pool);
+		if((rv = apr_uri_parse(pool, path, &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to parse get_url %s:", job->key, path);
+			continue;
+		}
+		mfs_fetch_options options;
+		memset(&options, 0, sizeof(options));
+		options.range_offset = offset;
+		options.range_length = length;
+		void *bytes = NULL;
+		apr_size_t received = 0;
+		apr_file_t *file = NULL;
+		if((rv = mfs_file_server_fetch(job->file_system, &uri, path, &bytes, &received, &file, NULL, pool, NULL, &options)) != APR_SUCCESS) {
+			mfs_log(LOG_ERR, "%s: Failed to get range %u from %s. Attempt count = %d/%d", job->key, range, path, i+1, job->path_count);
+			continue;
+		}
+		if((range == 0) && (options.response_code == 416)) { //an empty file
+			job->total = 0;
+			return APR_SUCCESS;
+		}
+		if(!mfs_range_response_ok(&options, received)) {
+			mfs_log(LOG_ERR, "%s: Unexpected response %ld to range %u from %s. Attempt count = %d/%d", job->key, options.response_code, range, path, i+1, job->path_count);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		if(range == 0) {
+			if(options.response_code == 200) { //the whole file
+				job->total = received;
+			} else if(options.range_total >= 0) {
+				job->total = options.range_total;
+			} else if(received < length) {
+				job->total = received;
+			} else {
+				mfs_log(LOG_ERR, "%s: %s did not give the size of the file", job->key, path);
+				return APR_ENOTIMPL;
+			}
+		} else if(received != length) {
+			mfs_log(LOG_ERR, "%s: Range %u from %s was %" APR_SIZE_T_FMT " bytes instead of %" APR_SIZE_T_FMT ". Attempt count = %d/%d", job->key, range, path, received, length, i+1, job->path_count);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		if((rv = mfs_parallel_write(job->fd, bytes, received, job->start + offset)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to write range %u:", job->key, range);
+			return rv;
+		}
+		apr_atomic_inc32(&job->config->range_count);
+		if(i > 0) {
+			apr_atomic_inc32(&job->config->retry_count);
+		}
+		return APR_SUCCESS;
+	}
+	return rv;
+}
+
+//the rest of the file after the first range in one request from the replica range 1 would start on
+apr_status_t mfs_parallel_fetch_rest(mfs_parallel_job *job, apr_file_t *file, apr_pool_t *pool) {
+	apr_status_t rv = APR_EGENERAL;
+	apr_off_t offset = (apr_off_t)job->config->range_size;
+	apr_size_t length = (apr_size_t)(job->total - offset);
+	int i;
+	for(i = 0; i < job->path_count; i++) {
+		char *path = job->paths[(1 + i) % job->path_count];
+		apr_uri_t uri;
+		apr_pool_clear(pool);
+		if((rv = apr_uri_parse(pool, path, &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to parse get_url %s:", job->key, path);
+			continue;
+		}
+		apr_off_t position = job->start + offset;
+		if((rv = apr_file_seek(file, APR_SET, &position)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to seek the download file:", job->key);
+			return rv;
+		}
+		mfs_fetch_options options;
+		memset(&options, 0, sizeof(options));
+		options.range_offset = offset;
+		options.check_length = true; //a server that ignores the range sends the whole file: stop before it is written
+		options.required_length = (apr_off_t)length;
+		void *bytes = NULL;
+		apr_size_t received = 0;
+		apr_file_t *f = file;
+		if((rv = mfs_file_server_fetch(job->file_system, &uri, path, &bytes, &received, &f, NULL, pool, NULL, &options)) != APR_SUCCESS) {
+			mfs_log(LOG_ERR, "%s: Failed to get the rest of the file from %s. Attempt count = %d/%d", job->key, path, i+1, job->path_count);
+			continue;
+		}
+		if((options.response_code != 206) || (options.range_start != offset) || (received != length)) {
+			mfs_log(LOG_ERR, "%s: Unexpected response %ld (%" APR_SIZE_T_FMT " bytes) to the rest of the file from %s. Attempt count = %d/%d", job->key, options.response_code, received, path, i+1, job->path_count);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		return apr_file_flush(file);
+	}
+	return rv;
+}
+
+//fetch ranges from the shared counter until they run out or one fails
+void mfs_parallel_download_ranges(mfs_parallel_job *job) {
+	apr_pool_t *pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&pool, NULL)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to create apr_pool");
+		job->rv = rv;
+		apr_atomic_set32(&job->failed, 1);
+		return;
+	}
+	while(apr_atomic_read32(&job->failed) == 0) {
+		apr_uint32_t range = apr_atomic_inc32(&job->next_range);
+		if(range >= job->range_count) {
+			break;
+		}
+		if((rv = mfs_parallel_fetch_range(job, range, pool)) != APR_SUCCESS) {
+			job->rv = rv;
+			apr_atomic_set32(&job->failed, 1);
+		}
+	}
+	apr_pool_destroy(pool);
+}
+
+void* APR_THREAD_FUNC mfs_parallel_download_thread(apr_thread_t *thd, void *data) {
+	mfs_parallel_download_ranges((mfs_parallel_job *)data);
+	apr_thread_exit(thd, APR_SUCCESS);
+	return NULL;
+}
+
+apr_status_t mfs_parallel_download_file(mfs_file_system *file_system, const char *key, char **paths, int path_count, apr_file_t *file, apr_size_t *total_bytes, apr_pool_t *pool) {
+	mfs_parallel_download *config = file_system->parallel_download;
+	apr_status_t rv;
+	apr_pool_t *range_pool;
+	mfs_parallel_job *job = apr_pcalloc(pool, sizeof(mfs_parallel_job));
+	job->file_system = file_system;
+	job->config = config;
+	job->key = key;
+	job->paths = paths;
+	job->path_count = path_count;
+	job->total = -1;
+	if(((rv = apr_file_flush(file)) != APR_SUCCESS) || ((rv = apr_file_seek(file, APR_CUR, &job->start)) != APR_SUCCESS) || ((rv = apr_os_file_get(&job->fd, file)) != APR_SUCCESS)) {
+		mfs_log_apr(LOG_ERR, rv, pool, "%s: Unable to get the position of the download file:", key);
+		return rv;
+	}
+	if((rv = apr_pool_create(&range_pool, pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	rv = mfs_parallel_fetch_range(job, 0, range_pool);
+	if((rv == APR_SUCCESS) && (job->total > (apr_off_t)config->range_size) && (job->total < config->min_size)) {
+		rv = mfs_parallel_fetch_rest(job, file, range_pool);
+	}
+	apr_pool_destroy(range_pool);
+	if(rv != APR_SUCCESS) {
+		return rv;
+	}
+	job->range_count = (apr_uint32_t)((job->total + config->range_size - 1) / config->range_size);
+	job->next_range = 1;
+	if((job->range_count > 1) && (job->total >= config->min_size)) {
+		int thread_count = config->thread_count;
+		int started = 0;
+		int i;
+		if(thread_count > (int)job->range_count - 1) {
+			thread_count = job->range_count - 1;
+		}
+		if(thread_count > 1) {
+			apr_atomic_inc32(&config->download_count);
+			apr_thread_t **threads = apr_pcalloc(pool, sizeof(apr_thread_t *) * thread_count);
+			apr_threadattr_t *thd_attr;
+			apr_threadattr_create(&thd_attr, pool);
+			for(i = 0; i < thread_count; i++) {
+				if((rv = apr_thread_create(&threads[i], thd_attr, mfs_parallel_download_thread, (void*)job, pool)) != APR_SUCCESS) {
+					mfs_log_apr(LOG_CRIT, rv, pool, "Unable to start mfs_parallel_download_thread thread.:");
+					threads[i] = NULL;
+				} else {
+					started++;
+				}
+			}
+			for(i = 0; i < thread_count; i++) {
+				if(threads[i] != NULL) {
+					apr_status_t rv2;
+					apr_thread_join(&rv2, threads[i]);
+				}
+			}
+		}
+		if(started == 0) { //one range after another in this thread
+			mfs_parallel_download_ranges(job);
+		}
+		if(apr_atomic_read32(&job->failed) != 0) {
+			return job->rv;
+		}
+	}
+	*total_bytes = (apr_size_t)job->total;
+	return APR_SUCCESS;
+}
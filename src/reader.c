@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+file like reading of a key.
+nothing happens until the first read: then the paths are looked up and a transfer from the current position to the end of the file
+is added to a curl multi handle owned by the reader. the multi handle is only driven from mfs_read so the transfer goes no faster than
+the caller reads. when the buffer is full the write callback pauses the transfer (CURL_WRITEFUNC_PAUSE) and it is resumed once the
+caller has emptied the buffer. cURL's receive buffer is set no larger than ours so a block always fits once it is empty: the buffer
+never grows. a seek inside the buffer just drops bytes, anywhere else drops the transfer and the next read starts a
+range request at the new position. a replica that fails is replaced by the next one from where the buffer ends.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <curl/curl.h>
+
+apr_status_t mfs_reader_resolve(mfs_reader *reader);
+apr_status_t mfs_reader_start(mfs_reader *reader);
+void mfs_reader_stop(mfs_reader *reader, bool reuse);
+apr_status_t mfs_reader_finish(mfs_reader *reader, CURLcode result);
+apr_status_t mfs_reader_pump(mfs_reader *reader);
+apr_status_t mfs_reader_wait(mfs_reader *reader, bool for_size);
+
+apr_status_t mfs_open(mfs_file_system *file_system, char *domain, char *key, apr_size_t buffer_size, mfs_reader **reader, apr_pool_t *pool) {
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p, pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_reader *r = apr_pcalloc(p, sizeof(mfs_reader));
+	r->file_system = file_system;
+	r->pool = p;
+	r->domain = apr_pstrdup(p, domain);
+	r->key = apr_pstrdup(p, key);
+	r->size = -1;
+	r->buffer_size = (buffer_size > 0) ? buffer_size : DEFAULT_READER_BUFFER_SIZE;
+	if(r->buffer_size < MIN_READER_BUFFER_SIZE) {
+		r->buffer_size = MIN_READER_BUFFER_SIZE;
+	}
+	r->buffer = apr_palloc(p, r->buffer_size);
+	if((r->multi = curl_multi_init()) == NULL) {
+		mfs_log(LOG_CRIT, "Unable to curl_multi_init");
+		apr_pool_destroy(p);
+		return APR_EGENERAL;
+	}
+	*reader = r;
+	return APR_SUCCESS;
+}
+
+void mfs_close(mfs_reader *reader) {
+	mfs_reader_stop(reader, false);
+	curl_multi_cleanup(reader->multi);
+	if(reader->local_file != NULL) {
+		apr_file_close(reader->local_file);
+	}
+	apr_pool_destroy(reader->pool);
+}
+
+//a copy on this machine is read directly, otherwise the paths are kept for the transfers
+apr_status_t mfs_reader_resolve(mfs_reader *reader) {
+	mfs_file_system *file_system = reader->file_system;
+	apr_status_t rv;
+	apr_off_t size;
+	int i;
+	if((file_system->mirrors != NULL) && (mfs_mirror_open(file_system, reader->domain, reader->key, &reader->local_file, &size, reader->pool) == APR_SUCCESS)) {
+		reader->size = size;
+		return APR_SUCCESS;
+	}
+	if((rv = mfs_get_paths(file_system, reader->domain, reader->key, true, &reader->paths, &reader->path_count, reader->pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_DEBUG, rv, reader->pool, "Unable to get paths for %s.%s:", reader->domain, reader->key);
+		reader->paths = NULL;
+		return rv;
+	}
+	if(apr_hash_count(file_system->local_docroots) > 0) {
+		for(i = 0; i < reader->path_count; i++) {
+			char *local_path = mfs_local_path(file_system, reader->paths[i], reader->pool);
+			if((local_path != NULL) && (mfs_local_file_open(local_path, &reader->local_file, &size, reader->pool) == APR_SUCCESS)) {
+				reader->size = size;
+				return APR_SUCCESS;
+			}
+		}
+	}
+	return APR_SUCCESS;
+}
+
+//called by cURL when data is ready to read
+size_t mfs_reader_write_callback(void *ptr, size_t size, size_t nmemb, void *stream) {
+	mfs_reader *reader = (mfs_reader *)stream;
+	apr_size_t length = size * nmemb;
+	const char *data = ptr;
+	if(!reader->started) { //an error page is not the file
+		long response_code = 0;
+		curl_easy_getinfo(reader->conn->curl, CURLINFO_RESPONSE_CODE, &response_code);
+		if(response_code == 200) { //the server ignored the range
+			curl_off_t content_length = -1;
+			curl_easy_getinfo(reader->conn->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+			if(content_length >= 0) {
+				reader->size = (apr_off_t)content_length;
+			}
+			reader->skip = reader->transfer_offset;
+			reader->transfer_offset = 0;
+		} else if((response_code == 206) && (reader->options.range_start == reader->transfer_offset)) {
+			if(reader->options.range_total >= 0) {
+				reader->size = reader->options.range_total;
+			}
+		} else {
+			mfs_log(LOG_ERR, "%s: Unexpected response %ld to a read at %" APR_OFF_T_FMT, reader->key, response_code, reader->transfer_offset);
+			reader->transfer_rv = APR_EGENERAL;
+			return 0;
+		}
+		reader->started = true;
+	}
+	apr_size_t skipped = (reader->skip < length) ? (apr_size_t)reader->skip : length;
+	apr_size_t remaining = length - skipped;
+	if(remaining > reader->buffer_size) { //cURL's buffer is set no larger than ours so this should not happen: the buffer is not grown
+		mfs_log(LOG_ERR, "%s: cURL handed over %ld bytes for a %ld byte read buffer", reader->key, (long)remaining, (long)reader->buffer_size);
+		reader->transfer_rv = APR_ENOSPC;
+		return 0;
+	}
+	if(remaining > reader->buffer_size - reader->buffer_length) {
+		reader->paused = true; //cURL keeps the block and gives it to us again once the transfer is resumed
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	reader->skip -= skipped;
+	reader->transfer_offset += skipped;
+	if(reader->buffer_start + reader->buffer_length + remaining > reader->buffer_size) {
+		memmove(reader->buffer, reader->buffer + reader->buffer_start, reader->buffer_length);
+		reader->buffer_start = 0;
+	}
+	memcpy(reader->buffer + reader->buffer_start + reader->buffer_length, data + skipped, remaining);
+	reader->buffer_length += remaining;
+	reader->transfer_offset += remaining;
+	return length;
+}
+
+//called by cURL for each response header line
+size_t mfs_reader_header_callback(char *ptr, size_t size, size_t nmemb, void *stream) {
+	mfs_reader *reader = (mfs_reader *)stream;
+	apr_size_t length = size * nmemb;
+	char content_range[MFS_VALIDATOR_SIZE] = "";
+	mfs_copy_header_value(ptr, length, "Content-Range", content_range);
+	if(content_range[0] != '\0') {
+		mfs_parse_content_range(content_range, &reader->options);
+	}
+	return length;
+}
+
+//start a transfer from the end of the buffer to the end of the file on the current path (or the next one that can be reached)
+apr_status_t mfs_reader_start(mfs_reader *reader) {
+	mfs_file_system *file_system = reader->file_system;
+	apr_status_t rv = APR_EGENERAL;
+	for(; reader->path_index < reader->path_count; reader->path_index++) {
+		char *path = reader->paths[reader->path_index];
+		apr_uri_t uri;
+		if((rv = apr_uri_parse(reader->pool, path, &uri)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, reader->pool, "%s: Unable to parse get_url %s:", reader->key, path);
+			continue;
+		}
+		if((uri.hostinfo == NULL)||(uri.scheme == NULL)||(uri.path==NULL)) {
+			mfs_log(LOG_ERR, "%s: Unable to parse get_url %s:", reader->key, path);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		if((rv = mfs_get_file_server(file_system, &uri, &reader->file_server)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, reader->pool, "Unable to get file server for %s:", uri.hostinfo);
+			continue;
+		}
+		if((rv = apr_reslist_acquire(reader->file_server->connections, (void**)&reader->conn)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, reader->pool, "Unable to get file server connection for %s:", uri.hostinfo);
+			reader->conn = NULL;
+			continue;
+		}
+		apr_atomic_inc32(&reader->file_server->downloads);
+		reader->transfer_offset = reader->position + reader->buffer_length;
+		reader->skip = 0;
+		reader->started = false;
+		reader->paused = false;
+		reader->transfer_rv = APR_SUCCESS;
+		reader->options.range_start = -1;
+		reader->options.range_end = -1;
+		reader->options.range_total = -1;
+		CURL *curl = reader->conn->curl;
+		curl_easy_setopt(curl, CURLOPT_URL, path);
+		curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, mfs_reader_write_callback);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, reader);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, mfs_reader_header_callback);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, reader);
+		if(reader->transfer_offset > 0) {
+			char range[64];
+			apr_snprintf(range, sizeof(range), "%" APR_OFF_T_FMT "-", reader->transfer_offset);
+			curl_easy_setopt(curl, CURLOPT_RANGE, range);
+		}
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, apr_time_as_msec(file_system->file_server_timeout));
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_READFUNCTION, NULL);
+		curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
+		//a paused transfer is up to the caller: cURL's low speed abort would fire while it is not reading
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+		//a block must fit in an empty buffer or pausing would never let it through
+		curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)((reader->buffer_size < CURL_MAX_READ_SIZE) ? reader->buffer_size : CURL_MAX_READ_SIZE));
+		if(curl_multi_add_handle(reader->multi, curl) != CURLM_OK) {
+			mfs_log(LOG_ERR, "Unable to add read of %s to curl multi handle", path);
+			mfs_reader_stop(reader, false);
+			rv = APR_EGENERAL;
+			continue;
+		}
+		return APR_SUCCESS;
+	}
+	mfs_log(LOG_ERR, "%s: No replica left to read from at %" APR_OFF_T_FMT, reader->key, reader->position + (apr_off_t)reader->buffer_length);
+	return rv;
+}
+
+//give the connection back: a finished transfer can be reused, one dropped part way through can't
+void mfs_reader_stop(mfs_reader *reader, bool reuse) {
+	apr_status_t rv;
+	if(reader->conn == NULL) {
+		return;
+	}
+	CURL *curl = reader->conn->curl;
+	curl_multi_remove_handle(reader->multi, curl);
+	apr_atomic_dec32(&reader->file_server->downloads);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+	curl_easy_setopt(curl, CURLOPT_RANGE, NULL);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)CURL_MAX_WRITE_SIZE);
+	if(reuse) {
+		if((rv = apr_reslist_release(reader->file_server->connections, reader->conn)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, reader->pool, "Unable to release file server connection for %s:", reader->file_server->url);
+		}
+	} else if((rv = apr_reslist_invalidate(reader->file_server->connections, reader->conn)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, reader->pool, "Unable to invalidate file server connection for %s:", reader->file_server->url);
+	}
+	reader->conn = NULL;
+	reader->paused = false;
+}
+
+//the transfer has ended: at the end of the file, or it failed and the next replica carries on
+apr_status_t mfs_reader_finish(mfs_reader *reader, CURLcode result) {
+	long response_code = 0;
+	curl_easy_getinfo(reader->conn->curl, CURLINFO_RESPONSE_CODE, &response_code);
+	if((result == CURLE_OK) && (reader->transfer_rv == APR_SUCCESS)
+			&& (reader->started || ((response_code == 200) && (reader->transfer_offset == 0)) || (response_code == 416))) {
+		if((response_code == 416) && (reader->options.range_total >= 0)) {
+			reader->size = reader->options.range_total;
+		} else {
+			reader->size = reader->transfer_offset; //the transfer always runs to the end of the file
+		}
+		mfs_reader_stop(reader, true);
+		return APR_SUCCESS;
+	}
+	mfs_log(LOG_ERR, "%s: Failed to read from %s at %" APR_OFF_T_FMT ":%s (%ld)", reader->key, reader->paths[reader->path_index], reader->transfer_offset, curl_easy_strerror(result), response_code);
+	mfs_reader_stop(reader, false);
+	reader->path_index++;
+	return mfs_reader_start(reader);
+}
+
+//one turn of the multi handle
+apr_status_t mfs_reader_pump(mfs_reader *reader) {
+	int running;
+	int msgs_left;
+	CURLMsg *msg;
+	if(reader->paused && (reader->buffer_length == 0)) {
+		reader->paused = false;
+		curl_easy_pause(reader->conn->curl, CURLPAUSE_CONT); //this may deliver the held block (and pause again)
+	}
+	curl_multi_perform(reader->multi, &running);
+	while((msg = curl_multi_info_read(reader->multi, &msgs_left)) != NULL) {
+		if(msg->msg == CURLMSG_DONE) {
+			return mfs_reader_finish(reader, msg->data.result);
+		}
+	}
+	if((reader->buffer_length == 0) && !reader->paused) {
+		curl_multi_wait(reader->multi, NULL, 0, 1000, NULL);
+	}
+	return APR_SUCCESS;
+}
+
+//drive the transfer until there is something in the buffer (or the size is known). returns with an empty buffer at the end of the file
+apr_status_t mfs_reader_wait(mfs_reader *reader, bool for_size) {
+	apr_status_t rv;
+	if((reader->paths == NULL) && (reader->local_file == NULL) && ((rv = mfs_reader_resolve(reader)) != APR_SUCCESS)) {
+		return rv;
+	}
+	while((reader->buffer_length == 0) || (for_size && (reader->size < 0))) {
+		if(reader->conn == NULL) {
+			if((reader->size >= 0) && (reader->position + (apr_off_t)reader->buffer_length >= reader->size)) {
+				return APR_SUCCESS;
+			}
+			if((rv = mfs_reader_start(reader)) != APR_SUCCESS) {
+				return rv;
+			}
+		} else if(for_size && reader->paused) { //the buffer is full and the server did not say how big the file is
+			return APR_ENOTIMPL;
+		}
+		if((rv = mfs_reader_pump(reader)) != APR_SUCCESS) {
+			return rv;
+		}
+	}
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_read(mfs_reader *reader, void *data, apr_size_t *length) {
+	apr_status_t rv;
+	apr_size_t wanted = *length;
+	*length = 0;
+	if(wanted == 0) {
+		return APR_SUCCESS;
+	}
+	if((reader->paths == NULL) && (reader->local_file == NULL) && ((rv = mfs_reader_resolve(reader)) != APR_SUCCESS)) {
+		return rv;
+	}
+	if(reader->local_file != NULL) {
+		*length = wanted;
+		rv = apr_file_read(reader->local_file, data, length);
+		if(rv == APR_SUCCESS) {
+			reader->position += *length;
+		}
+		return rv;
+	}
+	if((rv = mfs_reader_wait(reader, false)) != APR_SUCCESS) {
+		return rv;
+	}
+	if(reader->buffer_length == 0) {
+		return APR_EOF;
+	}
+	apr_size_t n = (wanted < reader->buffer_length) ? wanted : reader->buffer_length;
+	memcpy(data, reader->buffer + reader->buffer_start, n);
+	reader->buffer_start += n;
+	reader->buffer_length -= n;
+	if(reader->buffer_length == 0) {
+		reader->buffer_start = 0;
+	}
+	reader->position += n;
+	*length = n;
+	return APR_SUCCESS;
+}
+
+apr_status_t mfs_seek(mfs_reader *reader, apr_seek_where_t where, apr_off_t *offset) {
+	apr_status_t rv;
+	apr_off_t target;
+	if((reader->paths == NULL) && (reader->local_file == NULL) && ((rv = mfs_reader_resolve(reader)) != APR_SUCCESS)) {
+		return rv;
+	}
+	if(reader->local_file != NULL) {
+		if((rv = apr_file_seek(reader->local_file, where, offset)) == APR_SUCCESS) {
+			reader->position = *offset;
+		}
+		return rv;
+	}
+	switch(where) {
+	case APR_SET:
+		target = *offset;
+		break;
+	case APR_CUR:
+		target = reader->position + *offset;
+		break;
+	case APR_END:
+		if((reader->size < 0) && ((rv = mfs_reader_wait(reader, true)) != APR_SUCCESS)) {
+			return rv;
+		}
+		target = reader->size + *offset;
+		break;
+	default:
+		return APR_EINVAL;
+	}
+	if(target < 0) {
+		return APR_EINVAL;
+	}
+	if((target >= reader->position) && (target <= reader->position + (apr_off_t)reader->buffer_length)) {
+		apr_size_t dropped = (apr_size_t)(target - reader->position);
+		reader->buffer_start += dropped;
+		reader->buffer_length -= dropped;
+	} else {
+		mfs_reader_stop(reader, false);
+		reader->buffer_start = 0;
+		reader->buffer_length = 0;
+		if(reader->path_index >= reader->path_count) { //every replica failed before: try them all again
+			reader->path_index = 0;
+		}
+	}
+	reader->position = target;
+	*offset = target;
+	return APR_SUCCESS;
+}
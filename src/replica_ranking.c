@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+orders replicas by what we have seen of their file servers.
+every download adds to exponentially weighted moving averages of the time to the first byte, the throughput and the error rate kept
+with the mfs_file_server. paths are then sorted by the expected time to fetch a typical file. a host that failed is only tried last
+so it would never get a chance to show it has recovered: every explore_interval rankings the worst path goes first instead.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+
+apr_status_t mfs_enable_replica_ranking(mfs_file_system *file_system, double alpha, int explore_interval) {
+	if(file_system->replica_ranking != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_replica_ranking called when replica ranking is already enabled");
+		return APR_EGENERAL;
+	}
+	mfs_replica_ranking *ranking = apr_pcalloc(file_system->pool, sizeof(mfs_replica_ranking));
+	ranking->alpha = ((alpha > 0) && (alpha <= 1)) ? alpha : DEFAULT_REPLICA_RANKING_ALPHA;
+	ranking->explore_interval = (explore_interval >= 0) ? explore_interval : DEFAULT_REPLICA_RANKING_EXPLORE_INTERVAL;
+	file_system->replica_ranking = ranking;
+	return APR_SUCCESS;
+}
+
+void mfs_host_stats_record(mfs_file_system *file_system, mfs_file_server *file_server, bool ok, double ttfb, double bytes, double elapsed) {
+	mfs_replica_ranking *ranking = file_system->replica_ranking;
+	if(ranking == NULL) {
+		return;
+	}
+	apr_status_t rv = apr_thread_mutex_lock(file_server->stats_lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock file server stats mutex:");
+		return;
+	}
+	mfs_host_stats *stats = &file_server->stats;
+	double alpha = (stats->samples == 0) ? 1.0 : ranking->alpha;
+	stats->error_rate = alpha * (ok ? 0.0 : 1.0) + (1.0 - alpha) * stats->error_rate;
+	if(ok) {
+		stats->ttfb = (stats->ttfb == 0) ? ttfb : ranking->alpha * ttfb + (1.0 - ranking->alpha) * stats->ttfb;
+		double transfer = elapsed - ttfb;
+		//a small body arrives with the first byte and says nothing about throughput
+		if((bytes > 0) && (transfer > 0.001)) {
+			double throughput = bytes / transfer;
+			stats->throughput = (stats->throughput == 0) ? throughput : ranking->alpha * throughput + (1.0 - ranking->alpha) * stats->throughput;
+		}
+	}
+	stats->samples++;
+	apr_thread_mutex_unlock(file_server->stats_lock);
+}
+
+double mfs_host_stats_cost(mfs_host_stats *stats, double size) {
+	if(stats->samples == 0) {
+		return 0;
+	}
+	double cost = stats->ttfb;
+	if(stats->throughput > 0) {
+		cost += size / stats->throughput;
+	}
+	//on average a failing host is asked 1 / (1 - error_rate) times for each success
+	double success = 1.0 - stats->error_rate;
+	if(success < MFS_REPLICA_RANKING_MIN_SUCCESS) {
+		success = MFS_REPLICA_RANKING_MIN_SUCCESS;
+	}
+	//an unreachable host fails with no ttfb: it still has to cost more than a working one
+	if(cost == 0) {
+		cost = apr_time_as_msec(DEFAULT_FILE_SERVER_TIMEOUT) / 1000.0;
+	}
+	return cost / success;
+}
+
+void mfs_rank_paths(mfs_file_system *file_system, char **paths, int path_count, apr_pool_t *pool) {
+	mfs_replica_ranking *ranking = file_system->replica_ranking;
+	int i, j;
+	if(path_count < 2) {
+		return;
+	}
+	double *costs = apr_palloc(pool, sizeof(double) * path_count);
+	for(i = 0; i < path_count; i++) {
+		apr_uri_t uri;
+		mfs_file_server *file_server;
+		costs[i] = 0;
+		if((apr_uri_parse(pool, paths[i], &uri) == APR_SUCCESS) && (uri.hostinfo != NULL) && (mfs_get_file_server(file_system, &uri, &file_server) == APR_SUCCESS)) {
+			if(apr_thread_mutex_lock(file_server->stats_lock) == APR_SUCCESS) {
+				costs[i] = mfs_host_stats_cost(&file_server->stats, MFS_REPLICA_RANKING_SIZE);
+				apr_thread_mutex_unlock(file_server->stats_lock);
+			}
+		}
+	}
+	//insertion sort: there are only a few paths and equal costs keep the tracker's order
+	bool reordered = false;
+	for(i = 1; i < path_count; i++) {
+		for(j = i; (j > 0) && (costs[j - 1] > costs[j]); j--) {
+			double cost = costs[j];
+			costs[j] = costs[j - 1];
+			costs[j - 1] = cost;
+			char *path = paths[j];
+			paths[j] = paths[j - 1];
+			paths[j - 1] = path;
+			reordered = true;
+		}
+	}
+	if(reordered) {
+		apr_atomic_inc32(&ranking->reordered_count);
+	}
+	if((ranking->explore_interval > 0) && (((apr_atomic_inc32(&ranking->rankings) + 1) % ranking->explore_interval) == 0) && (costs[path_count - 1] > costs[0])) {
+		char *worst = paths[path_count - 1];
+		for(i = path_count - 1; i > 0; i--) {
+			paths[i] = paths[i - 1];
+		}
+		paths[0] = worst;
+		apr_atomic_inc32(&ranking->explored_count);
+	}
+}
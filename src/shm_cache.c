@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+cross process get_paths cache in a named apr_shm segment.
+the segment is a header followed by a fixed number of fixed size slots (open addressing, linear probing).
+each slot is protected by a sequence lock:
+	writers cas the sequence from even to odd, write, then increment it back to even.
+	readers copy the slot out and retry if the sequence was odd or changed while copying.
+so readers never block and never take a lock.
+a put only writes one slot at a time so two puts of the same key can leave it in two slots: once its slot is unlocked the writer
+looks for other copies and expires them. remove and clear wait for each slot they have to change.
+the header counts the file systems attached to the segment and the last to go removes it. the creator's pool would remove it on
+destroy (apr_shm_create registers that cleanup) so a creator that is not the last keeps its pool, and its mapping, until it exits.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_shm.h>
+#include <stdlib.h>
+
+#define MFS_SHM_CACHE_MAGIC 0x4d465343 //MFSC
+#define MFS_SHM_CACHE_VERSION 2
+#define MFS_SHM_CACHE_PROBE_LIMIT 8 //max slots looked at for a key
+#define MFS_SHM_CACHE_READ_RETRIES 4 //how many times a reader retries a slot that is being written
+#define MFS_SHM_CACHE_STUCK_TIME apr_time_from_sec(1) //a slot locked this long belonged to a process that died while writing it
+
+typedef struct _mfs_shm_cache_header {
+	apr_uint32_t magic;
+	apr_uint32_t version;
+	apr_uint32_t slot_count;
+	apr_uint32_t slot_size;
+	volatile apr_uint32_t attach_count;
+} mfs_shm_cache_header;
+
+typedef struct {
+	volatile apr_uint32_t sequence; //odd while being written
+	apr_uint32_t hash; //0 means the slot has never been used
+	apr_time_t expires_at;
+	apr_uint16_t key_length; //domain + \0 + key
+	apr_uint16_t data_length; //key + \0 terminated paths
+	apr_uint16_t path_count;
+	char data[1];
+} mfs_shm_cache_slot;
+
+#define MFS_SHM_CACHE_SLOT_STRIDE(slot_size) APR_ALIGN_DEFAULT(APR_OFFSETOF(mfs_shm_cache_slot, data) + (slot_size))
+
+mfs_shm_cache_slot * mfs_shm_cache_slot_at(mfs_shm_cache *cache, apr_uint32_t index) {
+	return (mfs_shm_cache_slot *)(cache->slots + ((apr_size_t)index * MFS_SHM_CACHE_SLOT_STRIDE(cache->slot_size)));
+}
+
+apr_status_t mfs_enable_shm_cache(mfs_file_system *file_system, const char *filename, int slot_count, apr_interval_time_t ttl) {
+	if(file_system->shm_cache != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_shm_cache called when the shared memory cache is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	//unmanaged: apr_terminate must not remove the segment while other processes use it
+	if((rv = apr_pool_create_unmanaged_ex(&p, NULL, NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	apr_atomic_init(p);
+	mfs_shm_cache *cache = apr_pcalloc(p, sizeof(mfs_shm_cache));
+	cache->pool = p;
+	cache->filename = apr_pstrdup(p, filename);
+	cache->ttl = (ttl > 0) ? ttl : DEFAULT_SHM_CACHE_TTL;
+	cache->slot_size = MFS_SHM_CACHE_SLOT_SIZE;
+	if(slot_count <= 0) {
+		slot_count = DEFAULT_SHM_CACHE_SLOTS;
+	}
+	apr_size_t size = APR_ALIGN_DEFAULT(sizeof(mfs_shm_cache_header)) + ((apr_size_t)slot_count * MFS_SHM_CACHE_SLOT_STRIDE(cache->slot_size));
+
+	//another process may have already created it...
+	bool created = false;
+	if((rv = apr_shm_attach(&cache->shm, filename, p)) != APR_SUCCESS) {
+		if((rv = apr_shm_create(&cache->shm, size, filename, p)) == APR_SUCCESS) {
+			created = true;
+		} else if((rv = apr_shm_attach(&cache->shm, filename, p)) != APR_SUCCESS) { //lost a race with another process creating it
+			mfs_log_apr(LOG_ERR, rv, p, "Unable to create or attach shared memory cache %s:", filename);
+			apr_pool_destroy(p);
+			return rv;
+		}
+	}
+	mfs_shm_cache_header *header = apr_shm_baseaddr_get(cache->shm);
+	if(created) {
+		memset(header, 0, size);
+		header->version = MFS_SHM_CACHE_VERSION;
+		header->slot_count = slot_count;
+		header->slot_size = cache->slot_size;
+		apr_atomic_set32(&header->magic, MFS_SHM_CACHE_MAGIC); //set last so attachers know its ready
+	} else if((apr_atomic_read32(&header->magic) != MFS_SHM_CACHE_MAGIC) || (header->version != MFS_SHM_CACHE_VERSION) || (header->slot_size != cache->slot_size) || (header->slot_count == 0)
+			|| (apr_shm_size_get(cache->shm) < APR_ALIGN_DEFAULT(sizeof(mfs_shm_cache_header)) + ((apr_size_t)header->slot_count * MFS_SHM_CACHE_SLOT_STRIDE(cache->slot_size)))) {
+		mfs_log(LOG_ERR, "Shared memory cache %s has an incompatible layout (magic=%x, version=%d, slot_size=%d). Remove it or use another file", filename, header->magic, header->version, header->slot_size);
+		apr_shm_detach(cache->shm);
+		apr_pool_destroy(p);
+		return APR_EGENERAL;
+	}
+	cache->created = created;
+	cache->header = header;
+	apr_atomic_inc32(&header->attach_count);
+	cache->slot_count = header->slot_count; //the segment may have been created with a different count: it wins
+	cache->slots = (char *)header + APR_ALIGN_DEFAULT(sizeof(mfs_shm_cache_header));
+	file_system->shm_cache = cache;
+	mfs_log(LOG_INFO, "Shared memory cache %s %s. slots=%d, ttl=%d ms", filename, created ? "created" : "attached", cache->slot_count, (apr_int32_t)apr_time_as_msec(cache->ttl));
+	return APR_SUCCESS;
+}
+
+void mfs_shm_cache_destroy(mfs_shm_cache *cache) {
+	mfs_shm_cache_header *header = cache->header;
+	if(apr_atomic_dec32(&header->attach_count) == 0) { //the last one out removes it
+		if(!cache->created) {
+			apr_status_t rv = apr_shm_remove(cache->filename, cache->pool);
+			if(rv != APR_SUCCESS) {
+				mfs_log_apr(LOG_ERR, rv, cache->pool, "Unable to remove shared memory cache %s:", cache->filename);
+			}
+		}
+		apr_pool_destroy(cache->pool); //the creator's cleanup removes the segment
+	} else if(!cache->created) {
+		apr_pool_destroy(cache->pool); //detach
+	} else {
+		mfs_log(LOG_INFO, "Shared memory cache %s is still attached elsewhere: it is kept", cache->filename);
+	}
+}
+
+apr_uint32_t mfs_shm_cache_hash(const char *cache_key, apr_ssize_t cache_key_length) {
+	apr_uint32_t hash = apr_hashfunc_default(cache_key, &cache_key_length);
+	return (hash == 0) ? 1 : hash;
+}
+
+//domain + \0 + key
+char * mfs_shm_cache_key(const char *domain, const char *key, apr_size_t *length, apr_pool_t *pool) {
+	apr_size_t domain_length = strlen(domain);
+	apr_size_t key_length = strlen(key);
+	char *cache_key = apr_palloc(pool, domain_length + key_length + 2);
+	memcpy(cache_key, domain, domain_length + 1);
+	memcpy(cache_key + domain_length + 1, key, key_length + 1);
+	*length = domain_length + key_length + 1;
+	return cache_key;
+}
+
+bool mfs_shm_cache_get_paths(mfs_shm_cache *cache, const char *domain, const char *key, char ***paths, int *path_count, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_shm_cache_key(domain, key, &cache_key_length, pool);
+	apr_uint32_t hash = mfs_shm_cache_hash(cache_key, cache_key_length);
+	char *copy = apr_palloc(pool, cache->slot_size);
+	int probe;
+	for(probe = 0; probe < MFS_SHM_CACHE_PROBE_LIMIT; probe++) {
+		mfs_shm_cache_slot *slot = mfs_shm_cache_slot_at(cache, (hash + probe) % cache->slot_count);
+		int retries;
+		for(retries = 0; retries < MFS_SHM_CACHE_READ_RETRIES; retries++) {
+			apr_uint32_t sequence = apr_atomic_add32(&slot->sequence, 0); //full barrier read
+			if(sequence & 1) { //being written
+				continue;
+			}
+			apr_uint32_t slot_hash = slot->hash;
+			if(slot_hash == 0) { //never used: the key cant be further along
+				apr_atomic_inc32(&cache->miss_count);
+				return false;
+			}
+			if(slot_hash != hash) {
+				break; //try the next slot
+			}
+			apr_time_t expires_at = slot->expires_at;
+			apr_uint16_t key_length = slot->key_length;
+			apr_uint16_t data_length = slot->data_length;
+			apr_uint16_t pc = slot->path_count;
+			if((data_length > cache->slot_size) || (key_length > data_length)) { //torn read
+				continue;
+			}
+			memcpy(copy, slot->data, data_length);
+			if(apr_atomic_add32(&slot->sequence, 0) != sequence) { //written while we copied
+				continue;
+			}
+			//we have a consistent copy
+			if((key_length != cache_key_length) || (memcmp(copy, cache_key, key_length) != 0)) {
+				break; //hash collision: try the next slot
+			}
+			if((apr_time_now() >= expires_at) || (pc == 0)) {
+				apr_atomic_inc32(&cache->miss_count);
+				return false;
+			}
+			char **s_paths = apr_palloc(pool, sizeof(char *) * pc);
+			char *pos = copy + key_length + 1;
+			char *end = copy + data_length;
+			int i;
+			for(i=0; i < pc; i++) {
+				if(pos >= end) {
+					apr_atomic_inc32(&cache->miss_count);
+					return false;
+				}
+				s_paths[i] = pos;
+				pos += strlen(pos) + 1;
+			}
+			*paths = s_paths;
+			*path_count = pc;
+			apr_atomic_inc32(&cache->hit_count);
+			return true;
+		}
+	}
+	apr_atomic_inc32(&cache->miss_count);
+	return false;
+}
+
+//lock a slot for writing. returns false if another writer has it
+bool mfs_shm_cache_lock_slot(mfs_shm_cache_slot *slot, apr_uint32_t *sequence) {
+	apr_uint32_t current = apr_atomic_read32(&slot->sequence);
+	if(current & 1) {
+		return false;
+	}
+	if(apr_atomic_cas32(&slot->sequence, current + 1, current) != current) {
+		return false;
+	}
+	*sequence = current + 1;
+	return true;
+}
+
+void mfs_shm_cache_unlock_slot(mfs_shm_cache_slot *slot) {
+	apr_atomic_inc32(&slot->sequence); //back to even: full barrier so the data is visible first
+}
+
+//lock a slot for writing, waiting for another writer to finish. a slot that stays locked for MFS_SHM_CACHE_STUCK_TIME is taken over
+//and expired: its writer died and what it left can't be trusted
+void mfs_shm_cache_wait_lock_slot(mfs_shm_cache_slot *slot) {
+	apr_uint32_t sequence;
+	apr_uint32_t stuck = 0;
+	apr_time_t stuck_since = 0;
+	while(!mfs_shm_cache_lock_slot(slot, &sequence)) {
+		apr_uint32_t current = apr_atomic_read32(&slot->sequence);
+		if(!(current & 1)) {
+			continue; //unlocked since we tried
+		}
+		apr_time_t now = apr_time_now();
+		if((stuck_since == 0) || (current != stuck)) {
+			stuck = current;
+			stuck_since = now;
+		} else if((now - stuck_since >= MFS_SHM_CACHE_STUCK_TIME) && (apr_atomic_cas32(&slot->sequence, current + 2, current) == current)) {
+			mfs_log(LOG_ERR, "Taking over a shared memory cache slot that has been locked for %d ms", (apr_int32_t)apr_time_as_msec(now - stuck_since));
+			slot->expires_at = 0;
+			return;
+		}
+		apr_sleep(1);
+	}
+}
+
+//a locked slot holds the key
+bool mfs_shm_cache_slot_has_key(mfs_shm_cache_slot *slot, apr_uint32_t hash, const char *cache_key, apr_size_t cache_key_length) {
+	return (slot->hash == hash) && (slot->key_length == cache_key_length) && (memcmp(slot->data, cache_key, cache_key_length) == 0);
+}
+
+//expire every slot holding the key except keep (NULL for all of them)
+void mfs_shm_cache_expire_key(mfs_shm_cache *cache, apr_uint32_t hash, const char *cache_key, apr_size_t cache_key_length, mfs_shm_cache_slot *keep) {
+	int probe;
+	for(probe = 0; probe < MFS_SHM_CACHE_PROBE_LIMIT; probe++) {
+		mfs_shm_cache_slot *slot = mfs_shm_cache_slot_at(cache, (hash + probe) % cache->slot_count);
+		if(slot == keep) {
+			continue;
+		}
+		//a slot that is not being written and has another hash can be skipped without the lock
+		apr_uint32_t sequence = apr_atomic_add32(&slot->sequence, 0);
+		if(!(sequence & 1) && (slot->hash != hash) && (apr_atomic_add32(&slot->sequence, 0) == sequence)) {
+			continue;
+		}
+		mfs_shm_cache_wait_lock_slot(slot);
+		if(mfs_shm_cache_slot_has_key(slot, hash, cache_key, cache_key_length)) {
+			slot->expires_at = 0; //keep the key so probing still works
+		}
+		mfs_shm_cache_unlock_slot(slot);
+	}
+}
+
+//find the slot to write a key into: the slot that already has the key, an unused/expired slot or the one that expires first
+mfs_shm_cache_slot * mfs_shm_cache_find_write_slot(mfs_shm_cache *cache, apr_uint32_t hash, const char *cache_key, apr_size_t cache_key_length) {
+	mfs_shm_cache_slot *victim = NULL;
+	int probe;
+	for(probe = 0; probe < MFS_SHM_CACHE_PROBE_LIMIT; probe++) {
+		mfs_shm_cache_slot *slot = mfs_shm_cache_slot_at(cache, (hash + probe) % cache->slot_count);
+		if(slot->hash == 0) {
+			return slot;
+		}
+		if((slot->hash == hash) && (slot->key_length == cache_key_length) && (memcmp(slot->data, cache_key, cache_key_length) == 0)) {
+			return slot; //may be a torn compare: the caller checks again once it holds the slot
+		}
+		if((victim == NULL) || (slot->expires_at < victim->expires_at)) {
+			victim = slot;
+		}
+	}
+	return victim;
+}
+
+void mfs_shm_cache_put_paths(mfs_shm_cache *cache, const char *domain, const char *key, char **paths, int path_count, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_shm_cache_key(domain, key, &cache_key_length, pool);
+	apr_size_t data_length = cache_key_length + 1;
+	int i;
+	for(i=0; i < path_count; i++) {
+		data_length += strlen(paths[i]) + 1;
+	}
+	if((data_length > cache->slot_size) || (path_count <= 0)) {
+		mfs_log(LOG_DEBUG, "Paths for %s.%s are too big for the shared memory cache (%d bytes)", domain, key, (int)data_length);
+		return;
+	}
+	apr_uint32_t hash = mfs_shm_cache_hash(cache_key, cache_key_length);
+	mfs_shm_cache_slot *slot = mfs_shm_cache_find_write_slot(cache, hash, cache_key, cache_key_length);
+	apr_uint32_t sequence;
+	if((slot == NULL) || !mfs_shm_cache_lock_slot(slot, &sequence)) {
+		return; //someone else is writing it.. its only a cache
+	}
+	//the compare in mfs_shm_cache_find_write_slot was made without the lock and may have missed the slot that has the key
+	bool had_key = mfs_shm_cache_slot_has_key(slot, hash, cache_key, cache_key_length);
+	slot->hash = hash;
+	slot->expires_at = apr_time_now() + cache->ttl;
+	slot->key_length = cache_key_length;
+	slot->data_length = data_length;
+	slot->path_count = path_count;
+	char *pos = slot->data;
+	memcpy(pos, cache_key, cache_key_length + 1);
+	pos += cache_key_length + 1;
+	for(i=0; i < path_count; i++) {
+		apr_size_t l = strlen(paths[i]) + 1;
+		memcpy(pos, paths[i], l);
+		pos += l;
+	}
+	mfs_shm_cache_unlock_slot(slot);
+	if(!had_key) { //one slot per key: a copy left elsewhere would outlive a remove
+		mfs_shm_cache_expire_key(cache, hash, cache_key, cache_key_length, slot);
+	}
+}
+
+void mfs_shm_cache_remove(mfs_shm_cache *cache, const char *domain, const char *key, apr_pool_t *pool) {
+	apr_size_t cache_key_length;
+	char *cache_key = mfs_shm_cache_key(domain, key, &cache_key_length, pool);
+	apr_uint32_t hash = mfs_shm_cache_hash(cache_key, cache_key_length);
+	mfs_shm_cache_expire_key(cache, hash, cache_key, cache_key_length, NULL);
+}
+
+//expire every key in the domain that starts with prefix (the children of a renamed directory). every slot has to be looked at
+void mfs_shm_cache_remove_prefix(mfs_shm_cache *cache, const char *domain, const char *prefix, apr_pool_t *pool) {
+	apr_size_t cache_prefix_length;
+	char *cache_prefix = mfs_shm_cache_key(domain, prefix, &cache_prefix_length, pool);
+	apr_uint32_t i;
+	for(i=0; i < cache->slot_count; i++) {
+		mfs_shm_cache_slot *slot = mfs_shm_cache_slot_at(cache, i);
+		if(slot->hash == 0) { //0 is a slot that has never been used
+			continue;
+		}
+		//a slot that is not being written and does not match can be skipped without the lock
+		apr_uint32_t sequence = apr_atomic_add32(&slot->sequence, 0);
+		if(!(sequence & 1) && ((slot->key_length < cache_prefix_length) || (memcmp(slot->data, cache_prefix, cache_prefix_length) != 0)) && (apr_atomic_add32(&slot->sequence, 0) == sequence)) {
+			continue;
+		}
+		mfs_shm_cache_wait_lock_slot(slot);
+		if((slot->hash != 0) && (slot->key_length >= cache_prefix_length) && (memcmp(slot->data, cache_prefix, cache_prefix_length) == 0)) {
+			slot->expires_at = 0; //keep the key so probing still works
+		}
+		mfs_shm_cache_unlock_slot(slot);
+	}
+}
+
+void mfs_shm_cache_clear(mfs_shm_cache *cache) {
+	apr_uint32_t i;
+	for(i=0; i < cache->slot_count; i++) {
+		mfs_shm_cache_slot *slot = mfs_shm_cache_slot_at(cache, i);
+		if(slot->hash != 0) { //0 is a slot that has never been used
+			mfs_shm_cache_wait_lock_slot(slot);
+			slot->expires_at = 0;
+			mfs_shm_cache_unlock_slot(slot);
+		}
+	}
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+count-min sketch for estimating access frequency (the "tiny" in TinyLFU).
+each key hash picks one counter in each of MFS_SKETCH_DEPTH rows. the estimate is the smallest of them.
+counters saturate at max_count and are all halved every sample_size increments.
+nothing is locked: an increment is a compare and swap on the word holding the counter, and the increment that reaches
+sample_size halves the words one at a time. increments that race with the halving may be lost which only makes the estimates
+a little lower.
+
+hot keys (keys whose estimate reaches a threshold) are reported to the caches as the keys worth caching and the hottest are
+kept in a small top-k list for operators. the list is only try-locked from the read path so a busy list skips an update
+rather than making a reader wait.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+#include <apr_strings.h>
+#include <stdlib.h>
+
+static const apr_uint32_t mfs_sketch_seeds[MFS_SKETCH_DEPTH] = {0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU};
+
+apr_status_t mfs_sketch_create(mfs_frequency_sketch **sketch, apr_uint32_t width, apr_uint32_t max_count, apr_pool_t *pool) {
+	mfs_frequency_sketch *s = apr_pcalloc(pool, sizeof(mfs_frequency_sketch));
+	s->width = 64;
+	while(s->width < width) {
+		s->width <<= 1;
+	}
+	s->sample_size = s->width * 10;
+	s->max_count = max_count;
+	s->counter_bits = (max_count <= 0xff) ? 8 : 32;
+	apr_size_t words = ((apr_size_t)s->width * MFS_SKETCH_DEPTH * s->counter_bits) / 32;
+	s->counters = apr_pcalloc(pool, words * sizeof(apr_uint32_t));
+	*sketch = s;
+	return APR_SUCCESS;
+}
+
+apr_uint32_t mfs_sketch_index(mfs_frequency_sketch *sketch, apr_uint32_t hash, int row) {
+	apr_uint32_t h = (hash ^ (hash >> 16)) * mfs_sketch_seeds[row];
+	return (apr_uint32_t)row * sketch->width + ((h >> 8) & (sketch->width - 1));
+}
+
+apr_uint32_t mfs_sketch_counter(mfs_frequency_sketch *sketch, apr_uint32_t word, apr_uint32_t index) {
+	if(sketch->counter_bits == 32) {
+		return word;
+	}
+	return (word >> ((index & 3) * 8)) & 0xff;
+}
+
+//halve every counter. only called by the increment that reached sample_size
+void mfs_sketch_age(mfs_frequency_sketch *sketch) {
+	apr_size_t i;
+	apr_size_t words = ((apr_size_t)sketch->width * MFS_SKETCH_DEPTH * sketch->counter_bits) / 32;
+	apr_uint32_t mask = (sketch->counter_bits == 32) ? 0x7fffffffU : 0x7f7f7f7fU;
+	for(i=0; i < words; i++) {
+		apr_uint32_t word;
+		do {
+			word = apr_atomic_read32(&sketch->counters[i]);
+		} while(apr_atomic_cas32(&sketch->counters[i], (word >> 1) & mask, word) != word);
+	}
+	apr_atomic_inc32(&sketch->ages);
+	apr_atomic_set32(&sketch->additions, sketch->sample_size / 2);
+}
+
+void mfs_sketch_increment(mfs_frequency_sketch *sketch, apr_uint32_t hash) {
+	int row;
+	for(row=0; row < MFS_SKETCH_DEPTH; row++) {
+		apr_uint32_t index = mfs_sketch_index(sketch, hash, row);
+		apr_uint32_t w = (sketch->counter_bits == 32) ? index : index >> 2;
+		apr_uint32_t one = (sketch->counter_bits == 32) ? 1 : 1U << ((index & 3) * 8);
+		apr_uint32_t word;
+		do {
+			word = apr_atomic_read32(&sketch->counters[w]);
+			if(mfs_sketch_counter(sketch, word, index) >= sketch->max_count) {
+				break;
+			}
+		} while(apr_atomic_cas32(&sketch->counters[w], word + one, word) != word);
+	}
+	if(apr_atomic_inc32(&sketch->additions) + 1 == sketch->sample_size) {
+		mfs_sketch_age(sketch);
+	}
+}
+
+int mfs_sketch_estimate(mfs_frequency_sketch *sketch, apr_uint32_t hash) {
+	apr_uint32_t estimate = sketch->max_count;
+	int row;
+	for(row=0; row < MFS_SKETCH_DEPTH; row++) {
+		apr_uint32_t index = mfs_sketch_index(sketch, hash, row);
+		apr_uint32_t w = (sketch->counter_bits == 32) ? index : index >> 2;
+		apr_uint32_t count = mfs_sketch_counter(sketch, apr_atomic_read32(&sketch->counters[w]), index);
+		if(count < estimate) {
+			estimate = count;
+		}
+	}
+	return (int)estimate;
+}
+
+apr_status_t mfs_enable_hot_keys(mfs_file_system *file_system, apr_uint32_t width, apr_uint32_t threshold, int top_k) {
+	if(file_system->hot_keys != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_hot_keys called when hot key detection is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p,NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_hot_keys *hot_keys = apr_pcalloc(p, sizeof(mfs_hot_keys));
+	hot_keys->pool = p;
+	hot_keys->threshold = threshold;
+	hot_keys->top_k = (top_k > 0) ? top_k : DEFAULT_HOT_KEY_TOP_K;
+	hot_keys->top = apr_pcalloc(p, sizeof(mfs_hot_key) * hot_keys->top_k);
+	//full width counters so the hottest keys can still be ranked
+	if((rv = mfs_sketch_create(&hot_keys->sketch, width, 0xffffffffU, p)) != APR_SUCCESS) {
+		apr_pool_destroy(p);
+		return rv;
+	}
+	if((rv = apr_thread_mutex_create(&hot_keys->lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create hot keys mutex:");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	file_system->hot_keys = hot_keys;
+	mfs_log(LOG_INFO, "Hot key detection enabled. width=%u, threshold=%u, top_k=%d", hot_keys->sketch->width, threshold, hot_keys->top_k);
+	return APR_SUCCESS;
+}
+
+void mfs_hot_keys_destroy(mfs_hot_keys *hot_keys) {
+	apr_thread_mutex_destroy(hot_keys->lock);
+	apr_pool_destroy(hot_keys->pool);
+}
+
+//domain and key are hashed separately so nothing has to be copied
+apr_uint32_t mfs_hot_keys_hash(const char *domain, const char *key) {
+	apr_ssize_t domain_length = APR_HASH_KEY_STRING;
+	apr_ssize_t key_length = APR_HASH_KEY_STRING;
+	return (apr_hashfunc_default(domain, &domain_length) * 0x01000193U) ^ apr_hashfunc_default(key, &key_length);
+}
+
+//a count taken before the sketch was last halved is halved to match
+apr_uint32_t mfs_hot_key_count(mfs_hot_key *hot_key, apr_uint32_t ages) {
+	apr_uint32_t since = ages - hot_key->ages;
+	return (since >= 32) ? 0 : hot_key->count >> since;
+}
+
+//keep a hot key in the top-k list if it is hotter than the coldest one there
+void mfs_hot_keys_note(mfs_hot_keys *hot_keys, const char *domain, const char *key, apr_uint32_t hash, apr_uint32_t count) {
+	if(apr_thread_mutex_trylock(hot_keys->lock) != APR_SUCCESS) {
+		return; //someone else is updating it: this access is not worth waiting for
+	}
+	apr_uint32_t ages = apr_atomic_read32(&hot_keys->sketch->ages);
+	int i;
+	int coldest = -1;
+	apr_uint32_t coldest_count = 0;
+	for(i=0; i < hot_keys->top_count; i++) {
+		mfs_hot_key *hot_key = &hot_keys->top[i];
+		if((hot_key->hash == hash) && (strncmp(hot_key->domain, domain, MFS_HOT_KEY_DOMAIN_SIZE - 1) == 0) && (strncmp(hot_key->key, key, MFS_HOT_KEY_SIZE - 1) == 0)) {
+			hot_key->count = count;
+			hot_key->ages = ages;
+			apr_thread_mutex_unlock(hot_keys->lock);
+			return;
+		}
+		apr_uint32_t c = mfs_hot_key_count(hot_key, ages);
+		if((coldest < 0) || (c < coldest_count)) {
+			coldest = i;
+			coldest_count = c;
+		}
+	}
+	if(hot_keys->top_count < hot_keys->top_k) {
+		coldest = hot_keys->top_count++;
+	} else if(count <= coldest_count) {
+		coldest = -1;
+	}
+	if(coldest >= 0) {
+		mfs_hot_key *hot_key = &hot_keys->top[coldest];
+		hot_key->hash = hash;
+		hot_key->count = count;
+		hot_key->ages = ages;
+		apr_cpystrn(hot_key->domain, domain, MFS_HOT_KEY_DOMAIN_SIZE);
+		apr_cpystrn(hot_key->key, key, MFS_HOT_KEY_SIZE);
+		apr_atomic_inc32(&hot_keys->promotion_count);
+	}
+	apr_thread_mutex_unlock(hot_keys->lock);
+}
+
+bool mfs_hot_keys_record(mfs_hot_keys *hot_keys, const char *domain, const char *key) {
+	apr_uint32_t hash = mfs_hot_keys_hash(domain, key);
+	mfs_sketch_increment(hot_keys->sketch, hash);
+	apr_uint32_t count = (apr_uint32_t)mfs_sketch_estimate(hot_keys->sketch, hash);
+	if(count < hot_keys->threshold) {
+		return false;
+	}
+	apr_atomic_inc32(&hot_keys->hot_count);
+	mfs_hot_keys_note(hot_keys, domain, key, hash, count);
+	return true;
+}
+
+bool mfs_hot_keys_is_hot(mfs_hot_keys *hot_keys, const char *domain, const char *key) {
+	return (apr_uint32_t)mfs_sketch_estimate(hot_keys->sketch, mfs_hot_keys_hash(domain, key)) >= hot_keys->threshold;
+}
+
+int mfs_hot_key_compare(const void *a, const void *b) {
+	apr_uint32_t count_a = ((const mfs_hot_key *)a)->count;
+	apr_uint32_t count_b = ((const mfs_hot_key *)b)->count;
+	return (count_a < count_b) ? 1 : ((count_a > count_b) ? -1 : 0);
+}
+
+int mfs_hot_keys_top(mfs_hot_keys *hot_keys, mfs_hot_key *keys, int max) {
+	//the whole list is ranked by current estimate before the hottest max are returned
+	mfs_hot_key *all = malloc(sizeof(mfs_hot_key) * hot_keys->top_k);
+	if((all == NULL) || (apr_thread_mutex_lock(hot_keys->lock) != APR_SUCCESS)) {
+		free(all);
+		return 0;
+	}
+	int count = hot_keys->top_count;
+	memcpy(all, hot_keys->top, sizeof(mfs_hot_key) * count);
+	apr_thread_mutex_unlock(hot_keys->lock);
+	apr_uint32_t ages = apr_atomic_read32(&hot_keys->sketch->ages);
+	int i;
+	for(i=0; i < count; i++) {
+		all[i].count = (apr_uint32_t)mfs_sketch_estimate(hot_keys->sketch, all[i].hash);
+		all[i].ages = ages;
+	}
+	qsort(all, count, sizeof(mfs_hot_key), mfs_hot_key_compare);
+	if(count > max) {
+		count = max;
+	}
+	memcpy(keys, all, sizeof(mfs_hot_key) * count);
+	free(all);
+	return count;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+fixed size slabs for downloads kept in a brigade.
+each slab is malloc'd in one block (header then data). the write callback fills a slab before starting the next and each full slab
+becomes a heap bucket whose free function puts it back on the arena's free list, so once enough slabs are in circulation a download
+allocates nothing. the free list is capped: slabs past max_free are freed.
+a bucket can outlive the file system so the arena is counted: every slab that exists and the file system hold a reference, and the
+last one to go destroys the arena's own pool (unmanaged so apr_terminate does not destroy the mutex under a late bucket either).
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_atomic.h>
+#include <stdlib.h>
+
+#define MFS_SLAB_HEADER_SIZE APR_ALIGN_DEFAULT(sizeof(mfs_slab))
+
+apr_status_t mfs_enable_slab_arena(mfs_file_system *file_system, apr_size_t slab_size, int max_free) {
+	apr_status_t rv;
+	if(file_system->slab_arena != NULL) {
+		mfs_log(LOG_ERR, "mfs_enable_slab_arena called when the slab arena is already enabled");
+		return APR_EGENERAL;
+	}
+	apr_pool_t *p;
+	if((rv = apr_pool_create_unmanaged_ex(&p, NULL, NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_slab_arena *arena = apr_pcalloc(p, sizeof(mfs_slab_arena));
+	arena->pool = p;
+	if((rv = apr_thread_mutex_create(&arena->lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create slab arena mutex:");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	arena->references = 1; //the file system's
+	arena->slab_size = (slab_size > 0) ? slab_size : DEFAULT_SLAB_SIZE;
+	arena->max_free = (max_free >= 0) ? max_free : DEFAULT_SLAB_MAX_FREE;
+	file_system->slab_arena = arena;
+	return APR_SUCCESS;
+}
+
+//drop a reference: the last one destroys the arena
+void mfs_slab_arena_release(mfs_slab_arena *arena, apr_uint32_t count) {
+	if(apr_atomic_add32(&arena->references, -count) == count) {
+		apr_pool_destroy(arena->pool);
+	}
+}
+
+//free the idle slabs and drop the file system's reference. slabs still in a brigade are freed when their bucket is destroyed and the
+//last of them takes the arena with it
+void mfs_slab_arena_destroy(mfs_slab_arena *arena) {
+	apr_uint32_t freed = 0;
+	apr_thread_mutex_lock(arena->lock);
+	while(arena->free_list != NULL) {
+		mfs_slab *slab = arena->free_list;
+		arena->free_list = slab->next;
+		free(slab);
+		freed++;
+	}
+	arena->free_count = 0;
+	arena->max_free = 0; //from now on returned slabs are freed
+	apr_thread_mutex_unlock(arena->lock);
+	mfs_slab_arena_release(arena, freed + 1); //not under the lock: it may be destroyed
+}
+
+mfs_slab * mfs_slab_get(mfs_slab_arena *arena) {
+	mfs_slab *slab = NULL;
+	apr_status_t rv = apr_thread_mutex_lock(arena->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock slab arena mutex:");
+		return NULL;
+	}
+	if(arena->free_list != NULL) {
+		slab = arena->free_list;
+		arena->free_list = slab->next;
+		arena->free_count--;
+		apr_atomic_inc32(&arena->reused_count);
+	}
+	apr_thread_mutex_unlock(arena->lock);
+	if(slab == NULL) { //a reused slab already holds its reference
+		if((slab = malloc(MFS_SLAB_HEADER_SIZE + arena->slab_size)) == NULL) {
+			mfs_log(LOG_CRIT, "Unable to allocate a %ld byte slab", (long)arena->slab_size);
+			return NULL;
+		}
+		slab->arena = arena;
+		slab->data = (char *)slab + MFS_SLAB_HEADER_SIZE;
+		apr_atomic_inc32(&arena->references); //the caller's file system holds one so the arena is still there
+		apr_atomic_inc32(&arena->allocated_count);
+	}
+	slab->next = NULL;
+	return slab;
+}
+
+void mfs_slab_put(mfs_slab *slab) {
+	mfs_slab_arena *arena = slab->arena;
+	if(apr_thread_mutex_lock(arena->lock) == APR_SUCCESS) {
+		if(arena->free_count < arena->max_free) {
+			slab->next = arena->free_list;
+			arena->free_list = slab;
+			arena->free_count++;
+			slab = NULL;
+		}
+		apr_thread_mutex_unlock(arena->lock);
+	}
+	if(slab != NULL) {
+		free(slab);
+		mfs_slab_arena_release(arena, 1);
+	}
+}
+
+void mfs_slab_bucket_free(void *data) {
+	mfs_slab_put((mfs_slab *)((char *)data - MFS_SLAB_HEADER_SIZE));
+}
+
+apr_bucket * mfs_slab_bucket_create(mfs_slab *slab, apr_size_t length, apr_bucket_alloc_t *list) {
+	return apr_bucket_heap_create(slab->data, length, mfs_slab_bucket_free, list);
+}
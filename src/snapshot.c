@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+metadata cache snapshots so a restarted process does not start with a cold cache.
+the file is a header followed by variable length records (one per entry), each padded to 8 bytes.
+saving writes to a temp file which is renamed over the snapshot so readers never see a partial file.
+loading maps the file and only builds an index of cache key -> record. a record is checksummed and turned
+into a cache entry the first time its key is looked up, so loading a large snapshot is cheap.
+entries keep their original expiry: a snapshot can make a start warm but never makes an entry live longer.
+*/
+
+#include "mogile_fs.h"
+#include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_mmap.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MFS_SNAPSHOT_MAGIC 0x4d46534e //MFSN
+#define MFS_SNAPSHOT_VERSION 1
+
+typedef struct {
+	apr_uint32_t magic;
+	apr_uint32_t version;
+	apr_uint32_t record_count;
+	apr_uint32_t header_size;
+	apr_time_t saved_at;
+} mfs_snapshot_header;
+
+typedef struct {
+	apr_uint32_t length; //the whole record including padding
+	apr_uint32_t checksum; //of everything after this field
+	apr_time_t expires_at;
+	apr_time_t mtime;
+	apr_uint64_t size;
+	apr_int64_t server_id;
+	apr_uint32_t cache_key_length; //type + domain + \0 + key (without the trailing \0)
+	apr_uint32_t path_count;
+	apr_uint32_t link_length; //including the \0. 0 if there is no link
+	unsigned char type;
+	unsigned char info_type;
+	unsigned char pad[2];
+	//followed by the cache key + \0, path_count \0 terminated paths then the link
+} mfs_snapshot_record;
+
+#define MFS_SNAPSHOT_RECORD_DATA(record) ((char *)(record) + sizeof(mfs_snapshot_record))
+#define MFS_SNAPSHOT_CHECKSUM_OFFSET APR_OFFSETOF(mfs_snapshot_record, expires_at)
+
+apr_uint32_t mfs_snapshot_checksum(const char *data, apr_size_t length) {
+	apr_uint32_t hash = 2166136261U; //fnv-1a
+	apr_size_t i;
+	for(i=0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+apr_status_t mfs_metadata_cache_set_snapshot(mfs_metadata_cache *cache, const char *filename, apr_interval_time_t interval) {
+	cache->snapshot_file = apr_pstrdup(cache->pool, filename);
+	cache->snapshot_interval = interval;
+	cache->next_snapshot = apr_time_now() + interval;
+	apr_status_t rv = mfs_metadata_cache_load_snapshot(cache);
+	if((interval > 0) && (cache->refresh_thread == NULL)) { //the refresh thread does the periodic saves
+		mfs_metadata_cache_start_refresh_thread(cache);
+	}
+	return rv;
+}
+
+//the size of the record for an entry
+apr_size_t mfs_snapshot_record_length(mfs_metadata_cache_entry *entry) {
+	apr_size_t length = sizeof(mfs_snapshot_record) + entry->cache_key_length + 1;
+	int i;
+	for(i=0; i < entry->path_count; i++) {
+		length += strlen(entry->paths[i]) + 1;
+	}
+	if(entry->info.link != NULL) {
+		length += strlen(entry->info.link) + 1;
+	}
+	return APR_ALIGN(length, 8);
+}
+
+void mfs_snapshot_write_record(mfs_metadata_cache_entry *entry, char *buf, apr_size_t length) {
+	memset(buf, 0, length);
+	mfs_snapshot_record *record = (mfs_snapshot_record *)buf;
+	record->length = (apr_uint32_t)length;
+	record->expires_at = entry->expires_at;
+	record->mtime = entry->info.mtime;
+	record->size = entry->info.size;
+	record->server_id = entry->info.server_id;
+	record->cache_key_length = (apr_uint32_t)entry->cache_key_length;
+	record->path_count = (apr_uint32_t)entry->path_count;
+	record->type = entry->type;
+	record->info_type = entry->info.type;
+	char *data = MFS_SNAPSHOT_RECORD_DATA(record);
+	memcpy(data, entry->cache_key, entry->cache_key_length + 1);
+	data += entry->cache_key_length + 1;
+	int i;
+	for(i=0; i < entry->path_count; i++) {
+		apr_size_t l = strlen(entry->paths[i]) + 1;
+		memcpy(data, entry->paths[i], l);
+		data += l;
+	}
+	if(entry->info.link != NULL) {
+		record->link_length = strlen(entry->info.link) + 1;
+		memcpy(data, entry->info.link, record->link_length);
+	}
+	record->checksum = mfs_snapshot_checksum(buf + MFS_SNAPSHOT_CHECKSUM_OFFSET, length - MFS_SNAPSHOT_CHECKSUM_OFFSET);
+}
+
+apr_status_t mfs_metadata_cache_save_snapshot(mfs_metadata_cache *cache) {
+	if(cache->snapshot_file == NULL) {
+		return APR_EGENERAL;
+	}
+	apr_pool_t *pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&pool, NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	//copy everything into one buffer while locked then write it out unlocked
+	if((rv = apr_thread_mutex_lock(cache->lock)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		apr_pool_destroy(pool);
+		return rv;
+	}
+	apr_time_t now = apr_time_now();
+	apr_size_t length = sizeof(mfs_snapshot_header);
+	apr_hash_index_t *hi;
+	mfs_snapshot_record *record;
+	mfs_metadata_cache_entry *entry;
+	for(entry = APR_RING_FIRST(cache->lru); entry != APR_RING_SENTINEL(cache->lru, _mfs_metadata_cache_entry, link); entry = APR_RING_NEXT(entry, link)) {
+		if((!entry->negative) && (now < entry->expires_at + cache->stale_time)) {
+			length += mfs_snapshot_record_length(entry);
+		}
+	}
+	//records from the last snapshot that have not been looked up yet are still worth keeping
+	if(cache->snapshot_index != NULL) {
+		for(hi = apr_hash_first(pool, cache->snapshot_index); hi; hi = apr_hash_next(hi)) {
+			apr_hash_this(hi, NULL, NULL, (void**)&record);
+			if(now < record->expires_at + cache->stale_time) {
+				length += record->length;
+			}
+		}
+	}
+	char *buf = malloc(length);
+	if(buf == NULL) {
+		apr_thread_mutex_unlock(cache->lock);
+		mfs_log(LOG_CRIT, "Unable to malloc metadata cache snapshot (%ld bytes)", (long)length);
+		apr_pool_destroy(pool);
+		return APR_ENOMEM;
+	}
+	mfs_snapshot_header *header = (mfs_snapshot_header *)buf;
+	memset(header, 0, sizeof(mfs_snapshot_header));
+	header->magic = MFS_SNAPSHOT_MAGIC;
+	header->version = MFS_SNAPSHOT_VERSION;
+	header->header_size = sizeof(mfs_snapshot_header);
+	header->saved_at = now;
+	char *pos = buf + sizeof(mfs_snapshot_header);
+	for(entry = APR_RING_FIRST(cache->lru); entry != APR_RING_SENTINEL(cache->lru, _mfs_metadata_cache_entry, link); entry = APR_RING_NEXT(entry, link)) {
+		if((!entry->negative) && (now < entry->expires_at + cache->stale_time)) {
+			apr_size_t l = mfs_snapshot_record_length(entry);
+			mfs_snapshot_write_record(entry, pos, l);
+			pos += l;
+			header->record_count++;
+		}
+	}
+	if(cache->snapshot_index != NULL) {
+		for(hi = apr_hash_first(pool, cache->snapshot_index); hi; hi = apr_hash_next(hi)) {
+			apr_hash_this(hi, NULL, NULL, (void**)&record);
+			if(now < record->expires_at + cache->stale_time) {
+				memcpy(pos, record, record->length);
+				pos += record->length;
+				header->record_count++;
+			}
+		}
+	}
+	apr_thread_mutex_unlock(cache->lock);
+	cache->next_snapshot = now + cache->snapshot_interval;
+
+	char *temp_file = apr_psprintf(pool, "%s.%ld.tmp", cache->snapshot_file, (long)getpid());
+	apr_file_t *file;
+	if((rv = apr_file_open(&file, temp_file, APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_ERR, rv, pool, "Unable to open metadata cache snapshot %s:", temp_file);
+	} else {
+		if((rv = apr_file_write_full(file, buf, length, NULL)) != APR_SUCCESS) {
+			mfs_log_apr(LOG_ERR, rv, pool, "Unable to write metadata cache snapshot %s:", temp_file);
+		}
+		apr_file_close(file);
+		if(rv == APR_SUCCESS) {
+			if((rv = apr_file_rename(temp_file, cache->snapshot_file, pool)) != APR_SUCCESS) {
+				mfs_log_apr(LOG_ERR, rv, pool, "Unable to rename metadata cache snapshot %s to %s:", temp_file, cache->snapshot_file);
+			}
+		}
+		if(rv != APR_SUCCESS) {
+			apr_file_remove(temp_file, pool);
+		} else {
+			mfs_log(LOG_DEBUG, "Saved %d entries to metadata cache snapshot %s", (int)header->record_count, cache->snapshot_file);
+		}
+	}
+	free(buf);
+	apr_pool_destroy(pool);
+	return rv;
+}
+
+apr_status_t mfs_metadata_cache_load_snapshot(mfs_metadata_cache *cache) {
+	apr_pool_t *pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&pool, cache->pool)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	apr_file_t *file;
+	if((rv = apr_file_open(&file, cache->snapshot_file, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, pool)) != APR_SUCCESS) {
+		if(!APR_STATUS_IS_ENOENT(rv)) {
+			mfs_log_apr(LOG_WARNING, rv, pool, "Unable to open metadata cache snapshot %s:", cache->snapshot_file);
+		}
+		apr_pool_destroy(pool);
+		return APR_STATUS_IS_ENOENT(rv) ? APR_SUCCESS : rv; //nothing saved yet
+	}
+	apr_finfo_t finfo;
+	if((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_WARNING, rv, pool, "Unable to stat metadata cache snapshot %s:", cache->snapshot_file);
+		apr_pool_destroy(pool);
+		return rv;
+	}
+	if(finfo.size < (apr_off_t)sizeof(mfs_snapshot_header)) {
+		mfs_log(LOG_WARNING, "Ignoring truncated metadata cache snapshot %s", cache->snapshot_file);
+		apr_pool_destroy(pool);
+		return APR_EGENERAL;
+	}
+	apr_mmap_t *map;
+	if((rv = apr_mmap_create(&map, file, 0, (apr_size_t)finfo.size, APR_MMAP_READ, pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_WARNING, rv, pool, "Unable to map metadata cache snapshot %s:", cache->snapshot_file);
+		apr_pool_destroy(pool);
+		return rv;
+	}
+	char *base = map->mm;
+	apr_size_t size = map->size;
+	mfs_snapshot_header *header = (mfs_snapshot_header *)base;
+	if((header->magic != MFS_SNAPSHOT_MAGIC) || (header->version != MFS_SNAPSHOT_VERSION) || (header->header_size < sizeof(mfs_snapshot_header)) || (header->header_size > size)) {
+		mfs_log(LOG_WARNING, "Ignoring metadata cache snapshot %s: unknown format", cache->snapshot_file);
+		apr_pool_destroy(pool);
+		return APR_EGENERAL;
+	}
+	//only check the records fit. their contents are checked when they are used
+	apr_hash_t *index = apr_hash_make(pool);
+	apr_size_t offset = header->header_size;
+	apr_uint32_t i;
+	for(i=0; i < header->record_count; i++) {
+		mfs_snapshot_record *record = (mfs_snapshot_record *)(base + offset);
+		if((offset + sizeof(mfs_snapshot_record) > size) || (record->length < sizeof(mfs_snapshot_record)) || (record->length % 8 != 0) || (record->length > size - offset) || (record->cache_key_length + 1 > record->length - sizeof(mfs_snapshot_record))) {
+			mfs_log(LOG_WARNING, "Metadata cache snapshot %s is corrupt after %d records", cache->snapshot_file, (int)i);
+			break;
+		}
+		apr_hash_set(index, MFS_SNAPSHOT_RECORD_DATA(record), record->cache_key_length, record);
+		offset += record->length;
+	}
+	if((rv = apr_thread_mutex_lock(cache->lock)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, pool, "Unable to lock metadata cache mutex:");
+		apr_pool_destroy(pool);
+		return rv;
+	}
+	mfs_metadata_cache_snapshot_discard(cache);
+	cache->snapshot_pool = pool;
+	cache->snapshot_index = index;
+	apr_thread_mutex_unlock(cache->lock);
+	mfs_log(LOG_INFO, "Loaded metadata cache snapshot %s with %d entries", cache->snapshot_file, (int)apr_hash_count(index));
+	return APR_SUCCESS;
+}
+
+//walk the \0 terminated strings after the key. returns false if they run past the end of the record
+bool mfs_snapshot_record_strings(mfs_snapshot_record *record, char **paths, char **link) {
+	char *data = MFS_SNAPSHOT_RECORD_DATA(record) + record->cache_key_length + 1;
+	char *end = (char *)record + record->length;
+	apr_uint32_t i;
+	for(i=0; i < record->path_count; i++) {
+		char *nul = memchr(data, '\0', end - data);
+		if(nul == NULL) {
+			return false;
+		}
+		if(paths != NULL) {
+			paths[i] = data;
+		}
+		data = nul + 1;
+	}
+	*link = NULL;
+	if(record->link_length > 0) {
+		if((record->link_length > (apr_size_t)(end - data)) || (data[record->link_length - 1] != '\0')) {
+			return false;
+		}
+		*link = data;
+	}
+	return true;
+}
+
+mfs_metadata_cache_entry * mfs_metadata_cache_snapshot_take(mfs_metadata_cache *cache, const char *cache_key, apr_size_t cache_key_length, apr_pool_t *pool) {
+	mfs_snapshot_record *record = apr_hash_get(cache->snapshot_index, cache_key, cache_key_length);
+	if(record == NULL) {
+		return NULL;
+	}
+	apr_hash_set(cache->snapshot_index, cache_key, cache_key_length, NULL); //only ever used once
+	if(record->checksum != mfs_snapshot_checksum((char *)record + MFS_SNAPSHOT_CHECKSUM_OFFSET, record->length - MFS_SNAPSHOT_CHECKSUM_OFFSET)) {
+		mfs_log(LOG_WARNING, "Ignoring corrupt metadata cache snapshot record");
+		return NULL;
+	}
+	if((record->type != MFS_CACHE_PATHS) && (record->type != MFS_CACHE_PATH_INFO)) {
+		return NULL;
+	}
+	char **paths = apr_palloc(pool, sizeof(char *) * (record->path_count + 1));
+	char *link;
+	if((record->path_count > record->length) || !mfs_snapshot_record_strings(record, paths, &link)) {
+		mfs_log(LOG_WARNING, "Ignoring corrupt metadata cache snapshot record");
+		return NULL;
+	}
+	const char *domain = cache_key + 1;
+	const char *key = domain + strlen(domain) + 1;
+	mfs_filepath_entry info;
+	mfs_filepath_entry *p_info = NULL;
+	if(record->type == MFS_CACHE_PATH_INFO) {
+		info.name = NULL;
+		info.type = record->info_type;
+		info.mtime = record->mtime;
+		info.size = (apr_size_t)record->size;
+		info.server_id = record->server_id;
+		info.link = link;
+		p_info = &info;
+	}
+	mfs_metadata_cache_entry *entry = mfs_metadata_cache_entry_create(record->type, domain, key, paths, (int)record->path_count, p_info);
+	if(entry != NULL) {
+		entry->expires_at = record->expires_at;
+		apr_atomic_inc32(&cache->snapshot_load_count);
+	}
+	return entry;
+}
+
+void mfs_metadata_cache_snapshot_forget(mfs_metadata_cache *cache, const char *cache_key, apr_size_t cache_key_length) {
+	apr_hash_set(cache->snapshot_index, cache_key, cache_key_length, NULL);
+}
+
+void mfs_metadata_cache_snapshot_forget_path(mfs_metadata_cache *cache, const char *path) {
+	apr_hash_index_t *hi;
+	const void *cache_key;
+	apr_ssize_t cache_key_length;
+	mfs_snapshot_record *record;
+	for (hi = apr_hash_first(NULL, cache->snapshot_index); hi; hi = apr_hash_next(hi)) {
+		apr_hash_this(hi, &cache_key, &cache_key_length, (void**)&record);
+		if(record->type != MFS_CACHE_PATHS) {
+			continue;
+		}
+		//walk the paths without trusting the record further than its length
+		char *data = MFS_SNAPSHOT_RECORD_DATA(record) + record->cache_key_length + 1;
+		char *end = (char *)record + record->length;
+		apr_uint32_t i;
+		for(i=0; (i < record->path_count) && (data < end); i++) {
+			char *nul = memchr(data, '\0', end - data);
+			if(nul == NULL) {
+				break;
+			}
+			if(strcmp(data, path) == 0) {
+				apr_hash_set(cache->snapshot_index, cache_key, cache_key_length, NULL); //deleting the current entry while iterating is allowed
+				break;
+			}
+			data = nul + 1;
+		}
+	}
+}
+
+void mfs_metadata_cache_snapshot_forget_prefix(mfs_metadata_cache *cache, const char *domain, const char *prefix) {
+	apr_hash_index_t *hi;
+	const void *cache_key;
+	apr_ssize_t cache_key_length;
+	apr_size_t domain_length = strlen(domain);
+	apr_size_t prefix_length = strlen(prefix);
+	for (hi = apr_hash_first(NULL, cache->snapshot_index); hi; hi = apr_hash_next(hi)) {
+		apr_hash_this(hi, &cache_key, &cache_key_length, NULL);
+		const char *c_key = cache_key;
+		if(((apr_size_t)cache_key_length >= domain_length + 2 + prefix_length) && (memcmp(c_key + 1, domain, domain_length + 1) == 0) && (memcmp(c_key + domain_length + 2, prefix, prefix_length) == 0)) {
+			apr_hash_set(cache->snapshot_index, cache_key, cache_key_length, NULL);
+		}
+	}
+}
+
+void mfs_metadata_cache_snapshot_discard(mfs_metadata_cache *cache) {
+	if(cache->snapshot_pool != NULL) {
+		apr_pool_destroy(cache->snapshot_pool); //unmaps and closes the file
+		cache->snapshot_pool = NULL;
+	}
+	cache->snapshot_index = NULL;
+}
@@ -30,6 +30,9 @@ typedef struct {
 
 #include "mogile_fs.h"
 #include "logger.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <strings.h>
 
 bool allow_watching = true;
 
@@ -41,6 +44,11 @@ void enable_watching() {
 	allow_watching = true;
 }
 
+//stop a single watch (get_next_watch_line will return APR_EGENERAL)
+void stop_watch(watch_data *watch) {
+	watch->stopped = true;
+}
+
 watch_data * init_watch(int tracker_index, tracker_pool *trackers, apr_pool_t *pool, char *client_id) {
 	watch_data * watch = apr_pcalloc(pool, sizeof(watch_data));
 	watch->tracker = &trackers->trackers[tracker_index];
@@ -61,12 +69,16 @@ apr_status_t sock_readline(char *bufptr, size_t len, watch_data * watch) {
 	char c;
 	apr_status_t rv;
 	int size=0;
-	while((allow_watching)&&(--len > 0)) {
+	while((allow_watching)&&(!watch->stopped)&&(--len > 0)) {
 		if(watch->cnt == 0) {
 			//need to refill buffer from socket....
 			watch->cnt = sizeof( watch->read_buf );
 			if((rv = apr_socket_recv(watch->connection->connection->socket, watch->read_buf, &watch->cnt)) != APR_SUCCESS) {
 				if(APR_STATUS_IS_TIMEUP(rv)) {
+					if((watch->return_on_timeout)&&(size == 0)) {
+						watch->cnt = 0;
+						return rv; //nothing read for this line yet so nothing is lost
+					}
 					//try again...
 					len++;		/* the while will decrement...*/
 					continue;
@@ -105,7 +117,7 @@ apr_status_t sock_readline(char *bufptr, size_t len, watch_data * watch) {
 
 apr_status_t get_next_watch_line(watch_data *watch, char *buf, int len) {
 	apr_status_t rv;
-	while(allow_watching) {
+	while((allow_watching)&&(!watch->stopped)) {
 		if(watch->connection == NULL) {
 			watch->connection = mfs_pool_get_connection(watch->trackers, watch->tracker_index, NULL, true, apr_time_from_sec(1) / 4);
 			if(watch->connection != NULL) {
@@ -113,11 +125,18 @@ apr_status_t get_next_watch_line(watch_data *watch, char *buf, int len) {
 				if((rv = apr_socket_send(watch->connection->connection->socket, "!watch\r\n", &l)) != APR_SUCCESS) {
 					mfs_log_apr(LOG_ERR, rv, NULL, "Failed to send !watch command:");
 				}
+				watch->connect_count++;
+			} else {
+				//try the next tracker next time around
+				watch->tracker_index = (watch->tracker_index + 1) % watch->trackers->tracker_count;
+				watch->tracker = &watch->trackers->trackers[watch->tracker_index];
 			}
 		}
 		if(watch->connection != NULL) {
 			rv = sock_readline(buf, len, watch);
-			if(rv != APR_SUCCESS) {
+			if((watch->return_on_timeout)&&(APR_STATUS_IS_TIMEUP(rv))) {
+				return rv;
+			} else if(rv != APR_SUCCESS) {
 				mfs_log_apr(LOG_ERR, rv, NULL, "Failed to readline for watch:");
 				//destroy the failed connection...
 				mfs_pool_destroy_connection(watch->connection);
@@ -127,7 +146,7 @@ apr_status_t get_next_watch_line(watch_data *watch, char *buf, int len) {
 			}
 		}
 		//failure.. try again in a second....
-		if(allow_watching) {
+		if((allow_watching)&&(!watch->stopped)) {
 			apr_sleep(apr_time_from_sec(1));
 		}
 	}
@@ -137,7 +156,7 @@ apr_status_t get_next_watch_line(watch_data *watch, char *buf, int len) {
 apr_status_t get_next_watch_cache_line(watch_data *watch, char *buf, int len) {
 	apr_status_t rv;
 	char * c_start;
-	while(allow_watching) {
+	while((allow_watching)&&(!watch->stopped)) {
 		if((rv = get_next_watch_line(watch, buf, len)) == APR_SUCCESS) {
 			c_start = strstr(buf, "[cache][");
 			if(c_start != NULL) {
@@ -155,4 +174,297 @@ apr_status_t get_next_watch_cache_line(watch_data *watch, char *buf, int len) {
 	}
 	return APR_EGENERAL;
 
-}
\ No newline at end of file
+}
+apr_status_t mfs_start_invalidation_dispatcher(mfs_file_system *file_system, apr_interval_time_t coalesce_time) {
+	if(file_system->invalidation_dispatcher != NULL) {
+		return APR_SUCCESS;
+	}
+	apr_pool_t *p;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&p, NULL)) != APR_SUCCESS) {
+		mfs_log(LOG_CRIT, "Unable to create apr_pool");
+		return rv;
+	}
+	mfs_invalidation_dispatcher *dispatcher = apr_pcalloc(p, sizeof(mfs_invalidation_dispatcher));
+	dispatcher->file_system = file_system;
+	dispatcher->pool = p;
+	dispatcher->coalesce_time = coalesce_time;
+	dispatcher->listeners = apr_array_make(p, 4, sizeof(mfs_invalidation_listener));
+	if((rv = apr_thread_mutex_create(&dispatcher->lock, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to create apr_thread_mutex_t:");
+		apr_pool_destroy(p);
+		return rv;
+	}
+	dispatcher->watch = init_watch(0, file_system->trackers, p, file_system->client_id);
+	dispatcher->watch->return_on_timeout = true; //so batches are applied on time
+	dispatcher->running = true;
+	apr_threadattr_t *thd_attr;
+	apr_threadattr_create(&thd_attr, p);
+	if((rv = apr_thread_create(&dispatcher->thread, thd_attr, mfs_invalidation_dispatcher_thread, (void*)dispatcher, p)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, p, "Unable to start mfs_invalidation_dispatcher_thread thread.:");
+		apr_thread_mutex_destroy(dispatcher->lock);
+		apr_pool_destroy(p);
+		return rv;
+	}
+	file_system->invalidation_dispatcher = dispatcher;
+	return APR_SUCCESS;
+}
+
+void mfs_stop_invalidation_dispatcher(mfs_file_system *file_system) {
+	mfs_invalidation_dispatcher *dispatcher = file_system->invalidation_dispatcher;
+	if(dispatcher == NULL) {
+		return;
+	}
+	dispatcher->running = false;
+	stop_watch(dispatcher->watch);
+	apr_status_t rv2;
+	apr_thread_join(&rv2, dispatcher->thread);
+	if(dispatcher->watch->connection != NULL) { //it is in watch mode so can't go back into the pool
+		mfs_pool_destroy_connection(dispatcher->watch->connection);
+		dispatcher->watch->connection = NULL;
+	}
+	file_system->invalidation_dispatcher = NULL;
+	apr_thread_mutex_destroy(dispatcher->lock);
+	apr_pool_destroy(dispatcher->pool);
+}
+
+apr_status_t mfs_add_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_callback callback, void *data) {
+	mfs_invalidation_dispatcher *dispatcher = file_system->invalidation_dispatcher;
+	if(dispatcher == NULL) {
+		mfs_log(LOG_ERR, "Unable to add invalidation callback: dispatcher is not started");
+		return APR_EGENERAL;
+	}
+	apr_status_t rv = apr_thread_mutex_lock(dispatcher->lock);
+	if(rv != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, NULL, "Unable to lock invalidation dispatcher mutex:");
+		return rv;
+	}
+	mfs_invalidation_listener *listener = apr_array_push(dispatcher->listeners);
+	listener->callback = callback;
+	listener->data = data;
+	apr_thread_mutex_unlock(dispatcher->lock);
+	return APR_SUCCESS;
+}
+
+void mfs_remove_invalidation_callback(mfs_file_system *file_system, mfs_invalidation_callback callback, void *data) {
+	mfs_invalidation_dispatcher *dispatcher = file_system->invalidation_dispatcher;
+	if((dispatcher == NULL)||(apr_thread_mutex_lock(dispatcher->lock) != APR_SUCCESS)) {
+		return;
+	}
+	int i;
+	for(i=0; i < dispatcher->listeners->nelts; i++) {
+		mfs_invalidation_listener *listener = &APR_ARRAY_IDX(dispatcher->listeners, i, mfs_invalidation_listener);
+		if((listener->callback == callback)&&(listener->data == data)) {
+			//keep the order of the others
+			memmove(listener, listener + 1, sizeof(mfs_invalidation_listener) * (dispatcher->listeners->nelts - i - 1));
+			dispatcher->listeners->nelts--;
+			break;
+		}
+	}
+	apr_thread_mutex_unlock(dispatcher->lock);
+}
+
+apr_status_t mfs_parse_invalidation(char *line, mfs_invalidation_event *event, apr_pool_t *pool) {
+	char *tok_state;
+	memset(event, 0, sizeof(mfs_invalidation_event));
+	char *operation = apr_strtok(line, " ", &tok_state);
+	if(operation == NULL) {
+		mfs_log(LOG_WARNING, "Empty cache invalidation");
+		return APR_EGENERAL;
+	}
+	if(strstr(operation, "://") != NULL) {
+		event->operation = MFS_INVALIDATE_PATH;
+		event->path = apr_pstrdup(pool, operation);
+		return APR_SUCCESS;
+	}
+	char *domain = apr_strtok(NULL, " ", &tok_state);
+	char *key = apr_strtok(NULL, " ", &tok_state);
+	if((domain == NULL)||(key == NULL)) {
+		mfs_log(LOG_WARNING, "Invalid cache invalidation: %s", operation);
+		return APR_EGENERAL;
+	}
+	event->domain = mfs_tracker_url_decode(domain, pool);
+	event->key = mfs_tracker_url_decode(key, pool);
+	if(strcasecmp(operation, "delete") == 0) {
+		event->operation = MFS_INVALIDATE_DELETE;
+	} else if(strcasecmp(operation, "rename") == 0) {
+		char *to_key = apr_strtok(NULL, " ", &tok_state);
+		if(to_key == NULL) {
+			mfs_log(LOG_WARNING, "Invalid rename cache invalidation for %s: no to_key", event->key);
+			return APR_EGENERAL;
+		}
+		event->operation = MFS_INVALIDATE_RENAME;
+		event->to_key = mfs_tracker_url_decode(to_key, pool);
+	} else if(strcasecmp(operation, "store") == 0) {
+		event->operation = MFS_INVALIDATE_STORE;
+	} else {
+		event->operation = MFS_INVALIDATE_KEY;
+	}
+	return APR_SUCCESS;
+}
+
+void mfs_invalidate_key(mfs_file_system *file_system, const char *domain, const char *key, apr_pool_t *pool) {
+	if(file_system->metadata_cache != NULL) {
+		mfs_metadata_cache_remove(file_system->metadata_cache, MFS_CACHE_PATHS, domain, key, pool);
+		mfs_metadata_cache_remove(file_system->metadata_cache, MFS_CACHE_PATH_INFO, domain, key, pool);
+	}
+	if(file_system->shm_cache != NULL) {
+		mfs_shm_cache_remove(file_system->shm_cache, domain, key, pool);
+	}
+	if(file_system->content_cache != NULL) {
+		mfs_content_cache_remove(file_system->content_cache, domain, key, pool);
+	}
+}
+
+void mfs_apply_invalidation(mfs_file_system *file_system, mfs_invalidation_event *event, apr_pool_t *pool) {
+	switch(event->operation) {
+		case MFS_INVALIDATE_ALL:
+			if(file_system->metadata_cache != NULL) {
+				mfs_metadata_cache_clear(file_system->metadata_cache);
+			}
+			if(file_system->shm_cache != NULL) {
+				mfs_shm_cache_clear(file_system->shm_cache);
+			}
+			if(file_system->content_cache != NULL) {
+				mfs_content_cache_clear(file_system->content_cache);
+			}
+			break;
+		case MFS_INVALIDATE_PATH:
+			if(file_system->metadata_cache != NULL) {
+				mfs_metadata_cache_remove_path(file_system->metadata_cache, event->path);
+			}
+			break;
+		case MFS_INVALIDATE_RENAME:
+			mfs_invalidate_key(file_system, event->domain, event->to_key, pool);
+			//fall through: the old key is gone too
+		default:
+			mfs_invalidate_key(file_system, event->domain, event->key, pool);
+	}
+	mfs_invalidation_dispatcher *dispatcher = file_system->invalidation_dispatcher;
+	if((dispatcher != NULL)&&(apr_thread_mutex_lock(dispatcher->lock) == APR_SUCCESS)) {
+		int i;
+		for(i=0; i < dispatcher->listeners->nelts; i++) {
+			mfs_invalidation_listener *listener = &APR_ARRAY_IDX(dispatcher->listeners, i, mfs_invalidation_listener);
+			listener->callback(file_system, event, listener->data, pool);
+		}
+		apr_thread_mutex_unlock(dispatcher->lock);
+	}
+}
+
+//events waiting to be applied, in the order they arrived
+typedef struct {
+	apr_hash_t *latest; //batch key -> index in events of the last event for it
+	apr_array_header_t *events; //NULL where a later event replaced it
+} mfs_invalidation_batch;
+
+mfs_invalidation_batch * mfs_invalidation_batch_make(apr_pool_t *pool) {
+	mfs_invalidation_batch *batch = apr_palloc(pool, sizeof(mfs_invalidation_batch));
+	batch->latest = apr_hash_make(pool);
+	batch->events = apr_array_make(pool, 64, sizeof(mfs_invalidation_event *));
+	return batch;
+}
+
+void mfs_invalidation_batch_clear(mfs_invalidation_batch *batch) {
+	apr_hash_clear(batch->latest);
+	apr_array_clear(batch->events);
+}
+
+//coalesce by the thing being invalidated: only the last event for a key (or path) in a batch is applied.
+//a rename touches two keys so it is never replaced. it also ends coalescing for both: listeners (the mirror) see the events
+//around it in order
+void mfs_invalidation_batch_add(mfs_invalidation_batch *batch, mfs_invalidation_event *event, apr_pool_t *pool) {
+	if(event->operation == MFS_INVALIDATE_RENAME) {
+		apr_hash_set(batch->latest, apr_pstrcat(pool, "k", event->domain, "/", event->key, NULL), APR_HASH_KEY_STRING, NULL);
+		apr_hash_set(batch->latest, apr_pstrcat(pool, "k", event->domain, "/", event->to_key, NULL), APR_HASH_KEY_STRING, NULL);
+	} else {
+		char *batch_key;
+		if(event->operation == MFS_INVALIDATE_PATH) {
+			batch_key = apr_pstrcat(pool, "p", event->path, NULL);
+		} else {
+			batch_key = apr_pstrcat(pool, "k", event->domain, "/", event->key, NULL);
+		}
+		int *index = apr_hash_get(batch->latest, batch_key, APR_HASH_KEY_STRING);
+		if(index != NULL) {
+			APR_ARRAY_IDX(batch->events, *index, mfs_invalidation_event *) = NULL;
+		} else {
+			index = apr_palloc(pool, sizeof(int));
+			apr_hash_set(batch->latest, batch_key, APR_HASH_KEY_STRING, index);
+		}
+		*index = batch->events->nelts;
+	}
+	APR_ARRAY_PUSH(batch->events, mfs_invalidation_event *) = event;
+}
+
+void mfs_invalidation_batch_apply(mfs_invalidation_dispatcher *dispatcher, mfs_invalidation_batch *batch, apr_pool_t *pool) {
+	int i;
+	for(i = 0; i < batch->events->nelts; i++) {
+		mfs_invalidation_event *event = APR_ARRAY_IDX(batch->events, i, mfs_invalidation_event *);
+		if(event != NULL) {
+			mfs_apply_invalidation(dispatcher->file_system, event, pool);
+			apr_atomic_inc32(&dispatcher->applied_count);
+		}
+	}
+}
+
+void* APR_THREAD_FUNC mfs_invalidation_dispatcher_thread(apr_thread_t *thd, void *data) {
+	mfs_invalidation_dispatcher *dispatcher = (mfs_invalidation_dispatcher *)data;
+	watch_data *watch = dispatcher->watch;
+	char line[5000];
+	apr_pool_t *batch_pool;
+	apr_status_t rv;
+	if((rv = apr_pool_create(&batch_pool, dispatcher->pool)) != APR_SUCCESS) {
+		mfs_log_apr(LOG_CRIT, rv, dispatcher->pool, "Unable to create apr_pool");
+		apr_thread_exit(thd, rv);
+		return NULL;
+	}
+	mfs_invalidation_batch *batch = mfs_invalidation_batch_make(batch_pool);
+	apr_time_t batch_started = 0;
+	bool flush_all = false;
+	unsigned int connect_count = 0;
+	while(dispatcher->running) {
+		rv = get_next_watch_cache_line(watch, line, sizeof(line));
+		if(watch->connect_count != connect_count) {
+			//anything sent while we were disconnected is lost
+			if(connect_count > 0) {
+				flush_all = true;
+				mfs_invalidation_batch_clear(batch);
+				if(batch_started == 0) {
+					batch_started = apr_time_now();
+				}
+			}
+			connect_count = watch->connect_count;
+		}
+		if(rv == APR_SUCCESS) {
+			mfs_invalidation_event *event = apr_palloc(batch_pool, sizeof(mfs_invalidation_event));
+			if(mfs_parse_invalidation(line, event, batch_pool) == APR_SUCCESS) {
+				apr_atomic_inc32(&dispatcher->event_count);
+				if(!flush_all) {
+					mfs_invalidation_batch_add(batch, event, batch_pool);
+				}
+				if(batch_started == 0) {
+					batch_started = apr_time_now();
+				}
+			}
+		} else if(!APR_STATUS_IS_TIMEUP(rv)) {
+			break; //stopped
+		}
+		if((batch_started != 0)&&((apr_time_now() - batch_started >= dispatcher->coalesce_time)||(batch->events->nelts >= MFS_INVALIDATION_MAX_BATCH))) {
+			if(flush_all) {
+				mfs_invalidation_event all;
+				memset(&all, 0, sizeof(mfs_invalidation_event));
+				all.operation = MFS_INVALIDATE_ALL;
+				mfs_apply_invalidation(dispatcher->file_system, &all, batch_pool);
+				apr_atomic_inc32(&dispatcher->applied_count);
+				flush_all = false;
+			} else {
+				mfs_invalidation_batch_apply(dispatcher, batch, batch_pool);
+			}
+			apr_pool_clear(batch_pool);
+			batch = mfs_invalidation_batch_make(batch_pool);
+			batch_started = 0;
+		}
+	}
+	apr_pool_destroy(batch_pool);
+	apr_thread_exit(thd, APR_SUCCESS);
+	return NULL;
+}
@@ -28,6 +28,7 @@
 #include "test_file_system_download.h"
 #include "test_real_server.h"
 #include "test_watch.h"
+#include "test_cache.h"
 #include <apr_general.h>
 
 int test_tracker();
@@ -38,6 +39,7 @@ int test_file_upload();
 int test_file_download();
 int test_file_system_download();
 int test_real_server();
+int test_cache();
 
 int main(int argc, const char * const argv[]) {
 	apr_status_t rv = apr_app_initialize(&argc, &argv, NULL);
@@ -63,6 +65,9 @@ int main(int argc, const char * const argv[]) {
 
 	result = test_file_system();
 	if(result != 0) return result;
+
+	result = test_cache();
+	if(result != 0) return result;
 		
 	result = test_file_upload();
 	if(result != 0) return result;
@@ -149,7 +154,10 @@ int test_watch() {
 	/* add the tests to the suite */
 	if (
 	(NULL == CU_add_test(pSuite, "test_watch_calling", test_watch_calling)) ||
-	(NULL == CU_add_test(pSuite, "test_watch_parsing", test_watch_parsing)) /*||
+	(NULL == CU_add_test(pSuite, "test_watch_parsing", test_watch_parsing)) ||
+	(NULL == CU_add_test(pSuite, "test_invalidation_parsing", test_invalidation_parsing)) ||
+	(NULL == CU_add_test(pSuite, "test_invalidation_dispatcher", test_invalidation_dispatcher)) ||
+	(NULL == CU_add_test(pSuite, "test_invalidation_rename", test_invalidation_rename)) /*||
 	(NULL == CU_add_test(pSuite, "test_meta_data", test_meta_data)) ||
 	(NULL == CU_add_test(pSuite, "test_response_parsing", test_response_parsing)) || 
 	(NULL == CU_add_test(pSuite, "test_request_calling", test_request_calling))*/
@@ -215,6 +223,41 @@ int test_file_system() {
 
 }
 
+int test_cache() {
+	CU_pSuite pSuite = NULL;
+	pSuite = CU_add_suite("Metadata Cache Testing Suite", NULL, NULL);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	/* add the tests to the suite */
+	if (
+	(NULL == CU_add_test(pSuite, "test_cache_paths", test_cache_paths)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_path_info", test_cache_path_info)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_eviction", test_cache_eviction)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_stale_when_trackers_down", test_cache_stale_when_trackers_down)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_refresh_ahead", test_cache_refresh_ahead)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_read_your_writes", test_cache_read_your_writes)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_snapshot", test_cache_snapshot)) ||
+	(NULL == CU_add_test(pSuite, "test_content_cache", test_content_cache)) ||
+	(NULL == CU_add_test(pSuite, "test_content_cache_admission", test_content_cache_admission)) ||
+	(NULL == CU_add_test(pSuite, "test_disk_cache", test_disk_cache)) ||
+	(NULL == CU_add_test(pSuite, "test_block_cache", test_block_cache)) ||
+	(NULL == CU_add_test(pSuite, "test_mirror", test_mirror)) ||
+	(NULL == CU_add_test(pSuite, "test_hot_keys", test_hot_keys)) ||
+	(NULL == CU_add_test(pSuite, "test_bloom_filter", test_bloom_filter)) ||
+	(NULL == CU_add_test(pSuite, "test_shm_cache_paths", test_shm_cache_paths)) ||
+	(NULL == CU_add_test(pSuite, "test_shm_cache_lifetime", test_shm_cache_lifetime)) ||
+	(NULL == CU_add_test(pSuite, "test_cache_rename_directory", test_cache_rename_directory))
+	    )
+	{
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+	return 0;
+}
+
 int test_file_upload() {
 	CU_pSuite pSuite = NULL;
 	pSuite = CU_add_suite("File Server Upload Testing Suite", NULL, NULL);
@@ -232,7 +275,10 @@ int test_file_upload() {
 	(NULL == CU_add_test(pSuite, "test_file_system_upload_bytes_ok", test_file_system_upload_bytes_ok)) ||
 	(NULL == CU_add_test(pSuite, "test_file_system_upload_file_ok_no_pool", test_file_system_upload_file_ok_no_pool)) ||
 	(NULL == CU_add_test(pSuite, "test_file_system_upload_bytes_timeout", test_file_system_upload_bytes_timeout)) ||
-	(NULL == CU_add_test(pSuite, "test_file_system_upload_bytes_corrupt_tracker", test_file_system_upload_bytes_corrupt_tracker)) 
+	(NULL == CU_add_test(pSuite, "test_file_system_upload_bytes_corrupt_tracker", test_file_system_upload_bytes_corrupt_tracker)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_upload_bytes_local", test_file_system_upload_bytes_local)) ||
+	(NULL == CU_add_test(pSuite, "test_pack", test_pack)) ||
+	(NULL == CU_add_test(pSuite, "test_pack_fill", test_pack_fill))
 	    )
 	{
 		CU_cleanup_registry();
@@ -259,7 +305,8 @@ int test_file_download() {
 	(NULL == CU_add_test(pSuite, "test_file_get_fail_brigade_large", test_file_get_fail_brigade_large)) ||
 	(NULL == CU_add_test(pSuite, "test_file_get_fail_brigade_large_with_data", test_file_get_fail_brigade_large_with_data)) ||
 	(NULL == CU_add_test(pSuite, "test_file_get_timeout_bytes", test_file_get_timeout_bytes)) ||
-	(NULL == CU_add_test(pSuite, "test_file_get_timeout_brigade_large_with_data", test_file_get_timeout_brigade_large_with_data))
+	(NULL == CU_add_test(pSuite, "test_file_get_timeout_brigade_large_with_data", test_file_get_timeout_brigade_large_with_data)) ||
+	(NULL == CU_add_test(pSuite, "test_file_get_conditional", test_file_get_conditional))
 	    )
 	{
 		CU_cleanup_registry();
@@ -285,7 +332,21 @@ int test_file_system_download() {
 	(NULL == CU_add_test(pSuite, "test_file_system_get_failover_bytes", test_file_system_get_failover_bytes)) ||
 	(NULL == CU_add_test(pSuite, "test_file_system_get_failover_file", test_file_system_get_failover_file)) ||
 	(NULL == CU_add_test(pSuite, "test_file_system_get_failover_brigade", test_file_system_get_failover_brigade)) ||
-	(NULL == CU_add_test(pSuite, "test_file_system_get_fail_bytes", test_file_system_get_fail_bytes))
+	(NULL == CU_add_test(pSuite, "test_file_system_get_fail_bytes", test_file_system_get_fail_bytes)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_local", test_file_system_get_local)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_range", test_file_system_get_range)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_parallel", test_file_system_get_parallel)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_parallel_serial", test_file_system_get_parallel_serial)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_hedged", test_file_system_get_hedged)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_hedged_large", test_file_system_get_hedged_large)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_ranked", test_file_system_get_ranked)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_balanced", test_file_system_get_balanced)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_stream", test_file_system_get_stream)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_reader", test_file_system_reader)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_into", test_file_system_get_into)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_into_error_page", test_file_system_get_into_error_page)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_slabs", test_file_system_get_slabs)) ||
+	(NULL == CU_add_test(pSuite, "test_file_system_get_required_length", test_file_system_get_required_length))
 	    )
 	{
 		CU_cleanup_registry();
@@ -0,0 +1,935 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+#include "test_cache.h"
+#include "common.h"
+#include "test_server.h"
+#include "test_http_server.h"
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+void test_cache_paths() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(1), apr_time_from_sec(1), 0));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one", "http://127.0.0.1:8082/path/two"};
+	char **paths;
+	int path_count;
+
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key", &paths, &path_count, p));
+
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key", put_paths, 2, p);
+	CU_ASSERT_EQUAL_FATAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key", &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(path_count, 2);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[0]);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8082/path/two", paths[1]);
+
+	//the domain is part of the key
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain2", "key", &paths, &path_count, p));
+
+	//expired but inside the stale window
+	apr_sleep(apr_time_from_msec(1100));
+	CU_ASSERT_EQUAL(MFS_CACHE_STALE, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key", &paths, &path_count, p));
+
+	//past the stale window
+	apr_sleep(apr_time_from_msec(1100));
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(0, file_system->metadata_cache->entry_count);
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_cache_path_info() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+
+	mfs_filepath_entry entry;
+	entry.type = TYPE_SYMLINK;
+	entry.link = "/a/link";
+	entry.mtime = apr_time_from_sec(1000);
+	entry.server_id = 12;
+	entry.size = 0;
+	mfs_metadata_cache_put_path_info(file_system->metadata_cache, "domain", "/a/path", &entry, p);
+
+	mfs_filepath_entry cached;
+	CU_ASSERT_EQUAL_FATAL(MFS_CACHE_HIT, mfs_metadata_cache_get_path_info(file_system->metadata_cache, "domain", "/a/path", &cached, p));
+	CU_ASSERT_EQUAL(TYPE_SYMLINK, cached.type);
+	CU_ASSERT_STRING_EQUAL("/a/link", cached.link);
+	CU_ASSERT_EQUAL(apr_time_from_sec(1000), cached.mtime);
+	CU_ASSERT_EQUAL(12, cached.server_id);
+
+	//paths and path info for the same key are separate entries
+	char **paths;
+	int path_count;
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "/a/path", &paths, &path_count, p));
+
+	mfs_metadata_cache_remove(file_system->metadata_cache, MFS_CACHE_PATH_INFO, "domain", "/a/path", p);
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_path_info(file_system->metadata_cache, "domain", "/a/path", &cached, p));
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_cache_eviction() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 3, apr_time_from_sec(60), 0, 0));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one"};
+	char **paths;
+	int path_count;
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key1", put_paths, 1, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key2", put_paths, 1, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key3", put_paths, 1, p);
+	//touch key1 so key2 is the least recently used
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key1", &paths, &path_count, p));
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key4", put_paths, 1, p);
+
+	CU_ASSERT_EQUAL(3, file_system->metadata_cache->entry_count);
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key1", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key2", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key3", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key4", &paths, &path_count, p));
+
+	//replacing an entry does not grow the cache
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key4", put_paths, 1, p);
+	CU_ASSERT_EQUAL(3, file_system->metadata_cache->entry_count);
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_cache_stale_when_trackers_down() {
+	mfs_file_system *file_system;
+	apr_status_t rv;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//nothing is listening on this port
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_msec(100), apr_time_from_sec(60), 0));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one"};
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key", put_paths, 1, p);
+	apr_sleep(apr_time_from_msec(200));
+
+	char **paths;
+	int path_count;
+	rv = mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, rv);
+	CU_ASSERT_EQUAL_FATAL(path_count, 1);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[0]);
+	CU_ASSERT_EQUAL(1, file_system->metadata_cache->stale_count);
+
+	//never cached so there is nothing to fall back on
+	rv = mfs_get_paths(file_system, "domain", "other_key", true, &paths, &path_count, p);
+	CU_ASSERT_NOT_EQUAL(APR_SUCCESS, rv);
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_cache_refresh_ahead() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//the tracker has moved the key
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fnew\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(2), 0, apr_time_from_sec(1)));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/old"};
+	char **paths;
+	int path_count;
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key", put_paths, 1, p);
+
+	//hot but not yet inside the refresh-ahead window
+	int i;
+	for(i = 0; i < DEFAULT_METADATA_CACHE_HOT_HITS - 1; i++) {
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+		CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/old", paths[0]);
+	}
+	apr_sleep(apr_time_from_msec(200));
+	CU_ASSERT_EQUAL(0, file_system->metadata_cache->refresh_count);
+
+	//inside the window the cached paths are still served and the refresh happens in the background
+	apr_sleep(apr_time_from_msec(1000));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(1, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/old", paths[0]);
+	for(i = 0; (i < 20) && (file_system->metadata_cache->refresh_count == 0); i++) {
+		apr_sleep(apr_time_from_msec(50));
+	}
+	CU_ASSERT_EQUAL_FATAL(1, file_system->metadata_cache->refresh_count);
+
+	//the refreshed entry has a new ttl: it is still a hit after the old one would have expired
+	apr_sleep(apr_time_from_msec(900));
+	CU_ASSERT_EQUAL_FATAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key", &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(1, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/new", paths[0]);
+
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_cache_read_your_writes() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//no tracker is listening: everything below must come from the cache
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	file_system->max_retries = 1;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+
+	char **paths;
+	int path_count;
+	mfs_cache_after_store(file_system, "domain", "from", "http://127.0.0.1:7500/dev1/0/000/000/0000000012.fid", p);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "from", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(1, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:7500/dev1/0/000/000/0000000012.fid", paths[0]);
+
+	mfs_cache_after_rename(file_system, "domain", "from", "to", false, p);
+	CU_ASSERT_EQUAL(APR_EBADPATH, mfs_get_paths(file_system, "domain", "from", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "to", true, &paths, &path_count, p));
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:7500/dev1/0/000/000/0000000012.fid", paths[0]);
+
+	mfs_cache_after_delete(file_system, "domain", "to", p);
+	CU_ASSERT_EQUAL(MFS_CACHE_NEGATIVE, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "to", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(APR_EBADPATH, mfs_get_paths(file_system, "domain", "to", true, &paths, &path_count, p));
+	mfs_filepath_entry info;
+	CU_ASSERT_EQUAL(APR_EBADPATH, mfs_path_info(file_system, "domain", "to", &info, p));
+
+	//an invalidation drops the negative entry too
+	mfs_invalidate_key(file_system, "domain", "to", p);
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "to", &paths, &path_count, p));
+
+	//renaming a directory drops its children
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "/dir/child", paths, 0, p);
+	mfs_cache_after_rename(file_system, "domain", "/dir", "/dir2", true, p);
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "/dir/child", &paths, &path_count, p));
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_cache_snapshot() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+	char *snapshot_file = "/tmp/mfs_test_cache.snapshot";
+	apr_file_remove(snapshot_file, p);
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_metadata_cache_set_snapshot(file_system->metadata_cache, snapshot_file, 0));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one", "http://127.0.0.1:8082/path/two"};
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key1", put_paths, 2, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key2", put_paths, 1, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key3", put_paths + 1, 1, p);
+	mfs_filepath_entry entry;
+	entry.type = TYPE_SYMLINK;
+	entry.link = "/a/link";
+	entry.mtime = apr_time_from_sec(1000);
+	entry.server_id = 12;
+	entry.size = 0;
+	mfs_metadata_cache_put_path_info(file_system->metadata_cache, "domain", "/a/path", &entry, p);
+	mfs_close_file_system(file_system); //saves the snapshot
+
+	//a "restarted" process
+	trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_metadata_cache_set_snapshot(file_system->metadata_cache, snapshot_file, 0));
+	CU_ASSERT_EQUAL(0, file_system->metadata_cache->entry_count); //nothing is loaded until it is looked up
+
+	char **paths;
+	int path_count;
+	CU_ASSERT_EQUAL_FATAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key1", &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(2, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[0]);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8082/path/two", paths[1]);
+	mfs_filepath_entry cached;
+	CU_ASSERT_EQUAL_FATAL(MFS_CACHE_HIT, mfs_metadata_cache_get_path_info(file_system->metadata_cache, "domain", "/a/path", &cached, p));
+	CU_ASSERT_EQUAL(TYPE_SYMLINK, cached.type);
+	CU_ASSERT_STRING_EQUAL("/a/link", cached.link);
+	CU_ASSERT_EQUAL(12, cached.server_id);
+	CU_ASSERT_EQUAL(2, file_system->metadata_cache->snapshot_load_count);
+
+	//invalidations apply to records that have not been looked up yet
+	mfs_metadata_cache_remove(file_system->metadata_cache, MFS_CACHE_PATHS, "domain", "key2", p);
+	mfs_metadata_cache_remove_path(file_system->metadata_cache, "http://127.0.0.1:8082/path/two");
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key2", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key3", &paths, &path_count, p));
+
+	mfs_close_file_system(file_system);
+	apr_file_remove(snapshot_file, p);
+	apr_pool_destroy(p);
+}
+
+mfs_content_entry * test_content_entry(const char *key, const char *data) {
+	mfs_content_entry *entry = mfs_content_entry_create("domain", key, strlen(data));
+	memcpy(entry->data, data, strlen(data));
+	return entry;
+}
+
+void test_content_cache() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_content_cache(file_system, 1024 * 1024, 1024, apr_time_from_sec(60)));
+	mfs_content_cache *cache = file_system->content_cache;
+
+	CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", "key", p));
+	mfs_content_cache_put(cache, test_content_entry("key", "hello world"));
+
+	//served from the cache without a tracker or file server
+	apr_size_t total_bytes;
+	void *bytes = NULL;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, -1));
+	CU_ASSERT_EQUAL_FATAL(11, total_bytes);
+	CU_ASSERT_EQUAL(0, memcmp("hello world", bytes, 11));
+	CU_ASSERT_EQUAL(1, cache->hit_count);
+
+	apr_bucket_brigade *brigade = apr_brigade_create(p, apr_bucket_alloc_create(p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_brigade(file_system, "domain", "key", &total_bytes, brigade, p, 11));
+	char *flat;
+	apr_size_t flat_length;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_brigade_pflatten(brigade, &flat, &flat_length, p));
+	CU_ASSERT_EQUAL_FATAL(11, flat_length);
+	CU_ASSERT_EQUAL(0, memcmp("hello world", flat, 11));
+
+	//the bytes and the bucket hold references so removing the entry does not free it
+	mfs_content_entry *entry = mfs_content_cache_get(cache, "domain", "key", p);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+	CU_ASSERT_EQUAL(4, entry->references); //cache + bytes + bucket + us
+	mfs_content_entry_release(entry);
+	mfs_invalidate_key(file_system, "domain", "key", p);
+	CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", "key", p));
+	CU_ASSERT_EQUAL(0, memcmp("hello world", bytes, 11));
+	apr_brigade_destroy(brigade);
+
+	//too big
+	char big[2048];
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	mfs_content_cache_put(cache, test_content_entry("big", big));
+	CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", "big", p));
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+int test_content_shard(const char *key) {
+	char cache_key[100];
+	apr_ssize_t l = strlen("domain") + strlen(key) + 1;
+	strcpy(cache_key, "domain");
+	strcpy(cache_key + strlen("domain") + 1, key);
+	return (apr_hashfunc_default(cache_key, &l) >> 16) % MFS_CONTENT_CACHE_SHARDS;
+}
+
+void test_content_cache_admission() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	//each shard has room for one 60 byte object
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_content_cache(file_system, MFS_CONTENT_CACHE_SHARDS * 100, 100, apr_time_from_sec(60)));
+	mfs_content_cache *cache = file_system->content_cache;
+
+	//find two keys in the same shard
+	char *hot = "key0";
+	char *cold = NULL;
+	int i;
+	for(i=1; (i < 10000) && (cold == NULL); i++) {
+		char *candidate = apr_psprintf(p, "key%d", i);
+		if(test_content_shard(candidate) == test_content_shard(hot)) {
+			cold = candidate;
+		}
+	}
+	CU_ASSERT_PTR_NOT_NULL_FATAL(cold);
+	char data[61];
+	memset(data, 'x', 60);
+	data[60] = '\0';
+
+	//hot is looked up a few times before it is cached
+	for(i=0; i < 5; i++) {
+		CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", hot, p));
+	}
+	mfs_content_cache_put(cache, test_content_entry(hot, data));
+
+	//a one off miss can not displace it
+	CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", cold, p));
+	mfs_content_cache_put(cache, test_content_entry(cold, data));
+	CU_ASSERT_EQUAL(1, cache->rejected_count);
+	mfs_content_entry *entry = mfs_content_cache_get(cache, "domain", hot, p);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(entry);
+	mfs_content_entry_release(entry);
+
+	//once it is used more often it can
+	for(i=0; i < 10; i++) {
+		CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", cold, p));
+	}
+	mfs_content_cache_put(cache, test_content_entry(cold, data));
+	CU_ASSERT_EQUAL(1, cache->eviction_count);
+	CU_ASSERT_PTR_NULL(mfs_content_cache_get(cache, "domain", hot, p));
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+apr_int64_t test_disk_cache_publish(mfs_disk_cache *cache, apr_int64_t fid, apr_size_t size, apr_time_t mtime, apr_pool_t *p) {
+	apr_file_t *file;
+	char data[1000];
+	memset(data, 'a' + (int)(fid % 26), size);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_mktemp(&file, mfs_disk_cache_temp_template(cache, p), APR_CREATE | APR_READ | APR_WRITE, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_write_full(file, data, size, NULL));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_disk_cache_publish(cache, fid, file, p));
+	apr_file_close(file);
+	apr_file_mtime_set(mfs_disk_cache_path(cache, fid, p), mtime, p);
+	return fid;
+}
+
+void test_disk_cache() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	char *directory = "/tmp/mfs_disk_cache_test";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_disk_cache(file_system, directory, 2500, apr_time_from_sec(60)));
+	mfs_disk_cache *cache = file_system->disk_cache;
+	apr_sleep(apr_time_from_msec(100)); //let the sweep thread do its first (empty) sweep
+
+	CU_ASSERT_EQUAL(123, mfs_fid_from_path("http://127.0.0.1:7500/dev1/0/000/000/0000000123.fid"));
+	CU_ASSERT_EQUAL(-1, mfs_fid_from_path("http://127.0.0.1:7500/dev1/0/000/000/0000000123.jpg"));
+
+	apr_file_t *file;
+	apr_off_t size;
+	CU_ASSERT_EQUAL(APR_ENOENT, mfs_disk_cache_open(cache, 1, &file, &size, p));
+
+	apr_time_t now = apr_time_now();
+	test_disk_cache_publish(cache, 1, 1000, now - apr_time_from_sec(300), p);
+	test_disk_cache_publish(cache, 258, 1000, now - apr_time_from_sec(200), p); //same bucket directory as 1
+	test_disk_cache_publish(cache, 3, 1000, now - apr_time_from_sec(100), p);
+	CU_ASSERT_EQUAL(3, cache->publish_count);
+
+	//a hit returns the file and touches it so it is no longer the oldest
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_disk_cache_open(cache, 1, &file, &size, p));
+	CU_ASSERT_EQUAL(1000, size);
+	apr_size_t total_bytes;
+	void *bytes = NULL;
+	apr_file_t *out = NULL;
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_local_file_serve(file, size, file_system, &bytes, &total_bytes, &out, NULL, p));
+	CU_ASSERT_EQUAL(1000, total_bytes);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(bytes);
+	CU_ASSERT_EQUAL('b', ((char*)bytes)[999]);
+
+	//3000 bytes is over 2500 so the least recently used file goes
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_disk_cache_sweep(cache));
+	CU_ASSERT_EQUAL(1, cache->eviction_count);
+	CU_ASSERT_EQUAL(2000, cache->size);
+	CU_ASSERT_EQUAL(APR_ENOENT, mfs_disk_cache_open(cache, 258, &file, &size, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_disk_cache_open(cache, 1, &file, &size, p));
+	apr_file_close(file);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_disk_cache_open(cache, 3, &file, &size, p));
+	apr_file_close(file);
+
+	apr_file_remove(mfs_disk_cache_path(cache, 1, p), p);
+	apr_file_remove(mfs_disk_cache_path(cache, 3, p), p);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_block_cache() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_basic_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+	//16 byte blocks, 2 blocks of read ahead
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_block_cache(file_system, 16, 1024 * 1024, 2));
+	mfs_block_cache *cache = file_system->block_cache;
+
+	char data[101];
+	int i;
+	for(i=0; i < 100; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[100] = '\0';
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	char buffer[32];
+	apr_size_t bytes_read;
+	//only the block that is read is fetched
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_block_cache_read(file_system, "domain", "key", 20, buffer, 4, &bytes_read, p));
+	CU_ASSERT_EQUAL(4, bytes_read);
+	CU_ASSERT_NSTRING_EQUAL(data + 20, buffer, 4);
+	CU_ASSERT_EQUAL(1, handle->request_count);
+	CU_ASSERT_STRING_EQUAL("bytes=16-31", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+
+	//the next read follows on so the 2 blocks after it are fetched in one request
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_block_cache_read(file_system, "domain", "key", 24, buffer, 8, &bytes_read, p));
+	CU_ASSERT_EQUAL(8, bytes_read);
+	CU_ASSERT_NSTRING_EQUAL(data + 24, buffer, 8);
+	CU_ASSERT_EQUAL(2, handle->request_count);
+	CU_ASSERT_STRING_EQUAL("bytes=32-63", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+	CU_ASSERT_EQUAL(2, cache->readahead_count);
+
+	//a hit that keeps reading ahead
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_block_cache_read(file_system, "domain", "key", 40, buffer, 8, &bytes_read, p));
+	CU_ASSERT_NSTRING_EQUAL(data + 40, buffer, 8);
+	CU_ASSERT_EQUAL(3, handle->request_count);
+	CU_ASSERT_STRING_EQUAL("bytes=64-79", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+	CU_ASSERT_EQUAL(3, cache->readahead_count);
+
+	//two missing blocks in one request. the file ends in the second
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_block_cache_read(file_system, "domain", "key", 90, buffer, 20, &bytes_read, p));
+	CU_ASSERT_EQUAL(10, bytes_read);
+	CU_ASSERT_NSTRING_EQUAL(data + 90, buffer, 10);
+	CU_ASSERT_EQUAL(4, handle->request_count);
+	CU_ASSERT_STRING_EQUAL("bytes=80-111", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+
+	//past the end
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_block_cache_read(file_system, "domain", "key", 200, buffer, 10, &bytes_read, p));
+	CU_ASSERT_EQUAL(0, bytes_read);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_mirror() {
+	mfs_file_system *file_system;
+	mfs_mirror *mirror;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//one response for both list_keys and get_paths. the second page lists the same key again which ends the listing
+	char test_response[] = "OK 123 key_count=1&key_1=%2Fdir%2Ffile&next_after=%2Fdir%2Ffile&paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	char data[] = "THIS IS THE MIRRORED DATA";
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	//a key left from an earlier run that has since been deleted
+	char *directory = "/tmp/mfs_mirror_test";
+	apr_file_t *file;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_dir_make_recursive(directory, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, "/tmp/mfs_mirror_test/gone", APR_WRITE | APR_CREATE | APR_TRUNCATE, APR_OS_DEFAULT, p));
+	apr_file_close(file);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, "/tmp/mfs_mirror_test/" MFS_MIRROR_INDEX, APR_WRITE | APR_CREATE | APR_TRUNCATE, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_write_full(file, "7\tgone\n", 7, NULL));
+	apr_file_close(file);
+
+	//one thread so the second fetch of the key finds the first one's copy
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_start_mirror(file_system, "domain", NULL, directory, 1, 0, &mirror));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_mirror_wait(mirror, apr_time_from_sec(5)));
+	CU_ASSERT_EQUAL(1, mirror->fetch_count);
+	CU_ASSERT_EQUAL(1, mirror->skip_count);
+	CU_ASSERT_EQUAL(1, mirror->remove_count);
+	CU_ASSERT_EQUAL(0, mirror->error_count);
+	apr_finfo_t finfo;
+	CU_ASSERT_NOT_EQUAL(APR_SUCCESS, apr_stat(&finfo, "/tmp/mfs_mirror_test/gone", APR_FINFO_SIZE, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_stat(&finfo, "/tmp/mfs_mirror_test/dir/file", APR_FINFO_SIZE, p));
+	CU_ASSERT_EQUAL(strlen(data), finfo.size);
+
+	//reads come from the mirror without the storage node
+	stop_test_http_server(handle);
+	void *bytes;
+	apr_size_t total_bytes;
+	file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "/dir/file", &total_bytes, &bytes, &file, p, NULL, -1));
+	CU_ASSERT_EQUAL_FATAL(strlen(data), total_bytes);
+	CU_ASSERT_NSTRING_EQUAL(data, bytes, total_bytes);
+	apr_off_t size;
+	CU_ASSERT_EQUAL(APR_ENOENT, mfs_mirror_open(file_system, "other_domain", "/dir/file", &file, &size, p));
+
+	//keys can't escape the directory or clash with the index
+	CU_ASSERT_STRING_EQUAL("/tmp/mfs_mirror_test/a/%2E./b%25c", mfs_mirror_path(mirror, "/a/../b%c", p));
+	CU_ASSERT_STRING_EQUAL("/tmp/mfs_mirror_test/a/%2F/b/%2F", mfs_mirror_path(mirror, "a//b/", p));
+	CU_ASSERT_STRING_EQUAL("/tmp/mfs_mirror_test/%2Emfs_mirror_index", mfs_mirror_path(mirror, MFS_MIRROR_INDEX, p));
+
+	//stopping writes the index of what is mirrored
+	mfs_stop_mirror(mirror);
+	CU_ASSERT_PTR_NULL(file_system->mirrors);
+	char index[100];
+	apr_size_t index_length = sizeof(index);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, "/tmp/mfs_mirror_test/" MFS_MIRROR_INDEX, APR_READ, APR_OS_DEFAULT, p));
+	apr_file_read(file, index, &index_length);
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(14, index_length);
+	CU_ASSERT_NSTRING_EQUAL("123\t/dir/file\n", index, 14);
+
+	apr_file_remove("/tmp/mfs_mirror_test/dir/file", p);
+	apr_file_remove("/tmp/mfs_mirror_test/" MFS_MIRROR_INDEX, p);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_hot_keys() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+	//hot after 3 accesses, the 2 hottest are listed
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_hot_keys(file_system, 1024, 3, 2));
+	mfs_hot_keys *hot_keys = file_system->hot_keys;
+
+	CU_ASSERT_FALSE(mfs_hot_keys_record(hot_keys, "domain", "a"));
+	CU_ASSERT_FALSE(mfs_hot_keys_record(hot_keys, "domain", "a"));
+	CU_ASSERT_FALSE(mfs_hot_keys_is_hot(hot_keys, "domain", "a"));
+	CU_ASSERT_TRUE(mfs_hot_keys_record(hot_keys, "domain", "a"));
+	CU_ASSERT_TRUE(mfs_hot_keys_is_hot(hot_keys, "domain", "a"));
+	CU_ASSERT_FALSE(mfs_hot_keys_is_hot(hot_keys, "other_domain", "a"));
+
+	int i;
+	for(i=0; i < 5; i++) {
+		mfs_hot_keys_record(hot_keys, "domain", "b");
+	}
+	//c only displaces a once it has been used more often
+	for(i=0; i < 3; i++) {
+		mfs_hot_keys_record(hot_keys, "domain", "c");
+	}
+	mfs_hot_key top[5];
+	CU_ASSERT_EQUAL_FATAL(2, mfs_hot_keys_top(hot_keys, top, 5));
+	CU_ASSERT_STRING_EQUAL("b", top[0].key);
+	CU_ASSERT_STRING_EQUAL("a", top[1].key);
+	mfs_hot_keys_record(hot_keys, "domain", "c");
+	CU_ASSERT_EQUAL_FATAL(2, mfs_hot_keys_top(hot_keys, top, 5));
+	CU_ASSERT_STRING_EQUAL("b", top[0].key);
+	CU_ASSERT_EQUAL(5, top[0].count);
+	CU_ASSERT_STRING_EQUAL("domain", top[1].domain);
+	CU_ASSERT_STRING_EQUAL("c", top[1].key);
+	CU_ASSERT_EQUAL(4, top[1].count);
+	CU_ASSERT_EQUAL_FATAL(1, mfs_hot_keys_top(hot_keys, top, 1));
+	CU_ASSERT_STRING_EQUAL("b", top[0].key);
+
+	//paths are only cached once the key is hot
+	char **paths;
+	int path_count;
+	mfs_metadata_cache *cache = file_system->metadata_cache;
+	for(i=0; i < 2; i++) {
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+		CU_ASSERT_EQUAL(0, cache->entry_count);
+	}
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL(1, cache->entry_count);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL(1, cache->hit_count);
+	CU_ASSERT_EQUAL_FATAL(1, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/dev1/0/000/000/0000000123.fid", paths[0]);
+
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_bloom_filter() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//one response for both list_keys and get_paths
+	char test_response[] = "OK 123 key_count=2&key_1=a&key_2=b&next_after=b&paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	//without watch events keys stored by other clients would be answered as absent
+	CU_ASSERT_EQUAL(APR_EGENERAL, mfs_enable_bloom_filter(file_system, "domain", 1000, 0.001, 0, apr_time_from_sec(3600)));
+	CU_ASSERT_PTR_NULL(apr_hash_get(file_system->bloom_filters, "domain", APR_HASH_KEY_STRING));
+	//a dispatcher without its watch thread (the looped server only takes one connection at a time). events are passed to the callback directly below
+	mfs_invalidation_dispatcher dispatcher;
+	memset(&dispatcher, 0, sizeof(dispatcher));
+	dispatcher.file_system = file_system;
+	dispatcher.listeners = apr_array_make(p, 4, sizeof(mfs_invalidation_listener));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_thread_mutex_create(&dispatcher.lock, APR_THREAD_MUTEX_DEFAULT, p));
+	file_system->invalidation_dispatcher = &dispatcher;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_bloom_filter(file_system, "domain", 1000, 0.001, 0, apr_time_from_sec(3600)));
+	CU_ASSERT_EQUAL(1, dispatcher.listeners->nelts);
+	mfs_bloom_filter *filter = apr_hash_get(file_system->bloom_filters, "domain", APR_HASH_KEY_STRING);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(filter);
+	CU_ASSERT_EQUAL(10, filter->hash_count);
+
+	int i;
+	for(i=0; (i < 100) && !filter->ready; i++) {
+		apr_sleep(apr_time_from_msec(20));
+	}
+	CU_ASSERT_TRUE_FATAL(filter->ready);
+	CU_ASSERT_EQUAL(2, filter->key_count);
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "a"));
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "b"));
+	CU_ASSERT_TRUE(mfs_bloom_filter_absent(file_system, "domain", "c"));
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "other_domain", "c"));
+
+	//a missing key is answered without the tracker (which would have returned paths)
+	char **paths;
+	int path_count;
+	CU_ASSERT_EQUAL(APR_EBADPATH, mfs_get_paths(file_system, "domain", "c", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "a", true, &paths, &path_count, p));
+
+	//our own stores and renamed directories
+	mfs_cache_after_store(file_system, "domain", "c", "http://127.0.0.1:8081/dev1/0/000/000/0000000124.fid", p);
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "c"));
+	CU_ASSERT_TRUE(mfs_bloom_filter_absent(file_system, "domain", "/dir/file"));
+	mfs_cache_after_rename(file_system, "domain", "/old", "/dir", true, p);
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "/dir"));
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "/dir/file"));
+	CU_ASSERT_TRUE(mfs_bloom_filter_absent(file_system, "domain", "/dirt"));
+
+	//watch events
+	mfs_invalidation_event event;
+	memset(&event, 0, sizeof(event));
+	event.operation = MFS_INVALIDATE_STORE;
+	event.domain = "domain";
+	event.key = "d";
+	mfs_bloom_invalidation_callback(file_system, &event, filter, p);
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "d"));
+	//once events may have been missed nothing is answered until a rebuild
+	event.operation = MFS_INVALIDATE_ALL;
+	mfs_bloom_invalidation_callback(file_system, &event, filter, p);
+	CU_ASSERT_FALSE(mfs_bloom_filter_absent(file_system, "domain", "e"));
+	for(i=0; (i < 100) && !filter->ready; i++) {
+		apr_sleep(apr_time_from_msec(20));
+	}
+	CU_ASSERT_TRUE_FATAL(filter->ready);
+	CU_ASSERT_EQUAL(2, filter->rebuild_count);
+	CU_ASSERT_TRUE(mfs_bloom_filter_absent(file_system, "domain", "e"));
+	//the rebuild listing is the truth now: the keys it did not list are gone
+	CU_ASSERT_TRUE(mfs_bloom_filter_absent(file_system, "domain", "/dir/file"));
+
+	stop_test_server(tracker_handle);
+	mfs_bloom_filter_destroy(filter);
+	CU_ASSERT_EQUAL(0, dispatcher.listeners->nelts);
+	file_system->invalidation_dispatcher = NULL; //it has no thread to stop
+	apr_thread_mutex_destroy(dispatcher.lock);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_shm_cache_paths() {
+	mfs_file_system *file_system1, *file_system2;
+	apr_pool_t *p = mfs_test_get_pool();
+	char shm_file[] = "/tmp/mfs_test_shm_cache";
+	apr_file_remove(shm_file, p);
+
+	//two file systems attached to the same segment behave like two processes
+	char tracker_list_str1[] = "127.0.0.1:9991";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system1, mfs_pool_init_quick(tracker_list_str1)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system1, shm_file, 16, apr_time_from_sec(60)));
+	char tracker_list_str2[] = "127.0.0.1:9991";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system2, mfs_pool_init_quick(tracker_list_str2)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system2, shm_file, 1000, apr_time_from_sec(60)));
+	CU_ASSERT_EQUAL(16, file_system2->shm_cache->slot_count); //the creator decides the size
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one", "http://127.0.0.1:8082/path/two"};
+	char **paths;
+	int path_count;
+	CU_ASSERT_FALSE(mfs_shm_cache_get_paths(file_system2->shm_cache, "domain", "key", &paths, &path_count, p));
+	mfs_shm_cache_put_paths(file_system1->shm_cache, "domain", "key", put_paths, 2, p);
+	CU_ASSERT_TRUE_FATAL(mfs_shm_cache_get_paths(file_system2->shm_cache, "domain", "key", &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(path_count, 2);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[0]);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8082/path/two", paths[1]);
+
+	//fill the table well past its size: lookups must never return another key's paths
+	int i;
+	for(i=0; i < 100; i++) {
+		char *key = apr_psprintf(p, "key%d", i);
+		char *one_path[] = {apr_psprintf(p, "http://127.0.0.1:8081/%d", i)};
+		mfs_shm_cache_put_paths(file_system1->shm_cache, "domain", key, one_path, 1, p);
+	}
+	for(i=0; i < 100; i++) {
+		char *key = apr_psprintf(p, "key%d", i);
+		if(mfs_shm_cache_get_paths(file_system2->shm_cache, "domain", key, &paths, &path_count, p)) {
+			CU_ASSERT_EQUAL(1, path_count);
+			CU_ASSERT_STRING_EQUAL(apr_psprintf(p, "http://127.0.0.1:8081/%d", i), paths[0]);
+		}
+	}
+
+	mfs_shm_cache_put_paths(file_system1->shm_cache, "domain", "key99", put_paths, 2, p);
+	mfs_shm_cache_remove(file_system2->shm_cache, "domain", "key99", p);
+	CU_ASSERT_FALSE(mfs_shm_cache_get_paths(file_system1->shm_cache, "domain", "key99", &paths, &path_count, p));
+
+	mfs_close_file_system(file_system2);
+	mfs_close_file_system(file_system1);
+	apr_pool_destroy(p);
+}
+
+void test_shm_cache_lifetime() {
+	mfs_file_system *file_system1, *file_system2, *file_system3;
+	apr_pool_t *p = mfs_test_get_pool();
+	char shm_file[] = "/tmp/mfs_test_shm_cache_lifetime";
+	apr_file_remove(shm_file, p);
+
+	char tracker_list_str1[] = "127.0.0.1:9991";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system1, mfs_pool_init_quick(tracker_list_str1)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system1, shm_file, 16, apr_time_from_sec(60)));
+	CU_ASSERT_TRUE(file_system1->shm_cache->created);
+	char tracker_list_str2[] = "127.0.0.1:9991";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system2, mfs_pool_init_quick(tracker_list_str2)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system2, shm_file, 16, apr_time_from_sec(60)));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one"};
+	char **paths;
+	int path_count;
+	mfs_shm_cache_put_paths(file_system2->shm_cache, "domain", "key", put_paths, 1, p);
+
+	//the creator going first does not take the segment away from the others
+	mfs_close_file_system(file_system1);
+	char tracker_list_str3[] = "127.0.0.1:9991";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system3, mfs_pool_init_quick(tracker_list_str3)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system3, shm_file, 16, apr_time_from_sec(60)));
+	CU_ASSERT_FALSE(file_system3->shm_cache->created);
+	CU_ASSERT_TRUE(mfs_shm_cache_get_paths(file_system3->shm_cache, "domain", "key", &paths, &path_count, p));
+
+	//puts from both sides leave one copy that a remove gets rid of
+	mfs_shm_cache_put_paths(file_system3->shm_cache, "domain", "key", put_paths, 1, p);
+	mfs_shm_cache_put_paths(file_system2->shm_cache, "domain", "key", put_paths, 1, p);
+	mfs_shm_cache_remove(file_system3->shm_cache, "domain", "key", p);
+	CU_ASSERT_FALSE(mfs_shm_cache_get_paths(file_system2->shm_cache, "domain", "key", &paths, &path_count, p));
+	CU_ASSERT_FALSE(mfs_shm_cache_get_paths(file_system3->shm_cache, "domain", "key", &paths, &path_count, p));
+
+	//clear expires every slot
+	int i;
+	for(i=0; i < 10; i++) {
+		mfs_shm_cache_put_paths(file_system2->shm_cache, "domain", apr_psprintf(p, "key%d", i), put_paths, 1, p);
+	}
+	mfs_shm_cache_clear(file_system3->shm_cache);
+	for(i=0; i < 10; i++) {
+		CU_ASSERT_FALSE(mfs_shm_cache_get_paths(file_system2->shm_cache, "domain", apr_psprintf(p, "key%d", i), &paths, &path_count, p));
+	}
+
+	//the last one out removes it: the next file system creates a new segment
+	mfs_close_file_system(file_system3);
+	mfs_close_file_system(file_system2);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system1, mfs_pool_init_quick(tracker_list_str1)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system1, shm_file, 16, apr_time_from_sec(60)));
+	CU_ASSERT_TRUE(file_system1->shm_cache->created);
+	mfs_close_file_system(file_system1);
+
+	//no slot count is the default, not a segment with no slots
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system1, mfs_pool_init_quick(tracker_list_str1)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system1, shm_file, 0, 0));
+	CU_ASSERT_EQUAL(DEFAULT_SHM_CACHE_SLOTS, file_system1->shm_cache->slot_count);
+	CU_ASSERT_EQUAL(DEFAULT_SHM_CACHE_TTL, file_system1->shm_cache->ttl);
+	mfs_shm_cache_put_paths(file_system1->shm_cache, "domain", "key", put_paths, 1, p);
+	CU_ASSERT_TRUE(mfs_shm_cache_get_paths(file_system1->shm_cache, "domain", "key", &paths, &path_count, p));
+	mfs_close_file_system(file_system1);
+	apr_pool_destroy(p);
+}
+
+void test_cache_rename_directory() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+	char shm_file[] = "/tmp/mfs_test_cache_rename_directory";
+	apr_file_remove(shm_file, p);
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, mfs_pool_init_quick(tracker_list_str)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_content_cache(file_system, 1024 * 1024, 1024, apr_time_from_sec(60)));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_shm_cache(file_system, shm_file, 64, apr_time_from_sec(60)));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one"};
+	char **paths;
+	int path_count;
+	int i;
+	const char *keys[] = {"/dir/a", "/dir/sub/b", "/dir2/c", "/dirx/d", "/other/e"};
+	for(i=0; i < 5; i++) {
+		mfs_content_cache_put(file_system->content_cache, test_content_entry(keys[i], "hello world"));
+		mfs_shm_cache_put_paths(file_system->shm_cache, "domain", keys[i], put_paths, 1, p);
+	}
+	mfs_content_cache_put(file_system->content_cache, mfs_content_entry_create("domain2", "/dir/a", 0));
+	mfs_shm_cache_put_paths(file_system->shm_cache, "domain2", "/dir/a", put_paths, 1, p);
+
+	//the children of both the old and the new directory go. keys that only share the start of the name stay
+	mfs_cache_after_rename(file_system, "domain", "/dir", "/dir2", true, p);
+	for(i=0; i < 5; i++) {
+		bool kept = (i >= 3);
+		mfs_content_entry *entry = mfs_content_cache_get(file_system->content_cache, "domain", keys[i], p);
+		CU_ASSERT_EQUAL(kept, entry != NULL);
+		if(entry != NULL) {
+			mfs_content_entry_release(entry);
+		}
+		CU_ASSERT_EQUAL(kept, mfs_shm_cache_get_paths(file_system->shm_cache, "domain", keys[i], &paths, &path_count, p));
+	}
+	//another domain is left alone
+	mfs_content_entry *entry = mfs_content_cache_get(file_system->content_cache, "domain2", "/dir/a", p);
+	CU_ASSERT_PTR_NOT_NULL(entry);
+	if(entry != NULL) {
+		mfs_content_entry_release(entry);
+	}
+	CU_ASSERT_TRUE(mfs_shm_cache_get_paths(file_system->shm_cache, "domain2", "/dir/a", &paths, &path_count, p));
+
+	//a file rename leaves the children alone
+	mfs_content_cache_put(file_system->content_cache, test_content_entry("/dirx/d/f", "hello world"));
+	mfs_cache_after_rename(file_system, "domain", "/dirx/d", "/diry", false, p);
+	entry = mfs_content_cache_get(file_system->content_cache, "domain", "/dirx/d/f", p);
+	CU_ASSERT_PTR_NOT_NULL(entry);
+	if(entry != NULL) {
+		mfs_content_entry_release(entry);
+	}
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) Mark Pentland 2011 <mark.pent@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+ 
+#include "mogile_fs.h"
+#include <stdbool.h>
+
+void test_cache_paths();
+void test_cache_path_info();
+void test_cache_eviction();
+void test_cache_stale_when_trackers_down();
+void test_cache_refresh_ahead();
+void test_cache_read_your_writes();
+void test_cache_snapshot();
+void test_content_cache();
+void test_content_cache_admission();
+void test_disk_cache();
+void test_block_cache();
+void test_mirror();
+void test_hot_keys();
+void test_bloom_filter();
+void test_shm_cache_paths();
+void test_shm_cache_lifetime();
+void test_cache_rename_directory();
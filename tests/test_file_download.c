@@ -419,3 +419,44 @@ void test_file_get_timeout_brigade_large_with_data() {
 
 
 
+
+void test_file_get_conditional() {
+	
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, NULL));
+
+	char  original_uri[] = "http://127.0.0.1:8081/test/get";
+	apr_uri_t *uri = apr_palloc(p, sizeof(apr_uri_t));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS,apr_uri_parse (p, original_uri, uri));
+	char data[] ="THIS IS THE GET DATA";
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_conditional_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	void *bytes = NULL;
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+	mfs_fetch_options options;
+	memset(&options, 0, sizeof(options));
+
+	//the validators are recorded
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_file_server_fetch(file_system, uri, original_uri, &bytes, &total_bytes, &file, NULL, p, NULL, &options));
+	CU_ASSERT_EQUAL(200, options.response_code);
+	CU_ASSERT_STRING_EQUAL("\"v1\"", options.etag);
+	CU_ASSERT_STRING_EQUAL("Sat, 01 Jan 2011 00:00:00 GMT", options.last_modified);
+	CU_ASSERT_EQUAL_FATAL(strlen(data), total_bytes);
+	CU_ASSERT_NSTRING_EQUAL(data, bytes, total_bytes);
+
+	//and sent back: no body this time
+	options.if_none_match = apr_pstrdup(p, options.etag);
+	bytes = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_file_server_fetch(file_system, uri, original_uri, &bytes, &total_bytes, &file, NULL, p, NULL, &options));
+	stop_test_http_server(handle);
+	CU_ASSERT_STRING_EQUAL("\"v1\"", apr_hash_get(handle->log, "IF_NONE_MATCH", APR_HASH_KEY_STRING));
+	CU_ASSERT_EQUAL(304, options.response_code);
+	CU_ASSERT_EQUAL(0, total_bytes);
+	CU_ASSERT_PTR_NULL(file);
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p); 
+}
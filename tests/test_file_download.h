@@ -24,4 +24,5 @@ void test_file_get_ok_brigade_large();
 void test_file_get_fail_brigade_large();
 void test_file_get_fail_brigade_large_with_data();
 void test_file_get_timeout_bytes();
-void test_file_get_timeout_brigade_large_with_data();
\ No newline at end of file
+void test_file_get_timeout_brigade_large_with_data();
+void test_file_get_conditional();
\ No newline at end of file
@@ -462,4 +462,748 @@ void test_file_system_file_size_mismatch() {
 	
 	mfs_close_file_system(file_system);
 	apr_pool_destroy(p); 
-}
\ No newline at end of file
+}
+void test_file_system_get_local() {
+	mfs_file_system *file_system;
+	apr_status_t rv;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//the second path is on this machine. there is no http server so it must be read from the docroot
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.2%3A7500%2Fdev2%2F0%2F000%2F000%2F0000000123.fid&path2=http%3A%2F%2F127.0.0.1%3A7500%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	
+	test_server_handle * tracker_handle = test_start_basic_server(test_response, 9991, p);
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_add_local_docroot(file_system, "127.0.0.1:7500", "/tmp/mfs_local_docroot_test/"));
+
+	char data[] ="THIS IS THE LOCAL DATA";
+	apr_file_t *local;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_dir_make_recursive("/tmp/mfs_local_docroot_test/dev1/0/000/000", APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&local, "/tmp/mfs_local_docroot_test/dev1/0/000/000/0000000123.fid", APR_WRITE | APR_CREATE | APR_TRUNCATE, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_write_full(local, data, strlen(data), NULL));
+	apr_file_close(local);
+
+	char *paths[3] = {"http://127.0.0.2:7500/dev2/0/000/000/0000000123.fid", "http://127.0.0.1:7500/dev1/0/000/000/0000000123.fid", "http://127.0.0.3:7500/dev3/0/000/000/0000000123.fid"};
+	mfs_prefer_local_paths(file_system, paths, 3);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:7500/dev1/0/000/000/0000000123.fid", paths[0]);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.2:7500/dev2/0/000/000/0000000123.fid", paths[1]);
+	CU_ASSERT_STRING_EQUAL("/tmp/mfs_local_docroot_test/dev1/0/000/000/0000000123.fid", mfs_local_path(file_system, paths[0], p));
+	CU_ASSERT_PTR_NULL(mfs_local_path(file_system, paths[1], p));
+
+	void *bytes;
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+
+	rv = mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, strlen(data));
+
+	stop_test_server(tracker_handle);
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, rv);
+	CU_ASSERT_EQUAL_FATAL(strlen(data), total_bytes);
+	CU_ASSERT_NSTRING_EQUAL(data, bytes, total_bytes);
+
+	apr_file_remove("/tmp/mfs_local_docroot_test/dev1/0/000/000/0000000123.fid", p);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p); 
+}
+
+void test_file_system_get_range() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+
+	char data[] ="THIS IS THE RANGE DATA";
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	void *bytes;
+	apr_size_t total_bytes;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_range_bytes(file_system, "domain", "key", 5, 2, &bytes, &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(2, total_bytes);
+	CU_ASSERT_NSTRING_EQUAL("IS", bytes, 2);
+	CU_ASSERT_STRING_EQUAL("bytes=5-6", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+
+	//a range that runs off the end gets what there is, one that starts past the end gets nothing
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_range_bytes(file_system, "domain", "key", 18, 10, &bytes, &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(4, total_bytes);
+	CU_ASSERT_NSTRING_EQUAL("DATA", bytes, 4);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_range_bytes(file_system, "domain", "key", 100, 10, &bytes, &total_bytes, p));
+	CU_ASSERT_EQUAL(0, total_bytes);
+
+	apr_bucket_brigade *brigade = apr_brigade_create(p, apr_bucket_alloc_create(p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_range_brigade(file_system, "domain", "key", 8, 3, &total_bytes, brigade, p));
+	char flat[10];
+	apr_size_t flat_length = sizeof(flat);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_brigade_flatten(brigade, flat, &flat_length));
+	CU_ASSERT_EQUAL_FATAL(3, flat_length);
+	CU_ASSERT_NSTRING_EQUAL("THE", flat, 3);
+
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_range_file(file_system, "domain", "key", 12, 5, &total_bytes, &file, p));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+	flat_length = sizeof(flat);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, flat, &flat_length));
+	CU_ASSERT_EQUAL_FATAL(5, flat_length);
+	CU_ASSERT_NSTRING_EQUAL("RANGE", flat, 5);
+	apr_file_close(file);
+	stop_test_http_server(handle);
+
+	//a server that ignores the range sends the whole file: only right for a range from the start
+	handle = start_test_http_server(8081, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+	CU_ASSERT_EQUAL(APR_EGENERAL, mfs_get_range_bytes(file_system, "domain", "key", 5, 2, &bytes, &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_range_bytes(file_system, "domain", "key", 0, 100, &bytes, &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(strlen(data), total_bytes);
+	CU_ASSERT_NSTRING_EQUAL(data, bytes, total_bytes);
+	stop_test_http_server(handle);
+
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_parallel() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_parallel_download(file_system, 50, 16, 3));
+
+	char data[101];
+	int i;
+	for(i = 0; i < 100; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[100] = '\0';
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	//100 bytes in 16 byte ranges: the first to get the size then 6 more on 3 threads
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file(file_system, "domain", "key", &total_bytes, &file, p, 100));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+	CU_ASSERT_EQUAL_FATAL(100, total_bytes);
+	char result[200];
+	apr_size_t result_length = sizeof(result);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, result, &result_length));
+	CU_ASSERT_EQUAL_FATAL(100, result_length);
+	CU_ASSERT_NSTRING_EQUAL(data, result, 100);
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(7, handle->request_count);
+	CU_ASSERT_EQUAL(1, file_system->parallel_download->download_count);
+	CU_ASSERT_EQUAL(7, file_system->parallel_download->range_count);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_parallel_serial() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_parallel_download(file_system, 1000, 16, 3));
+
+	char data[101];
+	int i;
+	for(i = 0; i < 100; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[100] = '\0';
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	//below min_size: the first range then the rest in one request
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+	char result[200];
+	apr_size_t result_length = sizeof(result);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file(file_system, "domain", "key", &total_bytes, &file, p, 100));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+	CU_ASSERT_EQUAL_FATAL(100, total_bytes);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, result, &result_length));
+	CU_ASSERT_EQUAL_FATAL(100, result_length);
+	CU_ASSERT_NSTRING_EQUAL(data, result, 100);
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(2, handle->request_count);
+	CU_ASSERT_STRING_EQUAL("bytes=16-", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+	CU_ASSERT_EQUAL(0, file_system->parallel_download->download_count);
+	CU_ASSERT_EQUAL(1, file_system->parallel_download->range_count);
+
+	//2 ranges over min_size: one thread is no better than this one so the second range is fetched here
+	file_system->parallel_download->min_size = 50;
+	file_system->parallel_download->range_size = 60;
+	file = NULL;
+	result_length = sizeof(result);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file(file_system, "domain", "key", &total_bytes, &file, p, 100));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+	CU_ASSERT_EQUAL_FATAL(100, total_bytes);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, result, &result_length));
+	CU_ASSERT_EQUAL_FATAL(100, result_length);
+	CU_ASSERT_NSTRING_EQUAL(data, result, 100);
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(4, handle->request_count);
+	CU_ASSERT_EQUAL(0, file_system->parallel_download->download_count);
+	CU_ASSERT_EQUAL(3, file_system->parallel_download->range_count);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_hedged() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_hedged_downloads(file_system, apr_time_from_msec(100)));
+
+	//the first replica takes 2 seconds to answer so the second is started after 100ms and wins
+	test_http_server *slow_handle = start_test_http_server(8081, "SLOW", 200, &test_http_server_timeout_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(slow_handle);
+	slow_handle->sleep_duration = apr_time_from_sec(2);
+	test_http_server *fast_handle = start_test_http_server(8082, "FAST", 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(fast_handle);
+
+	void *bytes = NULL;
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+	apr_time_t start = apr_time_now();
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, 4));
+	CU_ASSERT_PTR_NULL(file);
+	CU_ASSERT(apr_time_now() - start < apr_time_from_sec(1));
+	CU_ASSERT_EQUAL_FATAL(4, total_bytes);
+	CU_ASSERT_NSTRING_EQUAL("FAST", bytes, 4);
+	CU_ASSERT_EQUAL(1, file_system->hedge->hedged_count);
+	CU_ASSERT_EQUAL(1, file_system->hedge->won_count);
+	CU_ASSERT_EQUAL(1, file_system->hedge->abort_count);
+
+	stop_test_http_server(fast_handle);
+	stop_test_http_server(slow_handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_hedged_large() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_hedged_downloads(file_system, apr_time_from_msec(100)));
+
+	//larger than max_buffer_size: too big to hedge so it is downloaded the usual way
+	apr_size_t buf_len = 200 * 1024;
+	char *data = apr_palloc(p, buf_len + 1);
+	int i;
+	for(i = 0; i < buf_len; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[buf_len] = '\0';
+	test_http_server *handle1 = start_test_http_server(8081, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle1);
+	test_http_server *handle2 = start_test_http_server(8082, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle2);
+
+	apr_size_t total_bytes;
+	apr_bucket_brigade *brigade = apr_brigade_create(p, apr_bucket_alloc_create(p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_brigade(file_system, "domain", "key", &total_bytes, brigade, p, buf_len));
+	CU_ASSERT_EQUAL_FATAL(buf_len, total_bytes);
+	char *result;
+	apr_size_t result_length;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_brigade_pflatten(brigade, &result, &result_length, p));
+	CU_ASSERT_EQUAL_FATAL(buf_len, result_length);
+	CU_ASSERT_NSTRING_EQUAL(data, result, buf_len);
+	apr_brigade_cleanup(brigade);
+
+	void *bytes = NULL;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, buf_len));
+	CU_ASSERT_EQUAL(buf_len, total_bytes);
+	CU_ASSERT_PTR_NOT_NULL(file);
+
+	stop_test_http_server(handle1);
+	stop_test_http_server(handle2);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_ranked() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_replica_ranking(file_system, 0.5, 0));
+
+	//nothing is listening on 8081
+	char data[] ="THIS IS THE GET DATA";
+	test_http_server *handle = start_test_http_server(8082, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	void *bytes;
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, strlen(data)));
+	CU_ASSERT_NSTRING_EQUAL(data, bytes, total_bytes);
+
+	//the host that failed now goes last
+	char **paths;
+	int path_count;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(2, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8082/path/two", paths[0]);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[1]);
+	CU_ASSERT_EQUAL(1, file_system->replica_ranking->reordered_count);
+
+	//exploring puts it first again now and then
+	file_system->replica_ranking->explore_interval = 1;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[0]);
+	CU_ASSERT_EQUAL(1, file_system->replica_ranking->explored_count);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_balanced() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_load_balancing(file_system));
+
+	//with two paths both are always the choices. when neither is busy the tracker's order is kept
+	char **paths;
+	int path_count;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_EQUAL_FATAL(2, path_count);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[0]);
+
+	//pretend 8081 is serving downloads
+	apr_uri_t uri;
+	mfs_file_server *file_server;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_uri_parse(p, paths[0], &uri));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_server(file_system, &uri, &file_server));
+	file_server->downloads = 3;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_paths(file_system, "domain", "key", true, &paths, &path_count, p));
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8082/path/two", paths[0]);
+	CU_ASSERT_STRING_EQUAL("http://127.0.0.1:8081/path/one", paths[1]);
+	CU_ASSERT_EQUAL(2, file_system->load_balancer->balanced_count);
+	CU_ASSERT_EQUAL(1, file_system->load_balancer->moved_count);
+	file_server->downloads = 0;
+
+	//the count goes back to 0 once a download is done
+	char data[] ="THIS IS THE GET DATA";
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+	void *bytes;
+	apr_size_t total_bytes;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, strlen(data)));
+	CU_ASSERT_EQUAL(0, file_server->downloads);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+typedef struct {
+	char *data;
+	apr_size_t size;
+	int calls;
+} test_stream_sink;
+
+apr_status_t test_stream_callback(void *ctx, const char *data, apr_size_t length) {
+	test_stream_sink *sink = ctx;
+	memcpy(sink->data + sink->size, data, length);
+	sink->size += length;
+	sink->calls++;
+	return APR_SUCCESS;
+}
+
+void test_file_system_get_stream() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+
+	apr_size_t buf_len = 1024 * 1024;
+	char *big_buffer = apr_palloc(p, buf_len + 1);
+	int i;
+	for(i = 0; i < buf_len; i++) {
+		big_buffer[i] = 'A' + (i % 26);
+	}
+	big_buffer[buf_len] = '\0';
+
+	//the first replica drops the connection half way: the second is asked for the rest
+	test_http_server *half_handle = start_test_http_server(8081, big_buffer, 200, &test_http_server_send_half_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(half_handle);
+	half_handle->sleep_duration = 0;
+	test_http_server *range_handle = start_test_http_server(8082, big_buffer, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(range_handle);
+
+	test_stream_sink sink;
+	sink.data = apr_palloc(p, buf_len);
+	sink.size = 0;
+	sink.calls = 0;
+	apr_size_t total_bytes;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_stream(file_system, "domain", "key", test_stream_callback, &sink, &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(buf_len, total_bytes);
+	CU_ASSERT_EQUAL_FATAL(buf_len, sink.size);
+	CU_ASSERT(memcmp(big_buffer, sink.data, buf_len) == 0);
+	CU_ASSERT(sink.calls > 1);
+	char *range = apr_hash_get(range_handle->log, "RANGE", APR_HASH_KEY_STRING);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(range);
+	CU_ASSERT(strcmp("bytes=0-", range) != 0); //it resumed
+
+	stop_test_http_server(half_handle);
+	stop_test_http_server(range_handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_reader() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+
+	char data[101];
+	int i;
+	for(i = 0; i < 100; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[100] = '\0';
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	//nothing is fetched until the first read
+	mfs_reader *reader;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_open(file_system, "domain", "key", 16, &reader, p));
+	CU_ASSERT_EQUAL(0, handle->request_count);
+	CU_ASSERT_EQUAL(MIN_READER_BUFFER_SIZE, reader->buffer_size);
+
+	//reads return what is buffered so they may come back in pieces
+	char result[100];
+	apr_size_t length = 10;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_read(reader, result, &length));
+	CU_ASSERT_EQUAL_FATAL(10, length);
+	CU_ASSERT_NSTRING_EQUAL(data, result, 10);
+	CU_ASSERT_EQUAL(1, handle->request_count);
+	apr_size_t total = 10;
+	while(total < 40) {
+		length = 40 - total;
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_read(reader, result + total, &length));
+		total += length;
+	}
+	CU_ASSERT_NSTRING_EQUAL(data, result, 40);
+	CU_ASSERT_EQUAL(1, handle->request_count);
+
+	//a seek back is a new range request
+	apr_off_t offset = 5;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_seek(reader, APR_SET, &offset));
+	length = 5;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_read(reader, result, &length));
+	CU_ASSERT_EQUAL_FATAL(5, length);
+	CU_ASSERT_NSTRING_EQUAL(data + 5, result, 5);
+	CU_ASSERT_EQUAL(2, handle->request_count);
+	CU_ASSERT_STRING_EQUAL("bytes=5-", apr_hash_get(handle->log, "RANGE", APR_HASH_KEY_STRING));
+
+	//the size came with the range
+	CU_ASSERT_EQUAL(100, reader->size);
+	offset = -4;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_seek(reader, APR_END, &offset));
+	CU_ASSERT_EQUAL(96, offset);
+	total = 0;
+	apr_status_t rv;
+	do {
+		length = sizeof(result) - total;
+		rv = mfs_read(reader, result + total, &length);
+		total += length;
+	} while(rv == APR_SUCCESS);
+	CU_ASSERT_EQUAL(APR_EOF, rv);
+	CU_ASSERT_EQUAL_FATAL(4, total);
+	CU_ASSERT_NSTRING_EQUAL(data + 96, result, 4);
+	mfs_close(reader);
+	stop_test_http_server(handle);
+
+	//a file many times the size of the buffer is paused and resumed in one transfer: the buffer never grows
+	apr_size_t big_size = MIN_READER_BUFFER_SIZE * 20;
+	char *big = apr_palloc(p, big_size + 1);
+	for(i = 0; i < (int)big_size; i++) {
+		big[i] = 'A' + (i % 26);
+	}
+	big[big_size] = '\0';
+	handle = start_test_http_server(8081, big, 200, &test_http_server_range_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_open(file_system, "domain", "key", MIN_READER_BUFFER_SIZE, &reader, p));
+	char *big_result = apr_palloc(p, big_size);
+	total = 0;
+	do {
+		length = big_size - total;
+		rv = mfs_read(reader, big_result + total, &length);
+		total += length;
+		CU_ASSERT_EQUAL(MIN_READER_BUFFER_SIZE, reader->buffer_size);
+		CU_ASSERT(length <= MIN_READER_BUFFER_SIZE);
+	} while((rv == APR_SUCCESS) && (total < big_size));
+	CU_ASSERT_EQUAL_FATAL(big_size, total);
+	CU_ASSERT_EQUAL(0, memcmp(big, big_result, big_size));
+	CU_ASSERT_EQUAL(1, handle->request_count);
+	mfs_close(reader);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_into() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+
+	char data[] ="THIS IS THE GET DATA";
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	char buffer[100];
+	apr_size_t total_bytes;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_into(file_system, "domain", "key", buffer, sizeof(buffer), &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(strlen(data), total_bytes);
+	CU_ASSERT_NSTRING_EQUAL(data, buffer, total_bytes);
+
+	//too small
+	CU_ASSERT_EQUAL(APR_ENOSPC, mfs_get_into(file_system, "domain", "key", buffer, 5, &total_bytes, p));
+
+	//bytes sized from the Content-Length are terminated
+	void *bytes;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, strlen(data)));
+	CU_ASSERT_PTR_NULL(file);
+	CU_ASSERT_STRING_EQUAL(data, bytes);
+
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_into_error_page() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+
+	char error_page[] = "<html><body>404 Not Found: the file is not on this device</body></html>";
+	char data[] ="THIS IS THE GET DATA";
+	test_http_server *handle1 = start_test_http_server(8081, error_page, 404, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle1);
+	test_http_server *handle2 = start_test_http_server(8082, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle2);
+
+	//the error page is longer than the buffer: that is not APR_ENOSPC, the next replica has the file
+	char buffer[30];
+	apr_size_t total_bytes;
+	CU_ASSERT(strlen(error_page) > sizeof(buffer));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_into(file_system, "domain", "key", buffer, sizeof(buffer), &total_bytes, p));
+	CU_ASSERT_EQUAL_FATAL(strlen(data), total_bytes);
+	CU_ASSERT_NSTRING_EQUAL(data, buffer, total_bytes);
+
+	//a short error page is not written into the caller's buffer either
+	stop_test_http_server(handle2);
+	handle2 = start_test_http_server(8082, "gone", 404, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle2);
+	char big_buffer[200];
+	memset(big_buffer, 'x', sizeof(big_buffer));
+	CU_ASSERT_EQUAL(APR_EGENERAL, mfs_get_into(file_system, "domain", "key", big_buffer, sizeof(big_buffer), &total_bytes, p));
+	CU_ASSERT_EQUAL(0, total_bytes);
+	CU_ASSERT_EQUAL('x', big_buffer[0]);
+	CU_ASSERT_EQUAL('x', big_buffer[sizeof(big_buffer) - 1]);
+
+	stop_test_http_server(handle1);
+	stop_test_http_server(handle2);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_slabs() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_slab_arena(file_system, 1024, 16));
+
+	apr_size_t buf_len = 10 * 1024;
+	char *data = apr_palloc(p, buf_len + 1);
+	int i;
+	for(i = 0; i < buf_len; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[buf_len] = '\0';
+	test_http_server *handle = start_test_http_server(8081, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle);
+
+	//10k in 1k slabs
+	apr_size_t total_bytes;
+	apr_bucket_brigade *brigade = apr_brigade_create(p, apr_bucket_alloc_create(p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_brigade(file_system, "domain", "key", &total_bytes, brigade, p, buf_len));
+	CU_ASSERT_EQUAL_FATAL(buf_len, total_bytes);
+	int bucket_count = 0;
+	apr_bucket *b;
+	for(b = APR_BRIGADE_FIRST(brigade); b != APR_BRIGADE_SENTINEL(brigade); b = APR_BUCKET_NEXT(b)) {
+		CU_ASSERT(b->length <= 1024);
+		bucket_count++;
+	}
+	CU_ASSERT_EQUAL(10, bucket_count);
+	char *result;
+	apr_size_t result_length;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_brigade_pflatten(brigade, &result, &result_length, p));
+	CU_ASSERT_EQUAL_FATAL(buf_len, result_length);
+	CU_ASSERT_NSTRING_EQUAL(data, result, buf_len);
+	CU_ASSERT_EQUAL(10, file_system->slab_arena->allocated_count);
+	CU_ASSERT_EQUAL(0, file_system->slab_arena->free_count);
+
+	//the slabs go back when the brigade is cleaned up and the next download reuses them
+	apr_brigade_cleanup(brigade);
+	CU_ASSERT_EQUAL(10, file_system->slab_arena->free_count);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_brigade(file_system, "domain", "key", &total_bytes, brigade, p, buf_len));
+	CU_ASSERT_EQUAL(10, file_system->slab_arena->allocated_count);
+	CU_ASSERT_EQUAL(10, file_system->slab_arena->reused_count);
+	CU_ASSERT_EQUAL(11, file_system->slab_arena->references); //the file system and the slabs
+
+	//a brigade can outlive the file system: the arena goes with its last slab
+	stop_test_http_server(handle);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_brigade_pflatten(brigade, &result, &result_length, p));
+	CU_ASSERT_NSTRING_EQUAL(data, result, buf_len);
+	apr_brigade_cleanup(brigade);
+	apr_pool_destroy(p);
+}
+
+void test_file_system_get_required_length() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 paths=2&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fpath%2Fone&path2=http%3A%2F%2F127.0.0.1%3A8082%2Fpath%2Ftwo\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+
+	apr_size_t buf_len = 200 * 1024; //over max_buffer_size so it goes to the destination file
+	char *data = apr_palloc(p, buf_len + 1);
+	int i;
+	for(i = 0; i < buf_len; i++) {
+		data[i] = 'A' + (i % 26);
+	}
+	data[buf_len] = '\0';
+	//the first replica is out of date: it is abandoned at the headers and the second is used
+	test_http_server *handle1 = start_test_http_server(8081, "AN OLD VERSION OF THE FILE", 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle1);
+	test_http_server *handle2 = start_test_http_server(8082, data, 200, &test_http_server_ok_handler);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(handle2);
+
+	char destination[] = "/tmp/mfs_made_directories_test/a/b/file";
+	apr_size_t total_bytes;
+	void *bytes = NULL;
+	apr_file_t *file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, destination, buf_len));
+	CU_ASSERT_EQUAL(buf_len, total_bytes);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+	char *result = apr_palloc(p, buf_len);
+	CU_ASSERT_EQUAL(APR_SUCCESS, apr_file_read_full(file, result, buf_len, NULL));
+	CU_ASSERT_NSTRING_EQUAL(data, result, buf_len);
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(1, apr_hash_count(file_system->made_directories));
+	CU_ASSERT_PTR_NOT_NULL(apr_hash_get(file_system->made_directories, "/tmp/mfs_made_directories_test/a/b", APR_HASH_KEY_STRING));
+
+	//the directory is made again if it is removed after it was cached
+	CU_ASSERT_EQUAL(APR_SUCCESS, apr_file_remove(destination, p));
+	CU_ASSERT_EQUAL(APR_SUCCESS, apr_dir_remove("/tmp/mfs_made_directories_test/a/b", p));
+	file = NULL;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, destination, buf_len));
+	CU_ASSERT_EQUAL(buf_len, total_bytes);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+	apr_file_close(file);
+
+	//with no replica of the right length the download fails
+	file = NULL;
+	CU_ASSERT_NOT_EQUAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, buf_len + 1));
+	//an empty file is required too
+	file = NULL;
+	CU_ASSERT_NOT_EQUAL(APR_SUCCESS, mfs_get_file_or_bytes(file_system, "domain", "key", &total_bytes, &bytes, &file, p, NULL, 0));
+
+	apr_file_remove(destination, p);
+	apr_dir_remove("/tmp/mfs_made_directories_test/a/b", p);
+	apr_dir_remove("/tmp/mfs_made_directories_test/a", p);
+	apr_dir_remove("/tmp/mfs_made_directories_test", p);
+	stop_test_http_server(handle1);
+	stop_test_http_server(handle2);
+	stop_test_server(tracker_handle);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
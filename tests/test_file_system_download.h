@@ -23,4 +23,18 @@ void test_file_system_get_ok_brigade_large();
 void test_file_system_get_failover_bytes();
 void test_file_system_get_failover_file();
 void test_file_system_get_failover_brigade();
-void test_file_system_get_fail_bytes();
\ No newline at end of file
+void test_file_system_get_fail_bytes();
+void test_file_system_get_local();
+void test_file_system_get_range();
+void test_file_system_get_parallel();
+void test_file_system_get_parallel_serial();
+void test_file_system_get_hedged();
+void test_file_system_get_hedged_large();
+void test_file_system_get_ranked();
+void test_file_system_get_balanced();
+void test_file_system_get_stream();
+void test_file_system_reader();
+void test_file_system_get_into();
+void test_file_system_get_into_error_page();
+void test_file_system_get_slabs();
+void test_file_system_get_required_length();
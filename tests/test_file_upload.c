@@ -205,6 +205,163 @@ void test_file_system_upload_bytes_ok() {
 }
 
 
+void test_file_system_upload_bytes_local() {
+	mfs_file_system *file_system;
+	apr_status_t rv;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//there is no http server: the device is on this machine so the file is written straight to the docroot
+	char test_response[] = "OK 123 fid=123&devid=1&path=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_basic_server(test_response, 9991, p);
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_add_local_docroot(file_system, "127.0.0.1:8081", "/tmp/mfs_local_device_test"));
+
+	char data[] = "THIS IS THE PUT DATA";
+	rv = mfs_store_bytes(file_system, "some_domain", "some/storage/key", "some_storage_class", p, data, strlen(data));
+	stop_test_server(tracker_handle);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, rv);
+
+	apr_file_t *file;
+	char tmp[100];
+	apr_size_t tmp_len = sizeof(tmp);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, "/tmp/mfs_local_device_test/dev1/0/000/000/0000000123.fid", APR_READ, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, tmp, &tmp_len));
+	CU_ASSERT_EQUAL_FATAL(strlen(data), tmp_len);
+	CU_ASSERT_NSTRING_EQUAL(data, tmp, tmp_len);
+	apr_file_close(file);
+
+	apr_file_remove("/tmp/mfs_local_device_test/dev1/0/000/000/0000000123.fid", p);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p); 
+}
+
+void test_pack() {
+	mfs_file_system *file_system;
+	mfs_pack *pack;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	//one response for list_keys (no containers yet), create_open, get_paths and delete. every key is stored to the same local file
+	char test_response[] = "OK 123 key_count=0&fid=123&devid=1&path=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid&paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_add_local_docroot(file_system, "127.0.0.1:8081", "/tmp/mfs_local_device_test"));
+	char *fid_path = "/tmp/mfs_local_device_test/dev1/0/000/000/0000000123.fid";
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_pack_open(file_system, "some_domain", "pack/", "some_storage_class", 16, &pack));
+	CU_ASSERT_EQUAL(0, apr_hash_count(pack->objects));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "one", "aaa", 3, p));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "two", "bbbb", 4, p));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "three", "cc", 2, p));
+	CU_ASSERT_EQUAL(APR_EINVAL, mfs_pack_put(pack, "big", "0123456789abcdefg", 17, p));
+
+	//buffered objects are served from memory
+	void *bytes;
+	apr_size_t length;
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_pack_get(pack, "two", &bytes, &length, p));
+	CU_ASSERT_EQUAL_FATAL(4, length);
+	CU_ASSERT_NSTRING_EQUAL("bbbb", bytes, 4);
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_delete(pack, "three"));
+	CU_ASSERT_EQUAL(APR_ENOENT, mfs_pack_get(pack, "three", &bytes, &length, p));
+	CU_ASSERT_EQUAL(APR_ENOENT, mfs_pack_delete(pack, "three"));
+
+	//the index is stored after the container so it is what is left in the file
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_pack_flush(pack, p));
+	CU_ASSERT_EQUAL(1, pack->container_count);
+	apr_file_t *file;
+	char tmp[100];
+	apr_size_t tmp_len = sizeof(tmp);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, fid_path, APR_READ, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, tmp, &tmp_len));
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(18, tmp_len);
+	CU_ASSERT_NSTRING_EQUAL("9\n0\t3\tone\n3\t4\ttwo\n", tmp, 18);
+
+	//stored objects are read from their range of the container
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, fid_path, APR_WRITE | APR_TRUNCATE, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_write_full(file, "aaabbbbcc", 9, NULL));
+	apr_file_close(file);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_pack_get(pack, "two", &bytes, &length, p));
+	CU_ASSERT_EQUAL_FATAL(4, length);
+	CU_ASSERT_NSTRING_EQUAL("bbbb", bytes, 4);
+
+	//with one gone less than half the container is live: two is copied to a new container and the old one deleted
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_delete(pack, "one"));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_compact(pack, 0.5, p));
+	CU_ASSERT_EQUAL(1, pack->compact_count);
+	CU_ASSERT_EQUAL(5, pack->reclaimed_bytes);
+	CU_ASSERT_EQUAL(2, pack->container_count);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pack->containers);
+	CU_ASSERT_PTR_NULL(pack->containers->next);
+	tmp_len = sizeof(tmp);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, fid_path, APR_READ, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, tmp, &tmp_len));
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(10, tmp_len);
+	CU_ASSERT_NSTRING_EQUAL("4\n0\t4\ttwo\n", tmp, 10);
+
+	mfs_pack_close(pack);
+	stop_test_server(tracker_handle);
+	apr_file_remove(fid_path, p);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+void test_pack_fill() {
+	mfs_file_system *file_system;
+	mfs_pack *pack;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char test_response[] = "OK 123 key_count=0&fid=123&devid=1&path=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid&paths=1&path1=http%3A%2F%2F127.0.0.1%3A8081%2Fdev1%2F0%2F000%2F000%2F0000000123.fid\r\n";
+	test_server_handle * tracker_handle = test_start_looped_server(test_response, 9991, p);
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_add_local_docroot(file_system, "127.0.0.1:8081", "/tmp/mfs_local_device_test"));
+	char *fid_path = "/tmp/mfs_local_device_test/dev1/0/000/000/0000000123.fid";
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_pack_open(file_system, "some_domain", "pack/", "some_storage_class", 16, &pack));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "one", "aaaaaaaa", 8, p));
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "two", "bbbbbbbb", 8, p));
+	CU_ASSERT_EQUAL(0, pack->container_count);
+
+	//three does not fit: only the full container is stored. three stays in the new open container
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "three", "cccc", 4, p));
+	CU_ASSERT_EQUAL(1, pack->container_count);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pack->open);
+	CU_ASSERT_PTR_NOT_NULL(pack->open->data);
+	CU_ASSERT_EQUAL(4, pack->open->size);
+	apr_file_t *file;
+	char tmp[100];
+	apr_size_t tmp_len = sizeof(tmp);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_open(&file, fid_path, APR_READ, APR_OS_DEFAULT, p));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, apr_file_read(file, tmp, &tmp_len));
+	apr_file_close(file);
+	CU_ASSERT_EQUAL(19, tmp_len);
+	CU_ASSERT_NSTRING_EQUAL("16\n0\t8\tone\n8\t8\ttwo\n", tmp, 19);
+
+	//the next object goes in the same container
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_pack_put(pack, "four", "dddd", 4, p));
+	CU_ASSERT_EQUAL(1, pack->container_count);
+	CU_ASSERT_EQUAL(8, pack->open->size);
+
+	//an explicit flush stores the open container too
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_pack_flush(pack, p));
+	CU_ASSERT_EQUAL(2, pack->container_count);
+	CU_ASSERT_PTR_NULL(pack->open);
+
+	mfs_pack_close(pack);
+	stop_test_server(tracker_handle);
+	apr_file_remove(fid_path, p);
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
 void test_file_system_upload_file_ok_no_pool() {
 	mfs_file_system *file_system;
 	apr_status_t rv;
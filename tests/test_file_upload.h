@@ -21,6 +21,9 @@ void test_file_put_ok_file();
 void test_file_put_ok_bytes_keepalive();
 void test_file_put_fail_no_connect();
 void test_file_system_upload_bytes_ok();
+void test_file_system_upload_bytes_local();
+void test_pack();
+void test_pack_fill();
 void test_file_system_upload_file_ok_no_pool();
 void test_file_system_upload_bytes_timeout();
 void test_file_system_upload_bytes_corrupt_tracker();
\ No newline at end of file
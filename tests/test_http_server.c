@@ -69,6 +69,88 @@ int test_http_server_ok_handler(void * cls,
 	}
 }
 
+//as test_http_server_ok_handler but sends an ETag and answers a matching If-None-Match with 304
+int test_http_server_conditional_handler(void * cls,
+		    struct MHD_Connection * connection,
+		    const char * url,
+		    const char * method,
+            const char * version,
+		    const char * upload_data,
+		    size_t * upload_data_size, 
+    		void ** ptr) {
+
+	test_http_server * handle = cls;
+	struct MHD_Response * response;
+	int ret;
+	if (*ptr == NULL) {
+		handle->log = apr_hash_make(handle->pool);
+	  	*ptr = cls; //just to flag its not null....
+	  	return MHD_YES;
+	}
+	const char *etag = "\"v1\"";
+	const char *if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+	apr_hash_set(handle->log,  apr_pstrdup(handle->pool, "METHOD"), APR_HASH_KEY_STRING, apr_pstrdup(handle->pool, method));
+	if(if_none_match != NULL) {
+		apr_hash_set(handle->log,  apr_pstrdup(handle->pool, "IF_NONE_MATCH"), APR_HASH_KEY_STRING, apr_pstrdup(handle->pool, if_none_match));
+	}
+	if((if_none_match != NULL) && (strcmp(if_none_match, etag) == 0)) {
+		response = MHD_create_response_from_data(0, (void*) "", MHD_NO, MHD_NO);
+		MHD_add_response_header(response, "ETag", etag);
+		ret = MHD_queue_response(connection, 304, response);
+	} else {
+		response = MHD_create_response_from_data(strlen(handle->response), (void*) handle->response, MHD_NO, MHD_NO);
+		MHD_add_response_header(response, "ETag", etag);
+		MHD_add_response_header(response, "Last-Modified", "Sat, 01 Jan 2011 00:00:00 GMT");
+		ret = MHD_queue_response(connection, handle->response_code, response);
+	}
+	MHD_destroy_response(response);
+	return ret;
+}
+
+//serves "Range: bytes=first-last" requests from the response with a 206 (416 if first is past the end)
+int test_http_server_range_handler(void * cls,
+		    struct MHD_Connection * connection,
+		    const char * url,
+		    const char * method,
+            const char * version,
+		    const char * upload_data,
+		    size_t * upload_data_size, 
+    		void ** ptr) {
+
+	test_http_server * handle = cls;
+	struct MHD_Response * response;
+	int ret;
+	apr_thread_mutex_lock(handle->lock); //parallel downloads send ranges at once
+	if (*ptr == NULL) {
+		handle->log = apr_hash_make(handle->pool);
+	  	*ptr = cls; //just to flag its not null....
+		apr_thread_mutex_unlock(handle->lock);
+	  	return MHD_YES;
+	}
+	handle->request_count++;
+	const char *range = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Range");
+	long first = 0;
+	long last = handle->response_length - 1;
+	if(range != NULL) {
+		apr_hash_set(handle->log,  apr_pstrdup(handle->pool, "RANGE"), APR_HASH_KEY_STRING, apr_pstrdup(handle->pool, range));
+		sscanf(range, "bytes=%ld-%ld", &first, &last);
+	}
+	if(first >= handle->response_length) {
+		response = MHD_create_response_from_data(0, (void*) "", MHD_NO, MHD_NO);
+		ret = MHD_queue_response(connection, 416, response);
+	} else {
+		if(last >= handle->response_length) {
+			last = handle->response_length - 1;
+		}
+		response = MHD_create_response_from_data(last - first + 1, (void*) (handle->response + first), MHD_NO, MHD_NO);
+		MHD_add_response_header(response, "Content-Range", apr_psprintf(handle->pool, "bytes %ld-%ld/%d", first, last, handle->response_length));
+		ret = MHD_queue_response(connection, (range != NULL) ? 206 : 200, response);
+	}
+	MHD_destroy_response(response);
+	apr_thread_mutex_unlock(handle->lock);
+	return ret;
+}
+
 //this will fail after the header is read...
 int test_http_server_fail_handler(void * cls,
 		    struct MHD_Connection * connection,
@@ -218,6 +300,7 @@ test_http_server * start_test_http_server(int port, char *response, int response
 	handle->response_length = strlen(response);
 	handle->response_code = response_code;
 	handle->pool = pool;
+	apr_thread_mutex_create(&handle->lock, APR_THREAD_MUTEX_DEFAULT, pool);
   	handle->deamon = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
 		port,
 		NULL,
@@ -28,6 +28,7 @@
 #include <apr_network_io.h>
 #include <apr_hash.h>
 #include <apr_pools.h>
+#include <apr_thread_mutex.h>
 
 typedef struct {
 	struct MHD_Daemon * deamon;
@@ -37,6 +38,8 @@ typedef struct {
 	int response_length;
 	int response_code;
 	long sleep_duration; //used in timeout tests...
+	volatile int request_count; //counted by handlers that need it
+	apr_thread_mutex_t *lock; //held by handlers that can be called by several connections at once
 } test_http_server;
 
 
@@ -52,6 +55,24 @@ int test_http_server_ok_handler(void * cls,
 		    size_t * upload_data_size, 
     		void ** ptr);
 
+int test_http_server_conditional_handler(void * cls,
+		    struct MHD_Connection * connection,
+		    const char * url,
+		    const char * method,
+            const char * version,
+		    const char * upload_data,
+		    size_t * upload_data_size, 
+    		void ** ptr);
+
+int test_http_server_range_handler(void * cls,
+		    struct MHD_Connection * connection,
+		    const char * url,
+		    const char * method,
+            const char * version,
+		    const char * upload_data,
+		    size_t * upload_data_size, 
+    		void ** ptr);
+
 int test_http_server_fail_handler(void * cls,
 		    struct MHD_Connection * connection,
 		    const char * url,
@@ -96,4 +96,132 @@ void test_watch_parsing() {
 		
 	}
 
-}
\ No newline at end of file
+}
+
+void test_invalidation_parsing() {
+	apr_pool_t *p = mfs_test_get_pool();
+	mfs_invalidation_event event;
+
+	{
+		char line[] = "http://127.0.0.1:7500/dev1/0/000/000/0000000012.fid";
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_parse_invalidation(line, &event, p));
+		CU_ASSERT_EQUAL(MFS_INVALIDATE_PATH, event.operation);
+		CU_ASSERT_STRING_EQUAL("http://127.0.0.1:7500/dev1/0/000/000/0000000012.fid", event.path);
+	}
+	{
+		char line[] = "delete test_domain some%2Fkey";
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_parse_invalidation(line, &event, p));
+		CU_ASSERT_EQUAL(MFS_INVALIDATE_DELETE, event.operation);
+		CU_ASSERT_STRING_EQUAL("test_domain", event.domain);
+		CU_ASSERT_STRING_EQUAL("some/key", event.key);
+	}
+	{
+		char line[] = "rename test_domain from to";
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_parse_invalidation(line, &event, p));
+		CU_ASSERT_EQUAL(MFS_INVALIDATE_RENAME, event.operation);
+		CU_ASSERT_STRING_EQUAL("from", event.key);
+		CU_ASSERT_STRING_EQUAL("to", event.to_key);
+	}
+	{
+		char line[] = "rename test_domain from";
+		CU_ASSERT_NOT_EQUAL(APR_SUCCESS, mfs_parse_invalidation(line, &event, p));
+	}
+	{
+		char line[] = "update test_domain key";
+		CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_parse_invalidation(line, &event, p));
+		CU_ASSERT_EQUAL(MFS_INVALIDATE_KEY, event.operation);
+	}
+	{
+		char line[] = "delete";
+		CU_ASSERT_NOT_EQUAL(APR_SUCCESS, mfs_parse_invalidation(line, &event, p));
+	}
+	apr_pool_destroy(p);
+}
+
+static void test_invalidation_count(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool) {
+	(*(int *)data)++;
+}
+
+void test_invalidation_dispatcher() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	file_system->client_id = "1234";
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one"};
+	char **paths;
+	int path_count;
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key1", put_paths, 1, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key2", put_paths, 1, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key3", put_paths, 1, p);
+
+	//key1 twice (coalesced), key2 is our own event so it is ignored
+	char test_response[] = "[x] [cache][abcd] store domain key1\r\n[x] [cache][abcd] delete domain key1\r\n[x] [cache][1234] delete domain key2\r\n";
+	test_server_handle * handle = test_start_basic_server(test_response, 9991, p);
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_start_invalidation_dispatcher(file_system, apr_time_from_msec(100)));
+	int called = 0;
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_add_invalidation_callback(file_system, test_invalidation_count, &called));
+
+	//the batch is applied after 100ms. the test server closes the connection and the watch reconnects after a second
+	apr_sleep(apr_time_from_msec(500));
+	CU_ASSERT_EQUAL(2, file_system->invalidation_dispatcher->event_count);
+	CU_ASSERT_EQUAL(1, file_system->invalidation_dispatcher->applied_count);
+	CU_ASSERT_EQUAL(1, called);
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key1", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key2", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key3", &paths, &path_count, p));
+
+	//events may have been missed while disconnected so everything is dropped
+	apr_sleep(apr_time_from_msec(1500));
+	stop_test_server(handle);
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key3", &paths, &path_count, p));
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
+
+static void test_invalidation_record_rename(mfs_file_system *file_system, mfs_invalidation_event *event, void *data, apr_pool_t *pool) {
+	if(event->operation == MFS_INVALIDATE_RENAME) {
+		*(char **)data = "renamed";
+	}
+}
+
+void test_invalidation_rename() {
+	mfs_file_system *file_system;
+	apr_pool_t *p = mfs_test_get_pool();
+
+	char tracker_list_str[] = "127.0.0.1:9991";
+	tracker_pool * trackers = mfs_pool_init_quick(tracker_list_str);
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_init_file_system(&file_system, trackers));
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_enable_metadata_cache(file_system, 100, apr_time_from_sec(60), 0, 0));
+
+	char *put_paths[] = {"http://127.0.0.1:8081/path/one"};
+	char **paths;
+	int path_count;
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key2", put_paths, 1, p);
+	mfs_metadata_cache_put_paths(file_system->metadata_cache, "domain", "key3", put_paths, 1, p);
+
+	//the delete of key1 must not replace the rename: key2 would never be invalidated
+	char test_response[] = "[x] [cache][abcd] rename domain key1 key2\r\n[x] [cache][abcd] delete domain key1\r\n";
+	test_server_handle * handle = test_start_basic_server(test_response, 9991, p);
+
+	CU_ASSERT_EQUAL_FATAL(APR_SUCCESS, mfs_start_invalidation_dispatcher(file_system, apr_time_from_msec(100)));
+	char *renamed = NULL;
+	CU_ASSERT_EQUAL(APR_SUCCESS, mfs_add_invalidation_callback(file_system, test_invalidation_record_rename, &renamed));
+
+	apr_sleep(apr_time_from_msec(500));
+	stop_test_server(handle);
+	CU_ASSERT_EQUAL(2, file_system->invalidation_dispatcher->event_count);
+	CU_ASSERT_EQUAL(2, file_system->invalidation_dispatcher->applied_count);
+	CU_ASSERT_PTR_NOT_NULL(renamed);
+	CU_ASSERT_EQUAL(MFS_CACHE_MISS, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key2", &paths, &path_count, p));
+	CU_ASSERT_EQUAL(MFS_CACHE_HIT, mfs_metadata_cache_get_paths(file_system->metadata_cache, "domain", "key3", &paths, &path_count, p));
+
+	mfs_close_file_system(file_system);
+	apr_pool_destroy(p);
+}
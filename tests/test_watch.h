@@ -20,4 +20,7 @@
 #include <stdbool.h>
 
 void test_watch_calling();
-void test_watch_parsing();
\ No newline at end of file
+void test_watch_parsing();
+void test_invalidation_parsing();
+void test_invalidation_dispatcher();
+void test_invalidation_rename();
\ No newline at end of file